@@ -0,0 +1,779 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "archive.h"
+#include "fs.h"
+
+enum {
+    KIND_ZIP,
+    KIND_TAR,  // plain or gzip'd, zlib reads both the same way
+};
+
+typedef struct member_t {
+    const char *name;   // no leading or trailing '/', not terminated
+    uint32_t name_sz;
+    bool is_dir;
+    mode_t mode;
+    uint16_t method;    // zip: 0 stored, 8 deflate
+    uint64_t size, csize;
+    uint64_t offset;    // zip: local header, tar: data in the tar stream
+} member_t;
+
+typedef struct index_t {
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+    off_t size;
+    int kind;
+    char *path;
+    unsigned char *map;  // zip: the whole file, names point into it
+    size_t map_sz;
+    char *names;         // tar: storage for the names
+    member_t *members;   // sorted by name
+    size_t count;
+    int refs;
+    uint64_t used;
+} index_t;
+
+// a child of the directory being listed
+typedef struct child_t {
+    const char *name;
+    uint32_t sz;
+    bool is_dir;
+    mode_t mode;
+} child_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static index_t *cache[ARCHIVE_CACHE_SZ];
+static uint64_t use_count = 0;
+
+static const char *extensions[] = {
+    ".zip", ".jar", ".war", ".apk", ".epub", ".cbz",
+    ".tar", ".tar.gz", ".tgz", ".taz", ".tar.zst", ".tzst",
+};
+
+static uint16_t le16(const unsigned char *p);
+static uint32_t le32(const unsigned char *p);
+static uint64_t le64(const unsigned char *p);
+static uint64_t octal(const char *p, size_t sz);
+static bool clean_name(const char **name, uint32_t *sz, bool *is_dir);
+static int compare_members(const void *a, const void *b);
+static int compare_children(const void *a, const void *b);
+static int compare_offsets(const void *a, const void *b);
+static int index_zip(index_t *ix, int fd);
+static int index_tar(index_t *ix);
+static int sniff(int fd);
+static index_t *get_index(const char *file, int *err);
+static void put_index(index_t *ix);
+static void free_index(index_t *ix);
+static size_t lower_bound(index_t *ix, const char *name, size_t sz);
+static int mkdirs(char *path);
+static int write_out(int out, const unsigned char *data, size_t sz);
+static int extract_zip(index_t *ix, member_t *m, int out);
+static int extract_file(index_t *ix, member_t *m, gzFile gz, const char *dest);
+
+static uint16_t
+le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+    return (uint32_t) le16(p) | (uint32_t) le16(p + 2) << 16;
+}
+
+static uint64_t
+le64(const unsigned char *p)
+{
+    return (uint64_t) le32(p) | (uint64_t) le32(p + 4) << 32;
+}
+
+// tar numbers are octal text, or big endian binary for big values
+static uint64_t
+octal(const char *p, size_t sz)
+{
+    uint64_t v = 0;
+    if ((unsigned char) p[0] & 0x80) {
+        for (size_t i = 1; i < sz; ++i)
+            v = v << 8 | (unsigned char) p[i];
+        return v;
+    }
+    for (size_t i = 0; i < sz && p[i]; ++i) {
+        if (p[i] >= '0' && p[i] <= '7')
+            v = v * 8 + (p[i] - '0');
+    }
+    return v;
+}
+
+bool
+archive_name(const char *name, size_t sz)
+{
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(*extensions); ++i) {
+        size_t len = strlen(extensions[i]);
+        if (sz > len && strncasecmp(name + sz - len, extensions[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// strip "./" and '/' at either end. false for names that would leave
+// the archive or can't be shown
+static bool
+clean_name(const char **name, uint32_t *sz, bool *is_dir)
+{
+    const char *n = *name;
+    uint32_t len = *sz;
+    for (;;) {
+        if (len && n[0] == '/') {
+            n++;
+            len--;
+        }
+        else if (len >= 2 && n[0] == '.' && n[1] == '/') {
+            n += 2;
+            len -= 2;
+        }
+        else {
+            break;
+        }
+    }
+    while (len && n[len-1] == '/') {
+        *is_dir = true;
+        --len;
+    }
+    if (!len || memchr(n, '\n', len)) return false;
+    for (uint32_t i = 0; i < len; ) {
+        uint32_t j = i;
+        while (j < len && n[j] != '/') ++j;
+        if (j - i == 0 || (j - i == 2 && n[i] == '.' && n[i+1] == '.'))
+            return false;
+        i = j + 1;
+    }
+    *name = n;
+    *sz = len;
+    return true;
+}
+
+static int
+compare_members(const void *a, const void *b)
+{
+    const member_t *x = a, *y = b;
+    int res = memcmp(x->name, y->name, (x->name_sz < y->name_sz)? x->name_sz : y->name_sz);
+    if (res) return res;
+    return (x->name_sz > y->name_sz) - (x->name_sz < y->name_sz);
+}
+
+// same order as a real listing: dirs first, then bytewise
+static int
+compare_children(const void *a, const void *b)
+{
+    const child_t *x = a, *y = b;
+    if (x->is_dir != y->is_dir)
+        return y->is_dir - x->is_dir;
+    int res = memcmp(x->name, y->name, (x->sz < y->sz)? x->sz : y->sz);
+    if (res) return res;
+    return (x->sz > y->sz) - (x->sz < y->sz);
+}
+
+static int
+compare_offsets(const void *a, const void *b)
+{
+    const member_t *x = *(member_t**) a, *y = *(member_t**) b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// everything comes from the central directory at the end, the members
+// themselves are never touched
+static int
+index_zip(index_t *ix, int fd)
+{
+    ix->map_sz = ix->size;
+    ix->map = mmap(NULL, ix->map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ix->map == MAP_FAILED) {
+        ix->map = NULL;
+        return errno;
+    }
+    const unsigned char *map = ix->map, *end = map + ix->map_sz;
+    if (ix->map_sz < 22) return EINVAL;
+
+    const unsigned char *eocd = NULL;
+    for (const unsigned char *p = end - 22; p >= map && end - p <= 65557; --p) {
+        if (le32(p) == 0x06054b50) {
+            eocd = p;
+            break;
+        }
+    }
+    if (!eocd) return EINVAL;
+
+    uint64_t count = le16(eocd + 10), cd_off = le32(eocd + 16);
+    if (count == 0xffff || cd_off == 0xffffffff) {
+        const unsigned char *loc = eocd - 20;
+        if (loc < map || le32(loc) != 0x07064b50) return EINVAL;
+        uint64_t off = le64(loc + 8);
+        if (off + 56 > ix->map_sz || le32(map + off) != 0x06064b50) return EINVAL;
+        count = le64(map + off + 32);
+        cd_off = le64(map + off + 48);
+    }
+    if (cd_off > ix->map_sz || count > ix->map_sz / 46) return EINVAL;
+
+    ix->members = malloc((count + 1) * sizeof(member_t));
+    const unsigned char *p = map + cd_off;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (p + 46 > end || le32(p) != 0x02014b50) break;
+        uint16_t nlen = le16(p + 28), xlen = le16(p + 30), clen = le16(p + 32);
+        if (p + 46 + nlen + xlen > end) break;
+
+        member_t m = {0};
+        bool from_unix = (le16(p + 4) >> 8) == 3;
+        uint32_t ext = le32(p + 38);
+        m.method = le16(p + 10);
+        m.csize = le32(p + 20);
+        m.size = le32(p + 24);
+        m.offset = le32(p + 42);
+
+        // zip64 sizes and offsets, only for the fields that overflowed
+        const unsigned char *x = p + 46 + nlen, *xend = x + xlen;
+        while (x + 4 <= xend) {
+            uint16_t id = le16(x), sz = le16(x + 2);
+            const unsigned char *v = x + 4, *vend = v + sz;
+            if (id == 0x0001) {
+                if (m.size == 0xffffffff && v + 8 <= vend) { m.size = le64(v); v += 8; }
+                if (m.csize == 0xffffffff && v + 8 <= vend) { m.csize = le64(v); v += 8; }
+                if (m.offset == 0xffffffff && v + 8 <= vend) { m.offset = le64(v); v += 8; }
+            }
+            x = vend;
+        }
+
+        m.name = (const char*) p + 46;
+        m.name_sz = nlen;
+        p += 46 + nlen + xlen + clen;
+        if (!clean_name(&m.name, &m.name_sz, &m.is_dir)) continue;
+
+        if (from_unix && (ext >> 16)) m.mode = ext >> 16;
+        else m.mode = m.is_dir? S_IFDIR | 0755 : S_IFREG | 0644;
+        if (S_ISDIR(m.mode)) m.is_dir = true;
+        ix->members[ix->count++] = m;
+    }
+    return 0;
+}
+
+// one pass over the headers. data is skipped with gzseek, which is a
+// plain lseek for an uncompressed tar
+static int
+index_tar(index_t *ix)
+{
+    gzFile gz = gzopen(ix->path, "rb");
+    if (!gz) return errno? errno : ENOMEM;
+    gzbuffer(gz, 128*1024);
+
+    size_t alloc = 0, names_sz = 0, names_alloc = 0;
+    size_t *offs = NULL;
+    char hdr[512];
+    char *long_name = NULL;
+    int err = 0;
+
+    for (bool first = true; ; first = false) {
+        if (gzread(gz, hdr, sizeof(hdr)) != sizeof(hdr)) break;
+
+        unsigned sum = 0, zero = 0;
+        for (int i = 0; i < 512; ++i) {
+            sum += (i >= 148 && i < 156)? ' ' : (unsigned char) hdr[i];
+            zero |= hdr[i];
+        }
+        if (!zero) break;
+        if (sum != octal(hdr + 148, 8)) {
+            if (first) err = EINVAL;
+            break;
+        }
+
+        uint64_t size = octal(hdr + 124, 12);
+        char type = hdr[156];
+        z_off_t data = gztell(gz);
+
+        if (type == 'K' || type == 'g') {
+            // long link targets and global headers, nothing to list
+            gzseek(gz, data + ((size + 511) & ~511ULL), SEEK_SET);
+            continue;
+        }
+        if (type == 'L' || type == 'x') {
+            // the name of the next member, in full
+            char *buf = malloc(size + 1);
+            if (gzread(gz, buf, size) != (int) size) {
+                free(buf);
+                break;
+            }
+            buf[size] = '\0';
+            if (type == 'L') {
+                free(long_name);
+                long_name = buf;
+            }
+            else {
+                for (char *rec = buf; rec < buf + size; ) {
+                    char *space = strchr(rec, ' ');
+                    long len = atol(rec);
+                    if (!space || len <= 0 || rec + len > buf + size) break;
+                    if (strncmp(space + 1, "path=", 5) == 0) {
+                        free(long_name);
+                        long_name = strndup(space + 6, rec + len - 1 - (space + 6));
+                    }
+                    rec += len;
+                }
+                free(buf);
+            }
+            gzseek(gz, data + ((size + 511) & ~511ULL), SEEK_SET);
+            continue;
+        }
+
+        char name[257 + 100];
+        if (long_name) {
+            snprintf(name, sizeof(name), "%s", long_name);
+        }
+        else if (memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345]) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", hdr + 345, hdr);
+        }
+        else {
+            snprintf(name, sizeof(name), "%.100s", hdr);
+        }
+        const char *n = long_name? long_name : name;
+        uint32_t nlen = strlen(n);
+        bool is_dir = (type == '5');
+
+        if (type != 'g' && clean_name(&n, &nlen, &is_dir)) {
+            if (ix->count == alloc) {
+                alloc = alloc? alloc*2 : 256;
+                ix->members = realloc(ix->members, alloc * sizeof(member_t));
+                offs = realloc(offs, alloc * sizeof(size_t));
+            }
+            if (names_sz + nlen > names_alloc) {
+                names_alloc = (names_sz + nlen) * 2;
+                ix->names = realloc(ix->names, names_alloc);
+            }
+            memcpy(ix->names + names_sz, n, nlen);
+            offs[ix->count] = names_sz;
+            names_sz += nlen;
+
+            member_t *m = &ix->members[ix->count++];
+            memset(m, 0, sizeof(*m));
+            m->name_sz = nlen;
+            m->is_dir = is_dir;
+            m->size = (type == '0' || type == '\0' || type == '7')? size : 0;
+            m->offset = data;
+            m->mode = octal(hdr + 100, 8) & 07777;
+            if (is_dir) m->mode |= S_IFDIR;
+            else if (type == '2') m->mode |= S_IFLNK;
+            else m->mode |= S_IFREG;
+        }
+        free(long_name);
+        long_name = NULL;
+
+        if (size && gzseek(gz, data + ((size + 511) & ~511ULL), SEEK_SET) < 0)
+            break;
+    }
+    free(long_name);
+    gzclose(gz);
+
+    for (size_t i = 0; i < ix->count; ++i)
+        ix->members[i].name = ix->names + offs[i];
+    free(offs);
+    return err;
+}
+
+static int
+sniff(int fd)
+{
+    unsigned char magic[4];
+    if (pread(fd, magic, 4, 0) != 4) return -1;
+    if (magic[0] == 'P' && magic[1] == 'K') return KIND_ZIP;
+    // no zstd here, a .tar.zst can only be opened as a file
+    if (le32(magic) == 0xfd2fb528) return -2;
+    return KIND_TAR;
+}
+
+static void
+free_index(index_t *ix)
+{
+    if (ix->map) munmap(ix->map, ix->map_sz);
+    free(ix->names);
+    free(ix->members);
+    free(ix->path);
+    free(ix);
+}
+
+static index_t *
+get_index(const char *file, int *err)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        *err = errno;
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    int64_t mtime = fs_mtime(&sb);
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < ARCHIVE_CACHE_SZ; ++i) {
+        index_t *ix = cache[i];
+        if (ix && ix->dev == sb.st_dev && ix->ino == sb.st_ino
+                && ix->mtime == mtime && ix->size == sb.st_size) {
+            ix->refs++;
+            ix->used = ++use_count;
+            pthread_mutex_unlock(&lock);
+            close(fd);
+            return ix;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    // indexing happens unlocked, a big tar.gz can take a while
+    index_t *ix = calloc(1, sizeof(index_t));
+    ix->dev = sb.st_dev;
+    ix->ino = sb.st_ino;
+    ix->mtime = mtime;
+    ix->size = sb.st_size;
+    ix->path = strdup(file);
+    ix->refs = 1;
+
+    ix->kind = S_ISREG(sb.st_mode)? sniff(fd) : -1;
+    if (ix->kind == KIND_ZIP) *err = index_zip(ix, fd);
+    else if (ix->kind == KIND_TAR) *err = index_tar(ix);
+    else *err = (ix->kind == -2)? ENOTSUP : EINVAL;
+    close(fd);
+    if (*err) {
+        free_index(ix);
+        return NULL;
+    }
+    qsort(ix->members, ix->count, sizeof(member_t), compare_members);
+
+    pthread_mutex_lock(&lock);
+    int slot = 0;
+    for (int i = 0; i < ARCHIVE_CACHE_SZ; ++i) {
+        if (!cache[i]) {
+            slot = i;
+            break;
+        }
+        if (cache[i]->used < cache[slot]->used)
+            slot = i;
+    }
+    if (cache[slot] && --cache[slot]->refs == 0)
+        free_index(cache[slot]);
+    // the cache holds a reference of its own
+    ix->refs++;
+    ix->used = ++use_count;
+    cache[slot] = ix;
+    pthread_mutex_unlock(&lock);
+    return ix;
+}
+
+static void
+put_index(index_t *ix)
+{
+    pthread_mutex_lock(&lock);
+    bool last = --ix->refs == 0;
+    pthread_mutex_unlock(&lock);
+    if (last) free_index(ix);
+}
+
+bool
+archive_find(const char *path, char *file, size_t file_sz, const char **inner)
+{
+    struct stat sb;
+    if (stat(path, &sb) == 0) return false;
+
+    size_t sz = strlen(path);
+    if (sz >= file_sz) return false;
+    memcpy(file, path, sz + 1);
+    while (sz > 1) {
+        while (sz > 0 && file[sz-1] != '/') --sz;
+        if (sz <= 1) break;
+        file[--sz] = '\0';
+        if (stat(file, &sb) == 0) {
+            if (!S_ISREG(sb.st_mode)) return false;
+            *inner = path + sz + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t
+lower_bound(index_t *ix, const char *name, size_t sz)
+{
+    size_t lo = 0, hi = ix->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        member_t *m = &ix->members[mid];
+        int res = memcmp(m->name, name, (m->name_sz < sz)? m->name_sz : sz);
+        if (res < 0 || (res == 0 && m->name_sz < sz)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int
+archive_list(const char *path, bool hidden, char **buf, size_t *sz,
+        mode_t **modes, size_t *count, int64_t *mtime)
+{
+    char file[PATH_MAX];
+    const char *inner = "";
+    struct stat sb;
+    if (stat(path, &sb) == 0) {
+        if (!S_ISREG(sb.st_mode)) return ENOTDIR;
+        snprintf(file, sizeof(file), "%s", path);
+    }
+    else if (!archive_find(path, file, sizeof(file), &inner)) {
+        return ENOENT;
+    }
+
+    int err = 0;
+    index_t *ix = get_index(file, &err);
+    if (!ix) return err;
+    *mtime = ix->mtime;
+
+    // members below dir are one sorted run. "dir/" sorts after "dir"
+    // and anything like "dir-x", and before "dir0"
+    char prefix[PATH_MAX];
+    size_t psz = snprintf(prefix, sizeof(prefix), "%s%s", inner, inner[0]? "/" : "");
+    size_t i = lower_bound(ix, prefix, psz);
+
+    child_t *kids = NULL;
+    size_t nkids = 0, alloc = 0, total = 0;
+    bool found = !inner[0];
+    for (; i < ix->count; ++i) {
+        member_t *m = &ix->members[i];
+        if (m->name_sz < psz || memcmp(m->name, prefix, psz) != 0) break;
+        found = true;
+
+        const char *name = m->name + psz;
+        uint32_t len = m->name_sz - psz;
+        const char *slash = memchr(name, '/', len);
+        child_t c = { name, slash? slash - name : len, slash || m->is_dir,
+            slash? S_IFDIR | 0755 : m->mode };
+        if (!hidden && name[0] == '.') continue;
+
+        // deeper members only say their dir exists, once is enough
+        if (nkids && kids[nkids-1].sz == c.sz && kids[nkids-1].is_dir == c.is_dir
+                && memcmp(kids[nkids-1].name, c.name, c.sz) == 0) {
+            if (!slash) kids[nkids-1].mode = c.mode;
+            continue;
+        }
+        if (nkids == alloc) {
+            alloc = alloc? alloc*2 : 64;
+            kids = realloc(kids, alloc * sizeof(child_t));
+        }
+        kids[nkids++] = c;
+        total += c.sz + c.is_dir + 1;
+    }
+
+    if (!found) {
+        // a file member isn't a directory
+        size_t j = lower_bound(ix, inner, strlen(inner));
+        bool file_member = j < ix->count && ix->members[j].name_sz == strlen(inner)
+            && memcmp(ix->members[j].name, inner, strlen(inner)) == 0;
+        free(kids);
+        put_index(ix);
+        return file_member? ENOTDIR : ENOENT;
+    }
+
+    qsort(kids, nkids, sizeof(child_t), compare_children);
+    *buf = malloc(total + 1);
+    *modes = calloc(nkids + 1, sizeof(mode_t));
+    char *p = *buf;
+    size_t n = 0;
+    for (size_t k = 0; k < nkids; ++k) {
+        child_t *c = &kids[k];
+        // an explicit dir entry and an implied one sort next to each other
+        if (k && c->is_dir && kids[k-1].is_dir && kids[k-1].sz == c->sz
+                && memcmp(kids[k-1].name, c->name, c->sz) == 0)
+            continue;
+        memcpy(p, c->name, c->sz);
+        p += c->sz;
+        if (c->is_dir) *p++ = '/';
+        *p++ = '\n';
+        (*modes)[n++] = c->mode;
+    }
+    *sz = p - *buf;
+    *count = n;
+    free(kids);
+    put_index(ix);
+    return 0;
+}
+
+static int
+mkdirs(char *path)
+{
+    for (char *p = path + 1; *p; ++p) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int res = mkdir(path, 0755);
+        *p = '/';
+        if (res < 0 && errno != EEXIST) return errno;
+    }
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) return errno;
+    return 0;
+}
+
+static int
+write_out(int out, const unsigned char *data, size_t sz)
+{
+    while (sz) {
+        ssize_t n = write(out, data, sz);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        data += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+static int
+extract_zip(index_t *ix, member_t *m, int out)
+{
+    const unsigned char *lh = ix->map + m->offset;
+    if (m->offset + 30 > ix->map_sz || le32(lh) != 0x04034b50) return EINVAL;
+    uint64_t start = m->offset + 30 + le16(lh + 26) + le16(lh + 28);
+    if (start + m->csize > ix->map_sz) return EINVAL;
+    const unsigned char *data = ix->map + start;
+
+    if (m->method == 0)
+        return write_out(out, data, m->size);
+    if (m->method != 8)
+        return ENOTSUP;
+
+    z_stream zs = {0};
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return ENOMEM;
+    unsigned char *buf = malloc(ARCHIVE_IO_SZ);
+    int err = 0, ret = Z_OK;
+    uint64_t left = m->csize;
+    zs.next_in = (unsigned char*) data;
+    while (ret != Z_STREAM_END && !err) {
+        if (!zs.avail_in) {
+            if (!left) break;
+            zs.avail_in = (left > UINT_MAX)? UINT_MAX : left;
+            left -= zs.avail_in;
+        }
+        zs.next_out = buf;
+        zs.avail_out = ARCHIVE_IO_SZ;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) err = EIO;
+        else err = write_out(out, buf, ARCHIVE_IO_SZ - zs.avail_out);
+    }
+    inflateEnd(&zs);
+    free(buf);
+    if (!err && ret != Z_STREAM_END) err = EIO;
+    return err;
+}
+
+static int
+extract_file(index_t *ix, member_t *m, gzFile gz, const char *dest)
+{
+    if (S_ISLNK(m->mode)) return 0;
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        (m->mode & 0777)? m->mode & 0777 : 0644);
+    if (out < 0) return errno;
+
+    int err = 0;
+    if (ix->kind == KIND_ZIP) {
+        err = extract_zip(ix, m, out);
+    }
+    else if (gzseek(gz, m->offset, SEEK_SET) < 0) {
+        err = EIO;
+    }
+    else {
+        unsigned char *buf = malloc(ARCHIVE_IO_SZ);
+        for (uint64_t left = m->size; left && !err; ) {
+            int n = gzread(gz, buf, (left > ARCHIVE_IO_SZ)? ARCHIVE_IO_SZ : left);
+            if (n <= 0) err = EIO;
+            else err = write_out(out, buf, n);
+            left -= (n > 0)? n : 0;
+        }
+        free(buf);
+    }
+    if (close(out) < 0 && !err) err = errno;
+    return err;
+}
+
+int
+archive_extract(const char *path, const char *dest)
+{
+    char file[PATH_MAX];
+    const char *inner;
+    if (!archive_find(path, file, sizeof(file), &inner)) {
+        // the archive itself: everything in it
+        struct stat sb;
+        if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) return ENOENT;
+        snprintf(file, sizeof(file), "%s", path);
+        inner = "";
+    }
+
+    int err = 0;
+    index_t *ix = get_index(file, &err);
+    if (!ix) return err;
+
+    gzFile gz = NULL;
+    if (ix->kind == KIND_TAR && !(gz = gzopen(ix->path, "rb"))) {
+        put_index(ix);
+        return EIO;
+    }
+
+    size_t isz = strlen(inner);
+    size_t i = lower_bound(ix, inner, isz);
+    member_t *exact = (isz && i < ix->count && ix->members[i].name_sz == isz
+        && memcmp(ix->members[i].name, inner, isz) == 0)? &ix->members[i] : NULL;
+
+    if (exact && !exact->is_dir) {
+        err = extract_file(ix, exact, gz, dest);
+    }
+    else {
+        // a whole tree. tar members go in stream order so gzseek only
+        // ever moves forward
+        char prefix[PATH_MAX];
+        size_t psz = snprintf(prefix, sizeof(prefix), "%s%s", inner, isz? "/" : "");
+        size_t start = lower_bound(ix, prefix, psz), end = start;
+        while (end < ix->count && ix->members[end].name_sz >= psz
+                && memcmp(ix->members[end].name, prefix, psz) == 0)
+            ++end;
+        if (!exact && end == start && isz) err = ENOENT;
+
+        member_t **todo = malloc((end - start + 1) * sizeof(member_t*));
+        size_t n = 0;
+        for (size_t k = start; k < end; ++k)
+            todo[n++] = &ix->members[k];
+        qsort(todo, n, sizeof(member_t*), compare_offsets);
+
+        char out[PATH_MAX];
+        snprintf(out, sizeof(out), "%s", dest);
+        if (!err) err = mkdirs(out);
+        for (size_t k = 0; k < n && !err; ++k) {
+            member_t *m = todo[k];
+            int len = snprintf(out, sizeof(out), "%s/%.*s", dest,
+                (int) (m->name_sz - psz), m->name + psz);
+            if (len >= (int) sizeof(out)) continue;
+            if (m->is_dir) {
+                err = mkdirs(out);
+                continue;
+            }
+            char *slash = strrchr(out, '/');
+            *slash = '\0';
+            err = mkdirs(out);
+            *slash = '/';
+            if (!err) err = extract_file(ix, m, gz, out);
+        }
+        free(todo);
+    }
+
+    if (gz) gzclose(gz);
+    put_index(ix);
+    return err;
+}
@@ -0,0 +1,33 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// archives are browsed as if they were directories: a path like
+// /x/a.zip/dir names dir inside a.zip. members are read straight out of
+// the archive, nothing gets unpacked to list it
+
+#define ARCHIVE_CACHE_SZ 4          // indexes kept around
+#define ARCHIVE_IO_SZ (64*1024)
+
+// by extension only, so the ui can decide without touching the disk
+bool archive_name(const char *name, size_t sz);
+
+// whether path is inside an archive (and not a real file). on success
+// file gets the archive's path and *inner points into path, at the
+// member ("" for the archive's root)
+bool archive_find(const char *path, char *file, size_t file_sz, const char **inner);
+
+// like a directory listing of path: names '\n' terminated, dirs end in
+// '/', dirs first. returns 0 or an errno
+int archive_list(const char *path, bool hidden, char **buf, size_t *sz,
+        mode_t **modes, size_t *count, int64_t *mtime);
+
+// copy the member at path (a file, or a dir with everything below it)
+// out to dest. returns 0 or an errno
+int archive_extract(const char *path, const char *dest);
+
+#endif
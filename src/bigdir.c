@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "bigdir.h"
+#include "wake.h"
+
+// the directory is only ever read by its own thread. everything the ui
+// looks at is under lock
+typedef struct bigdir_t {
+    char *path;
+    bool hidden;
+    DIR *dir;
+    long marks[BIGDIR_MAX_MARKS];  // mark k is where entry k*stride is
+    size_t nmarks, stride;
+    size_t index;        // of the entry readdir gives next
+    size_t count_index;  // entries seen so far
+    long count_loc;      // and where to pick up counting
+
+    // under lock
+    bool closing;
+    bool want, search, back;
+    size_t start, from;
+    char *text;
+    unsigned gen;        // bumped by every request
+    bigdir_window_t *result;
+    size_t counted;
+    bool exact;
+} bigdir_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bigdir_t *cur = NULL;
+
+static bool interrupted(bigdir_t *d, unsigned gen);
+static void publish(bigdir_t *d, bool force);
+static void add_mark(bigdir_t *d, long loc);
+static struct dirent *next_entry(bigdir_t *d);
+static bool seek_to(bigdir_t *d, size_t target, unsigned gen);
+static bool entry_is_dir(bigdir_t *d, struct dirent *de);
+static bigdir_window_t *read_window(bigdir_t *d, size_t start, unsigned gen);
+static size_t find(bigdir_t *d, size_t from, const char *text, bool back, unsigned gen);
+static void *bigdir_thread(void *arg);
+
+size_t
+bigdir_threshold(void)
+{
+    static size_t threshold = 0;
+    static bool loaded = false;
+    if (!loaded) {
+        char *env = getenv("MFM_BIG_DIR");
+        threshold = env? strtoull(env, NULL, 10) : BIGDIR_THRESHOLD;
+        loaded = true;
+    }
+    return threshold;
+}
+
+static bool
+interrupted(bigdir_t *d, unsigned gen)
+{
+    pthread_mutex_lock(&lock);
+    bool res = d->closing || d->gen != gen;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+static void
+publish(bigdir_t *d, bool force)
+{
+    pthread_mutex_lock(&lock);
+    d->counted = d->count_index;
+    if (d == cur) wake_notify(&wake, force);
+    pthread_mutex_unlock(&lock);
+}
+
+// past the limit every other mark goes and the stride doubles
+static void
+add_mark(bigdir_t *d, long loc)
+{
+    if (d->nmarks == BIGDIR_MAX_MARKS) {
+        for (size_t i = 0; i < BIGDIR_MAX_MARKS / 2; ++i)
+            d->marks[i] = d->marks[2*i];
+        d->nmarks = BIGDIR_MAX_MARKS / 2;
+        d->stride *= 2;
+    }
+    d->marks[d->nmarks++] = loc;
+}
+
+// like readdir, minus what the listing wouldn't show
+static struct dirent *
+next_entry(bigdir_t *d)
+{
+    for (;;) {
+        long loc = telldir(d->dir);
+        struct dirent *de = readdir(d->dir);
+        if (!de) {
+            pthread_mutex_lock(&lock);
+            d->exact = true;
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        char *name = de->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (name[0] == '.' && !d->hidden)
+            continue;
+        if (strchr(name, '\n'))
+            continue;
+
+        if (d->index == d->nmarks * d->stride)
+            add_mark(d, loc);
+        d->index++;
+        if (d->index > d->count_index) {
+            d->count_index = d->index;
+            d->count_loc = telldir(d->dir);
+        }
+        return de;
+    }
+}
+
+// false if the directory ends before target
+static bool
+seek_to(bigdir_t *d, size_t target, unsigned gen)
+{
+    if (target >= d->count_index && d->count_index > d->index) {
+        seekdir(d->dir, d->count_loc);
+        d->index = d->count_index;
+    }
+    else if (d->nmarks && (target < d->index || target - d->index > d->stride)) {
+        size_t k = target / d->stride;
+        if (k >= d->nmarks) k = d->nmarks - 1;
+        if (target < d->index || k * d->stride > d->index) {
+            seekdir(d->dir, d->marks[k]);
+            d->index = k * d->stride;
+        }
+    }
+    while (d->index < target) {
+        if (!next_entry(d)) return false;
+        if ((d->index % BIGDIR_BATCH) == 0 && interrupted(d, gen)) return false;
+    }
+    return true;
+}
+
+static bool
+entry_is_dir(bigdir_t *d, struct dirent *de)
+{
+    if (de->d_type != DT_UNKNOWN)
+        return de->d_type == DT_DIR;
+    struct stat st;
+    return fstatat(dirfd(d->dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+        && S_ISDIR(st.st_mode);
+}
+
+static bigdir_window_t *
+read_window(bigdir_t *d, size_t start, unsigned gen)
+{
+    if (start == BIGDIR_END) {
+        // the end is only known once everything has been counted
+        if (!seek_to(d, SIZE_MAX, gen) && interrupted(d, gen))
+            return NULL;
+        start = (d->count_index > BIGDIR_WINDOW)? d->count_index - BIGDIR_WINDOW : 0;
+    }
+    if (!seek_to(d, start, gen)) {
+        if (interrupted(d, gen)) return NULL;
+        // asked for too much, the last window will have to do
+        start = (d->count_index > BIGDIR_WINDOW)? d->count_index - BIGDIR_WINDOW : 0;
+        seek_to(d, start, gen);
+    }
+
+    bigdir_window_t *w = calloc(1, sizeof(bigdir_window_t));
+    w->start = d->index;
+    w->found = SIZE_MAX;
+    w->modes = calloc(BIGDIR_WINDOW + 1, sizeof(mode_t));
+    size_t alloc = 64 * 1024;
+    w->buf = malloc(alloc);
+
+    struct dirent *de;
+    while (w->count < BIGDIR_WINDOW && (de = next_entry(d))) {
+        size_t len = strlen(de->d_name);
+        if (w->sz + len + 2 > alloc) {
+            alloc *= 2;
+            w->buf = realloc(w->buf, alloc);
+        }
+        memcpy(w->buf + w->sz, de->d_name, len);
+        w->sz += len;
+        if (entry_is_dir(d, de)) w->buf[w->sz++] = '/';
+        w->buf[w->sz++] = '\n';
+
+        struct stat st;
+        if (fstatat(dirfd(d->dir), de->d_name, &st, 0) == 0)
+            w->modes[w->count] = st.st_mode;
+        w->count++;
+    }
+    return w;
+}
+
+// index of the first name after from (or the last one before it)
+// holding text, wrapping around. SIZE_MAX if there is none
+static size_t
+find(bigdir_t *d, size_t from, const char *text, bool back, unsigned gen)
+{
+    size_t found = SIZE_MAX;
+    struct dirent *de;
+    if (!back) {
+        if (seek_to(d, from + 1, gen)) {
+            while ((de = next_entry(d))) {
+                if (strstr(de->d_name, text)) return d->index - 1;
+                if ((d->index % BIGDIR_BATCH) == 0 && interrupted(d, gen))
+                    return SIZE_MAX;
+            }
+        }
+        if (interrupted(d, gen) || !seek_to(d, 0, gen)) return SIZE_MAX;
+        while (d->index <= from && (de = next_entry(d))) {
+            if (strstr(de->d_name, text)) return d->index - 1;
+            if ((d->index % BIGDIR_BATCH) == 0 && interrupted(d, gen))
+                return SIZE_MAX;
+        }
+        return SIZE_MAX;
+    }
+
+    // directory streams only go forward, so remember the last match
+    if (!seek_to(d, 0, gen)) return SIZE_MAX;
+    while ((de = next_entry(d))) {
+        if (d->index > from && found != SIZE_MAX) break;
+        if (d->index - 1 != from && strstr(de->d_name, text))
+            found = d->index - 1;
+        if ((d->index % BIGDIR_BATCH) == 0 && interrupted(d, gen))
+            return SIZE_MAX;
+    }
+    return found;
+}
+
+static void *
+bigdir_thread(void *arg)
+{
+    bigdir_t *d = arg;
+    d->dir = opendir(d->path);
+    if (!d->dir) {
+        pthread_mutex_lock(&lock);
+        d->exact = true;
+        pthread_mutex_unlock(&lock);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!d->closing && !d->want && (d->exact || !d->dir))
+            pthread_cond_wait(&cond, &lock);
+        if (d->closing) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        bool want = d->want, search = d->search, back = d->back;
+        size_t start = d->start, from = d->from;
+        char *text = (search && d->text)? strdup(d->text) : NULL;
+        unsigned gen = d->gen;
+        d->want = false;
+        pthread_mutex_unlock(&lock);
+
+        if (!want) {
+            // nobody is waiting on a window, keep counting
+            if (d->index != d->count_index && d->count_index) {
+                seekdir(d->dir, d->count_loc);
+                d->index = d->count_index;
+            }
+            for (size_t i = 0; i < BIGDIR_BATCH && next_entry(d); ++i);
+            publish(d, false);
+            continue;
+        }
+
+        bigdir_window_t *w = NULL;
+        if (!d->dir) {
+            w = calloc(1, sizeof(bigdir_window_t));
+            w->found = SIZE_MAX;
+        }
+        else if (search) {
+            size_t found = find(d, from, text, back, gen);
+            if (found != SIZE_MAX) start = (found > BIGDIR_WINDOW/2)? found - BIGDIR_WINDOW/2 : 0;
+            w = interrupted(d, gen)? NULL : read_window(d, start, gen);
+            if (w) w->found = found;
+        }
+        else {
+            w = read_window(d, start, gen);
+        }
+        free(text);
+        if (w) w->search = search;
+        publish(d, true);
+
+        pthread_mutex_lock(&lock);
+        if (w && d == cur && d->gen == gen) {
+            bigdir_free_window(d->result);
+            d->result = w;
+            w = NULL;
+            wake_notify(&wake, true);
+        }
+        pthread_mutex_unlock(&lock);
+        bigdir_free_window(w);
+    }
+
+    if (d->dir) closedir(d->dir);
+    bigdir_free_window(d->result);
+    free(d->text);
+    free(d->path);
+    free(d);
+    return NULL;
+}
+
+bool
+bigdir_open(const char *path, bool hidden)
+{
+    wake_open(&wake);
+    bigdir_close();
+
+    bigdir_t *d = calloc(1, sizeof(bigdir_t));
+    d->path = strdup(path);
+    d->hidden = hidden;
+    d->stride = BIGDIR_BATCH / 16;
+
+    pthread_mutex_lock(&lock);
+    cur = d;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    bool ok = pthread_create(&thread, &attr, bigdir_thread, d) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) cur = NULL;
+    pthread_mutex_unlock(&lock);
+    if (!ok) {
+        free(d->path);
+        free(d);
+    }
+    return ok;
+}
+
+// the thread cleans up after itself, so a stuck mount can't block this
+void
+bigdir_close(void)
+{
+    pthread_mutex_lock(&lock);
+    if (cur) {
+        cur->closing = true;
+        pthread_cond_broadcast(&cond);
+        cur = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int
+bigdir_fd(void)
+{
+    return wake.fd[0];
+}
+
+void
+bigdir_request(size_t start)
+{
+    pthread_mutex_lock(&lock);
+    if (cur) {
+        cur->want = true;
+        cur->search = false;
+        cur->start = start;
+        cur->gen++;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+bigdir_search(size_t from, const char *text, bool back)
+{
+    pthread_mutex_lock(&lock);
+    if (cur) {
+        free(cur->text);
+        cur->text = strdup(text);
+        cur->want = true;
+        cur->search = true;
+        cur->back = back;
+        cur->from = from;
+        cur->gen++;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+bigdir_window_t *
+bigdir_take(void)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+    bigdir_window_t *w = cur? cur->result : NULL;
+    if (w) cur->result = NULL;
+    pthread_mutex_unlock(&lock);
+    return w;
+}
+
+void
+bigdir_free_window(bigdir_window_t *w)
+{
+    if (!w) return;
+    free(w->buf);
+    free(w->modes);
+    free(w);
+}
+
+size_t
+bigdir_count(bool *exact)
+{
+    pthread_mutex_lock(&lock);
+    size_t n = cur? cur->counted : 0;
+    if (exact) *exact = cur? cur->exact : true;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
@@ -0,0 +1,55 @@
+#ifndef BIGDIR_H
+#define BIGDIR_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// directories too big to hold in memory. only a window of entries is
+// read at a time, in directory order. telldir() checkpoints let any
+// window be found again without reading from the start, and there are
+// never more than BIGDIR_MAX_MARKS of them, so memory stays the same
+// however big the directory is
+
+#define BIGDIR_THRESHOLD 1000000  // entries before a listing is windowed
+#define BIGDIR_WINDOW 4096        // entries in a window
+#define BIGDIR_MAX_MARKS 4096
+#define BIGDIR_BATCH 4096         // entries counted between requests
+
+#define BIGDIR_END (SIZE_MAX-1)   // window start meaning the last window
+
+typedef struct bigdir_window_t {
+    size_t start;   // index in the directory of the first name
+    char *buf;      // names, '\n' terminated, dirs end in '/'
+    size_t sz;
+    mode_t *modes;  // one per name, 0 if stat failed
+    size_t count;
+    size_t found;   // searches: index of the match, SIZE_MAX if none
+    bool search;
+} bigdir_window_t;
+
+// how many entries make a listing windowed, 0 if never (MFM_BIG_DIR)
+size_t bigdir_threshold(void);
+
+// start counting path and serving windows of it. replaces whatever
+// was open before
+bool bigdir_open(const char *path, bool hidden);
+void bigdir_close(void);
+// fd that becomes readable when a window is in or the count moved
+int bigdir_fd(void);
+
+// ask for the window starting at start. a newer request replaces one
+// that hasn't been served yet
+void bigdir_request(size_t start);
+// look for the next name after from containing text, wrapping around
+// (or the one before it if back). the window comes with found set
+void bigdir_search(size_t from, const char *text, bool back);
+// the window asked for, NULL if it isn't in yet
+bigdir_window_t *bigdir_take(void);
+void bigdir_free_window(bigdir_window_t *w);
+
+// entries counted so far, and whether that's all of them
+size_t bigdir_count(bool *exact);
+
+#endif
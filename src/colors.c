@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <ncurses.h>
+#include "colors.h"
+
+#define EXT_KEY_SZ 16  // longer extensions go with the suffix patterns
+
+// what LS_COLORS calls fi, di, ln... besides files and dirs, each one
+// may be unset and fall back to a more general one
+enum {
+    CLASS_LINK,
+    CLASS_ORPHAN,
+    CLASS_FIFO,
+    CLASS_SOCK,
+    CLASS_BLK,
+    CLASS_CHR,
+    CLASS_EXEC,
+    CLASS_SETUID,
+    CLASS_SETGID,
+    CLASS_COUNT,
+};
+
+typedef struct style_t {
+    short fg, bg;  // -1 for the defaults
+    int attr;
+} style_t;
+
+typedef struct slot_t {
+    char key[EXT_KEY_SZ];
+    uint8_t len;
+    uint8_t style;
+} slot_t;
+
+typedef struct suffix_t {
+    char *text;
+    size_t len;
+    uint8_t style;
+} suffix_t;
+
+static const char *class_names[CLASS_COUNT] = {
+    "ln", "or", "pi", "so", "bd", "cd", "ex", "su", "sg",
+};
+
+static const char *default_rules =
+    "di=34:ln=36:or=31;01:pi=33:so=35:bd=33;01:cd=33;01:ex=32:"
+    "su=37;41:sg=30;43:"
+    "*.tar=31:*.tgz=31:*.gz=31:*.bz2=31:*.xz=31:*.zst=31:*.lz4=31:"
+    "*.zip=31:*.7z=31:*.rar=31:*.deb=31:*.rpm=31:*.iso=31:"
+    "*.jpg=35:*.jpeg=35:*.png=35:*.gif=35:*.bmp=35:*.webp=35:*.svg=35:"
+    "*.tif=35:*.tiff=35:*.mp4=35:*.mkv=35:*.webm=35:*.avi=35:*.mov=35:"
+    "*.mp3=36:*.flac=36:*.ogg=36:*.opus=36:*.wav=36:*.m4a=36:"
+    "*.pdf=33:*.epub=33";
+
+static style_t styles[STYLE_MAX] = {
+    [STYLE_FILE] = { COLOR_WHITE, COLOR_BLACK, 0 },
+    [STYLE_DIR]  = { COLOR_BLUE,  COLOR_BLACK, 0 },
+};
+static int nstyles = 2;
+static int attrs[STYLE_MAX], sel_attrs[STYLE_MAX];
+
+static int class_style[CLASS_COUNT];
+static bool link_target = false;  // ln=target: links look like what they point to
+
+static suffix_t suffixes[STYLE_MAX_SUFFIX];
+static int nsuffixes = 0;
+
+// the extension table. a key's bucket picks the seed that puts it in
+// its slot, and seeds are chosen so no two keys share a slot, so a
+// lookup is two hashes and one compare
+static slot_t *keys = NULL;
+static size_t nkeys = 0, keys_alloc = 0;
+static slot_t *slots = NULL;
+static uint16_t *seeds = NULL;
+static size_t nslots = 0, nbuckets = 0;
+
+static uint64_t hash(const char *s, size_t len, uint64_t seed);
+static int parse_style(const char *sgr, size_t len);
+static void add_ext(const char *ext, size_t len, uint8_t style);
+static void add_rule(const char *key, size_t key_sz, const char *val, size_t val_sz);
+static bool place_bucket(size_t *members, size_t n, uint16_t seed, bool *used);
+static bool build_table(size_t size);
+static int lookup_ext(const char *name, size_t len);
+static int class_or(int cls, int fallback);
+static short map_color(short c, int *attr);
+
+static uint64_t
+hash(const char *s, size_t len, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// "01;34" and the like into a style, reusing one that looks the same
+static int
+parse_style(const char *sgr, size_t len)
+{
+    style_t st = { -1, -1, 0 };
+    int codes[16], n = 0;
+    for (size_t i = 0; i < len && n < 16; ) {
+        if (!isdigit((unsigned char) sgr[i])) {
+            ++i;
+            continue;
+        }
+        int v = 0;
+        while (i < len && isdigit((unsigned char) sgr[i]))
+            v = v * 10 + (sgr[i++] - '0');
+        codes[n++] = v;
+    }
+    for (int i = 0; i < n; ++i) {
+        int c = codes[i];
+        if (c == 0) st = (style_t) { -1, -1, 0 };
+        else if (c == 1) st.attr |= A_BOLD;
+        else if (c == 2) st.attr |= A_DIM;
+        else if (c == 4) st.attr |= A_UNDERLINE;
+        else if (c == 5) st.attr |= A_BLINK;
+        else if (c == 7) st.attr |= A_REVERSE;
+        else if (c >= 30 && c <= 37) st.fg = c - 30;
+        else if (c >= 40 && c <= 47) st.bg = c - 40;
+        else if (c >= 90 && c <= 97) st.fg = c - 90 + 8;
+        else if (c >= 100 && c <= 107) st.bg = c - 100 + 8;
+        else if ((c == 38 || c == 48) && i + 2 < n && codes[i+1] == 5) {
+            if (c == 38) st.fg = codes[i+2];
+            else st.bg = codes[i+2];
+            i += 2;
+        }
+        else if ((c == 38 || c == 48) && i + 1 < n && codes[i+1] == 2) {
+            // no truecolor in curses pairs, leave it as it was
+            i += 4;
+        }
+    }
+    if (st.fg < 0) st.fg = COLOR_WHITE;
+    if (st.bg < 0) st.bg = COLOR_BLACK;
+
+    // files and dirs may still change, nothing else should follow them
+    for (int i = STYLE_DIR + 1; i < nstyles; ++i) {
+        if (styles[i].fg == st.fg && styles[i].bg == st.bg && styles[i].attr == st.attr)
+            return i;
+    }
+    if (nstyles == STYLE_MAX) return STYLE_FILE;
+    styles[nstyles] = st;
+    return nstyles++;
+}
+
+static void
+add_ext(const char *ext, size_t len, uint8_t style)
+{
+    char key[EXT_KEY_SZ];
+    for (size_t i = 0; i < len; ++i)
+        key[i] = tolower((unsigned char) ext[i]);
+
+    // a later rule for the same extension wins, like in ls
+    for (size_t i = 0; i < nkeys; ++i) {
+        if (keys[i].len == len && memcmp(keys[i].key, key, len) == 0) {
+            keys[i].style = style;
+            return;
+        }
+    }
+    if (nkeys == keys_alloc) {
+        keys_alloc = keys_alloc? keys_alloc*2 : 64;
+        keys = realloc(keys, keys_alloc * sizeof(slot_t));
+    }
+    memcpy(keys[nkeys].key, key, len);
+    keys[nkeys].len = len;
+    keys[nkeys].style = style;
+    nkeys++;
+}
+
+static void
+add_rule(const char *key, size_t key_sz, const char *val, size_t val_sz)
+{
+    if (key_sz == 2 && memcmp(key, "ln", 2) == 0 && val_sz == 6
+            && memcmp(val, "target", 6) == 0) {
+        link_target = true;
+        return;
+    }
+
+    if (key[0] == '*') {
+        const char *pat = key + 1;
+        size_t len = key_sz - 1;
+        if (!len || memchr(pat, '*', len) || memchr(pat, '?', len) || memchr(pat, '[', len))
+            return;
+        int style = parse_style(val, val_sz);
+        // "*.ext" goes in the table, anything else is matched as a suffix
+        bool ext = pat[0] == '.' && len > 1 && len - 1 < EXT_KEY_SZ
+            && !memchr(pat + 1, '.', len - 1);
+        if (ext) {
+            add_ext(pat + 1, len - 1, style);
+        }
+        else if (nsuffixes < STYLE_MAX_SUFFIX) {
+            suffixes[nsuffixes].text = strndup(pat, len);
+            suffixes[nsuffixes].len = len;
+            suffixes[nsuffixes].style = style;
+            nsuffixes++;
+        }
+        return;
+    }
+
+    if (key_sz != 2) return;
+    if (memcmp(key, "fi", 2) == 0 || memcmp(key, "di", 2) == 0) {
+        // files and dirs always have the first two styles
+        int res = parse_style(val, val_sz);
+        int slot = (key[0] == 'f')? STYLE_FILE : STYLE_DIR;
+        styles[slot] = styles[res];
+        if (res == nstyles - 1 && res > STYLE_DIR) nstyles--;
+        return;
+    }
+    for (int i = 0; i < CLASS_COUNT; ++i) {
+        if (memcmp(key, class_names[i], 2) == 0) {
+            class_style[i] = parse_style(val, val_sz);
+            return;
+        }
+    }
+}
+
+static bool
+place_bucket(size_t *members, size_t n, uint16_t seed, bool *used)
+{
+    size_t placed[n];
+    size_t k = 0;
+    for (; k < n; ++k) {
+        slot_t *key = &keys[members[k]];
+        size_t s = hash(key->key, key->len, seed) & (nslots - 1);
+        bool taken = used[s];
+        for (size_t j = 0; j < k && !taken; ++j)
+            taken = placed[j] == s;
+        if (taken) break;
+        placed[k] = s;
+    }
+    if (k < n) return false;
+    for (k = 0; k < n; ++k) {
+        used[placed[k]] = true;
+        slots[placed[k]] = keys[members[k]];
+    }
+    return true;
+}
+
+// buckets with more keys are harder to place, so they go first while
+// the table is still empty
+static bool
+build_table(size_t size)
+{
+    nslots = size;
+    nbuckets = 1;
+    while (nbuckets * 2 < nkeys) nbuckets *= 2;
+    free(slots);
+    free(seeds);
+    slots = calloc(nslots, sizeof(slot_t));
+    seeds = calloc(nbuckets, sizeof(uint16_t));
+
+    size_t *bucket_of = malloc((nkeys + 1) * sizeof(size_t));
+    size_t *sizes = calloc(nbuckets, sizeof(size_t));
+    for (size_t i = 0; i < nkeys; ++i) {
+        bucket_of[i] = hash(keys[i].key, keys[i].len, 0) & (nbuckets - 1);
+        sizes[bucket_of[i]]++;
+    }
+    size_t largest = 0;
+    for (size_t b = 0; b < nbuckets; ++b)
+        if (sizes[b] > largest) largest = sizes[b];
+
+    bool *used = calloc(nslots, sizeof(bool));
+    size_t *members = malloc((largest + 1) * sizeof(size_t));
+    bool ok = true;
+    for (size_t want = largest; want > 0 && ok; --want) {
+        for (size_t b = 0; b < nbuckets && ok; ++b) {
+            if (sizes[b] != want) continue;
+            size_t n = 0;
+            for (size_t i = 0; i < nkeys; ++i)
+                if (bucket_of[i] == b) members[n++] = i;
+            uint16_t seed = 1;
+            while (seed && !place_bucket(members, n, seed, used)) ++seed;
+            seeds[b] = seed;
+            ok = seed != 0;
+        }
+    }
+    free(members);
+    free(used);
+    free(sizes);
+    free(bucket_of);
+    return ok;
+}
+
+static int
+lookup_ext(const char *name, size_t len)
+{
+    for (int i = 0; i < nsuffixes; ++i) {
+        suffix_t *s = &suffixes[i];
+        if (len >= s->len && strncasecmp(name + len - s->len, s->text, s->len) == 0)
+            return s->style;
+    }
+    if (!nkeys) return -1;
+
+    const char *dot = NULL;
+    for (size_t i = len; i > 0 && !dot; --i)
+        if (name[i-1] == '.') dot = name + i - 1;
+    size_t ext_sz = dot? (size_t) (name + len - dot - 1) : 0;
+    if (!ext_sz || ext_sz >= EXT_KEY_SZ) return -1;
+
+    char key[EXT_KEY_SZ];
+    for (size_t i = 0; i < ext_sz; ++i)
+        key[i] = tolower((unsigned char) dot[1+i]);
+    uint16_t seed = seeds[hash(key, ext_sz, 0) & (nbuckets - 1)];
+    if (!seed) return -1;
+    slot_t *s = &slots[hash(key, ext_sz, seed) & (nslots - 1)];
+    if (s->len != ext_sz || memcmp(s->key, key, ext_sz) != 0) return -1;
+    return s->style;
+}
+
+static int
+class_or(int cls, int fallback)
+{
+    return (class_style[cls] >= 0)? class_style[cls] : fallback;
+}
+
+void
+colors_load(void)
+{
+    for (int i = 0; i < CLASS_COUNT; ++i)
+        class_style[i] = -1;
+
+    const char *rules = getenv("MFM_COLORS");
+    if (!rules || !*rules) rules = getenv("LS_COLORS");
+    if (!rules || !*rules) rules = default_rules;
+
+    for (const char *p = rules; *p; ) {
+        const char *end = strchr(p, ':');
+        if (!end) end = p + strlen(p);
+        const char *eq = memchr(p, '=', end - p);
+        if (eq && eq > p) add_rule(p, eq - p, eq + 1, end - eq - 1);
+        p = *end? end + 1 : end;
+    }
+
+    size_t size = 8;
+    while (size < nkeys * 2) size *= 2;
+    while (nkeys && !build_table(size)) size *= 2;
+}
+
+// colours past what the terminal has are folded into the first eight,
+// brighter ones made bold instead
+static short
+map_color(short c, int *attr)
+{
+    if (c < COLORS) return c;
+    if (c < 16) {
+        *attr |= A_BOLD;
+        return c - 8;
+    }
+    return c % 8;
+}
+
+void
+colors_init_pairs(int first)
+{
+    for (int i = 0; i < nstyles; ++i) {
+        int pair = first + i * 2;
+        if (pair + 1 >= COLOR_PAIRS) {
+            attrs[i] = attrs[STYLE_FILE];
+            sel_attrs[i] = sel_attrs[STYLE_FILE];
+            continue;
+        }
+        int attr = styles[i].attr;
+        short fg = map_color(styles[i].fg, &attr);
+        short bg = map_color(styles[i].bg, &attr);
+        // the cursor row swaps them, like the plain file and dir colours
+        init_pair(pair, fg, bg);
+        init_pair(pair + 1, bg, fg);
+        attrs[i] = COLOR_PAIR(pair) | attr;
+        sel_attrs[i] = COLOR_PAIR(pair + 1) | attr;
+    }
+}
+
+uint8_t
+colors_classify(const char *name, size_t len, mode_t mode, bool link)
+{
+    // archives list their symlinks by mode
+    link = link || S_ISLNK(mode);
+    if (link && !mode) return class_or(CLASS_ORPHAN, class_or(CLASS_LINK, STYLE_FILE));
+    if (link && !link_target && class_style[CLASS_LINK] >= 0)
+        return class_style[CLASS_LINK];
+
+    if (S_ISDIR(mode)) return STYLE_DIR;
+    if (S_ISFIFO(mode)) return class_or(CLASS_FIFO, STYLE_FILE);
+    if (S_ISSOCK(mode)) return class_or(CLASS_SOCK, STYLE_FILE);
+    if (S_ISBLK(mode)) return class_or(CLASS_BLK, STYLE_FILE);
+    if (S_ISCHR(mode)) return class_or(CLASS_CHR, STYLE_FILE);
+
+    if ((mode & S_ISUID) && class_style[CLASS_SETUID] >= 0)
+        return class_style[CLASS_SETUID];
+    if ((mode & S_ISGID) && class_style[CLASS_SETGID] >= 0)
+        return class_style[CLASS_SETGID];
+    if ((mode & 0111) && class_style[CLASS_EXEC] >= 0)
+        return class_style[CLASS_EXEC];
+
+    int style = lookup_ext(name, len);
+    return (style >= 0)? style : STYLE_FILE;
+}
+
+int
+colors_attrs(uint8_t style, bool sel)
+{
+    if (style >= nstyles) style = STYLE_FILE;
+    return sel? sel_attrs[style] : attrs[style];
+}
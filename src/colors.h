@@ -0,0 +1,32 @@
+#ifndef COLORS_H
+#define COLORS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// file colours in the LS_COLORS format, from MFM_COLORS, LS_COLORS or
+// the defaults. entries are classified once, when their metadata comes
+// in, and drawing a row only looks its style up
+
+#define STYLE_MAX 128         // distinct colours, the rest fall back to files
+#define STYLE_MAX_SUFFIX 32   // patterns that aren't a plain "*.ext"
+
+enum {
+    STYLE_FILE,
+    STYLE_DIR,
+};
+
+// parse the rules and build the extension table. once, at startup.
+// without it files and dirs are drawn plain
+void colors_load(void);
+// set up the curses pairs from first on, after start_color()
+void colors_init_pairs(int first);
+// style of an entry. mode is what stat() says, 0 if it isn't known
+// yet, and link whether lstat() says it's a symlink
+uint8_t colors_classify(const char *name, size_t len, mode_t mode, bool link);
+// curses attributes to draw a style with, on the cursor row if sel
+int colors_attrs(uint8_t style, bool sel);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "columns.h"
+#include "fs.h"
+
+#define SIX_MONTHS (182*24*3600)
+
+// an id and its name, open addressing on the id
+typedef struct id_name_t {
+    uint32_t id;
+    bool used;
+    char name[COLUMNS_NAME_MAX + 1];
+} id_name_t;
+
+typedef struct id_cache_t {
+    id_name_t slots[COLUMNS_CACHE_SZ];
+    size_t count;
+} id_cache_t;
+
+static id_cache_t users, groups;
+
+static id_name_t *cache_slot(id_cache_t *c, uint32_t id, bool *found);
+static void mode_string(mode_t mode, char *buf);
+static void size_string(int64_t size, char *buf, size_t sz);
+static void build(files_t *f);
+
+// the slot id is in, or the one it goes in. a full cache starts over,
+// it's a handful of ids anywhere but the strangest of systems
+static id_name_t *
+cache_slot(id_cache_t *c, uint32_t id, bool *found)
+{
+    if (c->count >= COLUMNS_CACHE_SZ / 2) {
+        memset(c, 0, sizeof(*c));
+    }
+    size_t k = (id * 2654435761u) & (COLUMNS_CACHE_SZ - 1);
+    while (c->slots[k].used && c->slots[k].id != id)
+        k = (k + 1) & (COLUMNS_CACHE_SZ - 1);
+    *found = c->slots[k].used;
+    return &c->slots[k];
+}
+
+const char *
+columns_user(uid_t uid)
+{
+    bool found;
+    id_name_t *s = cache_slot(&users, uid, &found);
+    if (found) return s->name;
+
+    // with nss going out to ldap this can take a while, but only once
+    struct passwd pw, *res = NULL;
+    char buf[4096];
+    if (getpwuid_r(uid, &pw, buf, sizeof(buf), &res) == 0 && res)
+        snprintf(s->name, sizeof(s->name), "%s", pw.pw_name);
+    else
+        snprintf(s->name, sizeof(s->name), "%u", (unsigned) uid);
+    s->id = uid;
+    s->used = true;
+    users.count++;
+    return s->name;
+}
+
+const char *
+columns_group(gid_t gid)
+{
+    bool found;
+    id_name_t *s = cache_slot(&groups, gid, &found);
+    if (found) return s->name;
+
+    struct group gr, *res = NULL;
+    char buf[4096];
+    if (getgrgid_r(gid, &gr, buf, sizeof(buf), &res) == 0 && res)
+        snprintf(s->name, sizeof(s->name), "%s", gr.gr_name);
+    else
+        snprintf(s->name, sizeof(s->name), "%u", (unsigned) gid);
+    s->id = gid;
+    s->used = true;
+    groups.count++;
+    return s->name;
+}
+
+static void
+mode_string(mode_t mode, char *buf)
+{
+    buf[0] = S_ISDIR(mode)? 'd' : S_ISLNK(mode)? 'l' : S_ISCHR(mode)? 'c'
+        : S_ISBLK(mode)? 'b' : S_ISFIFO(mode)? 'p' : S_ISSOCK(mode)? 's' : '-';
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; ++i)
+        buf[i+1] = (mode & (0400 >> i))? rwx[i] : '-';
+    if (mode & S_ISUID) buf[3] = (mode & S_IXUSR)? 's' : 'S';
+    if (mode & S_ISGID) buf[6] = (mode & S_IXGRP)? 's' : 'S';
+    if (mode & S_ISVTX) buf[9] = (mode & S_IXOTH)? 't' : 'T';
+    buf[10] = '\0';
+}
+
+// like ls -h, never more than 4 characters
+static void
+size_string(int64_t size, char *buf, size_t sz)
+{
+    static const char units[] = "KMGTPE";
+    if (size < 1024) {
+        snprintf(buf, sz, "%d", (int) size);
+        return;
+    }
+    double v = size;
+    int u = -1;
+    while (v >= 1024 && u < 5) {
+        v /= 1024;
+        ++u;
+    }
+    // 1023.9K would round up to five characters
+    if (v >= 999.5 && u < 5) {
+        v /= 1024;
+        ++u;
+    }
+    if (v < 9.95) snprintf(buf, sz, "%.1f%c", v, units[u]);
+    else snprintf(buf, sz, "%.0f%c", v, units[u]);
+}
+
+static void
+build(files_t *f)
+{
+    size_t n = f->all.size;
+    fs_meta_t *meta = f->meta;
+    f->cols_w = 0;
+    if (!meta || !n) {
+        f->cols = calloc(1, 1);
+        return;
+    }
+
+    // names as long as the longest of the listing
+    int uw = 1, gw = 1, lw = 1;
+    for (size_t i = 0; i < n; ++i) {
+        if (!f->all.data[i].mode) continue;
+        int len = strlen(columns_user(meta[i].uid));
+        if (len > uw) uw = len;
+        len = strlen(columns_group(meta[i].gid));
+        if (len > gw) gw = len;
+        len = snprintf(NULL, 0, "%u", meta[i].nlink);
+        if (len > lw) lw = len;
+    }
+
+    // "drwxr-xr-x 2 user group  4.0K Oct 19 02:04"
+    size_t w = 10 + 1 + lw + 1 + uw + 1 + gw + 1 + 5 + 1 + 12;
+    f->cols_w = w;
+    f->cols = malloc(n * (w + 1));
+    time_t now = time(NULL);
+    for (size_t i = 0; i < n; ++i) {
+        char *row = f->cols + i * (w + 1);
+        memset(row, ' ', w);
+        row[w] = '\0';
+        mode_t mode = f->all.data[i].mode;
+        if (!mode) continue;
+
+        char perms[11], size[16], date[32];
+        mode_string(mode, perms);
+        size_string(meta[i].size, size, sizeof(size));
+        time_t t = meta[i].mtime;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        bool recent = t <= now + 3600 && now - t < SIX_MONTHS;
+        strftime(date, sizeof(date), recent? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+        int len = snprintf(row, w + 1, "%s %*u %-*s %-*s %5s %s", perms,
+            lw, meta[i].nlink, uw, columns_user(meta[i].uid),
+            gw, columns_group(meta[i].gid), size, date);
+        if (len >= 0 && (size_t) len < w) row[len] = ' ';
+    }
+}
+
+const char *
+columns_row(files_t *f, size_t i)
+{
+    if (!f->cols) build(f);
+    if (!f->cols_w || i >= f->size) return "";
+    return f->cols + f->view[i] * (f->cols_w + 1);
+}
+
+size_t
+columns_width(files_t *f)
+{
+    if (!f->cols) build(f);
+    return f->cols_w;
+}
+
+void
+columns_reset(files_t *f)
+{
+    free(f->cols);
+    f->cols = NULL;
+    f->cols_w = 0;
+}
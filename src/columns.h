@@ -0,0 +1,30 @@
+#ifndef COLUMNS_H
+#define COLUMNS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "mfm.h"
+
+// the long listing: type and permissions, links, owner, group, size
+// and mtime in front of every name, like ls -lh. the columns of a
+// listing are laid out once, the first time they're drawn after it
+// changed, into one block with a fixed stride, so drawing a row is a
+// lookup however big the listing is
+
+#define COLUMNS_NAME_MAX 12  // owner and group names are cut there
+#define COLUMNS_CACHE_SZ 1024  // uids and gids remembered, a power of two
+
+// user and group names, looked up once per id. ids without a name come
+// back as numbers
+const char *columns_user(uid_t uid);
+const char *columns_group(gid_t gid);
+
+// the columns of the row i of the view, all spaces if its metadata
+// isn't in. always columns_width(f) long
+const char *columns_row(files_t *f, size_t i);
+size_t columns_width(files_t *f);
+// the listing's metadata changed, lay the columns out again next time
+void columns_reset(files_t *f);
+
+#endif
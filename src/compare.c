@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "compare.h"
+#include "dupes.h"
+#include "wake.h"
+
+typedef struct name_t {
+    char *name;
+} name_t;
+
+typedef struct item_t {
+    char *rel;     // relative to its tree, dirs end in '/'
+    uint32_t tag;  // 0 until the hashes say otherwise
+    bool right;    // in the right tree
+    off_t size;
+} item_t;
+
+typedef struct job_t {
+    char *left, *right, *right_rel;
+    bool contents, hidden;
+} job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false, reported = true, hashing = false;
+static volatile bool cancel = false;
+static compare_result_t *result = NULL;
+
+// progress, under lock
+static size_t nseen = 0, ndiffer = 0, nfailed = 0;
+static size_t nhash = 0, nhashed = 0, next_hash = 0;
+static uint64_t hash_bytes = 0, hashed_bytes = 0;
+static int64_t start_ms = 0, end_ms = 0;
+
+// only touched by the compare thread, and the hash workers once the
+// walk is over
+static item_t *items = NULL;
+static size_t nitems = 0, items_alloc = 0;
+static size_t *to_hash = NULL;
+
+static int compare_names(const void *a, const void *b);
+static name_t *read_names(int fd, size_t *n, bool hidden);
+static void free_names(name_t *names, size_t n);
+static void add_item(const char *rel, size_t len, uint32_t tag, bool right, off_t size);
+static void one_side(int fd, const char *name, char *rel, size_t len, bool right);
+static void both_sides(int lfd, int rfd, const char *name, char *rel, size_t len, job_t *job);
+static void compare_dir(int lfd, int rfd, char *rel, size_t len, job_t *job);
+static bool hash_file(const char *path, off_t size, uint64_t *hash);
+static void *hash_thread(void *arg);
+static void run_hashes(job_t *job);
+static compare_result_t *make_result(job_t *job);
+static void *compare_thread(void *arg);
+
+static int
+compare_names(const void *a, const void *b)
+{
+    return strcmp(((name_t*) a)->name, ((name_t*) b)->name);
+}
+
+static name_t *
+read_names(int fd, size_t *n, bool hidden)
+{
+    *n = 0;
+    int dup_fd = dup(fd);
+    DIR *dir = (dup_fd >= 0)? fdopendir(dup_fd) : NULL;
+    if (!dir) {
+        if (dup_fd >= 0) close(dup_fd);
+        return NULL;
+    }
+    size_t alloc = 64;
+    name_t *names = malloc(alloc * sizeof(name_t));
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        char *name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        if ((name[0] == '.' && !hidden) || strchr(name, '\n'))
+            continue;
+        if (*n == alloc) {
+            alloc *= 2;
+            names = realloc(names, alloc * sizeof(name_t));
+        }
+        names[*n].name = strdup(name);
+        (*n)++;
+    }
+    closedir(dir);
+    qsort(names, *n, sizeof(name_t), compare_names);
+    return names;
+}
+
+static void
+free_names(name_t *names, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        free(names[i].name);
+    free(names);
+}
+
+static void
+add_item(const char *rel, size_t len, uint32_t tag, bool right, off_t size)
+{
+    if (nitems == items_alloc) {
+        items_alloc = items_alloc? items_alloc*2 : 256;
+        items = realloc(items, items_alloc * sizeof(item_t));
+    }
+    items[nitems++] = (item_t) { strndup(rel, len), tag, right, size };
+    if (!tag) return;
+    pthread_mutex_lock(&lock);
+    ndiffer++;
+    wake_notify(&wake, false);
+    pthread_mutex_unlock(&lock);
+}
+
+// a dir that is only on one side is listed by itself, not what is in it
+static void
+one_side(int fd, const char *name, char *rel, size_t len, bool right)
+{
+    struct stat st;
+    bool dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+    int sz = snprintf(rel + len, PATH_MAX - len, "%s%s", name, dir? "/" : "");
+    if (sz >= PATH_MAX - (int) len) return;
+    add_item(rel, len + sz, right? COMPARE_RIGHT : COMPARE_LEFT, right, 0);
+}
+
+// mtimes only count to the second, plenty of tools that copy trees
+// don't keep more than that
+static void
+both_sides(int lfd, int rfd, const char *name, char *rel, size_t len, job_t *job)
+{
+    struct stat ls, rs;
+    if (fstatat(lfd, name, &ls, AT_SYMLINK_NOFOLLOW) < 0
+            || fstatat(rfd, name, &rs, AT_SYMLINK_NOFOLLOW) < 0) {
+        pthread_mutex_lock(&lock);
+        nfailed++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    bool dir = S_ISDIR(ls.st_mode) && S_ISDIR(rs.st_mode);
+    int sz = snprintf(rel + len, PATH_MAX - len, "%s%s", name, dir? "/" : "");
+    if (sz >= PATH_MAX - (int) len) return;
+
+    bool meta = (ls.st_mode & S_IFMT) != (rs.st_mode & S_IFMT)
+        || (ls.st_mode & 07777) != (rs.st_mode & 07777);
+    if (!meta && S_ISREG(ls.st_mode)) {
+        meta = ls.st_size != rs.st_size || ls.st_mtim.tv_sec != rs.st_mtim.tv_sec;
+    }
+    else if (!meta && S_ISLNK(ls.st_mode)) {
+        char lt[PATH_MAX], rt[PATH_MAX];
+        ssize_t ln = readlinkat(lfd, name, lt, sizeof(lt));
+        ssize_t rn = readlinkat(rfd, name, rt, sizeof(rt));
+        meta = ln != rn || ln < 0 || memcmp(lt, rt, ln) != 0;
+    }
+
+    if (meta)
+        add_item(rel, len + sz, COMPARE_META, false, 0);
+    else if (job->contents && S_ISREG(ls.st_mode))
+        add_item(rel, len + sz, 0, false, ls.st_size);
+
+    if (dir && !cancel) {
+        int l = openat(lfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int r = openat(rfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (l >= 0 && r >= 0) compare_dir(l, r, rel, len + sz, job);
+        if (l >= 0) close(l);
+        if (r >= 0) close(r);
+    }
+}
+
+// both sides are sorted, one pass over each finds what is where
+static void
+compare_dir(int lfd, int rfd, char *rel, size_t len, job_t *job)
+{
+    size_t nl = 0, nr = 0;
+    name_t *l = read_names(lfd, &nl, job->hidden);
+    name_t *r = read_names(rfd, &nr, job->hidden);
+    if (!l || !r) {
+        pthread_mutex_lock(&lock);
+        nfailed++;
+        pthread_mutex_unlock(&lock);
+        free_names(l, nl);
+        free_names(r, nr);
+        return;
+    }
+
+    size_t i = 0, j = 0;
+    while ((i < nl || j < nr) && !cancel) {
+        int cmp = (i == nl)? 1 : (j == nr)? -1 : strcmp(l[i].name, r[j].name);
+        if (cmp < 0) {
+            one_side(lfd, l[i++].name, rel, len, false);
+        }
+        else if (cmp > 0) {
+            one_side(rfd, r[j++].name, rel, len, true);
+        }
+        else {
+            both_sides(lfd, rfd, l[i].name, rel, len, job);
+            ++i, ++j;
+        }
+        pthread_mutex_lock(&lock);
+        nseen++;
+        wake_notify(&wake, false);
+        pthread_mutex_unlock(&lock);
+    }
+    rel[len] = '\0';
+    free_names(l, nl);
+    free_names(r, nr);
+}
+
+static bool
+hash_file(const char *path, off_t size, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return false;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    madvise(data, size, MADV_SEQUENTIAL);
+    *hash = dupes_hash(data, size, size);
+    munmap(data, size);
+    return true;
+}
+
+static void *
+hash_thread(void *arg)
+{
+    job_t *job = arg;
+    char lpath[PATH_MAX], rpath[PATH_MAX];
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        size_t i = next_hash++;
+        pthread_mutex_unlock(&lock);
+        if (i >= nhash || cancel) return NULL;
+
+        item_t *it = &items[to_hash[i]];
+        snprintf(lpath, sizeof(lpath), "%s/%s", job->left, it->rel);
+        snprintf(rpath, sizeof(rpath), "%s/%s", job->right, it->rel);
+        uint64_t lh = 0, rh = 0;
+        bool same = it->size == 0
+            || (hash_file(lpath, it->size, &lh) && hash_file(rpath, it->size, &rh) && lh == rh);
+
+        pthread_mutex_lock(&lock);
+        if (!same) {
+            it->tag = COMPARE_CONTENT;
+            ndiffer++;
+        }
+        nhashed++;
+        hashed_bytes += it->size;
+        wake_notify(&wake, false);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+static void
+run_hashes(job_t *job)
+{
+    size_t n = 0;
+    uint64_t bytes = 0;
+    to_hash = malloc((nitems + 1) * sizeof(size_t));
+    for (size_t i = 0; i < nitems; ++i) {
+        if (items[i].tag) continue;
+        to_hash[n++] = i;
+        bytes += items[i].size;
+    }
+
+    pthread_mutex_lock(&lock);
+    hashing = true;
+    nhash = n;
+    nhashed = next_hash = 0;
+    hash_bytes = bytes;
+    hashed_bytes = 0;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = (cpus < 1)? 1 : (cpus > COMPARE_MAX_THREADS)? COMPARE_MAX_THREADS : cpus;
+    if (nthreads > n) nthreads = n;
+    pthread_t threads[COMPARE_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[started], NULL, hash_thread, job) == 0)
+            started++;
+    }
+    if (!started && n) hash_thread(job);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(to_hash);
+    to_hash = NULL;
+}
+
+// what turned out the same after hashing is left out
+static compare_result_t *
+make_result(job_t *job)
+{
+    compare_result_t *r = calloc(1, sizeof(compare_result_t));
+    size_t prefix = strlen(job->right_rel), alloc = 0;
+    r->tags = malloc((nitems + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < nitems; ++i) {
+        item_t *it = &items[i];
+        if (!it->tag) continue;
+        size_t len = strlen(it->rel);
+        size_t need = r->sz + prefix + len + 2;
+        if (need > alloc) {
+            alloc = need * 2;
+            r->buf = realloc(r->buf, alloc);
+        }
+        if (it->right) {
+            memcpy(r->buf + r->sz, job->right_rel, prefix);
+            r->sz += prefix;
+            r->buf[r->sz++] = '/';
+        }
+        memcpy(r->buf + r->sz, it->rel, len);
+        r->sz += len;
+        r->buf[r->sz++] = '\n';
+        r->tags[r->count++] = it->tag;
+        r->counts[it->tag]++;
+    }
+    return r;
+}
+
+static void *
+compare_thread(void *arg)
+{
+    job_t *job = arg;
+    char *rel = malloc(PATH_MAX);
+    rel[0] = '\0';
+    int l = open(job->left, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int r = open(job->right, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (l >= 0 && r >= 0) {
+        compare_dir(l, r, rel, 0, job);
+        if (job->contents && !cancel) run_hashes(job);
+    }
+    else {
+        pthread_mutex_lock(&lock);
+        nfailed++;
+        pthread_mutex_unlock(&lock);
+    }
+    if (l >= 0) close(l);
+    if (r >= 0) close(r);
+    free(rel);
+
+    compare_result_t *res = cancel? NULL : make_result(job);
+    for (size_t i = 0; i < nitems; ++i)
+        free(items[i].rel);
+    free(items);
+    items = NULL;
+    nitems = items_alloc = 0;
+
+    pthread_mutex_lock(&lock);
+    if (res) res->seen = nseen;
+    result = res;
+    running = false;
+    end_ms = now_ms();
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+
+    free(job->left);
+    free(job->right);
+    free(job->right_rel);
+    free(job);
+    return NULL;
+}
+
+bool
+compare_start(const char *left, const char *right, const char *right_rel,
+        bool contents, bool hidden)
+{
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wake_open(&wake);
+    compare_free_result(result);
+    result = NULL;
+    nseen = ndiffer = nfailed = 0;
+    nhash = nhashed = next_hash = 0;
+    hash_bytes = hashed_bytes = 0;
+    hashing = false;
+    start_ms = now_ms();
+    end_ms = 0;
+    cancel = false;
+    reported = false;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->left = strdup(left);
+    job->right = strdup(right);
+    job->right_rel = strdup(right_rel);
+    job->contents = contents;
+    job->hidden = hidden;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, compare_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) {
+        free(job->left);
+        free(job->right);
+        free(job->right_rel);
+        free(job);
+        reported = true;
+    }
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void
+compare_cancel(void)
+{
+    pthread_mutex_lock(&lock);
+    cancel = true;
+    pthread_mutex_unlock(&lock);
+}
+
+bool
+compare_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+compare_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+compare_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    bool finished = false;
+    if (running && hashing) {
+        snprintf(buf, sz, "compare: hashing %zu/%zu files, %llu/%llu MiB",
+            nhashed, nhash, (unsigned long long) (hashed_bytes >> 20),
+            (unsigned long long) (hash_bytes >> 20));
+    }
+    else if (running) {
+        snprintf(buf, sz, "compare: %zu entries, %zu differ", nseen, ndiffer);
+    }
+    else {
+        finished = !reported;
+        reported = true;
+        char failed[64] = "";
+        if (nfailed)
+            snprintf(failed, sizeof(failed), ", %zu unreadable", nfailed);
+        double secs = (end_ms - start_ms) / 1000.0;
+        if (cancel || !result) {
+            snprintf(buf, sz, "compare: cancelled");
+        }
+        else if (!result->count) {
+            snprintf(buf, sz, "compare: no differences in %zu entries, %.2fs%s",
+                nseen, secs, failed);
+        }
+        else {
+            size_t *n = result->counts;
+            snprintf(buf, sz, "compare: %zu only here, %zu only there, %zu meta, "
+                "%zu contents, %zu seen, %.2fs%s", n[COMPARE_LEFT], n[COMPARE_RIGHT],
+                n[COMPARE_META], n[COMPARE_CONTENT], nseen, secs, failed);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
+
+compare_result_t *
+compare_take(void)
+{
+    pthread_mutex_lock(&lock);
+    compare_result_t *r = running? NULL : result;
+    if (r) result = NULL;
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+void
+compare_free_result(compare_result_t *r)
+{
+    if (!r) return;
+    free(r->buf);
+    free(r->tags);
+    free(r);
+}
@@ -0,0 +1,48 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// compares two trees, like diff -r. every dir is read on both sides,
+// sorted once and merge-joined, so a level costs a pass over each.
+// files whose size and mtime agree can be hashed too, on a few threads,
+// to catch the ones that differ anyway
+
+#define COMPARE_MAX_THREADS 8
+
+enum {
+    COMPARE_LEFT = 1,  // only in the left tree
+    COMPARE_RIGHT,     // only in the right one
+    COMPARE_META,      // type, permissions, size or mtime differ
+    COMPARE_CONTENT,   // size and mtime agree, contents don't
+    COMPARE_TAGS,
+};
+
+typedef struct compare_result_t {
+    char *buf;       // paths relative to left, '\n' terminated
+    size_t sz;
+    uint32_t *tags;  // COMPARE_* for each path
+    size_t count;
+    size_t counts[COMPARE_TAGS];  // paths with each tag
+    size_t seen;     // entries looked at
+} compare_result_t;
+
+// compare the trees in left and right. what is only in right is listed
+// as right_rel, the way to right from left, followed by its path. with
+// contents set, files that look the same are hashed. false if a compare
+// is already running
+bool compare_start(const char *left, const char *right, const char *right_rel,
+        bool contents, bool hidden);
+void compare_cancel(void);
+bool compare_running(void);
+// fd that becomes readable on progress and when the result is in
+int compare_fd(void);
+// one line describing the compare. true once, when it has just finished
+bool compare_progress(char *buf, size_t sz);
+// the finished result, NULL while running or after a cancel
+compare_result_t *compare_take(void);
+void compare_free_result(compare_result_t *r);
+
+#endif
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "control.h"
+
+typedef struct client_t {
+    int fd;
+    char in[CONTROL_LINE_MAX];
+    size_t in_sz;
+    char *out;
+    size_t out_sz, out_alloc;
+    bool closing;  // drop it once the replies are out
+} client_t;
+
+static int listen_fd = -1;
+static client_t clients[CONTROL_MAX_CLIENTS];
+static size_t nclients = 0;
+static char sock_dir[PATH_MAX];
+static char sock_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+static char sock_name[64];
+
+static void remove_stale(void);
+static void append(client_t *c, const char *data, size_t sz);
+static void vappend(control_reply_t *r, const char *fmt, va_list ap);
+static void run_line(client_t *c, char *line, control_handler_t handle, void *data);
+static bool read_client(client_t *c, control_handler_t handle, void *data);
+static void flush_client(client_t *c);
+static void accept_clients(void);
+
+// sockets left behind by instances that didn't get to clean up
+static void
+remove_stale(void)
+{
+    DIR *dir = opendir(sock_dir);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        char *end;
+        long pid = strtol(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".sock") != 0) continue;
+        if (kill(pid, 0) < 0 && errno == ESRCH)
+            unlinkat(dirfd(dir), de->d_name, 0);
+    }
+    closedir(dir);
+}
+
+bool
+control_open(void)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int dlen;
+    if (runtime && *runtime)
+        dlen = snprintf(sock_dir, sizeof(sock_dir), "%s/mfm", runtime);
+    else
+        dlen = snprintf(sock_dir, sizeof(sock_dir), "/tmp/mfm-%u", (unsigned) getuid());
+    // a cut short path would be some other socket
+    if (dlen < 0 || dlen >= (int) sizeof(sock_dir)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    // in /tmp the dir could be someone else's, only ever use our own
+    struct stat st;
+    if (mkdir(sock_dir, 0700) < 0 && errno != EEXIST) return false;
+    if (lstat(sock_dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid())
+        return false;
+    remove_stale();
+
+    snprintf(sock_name, sizeof(sock_name), "%d.sock", (int) getpid());
+    int len = snprintf(sock_path, sizeof(sock_path), "%s/%s", sock_dir, sock_name);
+    if (len < 0 || len >= (int) sizeof(sock_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, sock_path, len + 1);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(sock_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+            || listen(listen_fd, CONTROL_MAX_CLIENTS) < 0) {
+        if (listen_fd >= 0) close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    // mfm.sock is whichever instance started last
+    char tmp[PATH_MAX], link[PATH_MAX];
+    int tlen = snprintf(tmp, sizeof(tmp), "%s/.%s", sock_dir, sock_name);
+    int llen = snprintf(link, sizeof(link), "%s/mfm.sock", sock_dir);
+    if (tlen >= 0 && tlen < (int) sizeof(tmp) && llen >= 0 && llen < (int) sizeof(link)) {
+        unlink(tmp);
+        if (symlink(sock_name, tmp) == 0 && rename(tmp, link) < 0)
+            unlink(tmp);
+    }
+
+    setenv("MFM_SOCKET", sock_path, 1);
+    return true;
+}
+
+void
+control_close(void)
+{
+    if (listen_fd < 0) return;
+    for (size_t i = 0; i < nclients; ++i) {
+        close(clients[i].fd);
+        free(clients[i].out);
+    }
+    nclients = 0;
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(sock_path);
+
+    char link[PATH_MAX], target[64];
+    int len = snprintf(link, sizeof(link), "%s/mfm.sock", sock_dir);
+    if (len < 0 || len >= (int) sizeof(link)) return;
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    if (n > 0) {
+        target[n] = '\0';
+        if (strcmp(target, sock_name) == 0) unlink(link);
+    }
+}
+
+size_t
+control_pollfds(struct pollfd *fds, size_t max)
+{
+    if (listen_fd < 0 || !max) return 0;
+    size_t n = 0;
+    fds[n++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+    for (size_t i = 0; i < nclients && n < max; ++i) {
+        short events = clients[i].out_sz? POLLIN | POLLOUT : POLLIN;
+        fds[n++] = (struct pollfd) { .fd = clients[i].fd, .events = events };
+    }
+    return n;
+}
+
+static void
+append(client_t *c, const char *data, size_t sz)
+{
+    if (c->out_sz + sz > c->out_alloc) {
+        c->out_alloc = (c->out_sz + sz) * 2;
+        c->out = realloc(c->out, c->out_alloc);
+    }
+    memcpy(c->out + c->out_sz, data, sz);
+    c->out_sz += sz;
+}
+
+static void
+vappend(control_reply_t *r, const char *fmt, va_list ap)
+{
+    va_list copy;
+    va_copy(copy, ap);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0) return;
+    if (r->sz + len + 2 > r->alloc) {
+        r->alloc = (r->sz + len + 2) * 2;
+        r->buf = realloc(r->buf, r->alloc);
+    }
+    vsnprintf(r->buf + r->sz, len + 1, fmt, ap);
+    r->sz += len;
+    r->buf[r->sz++] = '\n';
+}
+
+void
+control_printf(control_reply_t *r, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vappend(r, fmt, ap);
+    va_end(ap);
+}
+
+void
+control_error(control_reply_t *r, const char *fmt, ...)
+{
+    // whatever data came before is dropped, the answer is the error
+    r->sz = 0;
+    r->failed = true;
+    va_list ap;
+    va_start(ap, fmt);
+    vappend(r, fmt, ap);
+    va_end(ap);
+}
+
+static void
+run_line(client_t *c, char *line, control_handler_t handle, void *data)
+{
+    size_t len = strlen(line);
+    if (len && line[len-1] == '\r') line[--len] = '\0';
+    if (!len) return;
+
+    char *arg = strchr(line, ' ');
+    if (arg) *arg++ = '\0';
+    else arg = line + len;
+
+    control_reply_t r = {0};
+    handle(data, line, arg, &r);
+    if (r.failed) append(c, "err ", 4);
+    if (r.sz) append(c, r.buf, r.sz);
+    if (!r.failed) append(c, "ok\n", 3);
+    free(r.buf);
+}
+
+// every complete line there is gets handled now, the replies go out
+// together afterwards
+static bool
+read_client(client_t *c, control_handler_t handle, void *data)
+{
+    bool handled = false;
+    for (;;) {
+        ssize_t n = recv(c->fd, c->in + c->in_sz, sizeof(c->in) - c->in_sz, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                c->closing = true;
+            break;
+        }
+        c->in_sz += n;
+
+        char *start = c->in, *end;
+        while ((end = memchr(start, '\n', c->in + c->in_sz - start))) {
+            *end = '\0';
+            run_line(c, start, handle, data);
+            handled = true;
+            start = end + 1;
+        }
+        c->in_sz -= start - c->in;
+        memmove(c->in, start, c->in_sz);
+        if (c->in_sz == sizeof(c->in)) {
+            append(c, "err line too long\n", 18);
+            c->closing = true;
+            break;
+        }
+    }
+    return handled;
+}
+
+static void
+flush_client(client_t *c)
+{
+    while (c->out_sz) {
+        ssize_t n = send(c->fd, c->out, c->out_sz, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c->out_sz = 0;
+                c->closing = true;
+            }
+            return;
+        }
+        c->out_sz -= n;
+        memmove(c->out, c->out + n, c->out_sz);
+    }
+}
+
+static void
+accept_clients(void)
+{
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        if (nclients == CONTROL_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        clients[nclients++] = (client_t) { .fd = fd };
+    }
+}
+
+bool
+control_serve(struct pollfd *fds, size_t n, control_handler_t handle, void *data)
+{
+    if (listen_fd < 0 || !n) return false;
+
+    bool handled = false;
+    for (size_t i = 1; i < n; ++i) {
+        client_t *c = NULL;
+        for (size_t j = 0; j < nclients && !c; ++j)
+            if (clients[j].fd == fds[i].fd) c = &clients[j];
+        if (!c || !fds[i].revents) continue;
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            handled |= read_client(c, handle, data);
+        flush_client(c);
+    }
+    if (fds[0].revents & POLLIN)
+        accept_clients();
+
+    // clients that are done, or that went away, are dropped
+    size_t kept = 0;
+    for (size_t i = 0; i < nclients; ++i) {
+        client_t *c = &clients[i];
+        if (c->closing && !c->out_sz) {
+            close(c->fd);
+            free(c->out);
+            continue;
+        }
+        clients[kept++] = *c;
+    }
+    nclients = kept;
+    return handled;
+}
@@ -0,0 +1,54 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <poll.h>
+
+// a unix socket other programs can drive a running mfm through. the
+// socket is $XDG_RUNTIME_DIR/mfm/<pid>.sock (or /tmp/mfm-<uid>/...),
+// mfm.sock next to it points at the latest instance, and MFM_SOCKET is
+// set for everything started from mfm.
+//
+// one command per line, "name [argument]". each is answered with any
+// number of lines of data and then "ok" or "err <why>". everything a
+// client has sent by the time mfm wakes up is handled in one go, before
+// the screen is drawn again:
+//   cd <path>        go to a dir, or to a file's dir with the cursor on it
+//   pwd              the current dir
+//   cursor           path of the entry under the cursor
+//   selection        selected paths, one per line
+//   select <path>    add path to the selection
+//   unselect <path>  take it out again
+//   clear            empty the selection
+//   refresh          read the current dir again
+//   dupes            look for duplicates, like 'U'
+//   pack <dest>      pack the selection, like 'P'
+//   quit
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_LINE_MAX 4096
+
+typedef struct control_reply_t {
+    char *buf;
+    size_t sz, alloc;
+    bool failed;
+} control_reply_t;
+
+typedef void (*control_handler_t)(void *data, char *cmd, char *arg, control_reply_t *reply);
+
+// start listening. false if there's no socket, mfm works without it
+bool control_open(void);
+void control_close(void);
+// fds to poll, the listener and its clients. returns how many
+size_t control_pollfds(struct pollfd *fds, size_t max);
+// accept, read and answer whatever the poll found. true if any command
+// was handled, so the screen needs drawing again
+bool control_serve(struct pollfd *fds, size_t n, control_handler_t handle, void *data);
+
+// add a line of data to a reply
+void control_printf(control_reply_t *r, const char *fmt, ...);
+// answer "err <why>" instead of "ok"
+void control_error(control_reply_t *r, const char *fmt, ...);
+
+#endif
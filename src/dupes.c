@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include "dupes.h"
+#include "wake.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+enum {
+    STAGE_SCAN,
+    STAGE_HEADS,
+    STAGE_FULL,
+    STAGE_DONE,
+};
+
+typedef struct file_t {
+    char *path;
+    uint64_t size;
+    dev_t dev;
+    ino_t ino;
+    uint64_t hash;
+    bool whole;  // hash covers the whole file already
+    bool bad;    // couldn't be read
+} file_t;
+
+// four independent lanes over 32 byte stripes, so the inner loop has
+// no dependency between lanes and the compiler can vectorize it
+typedef struct hasher_t {
+    uint64_t v[4];
+    unsigned char tail[32];
+    size_t tail_sz;
+    uint64_t total, seed;
+} hasher_t;
+
+typedef struct job_t {
+    char **roots;
+    size_t nroots;
+    char *base;
+    bool hidden;
+} job_t;
+
+typedef struct pool_t {
+    file_t **work;
+    size_t count, next;
+    bool full;
+} pool_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false;
+static volatile bool cancel = false;
+static dupes_result_t *result = NULL;
+
+// progress, under lock
+static int stage = STAGE_SCAN;
+static size_t done_files = 0, total_files = 0;
+static uint64_t done_bytes = 0, total_bytes = 0;
+
+static file_t *files = NULL;
+static size_t nfiles = 0, files_alloc = 0;
+
+static uint64_t rotl(uint64_t x, int r);
+static uint64_t round64(uint64_t acc, uint64_t in);
+static uint64_t read64(const unsigned char *p);
+static void hash_init(hasher_t *h, uint64_t seed);
+static void hash_update(hasher_t *h, const void *data, size_t sz);
+static uint64_t hash_final(hasher_t *h);
+static void walk(char *path, size_t sz, bool hidden, int depth);
+static void hash_file(file_t *f, bool full, unsigned char *buf);
+static void *pool_thread(void *arg);
+static void run_pool(file_t **work, size_t count, bool full);
+static int compare_size(const void *a, const void *b);
+static int compare_hash(const void *a, const void *b);
+static size_t next_run(file_t **v, size_t i, size_t n, bool by_hash);
+static void *dupes_thread(void *arg);
+static bool same_contents(int a, int b);
+
+static uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+round64(uint64_t acc, uint64_t in)
+{
+    acc += in * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t
+read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void
+hash_init(hasher_t *h, uint64_t seed)
+{
+    h->v[0] = seed + P1 + P2;
+    h->v[1] = seed + P2;
+    h->v[2] = seed;
+    h->v[3] = seed - P1;
+    h->tail_sz = 0;
+    h->total = 0;
+    h->seed = seed;
+}
+
+static void
+hash_update(hasher_t *h, const void *data, size_t sz)
+{
+    const unsigned char *p = data;
+    h->total += sz;
+
+    if (h->tail_sz) {
+        size_t n = 32 - h->tail_sz;
+        if (n > sz) n = sz;
+        memcpy(h->tail + h->tail_sz, p, n);
+        h->tail_sz += n;
+        p += n;
+        sz -= n;
+        if (h->tail_sz < 32) return;
+        for (int i = 0; i < 4; ++i)
+            h->v[i] = round64(h->v[i], read64(h->tail + i*8));
+        h->tail_sz = 0;
+    }
+
+    uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+    for (; sz >= 32; p += 32, sz -= 32) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+    }
+    h->v[0] = v0, h->v[1] = v1, h->v[2] = v2, h->v[3] = v3;
+
+    memcpy(h->tail, p, sz);
+    h->tail_sz = sz;
+}
+
+static uint64_t
+hash_final(hasher_t *h)
+{
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            acc ^= round64(0, h->v[i]);
+            acc = acc * P1 + P4;
+        }
+    }
+    else {
+        acc = h->seed + P5;
+    }
+    acc += h->total;
+
+    const unsigned char *p = h->tail;
+    size_t sz = h->tail_sz;
+    for (; sz >= 8; p += 8, sz -= 8) {
+        acc ^= round64(0, read64(p));
+        acc = rotl(acc, 27) * P1 + P4;
+    }
+    for (; sz > 0; ++p, --sz) {
+        acc ^= *p * P5;
+        acc = rotl(acc, 11) * P1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t
+dupes_hash(const void *data, size_t sz, uint64_t seed)
+{
+    hasher_t h;
+    hash_init(&h, seed);
+    hash_update(&h, data, sz);
+    return hash_final(&h);
+}
+
+// path has room for PATH_MAX bytes, sz is its length
+static void
+walk(char *path, size_t sz, bool hidden, int depth)
+{
+    if (cancel || depth > 256) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) && !cancel) {
+        char *name = de->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (name[0] == '.' && !hidden)
+            continue;
+        if (de->d_type == DT_LNK)
+            continue;
+
+        size_t len = strlen(name);
+        if (sz + len + 2 >= PATH_MAX) continue;
+
+        struct stat st;
+        if (de->d_type != DT_DIR
+                && fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        if (de->d_type == DT_DIR || S_ISDIR(st.st_mode)) {
+            if (sz > 1) path[sz] = '/';
+            memcpy(path + sz + (sz > 1), name, len + 1);
+            walk(path, sz + (sz > 1) + len, hidden, depth + 1);
+            path[sz] = '\0';
+            continue;
+        }
+        // empty files are all the same and free anyway
+        if (!S_ISREG(st.st_mode) || st.st_size == 0)
+            continue;
+
+        if (nfiles == files_alloc) {
+            files_alloc = files_alloc? files_alloc*2 : 1024;
+            files = realloc(files, files_alloc * sizeof(file_t));
+        }
+        file_t *f = &files[nfiles++];
+        memset(f, 0, sizeof(*f));
+        f->path = malloc(sz + len + 2);
+        sprintf(f->path, "%s%s%s", path, (sz > 1)? "/" : "", name);
+        f->size = st.st_size;
+        f->dev = st.st_dev;
+        f->ino = st.st_ino;
+
+        pthread_mutex_lock(&lock);
+        total_files = nfiles;
+        wake_notify(&wake, false);
+        pthread_mutex_unlock(&lock);
+    }
+    closedir(dir);
+}
+
+// either the first and last blocks, or everything
+static void
+hash_file(file_t *f, bool full, unsigned char *buf)
+{
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        f->bad = true;
+        return;
+    }
+
+    hasher_t h;
+    hash_init(&h, f->size);
+    if (!full) {
+        f->whole = f->size <= 2 * DUPES_BLOCK_SZ;
+        size_t n = f->whole? f->size : DUPES_BLOCK_SZ;
+        ssize_t got = pread(fd, buf, n, 0);
+        if (got != (ssize_t) n) f->bad = true;
+        else hash_update(&h, buf, got);
+
+        if (!f->whole && !f->bad) {
+            got = pread(fd, buf, DUPES_BLOCK_SZ, f->size - DUPES_BLOCK_SZ);
+            if (got != DUPES_BLOCK_SZ) f->bad = true;
+            else hash_update(&h, buf, got);
+        }
+    }
+    else {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        uint64_t left = f->size;
+        while (left && !cancel) {
+            ssize_t got = read(fd, buf, DUPES_READ_SZ);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            hash_update(&h, buf, got);
+            left -= (got > left)? left : (uint64_t) got;
+
+            pthread_mutex_lock(&lock);
+            done_bytes += got;
+            wake_notify(&wake, false);
+            pthread_mutex_unlock(&lock);
+        }
+        if (left) f->bad = true;
+    }
+    close(fd);
+    f->hash = hash_final(&h);
+}
+
+static void *
+pool_thread(void *arg)
+{
+    pool_t *pool = arg;
+    unsigned char *buf = malloc(pool->full? DUPES_READ_SZ : DUPES_BLOCK_SZ * 2);
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        size_t i = pool->next++;
+        if (i < pool->count) {
+            done_files++;
+            wake_notify(&wake, false);
+        }
+        pthread_mutex_unlock(&lock);
+        if (i >= pool->count || cancel) break;
+
+        hash_file(pool->work[i], pool->full, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void
+run_pool(file_t **work, size_t count, bool full)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = (ncpu > 0)? ncpu : 1;
+    if (nthreads > DUPES_MAX_THREADS) nthreads = DUPES_MAX_THREADS;
+    if (nthreads > count) nthreads = count;
+
+    pool_t pool = { .work = work, .count = count, .full = full };
+    pthread_t threads[DUPES_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < nthreads; ++i) {
+        if (pthread_create(&threads[started], NULL, pool_thread, &pool) == 0)
+            started++;
+    }
+    // this thread works too, so there is always at least one
+    pool_thread(&pool);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+// biggest first, so the slow files start early. hardlinks end up next
+// to each other
+static int
+compare_size(const void *a, const void *b)
+{
+    const file_t *x = *(file_t**) a, *y = *(file_t**) b;
+    if (x->size != y->size) return (x->size < y->size) - (x->size > y->size);
+    if (x->dev != y->dev) return (x->dev > y->dev) - (x->dev < y->dev);
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int
+compare_hash(const void *a, const void *b)
+{
+    const file_t *x = *(file_t**) a, *y = *(file_t**) b;
+    if (x->size != y->size) return (x->size < y->size) - (x->size > y->size);
+    if (x->hash != y->hash) return (x->hash > y->hash) - (x->hash < y->hash);
+    return strcmp(x->path, y->path);
+}
+
+// end of the run of files that can't be told apart yet, starting at i
+static size_t
+next_run(file_t **v, size_t i, size_t n, bool by_hash)
+{
+    size_t j = i + 1;
+    while (j < n && v[j]->size == v[i]->size
+            && (!by_hash || v[j]->hash == v[i]->hash))
+        ++j;
+    return j;
+}
+
+static void *
+dupes_thread(void *arg)
+{
+    job_t *job = arg;
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < job->nroots && !cancel; ++i) {
+        struct stat st;
+        if (lstat(job->roots[i], &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            snprintf(path, sizeof(path), "%s", job->roots[i]);
+            walk(path, strlen(path), job->hidden, 0);
+        }
+        else if (S_ISREG(st.st_mode) && st.st_size) {
+            if (nfiles == files_alloc) {
+                files_alloc = files_alloc? files_alloc*2 : 1024;
+                files = realloc(files, files_alloc * sizeof(file_t));
+            }
+            files[nfiles++] = (file_t) { .path = strdup(job->roots[i]),
+                .size = st.st_size, .dev = st.st_dev, .ino = st.st_ino };
+        }
+    }
+
+    // 1. sizes: only files that share their size with another can match
+    file_t **v = malloc((nfiles + 1) * sizeof(file_t*));
+    for (size_t i = 0; i < nfiles; ++i)
+        v[i] = &files[i];
+    qsort(v, nfiles, sizeof(file_t*), compare_size);
+
+    size_t n = 0;
+    for (size_t i = 0; i < nfiles; ) {
+        size_t j = next_run(v, i, nfiles, false);
+        size_t start = n;
+        for (size_t k = i; k < j; ++k) {
+            // a second name for the same inode is no duplicate
+            if (n > start && v[k]->dev == v[n-1]->dev && v[k]->ino == v[n-1]->ino)
+                continue;
+            v[n++] = v[k];
+        }
+        if (n - start < 2) n = start;
+        i = j;
+    }
+
+    // 2. first and last blocks
+    pthread_mutex_lock(&lock);
+    stage = STAGE_HEADS;
+    done_files = 0;
+    total_files = n;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    if (!cancel) run_pool(v, n, false);
+
+    // 3. whole files, for what still looks the same
+    qsort(v, n, sizeof(file_t*), compare_hash);
+    file_t **full = malloc((n + 1) * sizeof(file_t*));
+    size_t nfull = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = next_run(v, i, n, true);
+        for (size_t k = i; j - i > 1 && k < j; ++k) {
+            if (v[k]->bad || v[k]->whole) continue;
+            full[nfull++] = v[k];
+            bytes += v[k]->size;
+        }
+        i = j;
+    }
+
+    pthread_mutex_lock(&lock);
+    stage = STAGE_FULL;
+    done_files = 0;
+    total_files = nfull;
+    done_bytes = 0;
+    total_bytes = bytes;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    if (!cancel) run_pool(full, nfull, true);
+    free(full);
+
+    // what still shares size and hash is a group
+    dupes_result_t *r = calloc(1, sizeof(dupes_result_t));
+    if (!cancel) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (!v[i]->bad) v[m++] = v[i];
+        }
+        n = m;
+        qsort(v, n, sizeof(file_t*), compare_hash);
+
+        size_t base_sz = strlen(job->base);
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i)
+            total += strlen(v[i]->path) + 1;
+        r->buf = malloc(total + 1);
+        r->groups = malloc((n + 1) * sizeof(uint32_t));
+
+        char *p = r->buf;
+        uint32_t group = 0;
+        for (size_t i = 0; i < n; ) {
+            size_t j = next_run(v, i, n, true);
+            if (j - i > 1) {
+                ++group;
+                r->wasted += v[i]->size * (j - i - 1);
+            }
+            for (size_t k = i; j - i > 1 && k < j; ++k) {
+                const char *rel = v[k]->path + base_sz;
+                while (*rel == '/') ++rel;
+                size_t len = strlen(rel);
+                memcpy(p, rel, len);
+                p += len;
+                *p++ = '\n';
+                r->groups[r->count++] = group;
+            }
+            i = j;
+        }
+        r->sz = p - r->buf;
+    }
+    free(v);
+
+    for (size_t i = 0; i < nfiles; ++i)
+        free(files[i].path);
+    free(files);
+    files = NULL;
+    nfiles = files_alloc = 0;
+    for (size_t i = 0; i < job->nroots; ++i)
+        free(job->roots[i]);
+    free(job->roots);
+    free(job->base);
+    free(job);
+
+    pthread_mutex_lock(&lock);
+    if (cancel) {
+        dupes_free_result(r);
+        r = NULL;
+    }
+    result = r;
+    stage = STAGE_DONE;
+    running = false;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+bool
+dupes_start(char **roots, size_t nroots, const char *base, bool hidden)
+{
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wake_open(&wake);
+    if (result) {
+        dupes_free_result(result);
+        result = NULL;
+    }
+    stage = STAGE_SCAN;
+    done_files = total_files = 0;
+    done_bytes = total_bytes = 0;
+    cancel = false;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->roots = malloc((nroots + 1) * sizeof(char*));
+    for (size_t i = 0; i < nroots; ++i)
+        job->roots[i] = strdup(roots[i]);
+    job->nroots = nroots;
+    job->base = strdup(base);
+    job->hidden = hidden;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, dupes_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) {
+        for (size_t i = 0; i < nroots; ++i)
+            free(job->roots[i]);
+        free(job->roots);
+        free(job->base);
+        free(job);
+    }
+    pthread_mutex_unlock(&lock);
+    return running;
+}
+
+void
+dupes_cancel(void)
+{
+    cancel = true;
+}
+
+bool
+dupes_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+dupes_fd(void)
+{
+    return wake.fd[0];
+}
+
+void
+dupes_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    switch (stage) {
+    case STAGE_SCAN:
+        snprintf(buf, sz, "dupes: scanning, %zu files", total_files);
+        break;
+    case STAGE_HEADS:
+        snprintf(buf, sz, "dupes: comparing blocks %zu/%zu", done_files, total_files);
+        break;
+    case STAGE_FULL:
+        snprintf(buf, sz, "dupes: hashing %zu/%zu files, %llu/%llu MiB",
+            done_files, total_files,
+            (unsigned long long) (done_bytes >> 20),
+            (unsigned long long) (total_bytes >> 20));
+        break;
+    default:
+        buf[0] = '\0';
+        break;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+dupes_result_t *
+dupes_take(void)
+{
+    pthread_mutex_lock(&lock);
+    dupes_result_t *r = running? NULL : result;
+    if (r) result = NULL;
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+void
+dupes_free_result(dupes_result_t *r)
+{
+    if (!r) return;
+    free(r->buf);
+    free(r->groups);
+    free(r);
+}
+
+static bool
+same_contents(int a, int b)
+{
+    static char x[65536], y[65536];
+    for (;;) {
+        ssize_t n = read(a, x, sizeof(x));
+        ssize_t m = read(b, y, sizeof(y));
+        if (n < 0 || n != m) return false;
+        if (n == 0) return true;
+        if (memcmp(x, y, n) != 0) return false;
+    }
+}
+
+// the hashes are only a hint, the bytes get compared before anything is
+// replaced. the new link is made next to target and renamed over it
+int
+dupes_link(const char *keep, const char *target, bool reflink)
+{
+    struct stat ks, ts;
+    if (lstat(keep, &ks) < 0 || lstat(target, &ts) < 0)
+        return errno;
+    if (!S_ISREG(ks.st_mode) || !S_ISREG(ts.st_mode))
+        return EINVAL;
+    if (ks.st_dev == ts.st_dev && ks.st_ino == ts.st_ino)
+        return 0;
+    if (ks.st_size != ts.st_size)
+        return EINVAL;
+    if (!reflink && ks.st_dev != ts.st_dev)
+        return EXDEV;
+
+    int a = open(keep, O_RDONLY | O_CLOEXEC);
+    int b = open(target, O_RDONLY | O_CLOEXEC);
+    bool same = a >= 0 && b >= 0 && same_contents(a, b);
+    if (b >= 0) close(b);
+    if (!same) {
+        if (a >= 0) close(a);
+        return EINVAL;
+    }
+
+    char tmp[PATH_MAX];
+    const char *slash = strrchr(target, '/');
+    int dir_sz = slash? (int) (slash - target) : 0;
+    snprintf(tmp, sizeof(tmp), "%.*s%s.mfm-link-%d", dir_sz, target,
+        slash? "/" : "", (int) getpid());
+
+    int err = 0;
+    if (!reflink) {
+        if (link(keep, tmp) < 0) err = errno;
+    }
+    else {
+#ifdef FICLONE
+        int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, ts.st_mode & 07777);
+        if (out < 0) {
+            err = errno;
+        }
+        else {
+            if (ioctl(out, FICLONE, a) < 0) err = errno;
+            else if (fchown(out, ts.st_uid, ts.st_gid) < 0) {
+                // keeping our own ownership is fine
+            }
+            close(out);
+            if (err) unlink(tmp);
+        }
+#else
+        err = EOPNOTSUPP;
+#endif
+    }
+    close(a);
+
+    if (!err && rename(tmp, target) < 0) {
+        err = errno;
+        unlink(tmp);
+    }
+    return err;
+}
@@ -0,0 +1,43 @@
+#ifndef DUPES_H
+#define DUPES_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// duplicate finder. runs on its own threads, the ui only picks up
+// progress and the final result
+
+#define DUPES_BLOCK_SZ 4096        // head and tail hashed in the second pass
+#define DUPES_READ_SZ (1024*1024)  // read size for full hashes
+#define DUPES_MAX_THREADS 8
+
+typedef struct dupes_result_t {
+    char *buf;         // paths relative to base, '\n' terminated
+    size_t sz;
+    uint32_t *groups;  // one per path, identical files share a group
+    size_t count;
+    uint64_t wasted;   // bytes that would be freed keeping one of each
+} dupes_result_t;
+
+// look for duplicates among the regular files under roots. paths in
+// the result are relative to base, which all roots must be under.
+// false if a search is already running
+bool dupes_start(char **roots, size_t nroots, const char *base, bool hidden);
+void dupes_cancel(void);
+bool dupes_running(void);
+// fd that becomes readable on progress and when the result is in
+int dupes_fd(void);
+// one line describing where the search is at
+void dupes_progress(char *buf, size_t sz);
+// the finished result, NULL while running
+dupes_result_t *dupes_take(void);
+void dupes_free_result(dupes_result_t *r);
+
+uint64_t dupes_hash(const void *data, size_t sz, uint64_t seed);
+
+// replace target with a hardlink (or a reflink) to keep, if both still
+// have the same contents. returns 0 or an errno
+int dupes_link(const char *keep, const char *target, bool reflink);
+
+#endif
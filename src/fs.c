@@ -0,0 +1,677 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "fs.h"
+#include "git.h"
+#include "archive.h"
+#include "bigdir.h"
+#include "vfs.h"
+#include "wake.h"
+
+typedef struct mount_t {
+    char *dir;
+    size_t len;
+    bool net;
+    dev_t dev;     // st_dev of what's on it
+    dev_t source;  // the block device it was mounted from, 0 if none
+    int stuck;  // requests past their timeout that haven't come back yet
+} mount_t;
+
+typedef struct request_t {
+    struct request_t *next;
+    unsigned gen;
+    char *path;
+    int flags;
+    int mount;
+    int64_t start;
+    bool expired;
+} request_t;
+
+// a batch of stats. once the ui gave up on it, the thread frees it
+typedef struct stat_job_t {
+    char **paths;
+    size_t n;
+    bool follow;
+    struct stat *st;
+    int *errs;
+    bool *links;
+    int mount;
+    bool done, abandoned;
+} stat_job_t;
+
+typedef struct name_t {
+    char *name;
+    size_t sz;
+    bool is_dir;
+    bool is_link;
+} name_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static fs_result_t *results = NULL, *results_tail = NULL;
+static request_t *requests = NULL;
+static unsigned last_gen = 0;
+static wake_t wake = WAKE_INIT;
+static mount_t *mounts = NULL;
+static int nmounts = 0;
+static int stuck_threads = 0;
+static int net_timeout = FS_NET_TIMEOUT_MS;
+static int local_timeout = FS_LOCAL_TIMEOUT_MS;
+
+static const char *net_types[] = {
+    "nfs", "nfs4", "cifs", "smb3", "smbfs", "9p", "ceph", "glusterfs",
+    "fuse.sshfs", "fuse.rclone", "fuse.s3fs", "afs", "davfs", "fuse.davfs2",
+};
+
+static void load_mounts(void);
+static void unescape(char *s);
+static int find_mount(const char *path);
+static void push_result(fs_result_t *r);
+static fs_result_t *take_result(unsigned gen);
+static bool cancelled(unsigned gen);
+static void finish_request(request_t *req);
+static int compare_names(const void *a, const void *b);
+static bool list_archive(request_t *req, fs_result_t *r);
+static void *list_thread(void *arg);
+static void free_stat_job(stat_job_t *job);
+static void *stat_thread(void *arg);
+
+// mount points in mountinfo have spaces and such as \ooo
+static void
+unescape(char *s)
+{
+    char *d = s;
+    while (*s) {
+        if (s[0] == '\\' && s[1] && s[2] && s[3]) {
+            *d++ = (char) ((s[1]-'0')*64 + (s[2]-'0')*8 + (s[3]-'0'));
+            s += 4;
+        }
+        else {
+            *d++ = *s++;
+        }
+    }
+    *d = '\0';
+}
+
+// /proc never blocks, unlike a statfs() on the mount itself
+static void
+load_mounts(void)
+{
+    // anything else is one mount, as slow as it was told to be
+    if (!vfs->native) {
+        mounts = malloc(sizeof(mount_t));
+        mounts[nmounts++] = (mount_t) { .dir = strdup("/"), .len = 1, .net = vfs->remote };
+        return;
+    }
+
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) return;
+
+    char line[8192];
+    while (fgets(line, sizeof(line), fp)) {
+        char dir[4096], type[256], source[4096] = "";
+        unsigned maj, min;
+        char *sep = strstr(line, " - ");
+        if (!sep || sscanf(line, "%*s %*s %u:%u %*s %4095s", &maj, &min, dir) != 3)
+            continue;
+        if (sscanf(sep + 3, "%255s %4095s", type, source) < 1)
+            continue;
+        unescape(dir);
+        unescape(source);
+
+        mount_t m = { .dir = strdup(dir), .len = strlen(dir), .dev = makedev(maj, min) };
+        for (size_t i = 0; i < sizeof(net_types) / sizeof(*net_types); ++i) {
+            if (strcmp(type, net_types[i]) == 0)
+                m.net = true;
+        }
+        // fuseblk and friends sit on a disk of their own
+        struct stat sb;
+        if (strncmp(source, "/dev/", 5) == 0 && stat(source, &sb) == 0
+                && S_ISBLK(sb.st_mode))
+            m.source = sb.st_rdev;
+        mounts = realloc(mounts, (nmounts+1) * sizeof(mount_t));
+        mounts[nmounts++] = m;
+    }
+    fclose(fp);
+}
+
+static int
+find_mount(const char *path)
+{
+    int best = -1;
+    for (int i = 0; i < nmounts; ++i) {
+        mount_t *m = &mounts[i];
+        bool prefix = strncmp(path, m->dir, m->len) == 0
+            && (m->len == 1 || path[m->len] == '/' || path[m->len] == '\0');
+        if (prefix && (best < 0 || m->len >= mounts[best].len))
+            best = i;
+    }
+    return best;
+}
+
+void
+fs_init(void)
+{
+    wake_open(&wake);
+    char *env;
+    if ((env = getenv("MFM_NET_TIMEOUT")) && atoi(env) > 0)
+        net_timeout = atoi(env);
+    if ((env = getenv("MFM_LOCAL_TIMEOUT")) && atoi(env) > 0)
+        local_timeout = atoi(env);
+    load_mounts();
+}
+
+int
+fs_fd(void)
+{
+    return wake.fd[0];
+}
+
+int
+fs_wait_ms(const char *path)
+{
+    int m = find_mount(path);
+    return (m >= 0 && mounts[m].net)? FS_NET_WAIT_MS : FS_LOCAL_WAIT_MS;
+}
+
+static void
+push_result(fs_result_t *r)
+{
+    pthread_mutex_lock(&lock);
+    r->next = NULL;
+    if (results_tail) results_tail->next = r;
+    else results = r;
+    results_tail = r;
+    pthread_cond_broadcast(&cond);
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+}
+
+// called with the lock held
+static fs_result_t *
+take_result(unsigned gen)
+{
+    while (results) {
+        fs_result_t *r = results;
+        results = r->next;
+        if (!results) results_tail = NULL;
+        if (r->gen == gen) return r;
+        fs_free_result(r);
+    }
+
+    wake_drain(&wake);
+    return NULL;
+}
+
+fs_result_t *
+fs_wait(unsigned gen, int ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&lock);
+    fs_result_t *r;
+    while (!(r = take_result(gen))) {
+        if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT) {
+            r = take_result(gen);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+fs_result_t *
+fs_poll(unsigned gen)
+{
+    pthread_mutex_lock(&lock);
+    fs_result_t *r = take_result(gen);
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+void
+fs_free_result(fs_result_t *r)
+{
+    free(r->buf);
+    free(r->modes);
+    free(r->links);
+    free(r->meta);
+    free(r->git);
+    free(r);
+}
+
+bool
+fs_expired(unsigned gen)
+{
+    bool expired = false;
+    int64_t now = now_ms();
+
+    pthread_mutex_lock(&lock);
+    for (request_t *req = requests; req; req = req->next) {
+        if (req->gen != gen) continue;
+        int timeout = (req->mount >= 0 && mounts[req->mount].net)?
+            net_timeout : local_timeout;
+        if (!req->expired && now - req->start > timeout) {
+            // from now on the mount is skipped until this one returns
+            req->expired = true;
+            stuck_threads++;
+            if (req->mount >= 0) mounts[req->mount].stuck++;
+        }
+        expired = req->expired;
+        break;
+    }
+    pthread_mutex_unlock(&lock);
+    return expired;
+}
+
+// a request is only worth finishing while nothing newer was asked for
+static bool
+cancelled(unsigned gen)
+{
+    pthread_mutex_lock(&lock);
+    bool res = (gen != last_gen);
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+static void
+finish_request(request_t *req)
+{
+    pthread_mutex_lock(&lock);
+    for (request_t **p = &requests; *p; p = &(*p)->next) {
+        if (*p == req) {
+            *p = req->next;
+            break;
+        }
+    }
+    if (req->expired) {
+        stuck_threads--;
+        if (req->mount >= 0) mounts[req->mount].stuck--;
+    }
+    pthread_mutex_unlock(&lock);
+    free(req->path);
+    free(req);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    const name_t *x = a, *y = b;
+    if (x->is_dir != y->is_dir)
+        return y->is_dir - x->is_dir;
+
+    int res = memcmp(x->name, y->name, (x->sz < y->sz)? x->sz : y->sz);
+    if (res) return res;
+    return (x->sz > y->sz) - (x->sz < y->sz);
+}
+
+// path is in (or is) an archive. the listing comes from its index,
+// and so do the modes
+static bool
+list_archive(request_t *req, fs_result_t *r)
+{
+    mode_t *modes;
+    size_t count;
+    int err = archive_list(req->path, req->flags & FS_LIST_HIDDEN,
+        &r->buf, &r->sz, &modes, &count, &r->mtime);
+    if (err) {
+        // not being a directory says more than not being an archive
+        if (err != EINVAL) r->err = err;
+        return false;
+    }
+    r->err = 0;
+    r->archive = true;
+    push_result(r);
+
+    fs_result_t *s = calloc(1, sizeof(fs_result_t));
+    s->gen = req->gen;
+    s->kind = FS_STATED;
+    s->modes = modes;
+    s->count = count;
+    push_result(s);
+    return true;
+}
+
+static void *
+list_thread(void *arg)
+{
+    request_t *req = arg;
+    fs_result_t *r = calloc(1, sizeof(fs_result_t));
+    r->gen = req->gen;
+    r->kind = FS_LISTED;
+
+    void *dir = vfs->opendir(req->path);
+    if (!dir) {
+        r->err = errno;
+        bool archive = vfs->native && (r->err == ENOTDIR || r->err == ENOENT);
+        if (archive && list_archive(req, r)) {
+            finish_request(req);
+            return NULL;
+        }
+        push_result(r);
+        finish_request(req);
+        return NULL;
+    }
+
+    // stat before reading so a change that races with us makes it stale
+    struct stat sb;
+    if (vfs->statat(dir, ".", &sb, true) == 0)
+        r->mtime = fs_mtime(&sb);
+
+    name_t *names = NULL;
+    size_t count = 0, alloc = 0, total = 0;
+    size_t big = vfs->native? bigdir_threshold() : 0;
+    const char *name;
+    int type;
+    while ((name = vfs->readdir(dir, &type))) {
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (name[0] == '.' && !(req->flags & FS_LIST_HIDDEN))
+            continue;
+        if (strchr(name, '\n'))
+            continue;
+        if ((count & 1023) == 0 && cancelled(req->gen))
+            break;
+        if (big && count >= big)
+            break;
+
+        bool is_dir = (type == VFS_DIR);
+        bool is_link = (type == VFS_LINK);
+        if (type == VFS_UNKNOWN) {
+            struct stat st;
+            bool ok = vfs->statat(dir, name, &st, false) == 0;
+            is_dir = ok && S_ISDIR(st.st_mode);
+            is_link = ok && S_ISLNK(st.st_mode);
+        }
+
+        if (count == alloc) {
+            alloc = alloc? alloc*2 : 256;
+            names = realloc(names, alloc * sizeof(name_t));
+        }
+        size_t sz = strlen(name);
+        names[count++] = (name_t) { strdup(name), sz, is_dir, is_link };
+        total += sz + is_dir + 1;
+    }
+
+    // too many to hold, the ui goes over it a window at a time
+    if (big && count >= big) {
+        for (size_t i = 0; i < count; ++i)
+            free(names[i].name);
+        free(names);
+        vfs->closedir(dir);
+        r->err = EFBIG;
+        push_result(r);
+        finish_request(req);
+        return NULL;
+    }
+
+    qsort(names, count, sizeof(name_t), compare_names);
+
+    r->buf = malloc(total + 1);
+    char *p = r->buf;
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(p, names[i].name, names[i].sz);
+        p += names[i].sz;
+        if (names[i].is_dir) *p++ = '/';
+        *p++ = '\n';
+    }
+    r->sz = p - r->buf;
+    push_result(r);
+
+    // names are on screen, now fill in the metadata
+    fs_result_t *s = calloc(1, sizeof(fs_result_t));
+    s->gen = req->gen;
+    s->kind = FS_STATED;
+    s->count = count;
+    s->modes = calloc(count + 1, sizeof(mode_t));
+    s->meta = calloc(count + 1, sizeof(fs_meta_t));
+    struct stat *st = calloc(count + 1, sizeof(struct stat));
+    for (size_t i = 0; i < count; ++i) {
+        if ((i & 255) == 0 && cancelled(req->gen)) {
+            free(s->modes);
+            s->modes = NULL;
+            break;
+        }
+        if (vfs->statat(dir, names[i].name, &st[i], true) == 0) {
+            s->modes[i] = st[i].st_mode;
+            s->meta[i] = (fs_meta_t) {
+                st[i].st_uid, st[i].st_gid, st[i].st_nlink,
+                st[i].st_size, st[i].st_mtim.tv_sec,
+            };
+        }
+        else {
+            st[i].st_mode = 0;
+        }
+        if (names[i].is_link && !s->links)
+            s->links = calloc(count + 1, sizeof(bool));
+        if (names[i].is_link)
+            s->links[i] = true;
+    }
+    vfs->closedir(dir);
+
+    bool stated = s->modes != NULL;
+    if (stated) push_result(s);
+    else fs_free_result(s);
+
+    // git markers last, they may have to look at whole subtrees
+    if (stated && (req->flags & FS_LIST_GIT) && vfs->native) {
+        char **list = malloc((count + 1) * sizeof(char*));
+        bool *is_dir = malloc(count + 1);
+        for (size_t i = 0; i < count; ++i) {
+            list[i] = names[i].name;
+            is_dir[i] = names[i].is_dir;
+        }
+        fs_result_t *g = calloc(1, sizeof(fs_result_t));
+        g->gen = req->gen;
+        g->kind = FS_GIT;
+        g->count = count;
+        g->git = malloc(count + 1);
+        if (git_status(req->path, list, is_dir, st, count, g->git, cancelled, req->gen))
+            push_result(g);
+        else
+            fs_free_result(g);
+        free(list);
+        free(is_dir);
+    }
+    free(st);
+
+    for (size_t i = 0; i < count; ++i)
+        free(names[i].name);
+    free(names);
+    finish_request(req);
+    return NULL;
+}
+
+unsigned
+fs_list(const char *path, int flags)
+{
+    request_t *req = calloc(1, sizeof(request_t));
+    req->path = strdup(path);
+    req->flags = flags;
+    req->mount = find_mount(path);
+    req->start = now_ms();
+
+    pthread_mutex_lock(&lock);
+    req->gen = ++last_gen;
+    bool stuck = stuck_threads >= FS_MAX_STUCK
+        || (req->mount >= 0 && mounts[req->mount].stuck);
+    if (!stuck) {
+        req->next = requests;
+        requests = req;
+    }
+    pthread_mutex_unlock(&lock);
+
+    unsigned gen = req->gen;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (stuck || pthread_create(&thread, &attr, list_thread, req) != 0) {
+        if (!stuck) finish_request(req);
+        else {
+            free(req->path);
+            free(req);
+        }
+        fs_result_t *r = calloc(1, sizeof(fs_result_t));
+        r->gen = gen;
+        r->kind = FS_LISTED;
+        r->err = stuck? ETIMEDOUT : EAGAIN;
+        push_result(r);
+    }
+    pthread_attr_destroy(&attr);
+    return gen;
+}
+
+static void
+free_stat_job(stat_job_t *job)
+{
+    for (size_t i = 0; i < job->n; ++i)
+        free(job->paths[i]);
+    free(job->paths);
+    free(job->st);
+    free(job->errs);
+    free(job->links);
+    free(job);
+}
+
+static void *
+stat_thread(void *arg)
+{
+    stat_job_t *job = arg;
+    for (size_t i = 0; i < job->n; ++i) {
+        struct stat *st = &job->st[i];
+        if (job->links && job->follow) {
+            job->links[i] = vfs->stat(job->paths[i], st, false) == 0
+                && S_ISLNK(st->st_mode);
+        }
+        job->errs[i] = (vfs->stat(job->paths[i], st, job->follow) < 0)? errno : 0;
+        if (job->links && !job->follow)
+            job->links[i] = !job->errs[i] && S_ISLNK(st->st_mode);
+    }
+
+    pthread_mutex_lock(&lock);
+    bool abandoned = job->abandoned;
+    job->done = true;
+    if (abandoned) {
+        stuck_threads--;
+        if (job->mount >= 0) mounts[job->mount].stuck--;
+    }
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    if (abandoned) free_stat_job(job);
+    return NULL;
+}
+
+bool
+fs_stat(char **paths, size_t n, bool follow, struct stat *st, int *errs, bool *links)
+{
+    for (size_t i = 0; i < n; ++i)
+        errs[i] = ETIMEDOUT;
+    if (!n) return true;
+
+    stat_job_t *job = calloc(1, sizeof(stat_job_t));
+    job->paths = malloc(n * sizeof(char*));
+    for (size_t i = 0; i < n; ++i)
+        job->paths[i] = strdup(paths[i]);
+    job->n = n;
+    job->follow = follow;
+    job->st = calloc(n, sizeof(struct stat));
+    job->errs = calloc(n, sizeof(int));
+    job->links = links? calloc(n, sizeof(bool)) : NULL;
+    job->mount = find_mount(paths[0]);
+    int timeout = (job->mount >= 0 && mounts[job->mount].net)?
+        net_timeout : local_timeout;
+
+    // a mount that already has a thread stuck on it gets no more
+    pthread_mutex_lock(&lock);
+    bool stuck = stuck_threads >= FS_MAX_STUCK
+        || (job->mount >= 0 && mounts[job->mount].stuck);
+    pthread_mutex_unlock(&lock);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    bool started = !stuck && pthread_create(&thread, &attr, stat_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        free_stat_job(job);
+        return false;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (!job->done) {
+        if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (!job->done) {
+        // from now on the mount is skipped until this one returns
+        job->abandoned = true;
+        stuck_threads++;
+        if (job->mount >= 0) mounts[job->mount].stuck++;
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    pthread_mutex_unlock(&lock);
+
+    memcpy(st, job->st, n * sizeof(struct stat));
+    memcpy(errs, job->errs, n * sizeof(int));
+    if (links) memcpy(links, job->links, n * sizeof(bool));
+    free_stat_job(job);
+    return true;
+}
+
+int
+fs_stat_path(const char *path, struct stat *st, bool follow)
+{
+    char *paths[] = { (char*) path };
+    int err;
+    fs_stat(paths, 1, follow, st, &err, NULL);
+    if (!err) return 0;
+    errno = err;
+    return -1;
+}
+
+bool
+fs_mount_info(dev_t dev, bool *net, dev_t *source)
+{
+    for (int i = 0; i < nmounts; ++i) {
+        if (mounts[i].dev != dev) continue;
+        *net = mounts[i].net;
+        *source = mounts[i].source;
+        return true;
+    }
+    return false;
+}
+
+int64_t
+fs_mtime(const struct stat *st)
+{
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
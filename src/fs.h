@@ -0,0 +1,86 @@
+#ifndef FS_H
+#define FS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// every directory read happens on a worker thread so a dead mount can
+// only ever hang that thread, never the ui
+
+#define FS_MAX_STUCK 16
+#define FS_LOCAL_WAIT_MS 250     // how long the ui blocks on local dirs
+#define FS_NET_WAIT_MS 30        // ... and on network filesystems
+#define FS_LOCAL_TIMEOUT_MS 10000
+#define FS_NET_TIMEOUT_MS 3000   // after this a mount counts as unreachable
+
+enum {
+    FS_LISTED,   // names are in
+    FS_STATED,   // metadata for the names of an earlier FS_LISTED
+    FS_GIT,      // git markers for the names of an earlier FS_LISTED
+};
+
+// fs_list flags
+enum {
+    FS_LIST_HIDDEN = 1 << 0,
+    FS_LIST_GIT    = 1 << 1,
+};
+
+// what the long listing shows besides the mode
+typedef struct fs_meta_t {
+    uint32_t uid, gid;
+    uint32_t nlink;
+    int64_t size;
+    int64_t mtime;  // seconds
+} fs_meta_t;
+
+typedef struct fs_result_t {
+    struct fs_result_t *next;
+    unsigned gen;
+    int kind;
+    int err;        // errno, 0 on success
+    int64_t mtime;  // FS_LISTED: dir mtime taken before reading it
+    char *buf;      // FS_LISTED: sorted names, '\n' terminated, dirs end in '/'
+    size_t sz;
+    bool archive;   // FS_LISTED: names come from inside an archive
+    mode_t *modes;  // FS_STATED: one per name, 0 if stat failed
+    bool *links;    // FS_STATED: which names are symlinks, NULL if none are
+    fs_meta_t *meta;  // FS_STATED: one per name, zeroed if stat failed
+    uint8_t *git;   // FS_GIT: GIT_* flags, one per name
+    size_t count;
+} fs_result_t;
+
+void fs_init(void);
+// fd that becomes readable whenever results are waiting
+int fs_fd(void);
+
+// start reading path, returns the generation the results are tagged with
+unsigned fs_list(const char *path, int flags);
+// wait up to ms for a result of gen. results for other generations are
+// dropped. NULL on timeout
+fs_result_t *fs_wait(unsigned gen, int ms);
+// next result of gen without waiting, NULL if there is none
+fs_result_t *fs_poll(unsigned gen);
+void fs_free_result(fs_result_t *r);
+
+// whether the request for gen has outlived its mount's timeout
+bool fs_expired(unsigned gen);
+// how long the ui should block on a listing of path
+int fs_wait_ms(const char *path);
+// stat n paths on a worker, waiting at most the timeout of the mount
+// of the first one. errs[i] is the errno for paths[i], 0 if st[i] is
+// good. with links, which paths are symlinks goes there too. false if
+// the worker didn't come back in time, every errs[i] is ETIMEDOUT then
+bool fs_stat(char **paths, size_t n, bool follow, struct stat *st, int *errs, bool *links);
+// the same for one path, like vfs->stat: -1 with errno set if it failed
+int fs_stat_path(const char *path, struct stat *st, bool follow);
+// what mountinfo says of the mount whose files have st_dev dev: if it's
+// a network filesystem, fuse ones going by their subtype, and the block
+// device it was mounted from (0 if none). false if it isn't known
+bool fs_mount_info(dev_t dev, bool *net, dev_t *source);
+// st_mtim in ns, what listings and snapshots are compared by
+int64_t fs_mtime(const struct stat *st);
+
+#endif
@@ -0,0 +1,1016 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "git.h"
+
+// everything here reads git's own files, there's never a git process
+
+#define SHA_SZ 20
+
+enum {
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7,
+};
+
+typedef struct index_entry_t {
+    const char *path;
+    uint32_t path_sz;
+    uint32_t mtime, mtime_ns, ino, size, mode;
+    uint16_t stage;
+    unsigned char sha[SHA_SZ];
+} index_entry_t;
+
+// a blob of HEAD, with its full path
+typedef struct tree_entry_t {
+    const char *path;
+    uint32_t path_sz;
+    unsigned char sha[SHA_SZ];
+} tree_entry_t;
+
+typedef struct pack_t {
+    unsigned char *idx, *pack;
+    size_t idx_sz, pack_sz;
+    uint32_t count;
+} pack_t;
+
+typedef struct ignore_t {
+    char *pat;
+    char *base;       // dir of the .gitignore, relative to the root
+    size_t base_sz;
+    bool negate, dir_only, anchored, deep;
+} ignore_t;
+
+typedef struct buf_t {
+    char *data;
+    size_t size, alloc;
+} buf_t;
+
+typedef struct repo_t {
+    char *root, *gitdir, *common;
+    size_t root_sz;
+    uint64_t used;
+
+    index_entry_t *index;
+    size_t nindex;
+    char *index_paths;
+    struct stat index_st;
+
+    unsigned char head[SHA_SZ];
+    bool has_head;
+    tree_entry_t *tree;
+    size_t ntree, tree_alloc;
+    buf_t tree_paths;
+
+    pack_t *packs;
+    int npacks;
+    bool packs_loaded;
+} repo_t;
+
+static pthread_mutex_t git_lock = PTHREAD_MUTEX_INITIALIZER;
+static repo_t repos[GIT_MAX_REPOS];
+static uint64_t use_count = 0;
+
+static uint32_t be32(const unsigned char *p);
+static void buf_add(buf_t *b, const void *data, size_t sz);
+static char *read_all(const char *path, size_t *sz);
+static bool find_root(const char *dir, char **root, char **gitdir);
+static repo_t *get_repo(const char *root, const char *gitdir);
+static void free_repo(repo_t *r);
+static bool load_index(repo_t *r);
+static bool parse_index(repo_t *r, unsigned char *buf, size_t sz);
+static bool hex_to_sha(const char *hex, unsigned char *sha);
+static bool resolve_ref(repo_t *r, const char *ref, unsigned char *sha, int depth);
+static void load_packs(repo_t *r);
+static unsigned char *inflate_all(const unsigned char *in, size_t in_sz, size_t out_sz, size_t *res_sz);
+static unsigned char *apply_delta(const unsigned char *base, size_t base_sz,
+        const unsigned char *delta, size_t delta_sz, size_t *res_sz);
+static unsigned char *pack_object(repo_t *r, pack_t *p, size_t off, int *type, size_t *sz, int depth);
+static unsigned char *read_object(repo_t *r, const unsigned char *sha, int *type, size_t *sz, int depth);
+static bool walk_tree(repo_t *r, const unsigned char *sha, buf_t *prefix, int depth);
+static void load_head(repo_t *r);
+static const tree_entry_t *head_lower_bound(repo_t *r, const char *path, size_t sz);
+static void load_ignores(repo_t *r, const char *rel, size_t rel_sz, ignore_t **ign, size_t *n);
+static void add_ignores(const char *file, const char *base, size_t base_sz, ignore_t **ign, size_t *n);
+static void free_ignores(ignore_t *ign, size_t n);
+static int ignored(ignore_t *ign, size_t n, const char *path, bool is_dir);
+static int find_name(char **names, const int *table, size_t hsz, const char *name, size_t sz);
+
+static uint32_t
+be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void
+buf_add(buf_t *b, const void *data, size_t sz)
+{
+    if (b->size + sz > b->alloc) {
+        b->alloc = (b->size + sz) * 2;
+        b->data = realloc(b->data, b->alloc);
+    }
+    memcpy(b->data + b->size, data, sz);
+    b->size += sz;
+}
+
+static char *
+read_all(const char *path, size_t *sz)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return NULL;
+    }
+    char *buf = malloc(sb.st_size + 1);
+    size_t got = 0;
+    while (got < sb.st_size) {
+        ssize_t n = read(fd, buf + got, sb.st_size - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    buf[got] = '\0';
+    if (sz) *sz = got;
+    return buf;
+}
+
+static bool
+find_root(const char *dir, char **root, char **gitdir)
+{
+    char path[4096];
+    size_t sz = strlen(dir);
+    if (sz >= sizeof(path) - 8) return false;
+    memcpy(path, dir, sz + 1);
+
+    for (;;) {
+        strcpy(path + sz, "/.git");
+        struct stat sb;
+        if (stat(path, &sb) == 0) {
+            path[sz] = '\0';
+            *root = strdup(sz? path : "/");
+            if (S_ISDIR(sb.st_mode)) {
+                path[sz] = '/';
+                *gitdir = strdup(path);
+                return true;
+            }
+            // worktrees and submodules point somewhere else
+            path[sz] = '/';
+            char *s = read_all(path, NULL);
+            if (s && strncmp(s, "gitdir: ", 8) == 0) {
+                char *end = s + strcspn(s, "\r\n");
+                *end = '\0';
+                if (s[8] == '/') {
+                    *gitdir = strdup(s + 8);
+                }
+                else {
+                    path[sz] = '\0';
+                    *gitdir = malloc(sz + strlen(s + 8) + 2);
+                    sprintf(*gitdir, "%s/%s", path, s + 8);
+                }
+                free(s);
+                return true;
+            }
+            free(s);
+            free(*root);
+            return false;
+        }
+        while (sz > 0 && path[sz-1] != '/') --sz;
+        if (sz == 0) return false;
+        --sz;
+    }
+}
+
+static void
+free_repo(repo_t *r)
+{
+    free(r->root);
+    free(r->gitdir);
+    free(r->common);
+    free(r->index);
+    free(r->index_paths);
+    free(r->tree);
+    free(r->tree_paths.data);
+    for (int i = 0; i < r->npacks; ++i) {
+        munmap(r->packs[i].idx, r->packs[i].idx_sz);
+        munmap(r->packs[i].pack, r->packs[i].pack_sz);
+    }
+    free(r->packs);
+    memset(r, 0, sizeof(*r));
+}
+
+static repo_t *
+get_repo(const char *root, const char *gitdir)
+{
+    repo_t *lru = &repos[0];
+    for (int i = 0; i < GIT_MAX_REPOS; ++i) {
+        if (repos[i].root && strcmp(repos[i].root, root) == 0) {
+            repos[i].used = ++use_count;
+            return &repos[i];
+        }
+        if (repos[i].used < lru->used)
+            lru = &repos[i];
+    }
+
+    free_repo(lru);
+    lru->root = strdup(root);
+    lru->root_sz = strlen(root);
+    lru->gitdir = strdup(gitdir);
+    lru->used = ++use_count;
+
+    // linked worktrees keep objects and refs in the main repository
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/commondir", gitdir);
+    char *common = read_all(path, NULL);
+    if (common) {
+        common[strcspn(common, "\r\n")] = '\0';
+        if (common[0] == '/') {
+            lru->common = strdup(common);
+        }
+        else {
+            lru->common = malloc(strlen(gitdir) + strlen(common) + 2);
+            sprintf(lru->common, "%s/%s", gitdir, common);
+        }
+        free(common);
+    }
+    else {
+        lru->common = strdup(gitdir);
+    }
+    return lru;
+}
+
+static bool
+parse_index(repo_t *r, unsigned char *buf, size_t sz)
+{
+    if (sz < 12 || memcmp(buf, "DIRC", 4) != 0) return false;
+    uint32_t version = be32(buf + 4), count = be32(buf + 8);
+    if (version < 2 || version > 4) return false;
+
+    index_entry_t *ents = calloc(count + 1, sizeof(index_entry_t));
+    size_t *offs = calloc(count + 1, sizeof(size_t));
+    buf_t paths = {0};
+    size_t pos = 12, prev = 0, prev_sz = 0;
+    uint32_t n = 0;
+
+    for (; n < count; ++n) {
+        if (pos + 62 > sz) break;
+        unsigned char *e = buf + pos;
+        index_entry_t *ie = &ents[n];
+        ie->mtime = be32(e + 8);
+        ie->mtime_ns = be32(e + 12);
+        ie->ino = be32(e + 20);
+        ie->mode = be32(e + 24);
+        ie->size = be32(e + 36);
+        memcpy(ie->sha, e + 40, SHA_SZ);
+        uint16_t flags = e[60] << 8 | e[61];
+        ie->stage = (flags >> 12) & 3;
+
+        size_t p = pos + 62;
+        if (version >= 3 && (flags & 0x4000)) p += 2;
+        if (p >= sz) break;
+
+        size_t start = paths.size;
+        if (version == 4) {
+            // prefix compressed: drop n bytes of the previous path
+            uint64_t strip = buf[p] & 127;
+            while (buf[p++] & 128 && p < sz)
+                strip = ((strip + 1) << 7) | (buf[p] & 127);
+            if (strip > prev_sz) break;
+            size_t keep = prev_sz - strip;
+            buf_add(&paths, NULL, 0);
+            if (keep) {
+                char *tmp = malloc(keep);
+                memcpy(tmp, paths.data + prev, keep);
+                buf_add(&paths, tmp, keep);
+                free(tmp);
+            }
+            size_t len = strnlen((char*) buf + p, sz - p);
+            buf_add(&paths, buf + p, len);
+            pos = p + len + 1;
+        }
+        else {
+            size_t len = strnlen((char*) buf + p, sz - p);
+            buf_add(&paths, buf + p, len);
+            pos += ((p - pos) + len + 8) & ~(size_t) 7;
+        }
+        buf_add(&paths, "", 1);
+        offs[n] = start;
+        prev = start;
+        prev_sz = paths.size - start - 1;
+        ie->path_sz = prev_sz;
+    }
+
+    for (uint32_t i = 0; i < n; ++i)
+        ents[i].path = paths.data + offs[i];
+    free(offs);
+
+    free(r->index);
+    free(r->index_paths);
+    r->index = ents;
+    r->nindex = n;
+    r->index_paths = paths.data;
+    return true;
+}
+
+static bool
+load_index(repo_t *r)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/index", r->gitdir);
+
+    struct stat sb;
+    if (stat(path, &sb) < 0) {
+        // fresh repo, nothing added yet
+        free(r->index);
+        r->index = NULL;
+        r->nindex = 0;
+        return true;
+    }
+    if (r->index && sb.st_ino == r->index_st.st_ino && sb.st_size == r->index_st.st_size
+            && sb.st_mtim.tv_sec == r->index_st.st_mtim.tv_sec
+            && sb.st_mtim.tv_nsec == r->index_st.st_mtim.tv_nsec)
+        return true;
+
+    size_t sz;
+    char *buf = read_all(path, &sz);
+    if (!buf) return false;
+    bool ok = parse_index(r, (unsigned char*) buf, sz);
+    free(buf);
+    if (ok) r->index_st = sb;
+    return ok;
+}
+
+static bool
+hex_to_sha(const char *hex, unsigned char *sha)
+{
+    for (int i = 0; i < SHA_SZ; ++i) {
+        unsigned int b;
+        if (sscanf(hex + i*2, "%2x", &b) != 1) return false;
+        sha[i] = b;
+    }
+    return true;
+}
+
+static bool
+resolve_ref(repo_t *r, const char *ref, unsigned char *sha, int depth)
+{
+    if (depth > 8) return false;
+    char path[4096];
+
+    // HEAD is per worktree, everything else lives in the common dir
+    snprintf(path, sizeof(path), "%s/%s",
+        strcmp(ref, "HEAD") == 0? r->gitdir : r->common, ref);
+    char *s = read_all(path, NULL);
+    if (s) {
+        bool ok;
+        s[strcspn(s, "\r\n")] = '\0';
+        if (strncmp(s, "ref: ", 5) == 0)
+            ok = resolve_ref(r, s + 5, sha, depth + 1);
+        else
+            ok = hex_to_sha(s, sha);
+        free(s);
+        return ok;
+    }
+
+    snprintf(path, sizeof(path), "%s/packed-refs", r->common);
+    s = read_all(path, NULL);
+    if (!s) return false;
+
+    bool ok = false;
+    size_t ref_sz = strlen(ref);
+    for (char *line = s; *line; ) {
+        char *end = line + strcspn(line, "\n");
+        if (end - line > 41 && line[40] == ' '
+                && (size_t) (end - line - 41) == ref_sz
+                && strncmp(line + 41, ref, ref_sz) == 0) {
+            ok = hex_to_sha(line, sha);
+            break;
+        }
+        line = *end? end + 1 : end;
+    }
+    free(s);
+    return ok;
+}
+
+static void
+load_packs(repo_t *r)
+{
+    r->packs_loaded = true;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/objects/pack", r->common);
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (len < 5 || strcmp(de->d_name + len - 4, ".idx") != 0)
+            continue;
+
+        pack_t p = {0};
+        char file[4096];
+        int n = snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+        if (n < 0 || n >= (int) sizeof(file)) continue;
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        struct stat sb;
+        if (fstat(fd, &sb) == 0 && sb.st_size >= 8 + 1024) {
+            p.idx_sz = sb.st_size;
+            p.idx = mmap(NULL, p.idx_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (!p.idx || p.idx == MAP_FAILED) continue;
+
+        // only v2 indexes, which is all git has written since 2008
+        if (be32(p.idx) != 0xff744f63 || be32(p.idx + 4) != 2) {
+            munmap(p.idx, p.idx_sz);
+            continue;
+        }
+        p.count = be32(p.idx + 8 + 255*4);
+
+        strcpy(file + strlen(file) - 4, ".pack");
+        fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &sb) == 0) {
+            p.pack_sz = sb.st_size;
+            p.pack = mmap(NULL, p.pack_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (fd >= 0) close(fd);
+        if (!p.pack || p.pack == MAP_FAILED) {
+            munmap(p.idx, p.idx_sz);
+            continue;
+        }
+
+        r->packs = realloc(r->packs, (r->npacks + 1) * sizeof(pack_t));
+        r->packs[r->npacks++] = p;
+    }
+    closedir(dir);
+}
+
+static unsigned char *
+inflate_all(const unsigned char *in, size_t in_sz, size_t out_sz, size_t *res_sz)
+{
+    z_stream zs = {0};
+    if (inflateInit(&zs) != Z_OK) return NULL;
+
+    size_t alloc = out_sz? out_sz + 1 : 4096;
+    unsigned char *out = malloc(alloc);
+    zs.next_in = (unsigned char*) in;
+    zs.avail_in = in_sz;
+
+    int ret;
+    do {
+        if (zs.total_out == alloc) {
+            alloc *= 2;
+            out = realloc(out, alloc);
+        }
+        zs.next_out = out + zs.total_out;
+        zs.avail_out = alloc - zs.total_out;
+        ret = inflate(&zs, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    *res_sz = zs.total_out;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static unsigned char *
+apply_delta(const unsigned char *base, size_t base_sz,
+        const unsigned char *delta, size_t delta_sz, size_t *res_sz)
+{
+    const unsigned char *p = delta, *end = delta + delta_sz;
+    size_t sizes[2] = {0, 0};
+    for (int i = 0; i < 2; ++i) {
+        int shift = 0;
+        unsigned char c;
+        do {
+            if (p >= end) return NULL;
+            c = *p++;
+            sizes[i] |= (size_t) (c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+    }
+    if (sizes[0] != base_sz) return NULL;
+
+    unsigned char *out = malloc(sizes[1] + 1), *o = out;
+    while (p < end) {
+        unsigned char c = *p++;
+        if (c & 0x80) {
+            size_t off = 0, sz = 0;
+            for (int i = 0; i < 4; ++i)
+                if (c & (1 << i) && p < end) off |= (size_t) *p++ << (i*8);
+            for (int i = 0; i < 3; ++i)
+                if (c & (0x10 << i) && p < end) sz |= (size_t) *p++ << (i*8);
+            if (!sz) sz = 0x10000;
+            if (off + sz > base_sz || o + sz > out + sizes[1]) break;
+            memcpy(o, base + off, sz);
+            o += sz;
+        }
+        else if (c) {
+            if (p + c > end || o + c > out + sizes[1]) break;
+            memcpy(o, p, c);
+            o += c;
+            p += c;
+        }
+    }
+    if (o != out + sizes[1]) {
+        free(out);
+        return NULL;
+    }
+    *res_sz = sizes[1];
+    return out;
+}
+
+static unsigned char *
+pack_object(repo_t *r, pack_t *pk, size_t off, int *type, size_t *sz, int depth)
+{
+    if (depth > 64 || off >= pk->pack_sz) return NULL;
+    const unsigned char *p = pk->pack + off, *end = pk->pack + pk->pack_sz;
+
+    unsigned char c = *p++;
+    *type = (c >> 4) & 7;
+    size_t size = c & 15;
+    int shift = 4;
+    while (c & 0x80 && p < end) {
+        c = *p++;
+        size |= (size_t) (c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    unsigned char *base = NULL;
+    size_t base_sz = 0;
+    if (*type == OBJ_OFS_DELTA) {
+        c = *p++;
+        size_t rel = c & 127;
+        while (c & 128 && p < end) {
+            c = *p++;
+            rel = ((rel + 1) << 7) | (c & 127);
+        }
+        if (rel > off) return NULL;
+        base = pack_object(r, pk, off - rel, type, &base_sz, depth + 1);
+    }
+    else if (*type == OBJ_REF_DELTA) {
+        if (p + SHA_SZ > end) return NULL;
+        base = read_object(r, p, type, &base_sz, depth + 1);
+        p += SHA_SZ;
+    }
+
+    size_t got;
+    unsigned char *data = inflate_all(p, end - p, size, &got);
+    if (!data) {
+        free(base);
+        return NULL;
+    }
+    if (!base) {
+        if (*type == OBJ_OFS_DELTA || *type == OBJ_REF_DELTA) {
+            free(data);
+            return NULL;
+        }
+        *sz = got;
+        return data;
+    }
+
+    unsigned char *res = apply_delta(base, base_sz, data, got, sz);
+    free(base);
+    free(data);
+    return res;
+}
+
+static unsigned char *
+read_object(repo_t *r, const unsigned char *sha, int *type, size_t *sz, int depth)
+{
+    char path[4096];
+    int n = snprintf(path, sizeof(path), "%s/objects/%02x/", r->common, sha[0]);
+    for (int i = 1; i < SHA_SZ; ++i)
+        n += snprintf(path + n, sizeof(path) - n, "%02x", sha[i]);
+
+    size_t raw_sz;
+    unsigned char *raw = (unsigned char*) read_all(path, &raw_sz);
+    if (raw) {
+        size_t got;
+        unsigned char *data = inflate_all(raw, raw_sz, 0, &got);
+        free(raw);
+        if (!data) return NULL;
+
+        // "<type> <size>\0<data>"
+        unsigned char *nul = memchr(data, '\0', got);
+        if (!nul) {
+            free(data);
+            return NULL;
+        }
+        if (strncmp((char*) data, "tree ", 5) == 0) *type = OBJ_TREE;
+        else if (strncmp((char*) data, "commit ", 7) == 0) *type = OBJ_COMMIT;
+        else if (strncmp((char*) data, "blob ", 5) == 0) *type = OBJ_BLOB;
+        else *type = OBJ_TAG;
+        *sz = got - (nul + 1 - data);
+        memmove(data, nul + 1, *sz);
+        return data;
+    }
+
+    if (!r->packs_loaded) load_packs(r);
+    for (int i = 0; i < r->npacks; ++i) {
+        pack_t *pk = &r->packs[i];
+        const unsigned char *fanout = pk->idx + 8;
+        uint32_t lo = sha[0]? be32(fanout + (sha[0]-1)*4) : 0;
+        uint32_t hi = be32(fanout + sha[0]*4);
+        const unsigned char *shas = fanout + 1024;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(shas + (size_t) mid*SHA_SZ, sha, SHA_SZ);
+            if (cmp == 0) {
+                const unsigned char *offs = shas + (size_t) pk->count * (SHA_SZ + 4);
+                size_t off = be32(offs + (size_t) mid*4);
+                if (off & 0x80000000) {
+                    const unsigned char *big = offs + (size_t) pk->count*4
+                        + (off & 0x7fffffff) * 8;
+                    off = (size_t) be32(big) << 32 | be32(big + 4);
+                }
+                return pack_object(r, pk, off, type, sz, depth);
+            }
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// flatten a tree into r->tree, in the same order as the index
+static bool
+walk_tree(repo_t *r, const unsigned char *sha, buf_t *prefix, int depth)
+{
+    int type;
+    size_t sz;
+    unsigned char *data = read_object(r, sha, &type, &sz, 0);
+    if (!data || type != OBJ_TREE || depth > 256) {
+        free(data);
+        return false;
+    }
+
+    const unsigned char *p = data, *end = data + sz;
+    while (p < end) {
+        const unsigned char *space = memchr(p, ' ', end - p);
+        if (!space) break;
+        const unsigned char *name = space + 1;
+        const unsigned char *nul = memchr(name, '\0', end - name);
+        if (!nul || nul + 1 + SHA_SZ > end) break;
+        const unsigned char *entry_sha = nul + 1;
+        bool is_tree = (space - p == 5 && memcmp(p, "40000", 5) == 0);
+        bool is_link = (space - p == 6 && memcmp(p, "160000", 6) == 0);
+
+        size_t keep = prefix->size;
+        buf_add(prefix, name, nul - name);
+        if (is_tree) {
+            buf_add(prefix, "/", 1);
+            walk_tree(r, entry_sha, prefix, depth + 1);
+        }
+        else if (!is_link) {
+            if (r->ntree == r->tree_alloc) {
+                r->tree_alloc = r->tree_alloc? r->tree_alloc*2 : 1024;
+                r->tree = realloc(r->tree, r->tree_alloc * sizeof(tree_entry_t));
+            }
+            tree_entry_t *te = &r->tree[r->ntree++];
+            // path is an offset until the buffer stops moving
+            te->path = (const char*) (uintptr_t) r->tree_paths.size;
+            te->path_sz = prefix->size;
+            memcpy(te->sha, entry_sha, SHA_SZ);
+            buf_add(&r->tree_paths, prefix->data, prefix->size);
+            buf_add(&r->tree_paths, "", 1);
+        }
+        prefix->size = keep;
+        p = entry_sha + SHA_SZ;
+    }
+    free(data);
+    return true;
+}
+
+static void
+load_head(repo_t *r)
+{
+    unsigned char sha[SHA_SZ];
+    if (!resolve_ref(r, "HEAD", sha, 0)) {
+        r->has_head = false;
+        r->ntree = 0;
+        return;
+    }
+    if (r->has_head && memcmp(sha, r->head, SHA_SZ) == 0)
+        return;
+
+    r->ntree = 0;
+    r->tree_paths.size = 0;
+    memcpy(r->head, sha, SHA_SZ);
+    r->has_head = true;
+
+    int type;
+    size_t sz;
+    unsigned char *commit = read_object(r, sha, &type, &sz, 0);
+    unsigned char tree[SHA_SZ];
+    if (commit && type == OBJ_COMMIT && sz > 45
+            && strncmp((char*) commit, "tree ", 5) == 0
+            && hex_to_sha((char*) commit + 5, tree)) {
+        buf_t prefix = {0};
+        walk_tree(r, tree, &prefix, 0);
+        free(prefix.data);
+    }
+    free(commit);
+
+    for (size_t i = 0; i < r->ntree; ++i)
+        r->tree[i].path = r->tree_paths.data + (uintptr_t) r->tree[i].path;
+}
+
+static const tree_entry_t *
+head_lower_bound(repo_t *r, const char *path, size_t sz)
+{
+    size_t lo = 0, hi = r->ntree;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const tree_entry_t *te = &r->tree[mid];
+        size_t n = (te->path_sz < sz)? te->path_sz : sz;
+        int cmp = memcmp(te->path, path, n);
+        if (cmp < 0 || (cmp == 0 && te->path_sz < sz)) lo = mid + 1;
+        else hi = mid;
+    }
+    return &r->tree[lo];
+}
+
+static void
+add_ignores(const char *file, const char *base, size_t base_sz, ignore_t **ign, size_t *n)
+{
+    char *s = read_all(file, NULL);
+    if (!s) return;
+
+    for (char *line = strtok(s, "\n"); line; line = strtok(NULL, "\n")) {
+        size_t len = strlen(line);
+        while (len && (line[len-1] == ' ' || line[len-1] == '\r')) line[--len] = '\0';
+        if (!len || line[0] == '#') continue;
+
+        ignore_t ig = {0};
+        if (line[0] == '!') {
+            ig.negate = true;
+            ++line;
+            --len;
+        }
+        if (len && line[len-1] == '/') {
+            ig.dir_only = true;
+            line[--len] = '\0';
+        }
+        if (strncmp(line, "**/", 3) == 0 && !strchr(line + 3, '/')) {
+            line += 3;
+        }
+        else if (strchr(line, '/')) {
+            ig.anchored = true;
+            if (line[0] == '/') ++line;
+        }
+        if (!*line) continue;
+        ig.deep = strstr(line, "**") != NULL;
+        ig.pat = strdup(line);
+        ig.base = strndup(base, base_sz);
+        ig.base_sz = base_sz;
+
+        *ign = realloc(*ign, (*n + 1) * sizeof(ignore_t));
+        (*ign)[(*n)++] = ig;
+    }
+    free(s);
+}
+
+// rules from info/exclude and every .gitignore from the root down to rel
+static void
+load_ignores(repo_t *r, const char *rel, size_t rel_sz, ignore_t **ign, size_t *n)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/info/exclude", r->common);
+    add_ignores(path, "", 0, ign, n);
+
+    snprintf(path, sizeof(path), "%s/.gitignore", r->root);
+    add_ignores(path, "", 0, ign, n);
+
+    for (size_t i = 0; i < rel_sz; ++i) {
+        if (rel[i] != '/') continue;
+        snprintf(path, sizeof(path), "%s/%.*s.gitignore", r->root, (int) i+1, rel);
+        add_ignores(path, rel, i+1, ign, n);
+    }
+}
+
+static void
+free_ignores(ignore_t *ign, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        free(ign[i].pat);
+        free(ign[i].base);
+    }
+    free(ign);
+}
+
+// path is relative to the root. 1 ignored, 0 not, -1 no rule says
+static int
+ignored(ignore_t *ign, size_t n, const char *path, bool is_dir)
+{
+    for (size_t i = n; i-- > 0; ) {
+        ignore_t *ig = &ign[i];
+        if (ig->dir_only && !is_dir) continue;
+        if (strncmp(path, ig->base, ig->base_sz) != 0) continue;
+
+        const char *rel = path + ig->base_sz;
+        bool match;
+        if (ig->anchored) {
+            match = fnmatch(ig->pat, rel, ig->deep? 0 : FNM_PATHNAME) == 0;
+        }
+        else {
+            const char *name = strrchr(rel, '/');
+            match = fnmatch(ig->pat, name? name + 1 : rel, 0) == 0;
+        }
+        if (match) return !ig->negate;
+    }
+    return -1;
+}
+
+// which of names is the first sz bytes of name, through the table
+// git_status builds. -1 if none is
+static int
+find_name(char **names, const int *table, size_t hsz, const char *name, size_t sz)
+{
+    uint32_t h = 2166136261u;
+    for (size_t c = 0; c < sz; ++c) h = (h ^ (unsigned char) name[c]) * 16777619u;
+    for (size_t k = h & (hsz - 1); table[k] >= 0; k = (k + 1) & (hsz - 1)) {
+        if (strncmp(names[table[k]], name, sz) == 0 && names[table[k]][sz] == '\0')
+            return table[k];
+    }
+    return -1;
+}
+
+bool
+git_status(const char *dir, char **names, const bool *is_dir,
+        const struct stat *st, size_t count, uint8_t *out,
+        git_stop_t stop, unsigned gen)
+{
+    char *root, *gitdir;
+    if (!find_root(dir, &root, &gitdir)) return false;
+
+    // a .git dir is no work tree of its own
+    size_t root_sz = strlen(root);
+    if (strstr(dir + root_sz, "/.git") == dir + root_sz) {
+        free(root);
+        free(gitdir);
+        return false;
+    }
+
+    pthread_mutex_lock(&git_lock);
+    repo_t *r = get_repo(root, gitdir);
+    free(root);
+    free(gitdir);
+
+    bool ok = load_index(r);
+    if (ok) load_head(r);
+
+    // rel is dir relative to the root with a trailing '/', or ""
+    char rel[4096];
+    size_t rel_sz = 0;
+    if (dir[r->root_sz] == '/') {
+        rel_sz = snprintf(rel, sizeof(rel) - 1, "%s/", dir + r->root_sz + 1);
+        if (rel_sz >= sizeof(rel) - 1) ok = false;
+    }
+    rel[rel_sz] = '\0';
+
+    // name -> index into names, open addressing
+    size_t hsz = 16;
+    while (hsz < count * 2) hsz *= 2;
+    int *table = malloc(hsz * sizeof(int));
+    memset(table, -1, hsz * sizeof(int));
+    for (size_t i = 0; ok && i < count; ++i) {
+        uint32_t h = 2166136261u;
+        for (char *c = names[i]; *c; ++c) h = (h ^ (unsigned char) *c) * 16777619u;
+        size_t k = h & (hsz - 1);
+        while (table[k] >= 0) k = (k + 1) & (hsz - 1);
+        table[k] = i;
+    }
+
+    bool *tracked = calloc(count + 1, sizeof(bool));
+    memset(out, 0, count);
+
+    // index entries under rel are one sorted run
+    size_t lo = 0, hi = ok? r->nindex : 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(r->index[mid].path, rel, rel_sz) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    const tree_entry_t *te = r->has_head? head_lower_bound(r, rel, rel_sz) : NULL;
+    const tree_entry_t *tend = r->tree + r->ntree;
+
+    char full[4096];
+    for (size_t i = lo; ok && i < r->nindex; ++i) {
+        index_entry_t *ie = &r->index[i];
+        if (strncmp(ie->path, rel, rel_sz) != 0) break;
+        if (((i - lo) & 511) == 511 && stop && stop(gen)) {
+            ok = false;
+            break;
+        }
+
+        const char *child = ie->path + rel_sz;
+        const char *slash = strchr(child, '/');
+        size_t child_sz = slash? (size_t) (slash - child) : strlen(child);
+
+        int idx = find_name(names, table, hsz, child, child_sz);
+
+        // HEAD and the index are sorted the same way, walk them together
+        bool in_head = false;
+        while (te && te < tend) {
+            int cmp = strcmp(te->path, ie->path);
+            if (cmp > 0) break;
+            if (cmp == 0) {
+                in_head = memcmp(te->sha, ie->sha, SHA_SZ) == 0;
+                ++te;
+                break;
+            }
+            // in HEAD but not in the index: a staged removal
+            const char *gone = te->path + rel_sz;
+            int k = find_name(names, table, hsz, gone, strcspn(gone, "/"));
+            if (k >= 0) out[k] |= GIT_STAGED;
+            ++te;
+        }
+
+        if (idx < 0) continue;
+        tracked[idx] = true;
+
+        uint8_t flags = 0;
+        if (ie->stage || !in_head) flags |= GIT_STAGED;
+        if (ie->stage) flags |= GIT_MODIFIED;
+
+        struct stat sb;
+        bool have = false;
+        if (!slash && st[idx].st_mode && !S_ISLNK(ie->mode & 0170000)) {
+            sb = st[idx];
+            have = true;
+        }
+        else {
+            snprintf(full, sizeof(full), "%s/%s", r->root, ie->path);
+            have = lstat(full, &sb) == 0;
+        }
+        if (!have) {
+            flags |= GIT_MODIFIED;
+        }
+        else if ((uint32_t) sb.st_size != ie->size
+                || (uint32_t) sb.st_mtim.tv_sec != ie->mtime
+                || (ie->mtime_ns && (uint32_t) sb.st_mtim.tv_nsec != ie->mtime_ns)) {
+            flags |= GIT_MODIFIED;
+        }
+        out[idx] |= flags;
+    }
+    // what's left of HEAD under rel sorts after the last index entry,
+    // those were removed as well
+    while (ok && te && te < tend && strncmp(te->path, rel, rel_sz) == 0) {
+        const char *gone = te->path + rel_sz;
+        int k = find_name(names, table, hsz, gone, strcspn(gone, "/"));
+        if (k >= 0) out[k] |= GIT_STAGED;
+        ++te;
+    }
+    free(table);
+
+    if (ok) {
+        ignore_t *ign = NULL;
+        size_t nign = 0;
+        load_ignores(r, rel, rel_sz, &ign, &nign);
+
+        // everything in an ignored dir is ignored
+        bool dir_ignored = false;
+        for (size_t i = 0; i < rel_sz; ++i) {
+            if (rel[i] != '/') continue;
+            rel[i] = '\0';
+            if (ignored(ign, nign, rel, true) == 1) dir_ignored = true;
+            rel[i] = '/';
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            if (tracked[i]) continue;
+            snprintf(full, sizeof(full), "%s%s", rel, names[i]);
+            if (strcmp(names[i], ".git") == 0) continue;
+            // a staged removal of it stays marked
+            if (dir_ignored || ignored(ign, nign, full, is_dir[i]) == 1)
+                out[i] |= GIT_IGNORED;
+            else
+                out[i] |= GIT_UNTRACKED;
+        }
+        free_ignores(ign, nign);
+    }
+
+    free(tracked);
+    pthread_mutex_unlock(&git_lock);
+    return ok;
+}
@@ -0,0 +1,28 @@
+#ifndef GIT_H
+#define GIT_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define GIT_MAX_REPOS 4
+
+enum {
+    GIT_MODIFIED  = 1 << 0, // worktree differs from the index
+    GIT_STAGED    = 1 << 1, // index differs from HEAD
+    GIT_UNTRACKED = 1 << 2,
+    GIT_IGNORED   = 1 << 3,
+};
+
+typedef bool (*git_stop_t)(unsigned gen);
+
+// fill out[i] with GIT_* flags for names[i] inside dir. st[i] is the
+// stat of names[i] (st_mode 0 if unknown). directories get the flags of
+// everything below them. returns false if dir isn't in a work tree or
+// stop() asked to give up. safe to call from any thread
+bool git_status(const char *dir, char **names, const bool *is_dir,
+        const struct stat *st, size_t count, uint8_t *out,
+        git_stop_t stop, unsigned gen);
+
+#endif
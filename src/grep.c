@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "grep.h"
+#include "wake.h"
+
+typedef struct job_t {
+    char *base;
+    char *text;
+    size_t len;
+    size_t rare;  // index of the needle byte least likely to show up
+    bool recursive;
+    bool hidden;
+} job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false, reported = true;
+static volatile bool cancel = false;
+
+// files waiting to be scanned, under lock
+static char **queue = NULL;
+static size_t queue_sz = 0, queue_alloc = 0, queue_next = 0;
+static bool walk_done = false;
+
+// progress and hits not taken yet, under lock
+static size_t nfiles = 0, nmatched = 0, nbinary = 0, nbig = 0, total_hits = 0;
+static grep_hits_t *pending = NULL;
+static int64_t start_ms = 0, end_ms = 0;
+
+static int byte_score(unsigned char c);
+static size_t pick_rare(const char *text, size_t len);
+static const char *find(const char *p, size_t n, job_t *job);
+static void add_hit(grep_hits_t *h, const char *path, size_t path_sz, uint32_t line,
+        const char *text, size_t text_sz);
+static void scan_file(job_t *job, const char *rel, grep_hits_t *out);
+static bool push_file(char *rel);
+static void walk(job_t *job);
+static void *worker_thread(void *arg);
+static void *grep_thread(void *arg);
+
+// how often a byte turns up in text and code, roughly. higher is more
+static int
+byte_score(unsigned char c)
+{
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+    const char *p = c? strchr(common, c) : NULL;
+    if (p) return 100 - (p - common);
+    if (c == '\n' || c == '\t' || c == '_' || c == '.' || c == ',' || c == '(' || c == ')')
+        return 60;
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 40;
+    return 20;
+}
+
+static size_t
+pick_rare(const char *text, size_t len)
+{
+    size_t best = 0;
+    for (size_t i = 1; i < len; ++i) {
+        if (byte_score(text[i]) < byte_score(text[best]))
+            best = i;
+    }
+    return best;
+}
+
+// memchr is vectorized, so it looks for the rarest byte of the needle
+// and only where that turns up is the whole needle compared
+static const char *
+find(const char *p, size_t n, job_t *job)
+{
+    size_t len = job->len, rare = job->rare;
+    char c = job->text[rare];
+    while (n >= len) {
+        const char *hit = memchr(p + rare, c, n - len + 1);
+        if (!hit) return NULL;
+        const char *start = hit - rare;
+        if (memcmp(start, job->text, len) == 0) return start;
+        n -= start + 1 - p;
+        p = start + 1;
+    }
+    return NULL;
+}
+
+static void
+add_hit(grep_hits_t *h, const char *path, size_t path_sz, uint32_t line,
+        const char *text, size_t text_sz)
+{
+    size_t need = path_sz + 16 + text_sz + 2;
+    if (h->sz + need > h->alloc) {
+        h->alloc = (h->sz + need) * 2;
+        h->buf = realloc(h->buf, h->alloc);
+    }
+    if (h->count == h->hits_alloc) {
+        h->hits_alloc = h->hits_alloc? h->hits_alloc*2 : 64;
+        h->lines = realloc(h->lines, h->hits_alloc * sizeof(uint32_t));
+        h->path_sz = realloc(h->path_sz, h->hits_alloc * sizeof(uint16_t));
+    }
+    char *out = h->buf + h->sz;
+    memcpy(out, path, path_sz);
+    out += path_sz;
+    out += sprintf(out, ":%u: ", line);
+
+    // the preview has to fit on one row of the listing
+    for (size_t i = 0; i < text_sz; ++i) {
+        unsigned char c = text[i];
+        *out++ = (c == '\t')? ' ' : (c < 32 || c == 127)? '.' : c;
+    }
+    // a trailing '/' would make the listing take it for a dir
+    if (out[-1] == '/') *out++ = ' ';
+    *out++ = '\n';
+    h->sz = out - h->buf;
+    h->lines[h->count] = line;
+    h->path_sz[h->count] = path_sz;
+    h->count++;
+}
+
+static void
+scan_file(job_t *job, const char *rel, grep_hits_t *out)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", job->base, rel);
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t) job->len) {
+        close(fd);
+        return;
+    }
+    if (st.st_size > GREP_MAX_FILE_SZ) {
+        close(fd);
+        pthread_mutex_lock(&lock);
+        nbig++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    size_t size = st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    if (memchr(data, 0, (size < GREP_BINARY_PROBE)? size : GREP_BINARY_PROBE)) {
+        munmap(data, size);
+        pthread_mutex_lock(&lock);
+        nbinary++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    // lines are counted lazily, only up to where the next hit is
+    size_t rel_sz = strlen(rel);
+    uint32_t line = 1;
+    const char *counted = data, *end = data + size, *p = data;
+    while (!cancel && p < end) {
+        const char *hit = find(p, end - p, job);
+        if (!hit) break;
+        for (const char *nl; (nl = memchr(counted, '\n', hit - counted)); counted = nl + 1)
+            line++;
+        const char *eol = memchr(hit, '\n', end - hit);
+        if (!eol) eol = end;
+
+        const char *text = counted;
+        while (text < hit && (*text == ' ' || *text == '\t')) ++text;
+        size_t text_sz = eol - text;
+        if (text_sz > GREP_PREVIEW_SZ) text_sz = GREP_PREVIEW_SZ;
+        add_hit(out, rel, rel_sz, line, text, text_sz);
+        p = eol;
+    }
+    munmap(data, size);
+}
+
+// false once there are hits enough, there's no point going on then
+static bool
+push_file(char *rel)
+{
+    pthread_mutex_lock(&lock);
+    if (queue_sz == queue_alloc) {
+        queue_alloc = queue_alloc? queue_alloc*2 : 1024;
+        queue = realloc(queue, queue_alloc * sizeof(char*));
+    }
+    queue[queue_sz++] = rel;
+    pthread_cond_signal(&cond);
+    bool more = total_hits < GREP_MAX_HITS;
+    pthread_mutex_unlock(&lock);
+    return more;
+}
+
+// dirs are taken off a stack of their own, the files go to the workers
+static void
+walk(job_t *job)
+{
+    size_t ndirs = 1, dirs_alloc = 64;
+    char **dirs = malloc(dirs_alloc * sizeof(char*));
+    dirs[0] = strdup("");
+
+    char path[PATH_MAX];
+    bool more = true;
+    while (ndirs && more && !cancel) {
+        char *rel = dirs[--ndirs];
+        snprintf(path, sizeof(path), "%s/%s", job->base, rel);
+        DIR *dir = opendir(path);
+        struct dirent *de;
+        while (dir && more && (de = readdir(dir)) && !cancel) {
+            char *name = de->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+            if (name[0] == '.' && !job->hidden)
+                continue;
+            if (strchr(name, '\n'))
+                continue;
+
+            unsigned char type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                type = DT_LNK;
+                if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                    type = S_ISDIR(st.st_mode)? DT_DIR : S_ISREG(st.st_mode)? DT_REG : DT_LNK;
+            }
+            if (type != DT_REG && !(type == DT_DIR && job->recursive))
+                continue;
+
+            char sub_path[PATH_MAX];
+            snprintf(sub_path, sizeof(sub_path), "%s%s%s", rel, *rel? "/" : "", name);
+            char *sub = strdup(sub_path);
+            if (type == DT_REG) {
+                more = push_file(sub);
+                continue;
+            }
+            if (ndirs == dirs_alloc) {
+                dirs_alloc *= 2;
+                dirs = realloc(dirs, dirs_alloc * sizeof(char*));
+            }
+            dirs[ndirs++] = sub;
+        }
+        if (dir) closedir(dir);
+        free(rel);
+    }
+    while (ndirs) free(dirs[--ndirs]);
+    free(dirs);
+}
+
+static void *
+worker_thread(void *arg)
+{
+    job_t *job = arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (queue_next == queue_sz && !walk_done && !cancel)
+            pthread_cond_wait(&cond, &lock);
+        if (cancel || queue_next == queue_sz || total_hits >= GREP_MAX_HITS) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        char *rel = queue[queue_next];
+        queue[queue_next++] = NULL;
+        pthread_mutex_unlock(&lock);
+
+        grep_hits_t found = {0};
+        scan_file(job, rel, &found);
+        free(rel);
+
+        // a file's hits go in together, so they stay next to each other
+        pthread_mutex_lock(&lock);
+        nfiles++;
+        if (found.count && !cancel && total_hits < GREP_MAX_HITS) {
+            if (!pending) pending = calloc(1, sizeof(grep_hits_t));
+            nmatched++;
+            total_hits += found.count;
+            grep_merge(pending, &found);
+            wake_notify(&wake, false);
+        }
+        pthread_mutex_unlock(&lock);
+        grep_free_hits(&found);
+    }
+}
+
+static void *
+grep_thread(void *arg)
+{
+    job_t *job = arg;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = (cpus < 1)? 1 : (cpus > GREP_MAX_THREADS)? GREP_MAX_THREADS : cpus;
+
+    pthread_t threads[GREP_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[started], NULL, worker_thread, job) == 0)
+            started++;
+    }
+
+    walk(job);
+    pthread_mutex_lock(&lock);
+    walk_done = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    // nothing started, the walking thread scans them itself
+    if (!started) worker_thread(job);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = queue_next; i < queue_sz; ++i)
+        free(queue[i]);
+    free(queue);
+    queue = NULL;
+    queue_sz = queue_alloc = queue_next = 0;
+    end_ms = now_ms();
+    running = false;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+
+    free(job->base);
+    free(job->text);
+    free(job);
+    return NULL;
+}
+
+bool
+grep_start(const char *base, const char *text, bool recursive, bool hidden)
+{
+    if (!*text) return false;
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wake_open(&wake);
+    grep_free_hits(pending);
+    free(pending);
+    pending = NULL;
+    nfiles = nmatched = nbinary = nbig = total_hits = 0;
+    start_ms = now_ms();
+    end_ms = 0;
+    walk_done = false;
+    cancel = false;
+    reported = false;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->base = strdup(base);
+    job->text = strdup(text);
+    job->len = strlen(text);
+    job->rare = pick_rare(text, job->len);
+    job->recursive = recursive;
+    job->hidden = hidden;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, grep_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) {
+        free(job->base);
+        free(job->text);
+        free(job);
+        reported = true;
+    }
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void
+grep_cancel(void)
+{
+    pthread_mutex_lock(&lock);
+    cancel = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+bool
+grep_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+grep_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+grep_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    bool finished = false;
+    if (running) {
+        snprintf(buf, sz, "grep: %zu files, %zu hits", nfiles, total_hits);
+    }
+    else {
+        finished = !reported;
+        reported = true;
+        char skipped[96] = "";
+        if (nbinary || nbig) {
+            snprintf(skipped, sizeof(skipped), ", skipped %zu binary and %zu too big",
+                nbinary, nbig);
+        }
+        if (cancel) {
+            snprintf(buf, sz, "grep: cancelled, %zu hits", total_hits);
+        }
+        else {
+            snprintf(buf, sz, "grep: %zu hits%s in %zu of %zu files, %.2fs%s",
+                total_hits, (total_hits >= GREP_MAX_HITS)? " (stopped there)" : "",
+                nmatched, nfiles, (end_ms - start_ms) / 1000.0, skipped);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
+
+grep_hits_t *
+grep_take(void)
+{
+    pthread_mutex_lock(&lock);
+    grep_hits_t *res = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void
+grep_merge(grep_hits_t *into, grep_hits_t *from)
+{
+    if (into->sz + from->sz > into->alloc) {
+        into->alloc = (into->sz + from->sz) * 2;
+        into->buf = realloc(into->buf, into->alloc);
+    }
+    if (into->count + from->count > into->hits_alloc) {
+        into->hits_alloc = (into->count + from->count) * 2;
+        into->lines = realloc(into->lines, into->hits_alloc * sizeof(uint32_t));
+        into->path_sz = realloc(into->path_sz, into->hits_alloc * sizeof(uint16_t));
+    }
+    memcpy(into->buf + into->sz, from->buf, from->sz);
+    memcpy(into->lines + into->count, from->lines, from->count * sizeof(uint32_t));
+    memcpy(into->path_sz + into->count, from->path_sz, from->count * sizeof(uint16_t));
+    into->sz += from->sz;
+    into->count += from->count;
+    free(from->buf);
+    free(from->lines);
+    free(from->path_sz);
+    *from = (grep_hits_t) {0};
+}
+
+void
+grep_free_hits(grep_hits_t *h)
+{
+    if (!h) return;
+    free(h->buf);
+    free(h->lines);
+    free(h->path_sz);
+    *h = (grep_hits_t) {0};
+}
@@ -0,0 +1,42 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// looks for text inside the files under a dir. one thread walks the
+// tree, the others map files and scan them, and hits are handed over
+// as they are found
+
+#define GREP_MAX_THREADS 8
+#define GREP_MAX_FILE_SZ (256*1024*1024)  // bigger files are skipped
+#define GREP_BINARY_PROBE 8192            // a NUL in here makes a file binary
+#define GREP_MAX_HITS 100000
+#define GREP_PREVIEW_SZ 160
+
+typedef struct grep_hits_t {
+    char *buf;          // "path:line: text" per hit, '\n' terminated
+    size_t sz, alloc;
+    uint32_t *lines;    // line number of each hit
+    uint16_t *path_sz;  // length of the path each hit starts with
+    size_t count, hits_alloc;
+} grep_hits_t;
+
+// look for text in the files in base, or below it if recursive. paths
+// in the hits are relative to base. false if a search is running
+bool grep_start(const char *base, const char *text, bool recursive, bool hidden);
+void grep_cancel(void);
+bool grep_running(void);
+// fd that becomes readable on progress and when hits are in
+int grep_fd(void);
+// one line describing the search. true once, when it has just finished
+bool grep_progress(char *buf, size_t sz);
+// hits found since the last call, NULL if there are none. free it
+grep_hits_t *grep_take(void);
+// move the hits of from to the end of into, from is left empty
+void grep_merge(grep_hits_t *into, grep_hits_t *from);
+// free what h holds, not h itself
+void grep_free_hits(grep_hits_t *h);
+
+#endif
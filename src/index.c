@@ -0,0 +1,806 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include "index.h"
+#include "fs.h"
+#include "wake.h"
+
+#define NONE UINT32_MAX      // a dir without a parent, an entry that's a file
+#define LEAF (UINT32_MAX-1)  // a dir that wasn't gone into, another mount
+#define INDEX_MAGIC "mfmidx1\n"
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// the file: a header_t, then dirs, entries, the bucket offsets and
+// counts, the names and the postings, each 8 byte aligned
+typedef struct header_t {
+    char magic[8];
+    uint32_t ndirs, nentries, nbuckets, pad;
+    uint64_t names_sz, postings_sz;
+} header_t;
+
+// roots have no parent and their full path as name. the entries of a
+// dir are together and sorted by name
+typedef struct dir_rec_t {
+    uint32_t parent, name, first, count;
+    int64_t mtime;  // nanoseconds, 0 if it couldn't be read
+} dir_rec_t;
+
+typedef struct entry_rec_t {
+    uint32_t dir, name;
+    uint32_t child;  // dir_rec_t of a dir, NONE for anything else, LEAF
+                     // while a dir is still being gone into
+} entry_rec_t;
+
+typedef struct view_t {
+    void *map;
+    size_t sz;
+    const header_t *h;
+    const dir_rec_t *dirs;
+    const entry_rec_t *entries;
+    const uint64_t *offs;    // nbuckets + 1
+    const uint32_t *counts;
+    const char *names;
+    const uint8_t *postings;
+} view_t;
+
+typedef struct builder_t {
+    dir_rec_t *dirs;
+    size_t ndirs, dirs_alloc;
+    entry_rec_t *entries;
+    size_t nentries, entries_alloc;
+    char *names;
+    size_t names_sz, names_alloc;
+    const view_t *old;
+    bool trust;  // watched dirs nothing happened in are taken as they are
+    dev_t dev;
+    size_t read, reused;
+} builder_t;
+
+typedef struct match_t {
+    uint32_t entry;
+    int rank;  // 0 the whole name, 1 the start of it, 2 anywhere
+    size_t len;
+} match_t;
+
+// path -> value, open addressing. values below 0 count as missing
+typedef struct map_t {
+    char **keys;
+    int *vals;
+    size_t count, alloc;
+} map_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static char *index_path = NULL;
+static char **roots = NULL;
+static size_t nroots = 0;
+static view_t cur;  // under lock, only the index thread replaces it
+
+// under lock
+static char line[256] = "";
+static bool reported = true;
+
+// only touched by the index thread
+static int ino = -1;
+static map_t watched, dirty;
+static char **wd_paths = NULL;
+static size_t nwd_paths = 0, nwatches = 0;
+
+static uint32_t hash_path(const char *s);
+static int map_get(map_t *m, const char *key);
+static void map_put(map_t *m, const char *key, int val);
+static void map_clear(map_t *m);
+static size_t align8(size_t n);
+static bool map_view(void *map, size_t sz, view_t *v);
+static bool map_file(const char *path, view_t *v);
+static uint32_t bucket(const unsigned char *s);
+static uint32_t add_name(builder_t *b, const char *name, size_t sz);
+static uint32_t add_dir(builder_t *b, uint32_t parent, const char *name);
+static void add_entry(builder_t *b, uint32_t dir, const char *name, uint32_t child);
+static uint32_t find_old(const view_t *v, const dir_rec_t *d, const char *name);
+static void watch(const char *path);
+static void unwatch_all(void);
+static int compare_cstr(const void *a, const void *b);
+static uint32_t walk(builder_t *b, char *path, size_t len, uint32_t parent,
+        const char *name, uint32_t old);
+static size_t varint(uint8_t *p, uint32_t v);
+static bool write_index(builder_t *b, const char *path);
+static void refresh(bool full);
+static bool wait_changes(void);
+static void *index_thread(void *arg);
+static size_t entry_path(const view_t *v, uint32_t e, char *buf, size_t sz);
+static int compare_matches(const void *a, const void *b);
+
+static uint32_t
+hash_path(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) h = (h ^ (unsigned char) *s) * 16777619u;
+    return h;
+}
+
+static int
+map_get(map_t *m, const char *key)
+{
+    if (!m->alloc) return -1;
+    for (size_t k = hash_path(key) & (m->alloc - 1); m->keys[k]; k = (k + 1) & (m->alloc - 1)) {
+        if (strcmp(m->keys[k], key) == 0) return m->vals[k];
+    }
+    return -1;
+}
+
+static void
+map_put(map_t *m, const char *key, int val)
+{
+    if ((m->count + 1) * 2 > m->alloc) {
+        map_t grown = { .alloc = m->alloc? m->alloc*2 : 1024 };
+        grown.keys = calloc(grown.alloc, sizeof(char*));
+        grown.vals = calloc(grown.alloc, sizeof(int));
+        for (size_t i = 0; i < m->alloc; ++i) {
+            if (!m->keys[i]) continue;
+            size_t k = hash_path(m->keys[i]) & (grown.alloc - 1);
+            while (grown.keys[k]) k = (k + 1) & (grown.alloc - 1);
+            grown.keys[k] = m->keys[i];
+            grown.vals[k] = m->vals[i];
+        }
+        grown.count = m->count;
+        free(m->keys);
+        free(m->vals);
+        *m = grown;
+    }
+    size_t k = hash_path(key) & (m->alloc - 1);
+    for (; m->keys[k]; k = (k + 1) & (m->alloc - 1)) {
+        if (strcmp(m->keys[k], key) == 0) {
+            m->vals[k] = val;
+            return;
+        }
+    }
+    m->keys[k] = strdup(key);
+    m->vals[k] = val;
+    m->count++;
+}
+
+static void
+map_clear(map_t *m)
+{
+    for (size_t i = 0; i < m->alloc; ++i)
+        free(m->keys[i]);
+    free(m->keys);
+    free(m->vals);
+    *m = (map_t) {0};
+}
+
+static size_t
+align8(size_t n)
+{
+    return (n + 7) & ~(size_t) 7;
+}
+
+// check an index file is whole and point v into it
+static bool
+map_view(void *map, size_t sz, view_t *v)
+{
+    const header_t *h = map;
+    if (sz < sizeof(header_t) || memcmp(h->magic, INDEX_MAGIC, 8) != 0
+            || h->nbuckets != INDEX_BUCKETS)
+        return false;
+    size_t off = sizeof(header_t);
+    size_t dirs = off;
+    off = align8(off + (size_t) h->ndirs * sizeof(dir_rec_t));
+    size_t entries = off;
+    off = align8(off + (size_t) h->nentries * sizeof(entry_rec_t));
+    size_t offs = off;
+    off = align8(off + (h->nbuckets + 1) * sizeof(uint64_t));
+    size_t counts = off;
+    off = align8(off + h->nbuckets * sizeof(uint32_t));
+    size_t names = off;
+    off = align8(off + h->names_sz);
+    size_t postings = off;
+    if (off + h->postings_sz > sz) return false;
+
+    *v = (view_t) {
+        .map = map,
+        .sz = sz,
+        .h = h,
+        .dirs = (const dir_rec_t*) ((char*) map + dirs),
+        .entries = (const entry_rec_t*) ((char*) map + entries),
+        .offs = (const uint64_t*) ((char*) map + offs),
+        .counts = (const uint32_t*) ((char*) map + counts),
+        .names = (char*) map + names,
+        .postings = (uint8_t*) map + postings,
+    };
+    return true;
+}
+
+static bool
+map_file(const char *path, view_t *v)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    if (map_view(map, st.st_size, v)) return true;
+    munmap(map, st.st_size);
+    return false;
+}
+
+// trigrams are folded to lower case and hashed into the buckets
+static uint32_t
+bucket(const unsigned char *s)
+{
+    uint32_t t = (tolower(s[0]) << 16) | (tolower(s[1]) << 8) | tolower(s[2]);
+    return (t * 2654435761u) >> (32 - INDEX_BUCKET_BITS);
+}
+
+static uint32_t
+add_name(builder_t *b, const char *name, size_t sz)
+{
+    if (b->names_sz + sz + 1 > b->names_alloc) {
+        while (b->names_sz + sz + 1 > b->names_alloc)
+            b->names_alloc = b->names_alloc? b->names_alloc*2 : 1 << 20;
+        b->names = realloc(b->names, b->names_alloc);
+    }
+    uint32_t off = b->names_sz;
+    memcpy(b->names + off, name, sz);
+    b->names[off + sz] = '\0';
+    b->names_sz += sz + 1;
+    return off;
+}
+
+static uint32_t
+add_dir(builder_t *b, uint32_t parent, const char *name)
+{
+    if (b->ndirs == b->dirs_alloc) {
+        b->dirs_alloc = b->dirs_alloc? b->dirs_alloc*2 : 1024;
+        b->dirs = realloc(b->dirs, b->dirs_alloc * sizeof(dir_rec_t));
+    }
+    uint32_t n = add_name(b, name, strlen(name));
+    b->dirs[b->ndirs] = (dir_rec_t) { parent, n, 0, 0, 0 };
+    return b->ndirs++;
+}
+
+static void
+add_entry(builder_t *b, uint32_t dir, const char *name, uint32_t child)
+{
+    if (b->nentries == b->entries_alloc) {
+        b->entries_alloc = b->entries_alloc? b->entries_alloc*2 : 4096;
+        b->entries = realloc(b->entries, b->entries_alloc * sizeof(entry_rec_t));
+    }
+    uint32_t n = add_name(b, name, strlen(name));
+    b->entries[b->nentries++] = (entry_rec_t) { dir, n, child };
+}
+
+// the dir called name in the old d, NONE if there's none
+static uint32_t
+find_old(const view_t *v, const dir_rec_t *d, const char *name)
+{
+    size_t lo = d->first, hi = (size_t) d->first + d->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int res = strcmp(v->names + v->entries[mid].name, name);
+        if (res == 0) {
+            uint32_t child = v->entries[mid].child;
+            return (child == LEAF)? NONE : child;
+        }
+        if (res < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NONE;
+}
+
+static void
+watch(const char *path)
+{
+    if (ino < 0 || nwatches >= INDEX_MAX_WATCHES || map_get(&watched, path) >= 0)
+        return;
+    int wd = inotify_add_watch(ino, path, WATCH_MASK);
+    if (wd < 0) return;
+    if ((size_t) wd >= nwd_paths) {
+        size_t n = nwd_paths? nwd_paths : 1024;
+        while ((size_t) wd >= n) n *= 2;
+        wd_paths = realloc(wd_paths, n * sizeof(char*));
+        memset(wd_paths + nwd_paths, 0, (n - nwd_paths) * sizeof(char*));
+        nwd_paths = n;
+    }
+    free(wd_paths[wd]);
+    wd_paths[wd] = strdup(path);
+    map_put(&watched, path, wd);
+    nwatches++;
+}
+
+// a dir moved somewhere, and every watch below it has the wrong path now
+static void
+unwatch_all(void)
+{
+    for (size_t i = 0; i < nwd_paths; ++i) {
+        if (!wd_paths[i]) continue;
+        inotify_rm_watch(ino, i);
+        free(wd_paths[i]);
+        wd_paths[i] = NULL;
+    }
+    map_clear(&watched);
+    nwatches = 0;
+}
+
+static int
+compare_cstr(const void *a, const void *b)
+{
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+// the dir at path, with old its counterpart in the index there was.
+// path is PATH_MAX long, names of what's in it are put after len
+static uint32_t
+walk(builder_t *b, char *path, size_t len, uint32_t parent, const char *name, uint32_t old)
+{
+    uint32_t id = add_dir(b, parent, name);
+    const dir_rec_t *od = (old != NONE)? &b->old->dirs[old] : NULL;
+
+    int64_t mtime = od? od->mtime : 0;
+    bool trusted = od && b->trust && map_get(&watched, path) >= 0
+        && map_get(&dirty, path) < 0;
+    if (!trusted) {
+        struct stat st;
+        if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return id;
+        if (st.st_dev != b->dev) return id;
+        mtime = fs_mtime(&st);
+    }
+    watch(path);
+    b->dirs[id].mtime = mtime;
+    b->dirs[id].first = b->nentries;
+
+    // the old dir of each entry that's a dir, the ones to go into next
+    uint32_t *olds = NULL;
+    size_t count = 0;
+    if (od && od->mtime && mtime == od->mtime) {
+        count = od->count;
+        olds = malloc((count + 1) * sizeof(uint32_t));
+        for (size_t i = 0; i < count; ++i) {
+            const entry_rec_t *e = &b->old->entries[od->first + i];
+            bool is_dir = e->child != NONE;
+            add_entry(b, id, b->old->names + e->name, is_dir? LEAF : NONE);
+            olds[i] = (e->child == LEAF)? NONE : e->child;
+        }
+        b->reused++;
+    }
+    else {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            b->dirs[id].mtime = 0;
+            return id;
+        }
+        char **names = NULL;
+        bool *dirs = NULL;
+        size_t alloc = 0;
+        struct dirent *de;
+        while ((de = readdir(dir))) {
+            char *n = de->d_name;
+            if (n[0] == '.' && (!n[1] || (n[1] == '.' && !n[2]))) continue;
+            if (count == alloc) {
+                alloc = alloc? alloc*2 : 64;
+                names = realloc(names, alloc * sizeof(char*));
+            }
+            // the type goes after the name, so they're sorted together
+            size_t sz = strlen(n);
+            names[count] = malloc(sz + 2);
+            memcpy(names[count], n, sz + 1);
+            bool is_dir = de->d_type == DT_DIR;
+            if (de->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(dirfd(dir), n, &st, AT_SYMLINK_NOFOLLOW) == 0
+                    && S_ISDIR(st.st_mode);
+            }
+            names[count][sz + 1] = is_dir;
+            count++;
+        }
+        closedir(dir);
+
+        qsort(names, count, sizeof(char*), compare_cstr);
+        olds = malloc((count + 1) * sizeof(uint32_t));
+        dirs = malloc(count + 1);
+        for (size_t i = 0; i < count; ++i) {
+            dirs[i] = names[i][strlen(names[i]) + 1];
+            add_entry(b, id, names[i], dirs[i]? LEAF : NONE);
+            olds[i] = (dirs[i] && od)? find_old(b->old, od, names[i]) : NONE;
+            free(names[i]);
+        }
+        free(names);
+        free(dirs);
+        b->read++;
+    }
+    b->dirs[id].count = count;
+
+    size_t first = b->dirs[id].first;
+    for (size_t i = 0; i < count; ++i) {
+        if (b->entries[first + i].child == NONE) continue;
+        const char *n = b->names + b->entries[first + i].name;
+        int sz = snprintf(path + len, PATH_MAX - len, "%s%s",
+            (len == 1 && path[0] == '/')? "" : "/", n);
+        if (sz < 0 || len + sz >= PATH_MAX) continue;
+        size_t nlen = len + sz;
+        const char *base = strrchr(path, '/') + 1;
+        uint32_t child = walk(b, path, nlen, id, base, olds[i]);
+        b->entries[first + i].child = child;
+        path[len] = '\0';
+    }
+    free(olds);
+    return id;
+}
+
+static size_t
+varint(uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// every entry goes in the bucket of each trigram of its name, and a
+// bucket holds the gaps between its entries. the sizes are worked out
+// first so the postings can be laid out in one go
+static bool
+write_index(builder_t *b, const char *path)
+{
+    uint64_t *offs = calloc(INDEX_BUCKETS + 1, sizeof(uint64_t));
+    uint32_t *counts = calloc(INDEX_BUCKETS, sizeof(uint32_t));
+    uint32_t *last = calloc(INDEX_BUCKETS, sizeof(uint32_t));
+    uint8_t *postings = NULL;
+    uint8_t tmp[8];
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            for (size_t k = 0; k < INDEX_BUCKETS; ++k)
+                offs[k + 1] += offs[k];
+            postings = malloc(offs[INDEX_BUCKETS] + 1);
+            memset(last, 0, INDEX_BUCKETS * sizeof(uint32_t));
+        }
+        for (size_t i = 0; i < b->nentries; ++i) {
+            const unsigned char *n = (unsigned char*) b->names + b->entries[i].name;
+            size_t len = strlen((char*) n);
+            // a name rarely has the same trigram twice. when it does
+            // past here, the query skips the repeat
+            uint32_t seen[256];
+            size_t nseen = 0;
+            for (size_t k = 0; k + 3 <= len; ++k) {
+                uint32_t bk = bucket(n + k);
+                bool dup = false;
+                for (size_t s = 0; s < nseen && !dup; ++s) dup = seen[s] == bk;
+                if (dup) continue;
+                if (nseen < 256) seen[nseen++] = bk;
+
+                uint32_t gap = i - last[bk];
+                last[bk] = i;
+                if (pass == 0) {
+                    offs[bk + 1] += varint(tmp, gap);
+                    counts[bk]++;
+                }
+                else {
+                    // offs[bk] moves along, it's put back below
+                    offs[bk] += varint(postings + offs[bk], gap);
+                }
+            }
+        }
+    }
+    // every bucket's offset is where the next one starts now
+    memmove(offs + 1, offs, INDEX_BUCKETS * sizeof(uint64_t));
+    offs[0] = 0;
+    free(last);
+
+    header_t h = {
+        .ndirs = b->ndirs,
+        .nentries = b->nentries,
+        .nbuckets = INDEX_BUCKETS,
+        .names_sz = b->names_sz,
+        .postings_sz = offs[INDEX_BUCKETS],
+    };
+    memcpy(h.magic, INDEX_MAGIC, 8);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "we");
+    bool ok = fp != NULL;
+    static const char zeros[8] = {0};
+    struct { const void *data; size_t sz; } parts[] = {
+        { &h, sizeof(h) },
+        { b->dirs, b->ndirs * sizeof(dir_rec_t) },
+        { b->entries, b->nentries * sizeof(entry_rec_t) },
+        { offs, (INDEX_BUCKETS + 1) * sizeof(uint64_t) },
+        { counts, INDEX_BUCKETS * sizeof(uint32_t) },
+        { b->names, b->names_sz },
+        { postings, offs[INDEX_BUCKETS] },
+    };
+    for (size_t i = 0; ok && i < sizeof(parts) / sizeof(parts[0]); ++i) {
+        if (parts[i].sz && fwrite(parts[i].data, parts[i].sz, 1, fp) != 1) ok = false;
+        size_t pad = align8(parts[i].sz) - parts[i].sz;
+        if (pad && fwrite(zeros, pad, 1, fp) != 1) ok = false;
+    }
+    if (fp && fclose(fp) != 0) ok = false;
+    if (ok) ok = rename(tmp_path, path) == 0;
+    if (!ok) unlink(tmp_path);
+
+    free(postings);
+    free(counts);
+    free(offs);
+    return ok;
+}
+
+static void
+refresh(bool full)
+{
+    int64_t start = now_ms();
+    builder_t b = { .old = &cur, .trust = !full && ino >= 0 };
+    char *path = malloc(PATH_MAX);
+
+    for (size_t i = 0; i < nroots; ++i) {
+        struct stat st;
+        if (stat(roots[i], &st) < 0) continue;
+        b.dev = st.st_dev;
+        uint32_t old = NONE;
+        for (size_t d = 0; cur.map && d < cur.h->ndirs && old == NONE; ++d) {
+            if (cur.dirs[d].parent == NONE && strcmp(cur.names + cur.dirs[d].name, roots[i]) == 0)
+                old = d;
+        }
+        snprintf(path, PATH_MAX, "%s", roots[i]);
+        walk(&b, path, strlen(path), NONE, roots[i], old);
+    }
+    free(path);
+    map_clear(&dirty);
+
+    view_t v;
+    bool ok = write_index(&b, index_path) && map_file(index_path, &v);
+    int err = errno;
+    view_t old = cur;
+    pthread_mutex_lock(&lock);
+    if (ok) cur = v;
+    if (ok) {
+        snprintf(line, sizeof(line), "index: %zu names in %zu dirs, %zu read, %zu unchanged, %.2fs",
+            b.nentries, b.ndirs, b.read, b.reused, (now_ms() - start) / 1000.0);
+    }
+    else {
+        snprintf(line, sizeof(line), "index: couldn't write %s: %s",
+            index_path, strerror(err));
+    }
+    // the ones after inotify said something changed go by quietly
+    reported = ok && !full;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    if (ok && old.map) munmap(old.map, old.sz);
+
+    free(b.dirs);
+    free(b.entries);
+    free(b.names);
+}
+
+// block until something changed under a watched dir, and then until
+// things have been quiet for a while. true if every dir has to be
+// looked at again
+static bool
+wait_changes(void)
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool full = false, any = false;
+    int64_t first = 0;
+    for (;;) {
+        struct pollfd p = { .fd = ino, .events = POLLIN };
+        int ms = !any? -1 : INDEX_QUIET_MS;
+        if (any && now_ms() - first > INDEX_QUIET_MS * 10) break;
+        int res = poll(&p, 1, ms);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) break;
+
+        ssize_t n = read(ino, buf, sizeof(buf));
+        if (n <= 0) continue;
+        if (!any) first = now_ms();
+        any = true;
+        for (char *c = buf; c < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event*) c;
+            c += sizeof(*ev) + ev->len;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_MOVE_SELF)) {
+                full = true;
+                continue;
+            }
+            if (ev->wd < 0 || (size_t) ev->wd >= nwd_paths || !wd_paths[ev->wd])
+                continue;
+            char *dir = wd_paths[ev->wd];
+            map_put(&dirty, dir, 1);
+            if (ev->mask & IN_IGNORED) {
+                // gone, a dir made there again gets a watch of its own
+                map_put(&watched, dir, -1);
+                free(dir);
+                wd_paths[ev->wd] = NULL;
+                nwatches--;
+            }
+        }
+    }
+    if (full) unwatch_all();
+    return full;
+}
+
+static void *
+index_thread(void *arg)
+{
+    (void) arg;
+    ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    bool full = true;
+    for (;;) {
+        refresh(full);
+        // without inotify the index is as fresh as the start of mfm
+        if (ino < 0) break;
+        full = wait_changes();
+    }
+    return NULL;
+}
+
+// full path of entry e, dirs ending in '/'. its length
+static size_t
+entry_path(const view_t *v, uint32_t e, char *buf, size_t sz)
+{
+    const char *parts[256];
+    size_t n = 0;
+    const entry_rec_t *er = &v->entries[e];
+    parts[n++] = v->names + er->name;
+    for (uint32_t d = er->dir; d != NONE && d < v->h->ndirs && n < 256; d = v->dirs[d].parent)
+        parts[n++] = v->names + v->dirs[d].name;
+
+    size_t len = 0;
+    for (size_t i = n; i-- > 0 && len < sz; ) {
+        bool slash = i + 1 < n && !(len == 1 && buf[0] == '/');
+        len += snprintf(buf + len, sz - len, "%s%s", slash? "/" : "", parts[i]);
+    }
+    if (er->child != NONE && len < sz)
+        len += snprintf(buf + len, sz - len, "/");
+    return (len < sz)? len : sz - 1;
+}
+
+bool
+index_start(void)
+{
+    char *env = getenv("MFM_INDEX");
+    char *home = getenv("HOME");
+    if (!env || !*env || !home) return false;
+
+    char *list = strdup(env);
+    for (char *tok = strtok(list, ":"); tok; tok = strtok(NULL, ":")) {
+        char real[PATH_MAX];
+        if (!realpath(tok, real)) continue;
+        roots = realloc(roots, (nroots + 1) * sizeof(char*));
+        roots[nroots++] = strdup(real);
+    }
+    free(list);
+    if (!nroots) return false;
+
+    index_path = malloc(PATH_MAX);
+    snprintf(index_path, PATH_MAX, "%s/.mfmindex", home);
+    wake_open(&wake);
+    // the last one answers queries until the refresh is done
+    map_file(index_path, &cur);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    bool ok = pthread_create(&thread, &attr, index_thread, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    return ok;
+}
+
+int
+index_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+index_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+    snprintf(buf, sz, "%s", line);
+    bool finished = !reported;
+    reported = true;
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
+
+static int
+compare_matches(const void *a, const void *b)
+{
+    const match_t *x = a, *y = b;
+    if (x->rank != y->rank) return x->rank - y->rank;
+    if (x->len != y->len) return (x->len > y->len) - (x->len < y->len);
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+size_t
+index_query(const char *text, char **out, size_t max)
+{
+    size_t len = strlen(text);
+    if (!len || !max) return 0;
+    pthread_mutex_lock(&lock);
+    if (!cur.map) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    // the rarest trigram has the fewest names to go over. shorter
+    // queries go over all of them
+    const uint8_t *p = NULL, *end = NULL;
+    if (len >= 3) {
+        uint32_t best = 0;
+        for (size_t i = 0; i + 3 <= len; ++i) {
+            uint32_t bk = bucket((const unsigned char*) text + i);
+            if (i == 0 || cur.counts[bk] < cur.counts[best]) best = bk;
+        }
+        p = cur.postings + cur.offs[best];
+        end = cur.postings + cur.offs[best + 1];
+    }
+
+    match_t *matches = malloc(INDEX_MAX_MATCHES * sizeof(match_t));
+    size_t n = 0;
+    uint32_t id = 0;
+    bool first = true;
+    for (size_t i = 0; n < INDEX_MAX_MATCHES; ++i) {
+        uint32_t e;
+        if (p) {
+            if (p >= end) break;
+            uint32_t gap = 0;
+            for (int shift = 0; p < end; shift += 7) {
+                gap |= (uint32_t) (*p & 0x7f) << shift;
+                if (!(*p++ & 0x80)) break;
+            }
+            // a name can be in a bucket twice, past the trigrams it
+            // was checked for
+            if (gap == 0 && !first) continue;
+            id += gap;
+            first = false;
+            e = id;
+        }
+        else {
+            if (i >= cur.h->nentries) break;
+            e = i;
+        }
+        if (e >= cur.h->nentries) break;
+
+        const char *name = cur.names + cur.entries[e].name;
+        if (!strcasestr(name, text)) continue;
+        size_t nlen = strlen(name);
+        int rank = (nlen == len)? 0 : (strncasecmp(name, text, len) == 0)? 1 : 2;
+        matches[n++] = (match_t) { e, rank, nlen };
+    }
+
+    qsort(matches, n, sizeof(match_t), compare_matches);
+    size_t res = 0;
+    char path[PATH_MAX];
+    for (size_t i = 0; i < n && res < max; ++i) {
+        entry_path(&cur, matches[i].entry, path, sizeof(path));
+        out[res++] = strdup(path);
+    }
+    pthread_mutex_unlock(&lock);
+    free(matches);
+    return res;
+}
@@ -0,0 +1,38 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// a locate style index of every name under the dirs in MFM_INDEX, colon
+// separated. it lives in ~/.mfmindex and is mapped rather than read:
+// dirs, names, and for every bucket of trigrams the names that have one
+// of them, delta encoded. a query only goes over the names in the bucket
+// of its rarest trigram.
+//
+// it's brought up to date on a thread of its own. a dir whose mtime
+// hasn't changed keeps its names without being read, and while mfm runs
+// inotify says which dirs changed, so the ones watched aren't even
+// stated. a new index is written next to the old one and renamed over it
+
+#define INDEX_BUCKET_BITS 18
+#define INDEX_BUCKETS (1 << INDEX_BUCKET_BITS)
+#define INDEX_MAX_WATCHES 65536
+#define INDEX_QUIET_MS 2000       // changes settle this long before a refresh
+#define INDEX_MAX_MATCHES 4096    // names looked at per query, at most
+#define INDEX_MAX_RESULTS 256
+
+// map the index and keep it up to date from now on. false if MFM_INDEX
+// isn't set
+bool index_start(void);
+// fd that becomes readable on progress and when a refresh is over
+int index_fd(void);
+// one line describing the last refresh. true once after the first one
+// and after any that failed
+bool index_progress(char *buf, size_t sz);
+// full paths of up to max names that contain text in any case, dirs
+// ending in '/'. whole names first, then names starting with it. the
+// paths are malloc'd
+size_t index_query(const char *text, char **out, size_t max);
+
+#endif
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "wake.h"
+
+// the records, each ending in a nul. paths go last, they can have
+// anything but a nul in them
+//   J <kind> <npaths> <dest>
+//   P <path>                                 npaths of them
+//   C <off> <len> <crc> <mtime> <dst>        a chunk of dst went in
+//   F <size> <mtime> <dst>                   dst is all there
+
+typedef struct slot_t {
+    char *dst;
+    journal_rec_t rec;
+} slot_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd = -1;  // locked while a job is written down
+static char *buf = NULL;  // records not written yet, under lock
+static size_t buf_sz = 0, buf_alloc = 0;
+static int64_t last_flush = 0;
+
+// the loaded job, only read while one runs
+static slot_t *slots = NULL;
+static size_t nslots = 0, slots_alloc = 0;
+static off_t valid = 0;  // where the last whole record ends
+
+static bool journal_file(char *file, size_t sz);
+static int open_locked(int flags);
+static uint32_t hash_path(const char *s);
+static slot_t *find_slot(const char *dst, bool add);
+static void free_slots(void);
+static void append(const char *fmt, ...);
+static void flush(bool force);
+
+static bool
+journal_file(char *file, size_t sz)
+{
+    char *home = getenv("HOME");
+    if (!home) return false;
+    snprintf(file, sz, "%s/.mfmjournal", home);
+    return true;
+}
+
+static int
+open_locked(int flags)
+{
+    char file[PATH_MAX];
+    if (!journal_file(file, sizeof(file))) return -1;
+    int res = open(file, flags | O_CLOEXEC, 0600);
+    if (res < 0) return -1;
+    if (flock(res, LOCK_EX | LOCK_NB) < 0) {
+        close(res);
+        return -1;
+    }
+    return res;
+}
+
+static uint32_t
+hash_path(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) h = (h ^ (unsigned char) *s) * 16777619u;
+    return h;
+}
+
+static slot_t *
+find_slot(const char *dst, bool add)
+{
+    if (!add && !nslots) return NULL;
+    if (add && (nslots + 1) * 2 > slots_alloc) {
+        size_t alloc = slots_alloc? slots_alloc*2 : 1024;
+        slot_t *grown = calloc(alloc, sizeof(slot_t));
+        for (size_t i = 0; i < slots_alloc; ++i) {
+            if (!slots[i].dst) continue;
+            size_t k = hash_path(slots[i].dst) & (alloc - 1);
+            while (grown[k].dst) k = (k + 1) & (alloc - 1);
+            grown[k] = slots[i];
+        }
+        free(slots);
+        slots = grown;
+        slots_alloc = alloc;
+    }
+    size_t k = hash_path(dst) & (slots_alloc - 1);
+    for (; slots[k].dst; k = (k + 1) & (slots_alloc - 1)) {
+        if (strcmp(slots[k].dst, dst) == 0) return &slots[k];
+    }
+    if (!add) return NULL;
+    slots[k].dst = strdup(dst);
+    slots[k].rec = (journal_rec_t) { .state = JOURNAL_NONE };
+    nslots++;
+    return &slots[k];
+}
+
+static void
+free_slots(void)
+{
+    for (size_t i = 0; i < slots_alloc; ++i)
+        free(slots[i].dst);
+    free(slots);
+    slots = NULL;
+    nslots = slots_alloc = 0;
+}
+
+// called with the lock held
+static void
+append(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (buf_sz + n + 1 > buf_alloc) {
+        while (buf_sz + n + 1 > buf_alloc)
+            buf_alloc = buf_alloc? buf_alloc*2 : 64 * 1024;
+        buf = realloc(buf, buf_alloc);
+    }
+    va_start(ap, fmt);
+    vsnprintf(buf + buf_sz, n + 1, fmt, ap);
+    va_end(ap);
+    // the nul goes in too, it's what ends a record
+    buf_sz += n + 1;
+}
+
+// called with the lock held, which it lets go of. the records written
+// in one go are synced in one go
+static void
+flush(bool force)
+{
+    int64_t now = now_ms();
+    if (fd < 0 || !buf_sz || (!force && now - last_flush < JOURNAL_FLUSH_MS)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    last_flush = now;
+    size_t off = 0;
+    while (off < buf_sz) {
+        ssize_t n = write(fd, buf + off, buf_sz - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    buf_sz = 0;
+    int sync_fd = fd;
+    pthread_mutex_unlock(&lock);
+    fdatasync(sync_fd);
+}
+
+bool
+journal_load(int *kind, char **dest, char ***paths, size_t *npaths)
+{
+    int in = open_locked(O_RDONLY);
+    if (in < 0) return false;
+    struct stat st;
+    char *data = NULL;
+    ssize_t sz = 0;
+    if (fstat(in, &st) == 0 && st.st_size > 0) {
+        data = malloc(st.st_size + 1);
+        sz = read(in, data, st.st_size);
+    }
+    close(in);
+    if (sz <= 0) {
+        free(data);
+        return false;
+    }
+
+    free_slots();
+    *dest = NULL;
+    *paths = NULL;
+    size_t want = 0, have = 0;
+    valid = 0;
+    for (char *rec = data; rec < data + sz; ) {
+        char *end = memchr(rec, '\0', data + sz - rec);
+        if (!end) break;  // cut short
+        unsigned long long off, len, size;
+        unsigned long crc;
+        long long mtime;
+        int k, n = -1;
+        if (rec[0] == 'J' && !*dest
+                && sscanf(rec, "J %d %zu %n", &k, &want, &n) == 2 && n > 0) {
+            *kind = k;
+            *dest = strdup(rec + n);
+            *paths = calloc(want + 1, sizeof(char*));
+        }
+        else if (rec[0] == 'P' && *dest && have < want && rec[1] == ' ') {
+            (*paths)[have++] = strdup(rec + 2);
+        }
+        else if (rec[0] == 'C' && sscanf(rec, "C %llu %llu %lu %lld %n",
+                &off, &len, &crc, &mtime, &n) == 4 && n > 0) {
+            slot_t *s = find_slot(rec + n, true);
+            s->rec = (journal_rec_t) {
+                .state = JOURNAL_PARTIAL,
+                .off = off, .len = len, .crc = crc, .mtime = mtime,
+            };
+        }
+        else if (rec[0] == 'F' && sscanf(rec, "F %llu %lld %n", &size, &mtime, &n) == 2
+                && n > 0) {
+            slot_t *s = find_slot(rec + n, true);
+            s->rec = (journal_rec_t) {
+                .state = JOURNAL_DONE, .size = size, .mtime = mtime,
+            };
+        }
+        rec = end + 1;
+        valid = rec - data;
+    }
+    free(data);
+
+    // a job whose paths didn't all make it in never got started
+    if (!*dest || have < want || !want) {
+        for (size_t i = 0; i < have; ++i)
+            free((*paths)[i]);
+        free(*paths);
+        free(*dest);
+        free_slots();
+        return false;
+    }
+    *npaths = want;
+    return true;
+}
+
+bool
+journal_begin(int kind, const char *dest, char **paths, size_t npaths, bool resume)
+{
+    pthread_mutex_lock(&lock);
+    fd = open_locked(O_WRONLY | O_CREAT | O_APPEND);
+    buf_sz = 0;
+    last_flush = now_ms();
+    if (fd < 0) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    // whatever came after the last whole record goes, then new ones go
+    // after it
+    if (resume && ftruncate(fd, valid) == 0) {
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+    free_slots();
+    if (ftruncate(fd, 0) < 0) {
+        close(fd);
+        fd = -1;
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    append("J %d %zu %s", kind, npaths, dest);
+    for (size_t i = 0; i < npaths; ++i)
+        append("P %s", paths[i]);
+    flush(true);
+    return true;
+}
+
+void
+journal_chunk(const char *dst, uint64_t off, uint64_t len, uint32_t crc, int64_t mtime)
+{
+    pthread_mutex_lock(&lock);
+    if (fd >= 0) {
+        append("C %llu %llu %lu %lld %s", (unsigned long long) off,
+            (unsigned long long) len, (unsigned long) crc, (long long) mtime, dst);
+    }
+    flush(false);
+}
+
+void
+journal_done(const char *dst, uint64_t size, int64_t mtime)
+{
+    pthread_mutex_lock(&lock);
+    if (fd >= 0) {
+        append("F %llu %lld %s", (unsigned long long) size, (long long) mtime, dst);
+    }
+    flush(false);
+}
+
+bool
+journal_active(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = fd >= 0;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+journal_rec_t
+journal_lookup(const char *dst)
+{
+    slot_t *s = find_slot(dst, false);
+    return s? s->rec : (journal_rec_t) { .state = JOURNAL_NONE };
+}
+
+void
+journal_end(bool finished)
+{
+    pthread_mutex_lock(&lock);
+    flush(true);
+    pthread_mutex_lock(&lock);
+    char file[PATH_MAX];
+    if (fd >= 0 && finished && journal_file(file, sizeof(file)))
+        unlink(file);
+    if (fd >= 0) close(fd);
+    fd = -1;
+    free_slots();
+    valid = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,49 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// what copies and moves got done, so one that was cut short can pick
+// up where it stopped. it lives in ~/.mfmjournal: the job, then a record
+// for every file finished and now and then one for how far into a big
+// file the copy is, with the checksum of the chunk that got it there.
+// records are appended and only count once their terminating nul is
+// in, so one half written when things died is left out. they're synced
+// in batches, at most JOURNAL_FLUSH_MS apart.
+//
+// only one mfm writes it at a time, the others copy without it
+
+#define JOURNAL_FLUSH_MS 1000
+
+enum {
+    JOURNAL_NONE,
+    JOURNAL_PARTIAL,  // off and len are the last chunk that went in
+    JOURNAL_DONE,
+};
+
+typedef struct journal_rec_t {
+    int state;
+    uint64_t off, len;
+    uint32_t crc;
+    uint64_t size;   // JOURNAL_DONE
+    int64_t mtime;   // of the source when it was copied, ns
+} journal_rec_t;
+
+// read what a job that didn't finish left behind. dest and paths are
+// malloc'd, and what it got done is kept for journal_lookup. false if
+// there's no such job or another mfm is at it
+bool journal_load(int *kind, char **dest, char ***paths, size_t *npaths);
+// write a job down from now on. resuming keeps what was loaded. false
+// if the journal can't be had, nothing is written then
+bool journal_begin(int kind, const char *dest, char **paths, size_t npaths, bool resume);
+void journal_chunk(const char *dst, uint64_t off, uint64_t len, uint32_t crc, int64_t mtime);
+void journal_done(const char *dst, uint64_t size, int64_t mtime);
+bool journal_active(void);
+// what the loaded job got done of dst
+journal_rec_t journal_lookup(const char *dst);
+// the job is over. one that finished leaves nothing to resume
+void journal_end(bool finished);
+
+#endif
@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mstring.h"
+#include "mlist.h"
+#include "mfile.h"
+#include "mfm.h"
+#include "jump.h"
+
+// on-disk layout, native endianness:
+//   header | record[count] | paths
+typedef struct header_t {
+    uint32_t magic, version;
+    uint32_t count, paths_sz;
+} header_t;
+
+typedef struct record_t {
+    int64_t last;
+    uint32_t hits;
+    uint32_t path_off, path_sz;
+    uint32_t flags;
+} record_t;
+
+#define FLAG_BOOKMARK 1
+
+static bool jump_file(char *file, size_t sz, char *name);
+static uint64_t char_bit(char c);
+static uint64_t path_mask(const char *s, size_t sz);
+static int find_path(jump_t *j, string_t path);
+static int add_path(jump_t *j, const char *path, size_t sz);
+static void import_mbm(jump_t *j);
+static double frecency(jump_entry_t *e, int64_t now);
+static int fuzzy_score(jump_entry_t *e, string_t query);
+static void drop_stale(jump_t *j);
+
+static bool
+jump_file(char *file, size_t sz, char *name)
+{
+    char *home = getenv("HOME");
+    if (!home) return false;
+    snprintf(file, sz, "%s/%s", home, name);
+    return true;
+}
+
+static uint64_t
+char_bit(char c)
+{
+    c = tolower((unsigned char) c);
+    if (c >= 'a' && c <= 'z') return 1ull << (c - 'a');
+    if (c >= '0' && c <= '9') return 1ull << (26 + c - '0');
+    return 1ull << (36 + ((unsigned char) c % 28));
+}
+
+static uint64_t
+path_mask(const char *s, size_t sz)
+{
+    uint64_t mask = 0;
+    for (size_t i = 0; i < sz; ++i)
+        mask |= char_bit(s[i]);
+    return mask;
+}
+
+static int
+find_path(jump_t *j, string_t path)
+{
+    uint64_t mask = path_mask(path.data, path.size);
+    for (int i = 0; i < j->size; ++i) {
+        jump_entry_t *e = &j->data[i];
+        if (e->path_sz == path.size && e->mask == mask
+                && memcmp(e->path, path.data, path.size) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+add_path(jump_t *j, const char *path, size_t sz)
+{
+    jump_entry_t e = {0};
+    e.path = malloc(sz + 1);
+    memcpy(e.path, path, sz);
+    e.path[sz] = '\0';
+    e.path_sz = sz;
+    e.mask = path_mask(path, sz);
+    e.owned = true;
+    LIST_ADDP(j, j->size, e);
+    return j->size - 1;
+}
+
+// pick up the bookmarks of the old mbm setup, one path per line
+static void
+import_mbm(jump_t *j)
+{
+    char file[MAX_PATH_SZ];
+    if (!jump_file(file, sizeof(file), ".mbm")) return;
+
+    char *s = read_file(file);
+    if (!s) return;
+    if (strcmp(s, "NULL") != 0) {
+        char *line = s;
+        while (*line) {
+            char *end = strchr(line, '\n');
+            size_t sz = end? end - line : strlen(line);
+            while (sz > 1 && line[sz-1] == '/') --sz;
+            if (sz && line[0] == '/') {
+                string_t path = { .data = line, .size = sz, .alloc = sz };
+                if (find_path(j, path) < 0)
+                    j->data[add_path(j, line, sz)].bookmark = true;
+            }
+            if (!end) break;
+            line = end + 1;
+        }
+    }
+    free(s);
+}
+
+jump_t
+load_jump(void)
+{
+    jump_t j = (jump_t) LIST_ALLOC(jump_entry_t);
+    j.map = NULL;
+    j.map_sz = 0;
+
+    char file[MAX_PATH_SZ];
+    if (!jump_file(file, sizeof(file), ".mfmjump")) return j;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        import_mbm(&j);
+        return j;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(header_t)) {
+        close(fd);
+        return j;
+    }
+
+    char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return j;
+
+    header_t *hdr = (header_t*) map;
+    size_t paths = sizeof(header_t) + (size_t) hdr->count * sizeof(record_t);
+    if (hdr->magic != JUMP_MAGIC || hdr->version != JUMP_VERSION
+            || paths + hdr->paths_sz > sb.st_size) {
+        munmap(map, sb.st_size);
+        return j;
+    }
+    j.map = map;
+    j.map_sz = sb.st_size;
+
+    // paths stay in the map, we only build the in-memory records
+    record_t *rec = (record_t*) (map + sizeof(header_t));
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        if ((size_t) rec[i].path_off + rec[i].path_sz > hdr->paths_sz)
+            continue;
+        jump_entry_t e = {
+            .path = map + paths + rec[i].path_off,
+            .path_sz = rec[i].path_sz,
+            .hits = rec[i].hits,
+            .last = rec[i].last,
+            .bookmark = rec[i].flags & FLAG_BOOKMARK,
+            .owned = false,
+        };
+        e.mask = path_mask(e.path, e.path_sz);
+        LIST_ADD(j, j.size, e);
+    }
+    return j;
+}
+
+void
+save_jump(jump_t *j)
+{
+    char file[MAX_PATH_SZ], tmp[MAX_PATH_SZ+8];
+    if (!jump_file(file, sizeof(file), ".mfmjump")) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    drop_stale(j);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+
+    header_t hdr = {
+        .magic = JUMP_MAGIC,
+        .version = JUMP_VERSION,
+        .count = j->size,
+        .paths_sz = 0,
+    };
+    for (int i = 0; i < j->size; ++i)
+        hdr.paths_sz += j->data[i].path_sz;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    uint32_t off = 0;
+    for (int i = 0; i < j->size; ++i) {
+        jump_entry_t *e = &j->data[i];
+        record_t rec = {
+            .last = e->last,
+            .hits = e->hits,
+            .path_off = off,
+            .path_sz = e->path_sz,
+            .flags = e->bookmark? FLAG_BOOKMARK : 0,
+        };
+        fwrite(&rec, sizeof(rec), 1, fp);
+        off += e->path_sz;
+    }
+    for (int i = 0; i < j->size; ++i)
+        fwrite(j->data[i].path, 1, j->data[i].path_sz, fp);
+
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok) rename(tmp, file);
+    else unlink(tmp);
+}
+
+void
+free_jump(jump_t *j)
+{
+    for (int i = 0; i < j->size; ++i) {
+        if (j->data[i].owned) free(j->data[i].path);
+    }
+    LIST_FREEP(j);
+    if (j->map) munmap(j->map, j->map_sz);
+    j->map = NULL;
+}
+
+// keep the table bounded, forgetting the least useful directories first
+static void
+drop_stale(jump_t *j)
+{
+    if (j->size <= JUMP_MAX_ENTRIES) return;
+
+    int64_t now = time(NULL);
+    while (j->size > JUMP_MAX_ENTRIES) {
+        int worst = -1;
+        double worst_score = 0;
+        for (int i = 0; i < j->size; ++i) {
+            if (j->data[i].bookmark) continue;
+            double score = frecency(&j->data[i], now);
+            if (worst < 0 || score < worst_score) {
+                worst = i;
+                worst_score = score;
+            }
+        }
+        if (worst < 0) break;
+        if (j->data[worst].owned) free(j->data[worst].path);
+        j->data[worst] = j->data[j->size-1];
+        j->size--;
+    }
+}
+
+void
+jump_visit(jump_t *j, string_t path)
+{
+    int i = find_path(j, path);
+    if (i < 0) i = add_path(j, path.data, path.size);
+    j->data[i].hits++;
+    j->data[i].last = time(NULL);
+}
+
+bool
+jump_toggle_bookmark(jump_t *j, string_t path)
+{
+    int i = find_path(j, path);
+    if (i < 0) {
+        i = add_path(j, path.data, path.size);
+        j->data[i].last = time(NULL);
+    }
+    j->data[i].bookmark = !j->data[i].bookmark;
+    return j->data[i].bookmark;
+}
+
+static double
+frecency(jump_entry_t *e, int64_t now)
+{
+    int64_t age = now - e->last;
+    double weight;
+    if (age < 60*60)            weight = 4.0;
+    else if (age < 24*60*60)    weight = 2.0;
+    else if (age < 7*24*60*60)  weight = 0.5;
+    else                        weight = 0.25;
+    return e->hits * weight;
+}
+
+// subsequence match, case insensitive. matches right after a '/' and
+// consecutive runs score higher, and so do matches in the last component.
+// returns -1 if query isn't a subsequence of the path
+static int
+fuzzy_score(jump_entry_t *e, string_t query)
+{
+    const char *p = e->path;
+    size_t base = e->path_sz;
+    while (base > 0 && p[base-1] != '/') --base;
+
+    int score = 0, run = 0;
+    size_t qi = 0;
+    for (size_t i = 0; i < e->path_sz && qi < query.size; ++i) {
+        if (tolower((unsigned char) p[i]) != tolower((unsigned char) query.data[qi])) {
+            run = 0;
+            continue;
+        }
+        ++qi;
+        ++run;
+        score += 1 + run*2;
+        if (i == 0 || p[i-1] == '/') score += 8;
+        if (i >= base) score += 4;
+    }
+    return (qi == query.size)? score : -1;
+}
+
+size_t
+jump_query(jump_t *j, string_t query, int *res, size_t max)
+{
+    int64_t now = time(NULL);
+    uint64_t qmask = path_mask(query.data, query.size);
+    double scores[JUMP_MAX_RESULTS];
+    size_t n = 0;
+    if (max > JUMP_MAX_RESULTS) max = JUMP_MAX_RESULTS;
+
+    for (int i = 0; i < j->size; ++i) {
+        jump_entry_t *e = &j->data[i];
+        if ((e->mask & qmask) != qmask) continue;
+
+        double score;
+        if (query.size) {
+            int fuzzy = fuzzy_score(e, query);
+            if (fuzzy < 0) continue;
+            score = fuzzy * 4.0 + frecency(e, now);
+        }
+        else {
+            score = frecency(e, now);
+        }
+        if (e->bookmark) score += 1000.0;
+
+        // insert into the (small) sorted result list
+        if (n == max && score <= scores[n-1]) continue;
+        size_t k = (n < max)? n++ : n-1;
+        while (k > 0 && scores[k-1] < score) {
+            scores[k] = scores[k-1];
+            res[k] = res[k-1];
+            --k;
+        }
+        scores[k] = score;
+        res[k] = i;
+    }
+    return n;
+}
@@ -0,0 +1,43 @@
+#ifndef JUMP_H
+#define JUMP_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "mstring.h"
+
+#define JUMP_MAGIC 0x4a4d464d /* "MFMJ" */
+#define JUMP_VERSION 1
+#define JUMP_MAX_ENTRIES 65536
+#define JUMP_MAX_RESULTS 64
+
+// a directory we've been to, or a bookmark
+typedef struct jump_entry_t {
+    char *path;
+    uint32_t path_sz;
+    uint32_t hits;
+    int64_t last;    // last visit, unix time
+    uint64_t mask;   // which characters appear in path, for quick rejects
+    bool bookmark;
+    bool owned;      // path was malloc'd (otherwise it points into the map)
+} jump_entry_t;
+
+typedef struct jump_t {
+    jump_entry_t *data;
+    size_t size, alloc;
+    void *map;
+    size_t map_sz;
+} jump_t;
+
+jump_t load_jump(void);
+void save_jump(jump_t *j);
+void free_jump(jump_t *j);
+
+void jump_visit(jump_t *j, string_t path);
+// returns whether path is bookmarked afterwards
+bool jump_toggle_bookmark(jump_t *j, string_t path);
+// fuzzy match query against every path, best first. returns the number
+// of indices written to res
+size_t jump_query(jump_t *j, string_t query, int *res, size_t max);
+
+#endif
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include "launch.h"
+#include "fs.h"
+
+extern char **environ;
+
+typedef struct magic_t {
+    size_t offset, size;
+    const char *bytes;
+    const char *class;
+} magic_t;
+
+static const magic_t magics[] = {
+    { 0,   8, "\x89PNG\r\n\x1a\n",     "image"   },
+    { 0,   3, "\xff\xd8\xff",          "image"   },
+    { 0,   4, "GIF8",                  "image"   },
+    { 8,   4, "WEBP",                  "image"   },
+    { 0,   2, "BM",                    "image"   },
+    { 0,   4, "%PDF",                  "pdf"     },
+    { 0,   4, "\x1a\x45\xdf\xa3",      "video"   },
+    { 4,   4, "ftyp",                  "video"   },
+    { 8,   3, "AVI",                   "video"   },
+    { 0,   3, "ID3",                   "audio"   },
+    { 0,   4, "fLaC",                  "audio"   },
+    { 0,   4, "OggS",                  "audio"   },
+    { 8,   4, "WAVE",                  "audio"   },
+    { 0,   4, "PK\x03\x04",            "archive" },
+    { 0,   2, "\x1f\x8b",              "archive" },
+    { 0,   6, "\xfd\x37\x7a\x58\x5a\0", "archive" },
+    { 0,   4, "\x28\xb5\x2f\xfd",      "archive" },
+    { 0,   3, "BZh",                   "archive" },
+    { 0,   6, "7z\xbc\xaf\x27\x1c",    "archive" },
+    { 257, 5, "ustar",                 "archive" },
+    { 0,   4, "\x7f""ELF",             "exec"    },
+};
+
+// sniffing is cheap but not free, remember the result per inode
+typedef struct sniff_t {
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+    off_t size;
+    const char *class;
+    bool used;
+} sniff_t;
+
+static sniff_t sniff_cache[SNIFF_CACHE_SZ];
+
+static const char *sniff(int fd);
+static bool looks_like_text(const unsigned char *buf, size_t sz);
+static int spawn_in(pid_t *pid, char **argv, const char *cwd, posix_spawnattr_t *attr);
+
+char **
+split_args(const char *cmd, size_t extra, size_t *argc)
+{
+    size_t alloc = extra + 4, n = 0;
+    char **argv = malloc(alloc * sizeof(char*));
+    const char *p = cmd? cmd : "";
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t') ++p;
+        if (!*p) break;
+
+        char *arg = malloc(strlen(p) + 1);
+        size_t sz = 0;
+        char quote = 0;
+        for (; *p; ++p) {
+            if (quote) {
+                if (*p == quote) quote = 0;
+                else arg[sz++] = *p;
+            }
+            else if (*p == '\'' || *p == '"') {
+                quote = *p;
+            }
+            else if (*p == ' ' || *p == '\t') {
+                break;
+            }
+            else {
+                arg[sz++] = *p;
+            }
+        }
+        arg[sz] = '\0';
+
+        if (n + extra + 1 >= alloc) {
+            alloc *= 2;
+            argv = realloc(argv, alloc * sizeof(char*));
+        }
+        argv[n++] = arg;
+    }
+    argv[n] = NULL;
+    if (argc) *argc = n;
+    return argv;
+}
+
+void
+free_args(char **argv)
+{
+    for (char **a = argv; *a; ++a)
+        free(*a);
+    free(argv);
+}
+
+// start argv[0] from the PATH in cwd, mfm's own cwd stays put. 0 or
+// the errno of what went wrong, chdir included
+static int
+spawn_in(pid_t *pid, char **argv, const char *cwd, posix_spawnattr_t *attr)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (cwd) posix_spawn_file_actions_addchdir_np(&actions, cwd);
+    int err = posix_spawnp(pid, argv[0], &actions, attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+#else
+    // the child writes down why it didn't get to exec, the pipe closing
+    // on exec says it did
+    (void) attr;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return errno;
+    pid_t child = fork();
+    if (child < 0) {
+        int err = errno;
+        close(fds[0]);
+        close(fds[1]);
+        return err;
+    }
+    if (child == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        int err = 0;
+        if (cwd && chdir(cwd) < 0) err = errno;
+        else {
+            execvp(argv[0], argv);
+            err = errno;
+        }
+        if (write(fds[1], &err, sizeof(err)) < 0) {
+            // nothing left to tell it with
+        }
+        _exit(127);
+    }
+    close(fds[1]);
+    int err = 0;
+    ssize_t n;
+    while ((n = read(fds[0], &err, sizeof(err))) < 0 && errno == EINTR);
+    close(fds[0]);
+    if (n == sizeof(err)) {
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR);
+        return err;
+    }
+    *pid = child;
+    return 0;
+#endif
+}
+
+int
+spawn_cmd(const char *cmd, const char *arg, const char *cwd)
+{
+    size_t argc;
+    char **argv = split_args(cmd, 1, &argc);
+    if (arg) {
+        argv[argc++] = strdup(arg);
+        argv[argc] = NULL;
+    }
+    if (!argc) {
+        free_args(argv);
+        return -1;
+    }
+
+    // same as system(): the child gets ^C, we don't
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old_int, old_quit;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGINT);
+    sigaddset(&def, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid = -1;
+    int status = -1;
+    int err = spawn_in(&pid, argv, cwd, &attr);
+    if (!err) {
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                err = errno;
+                status = -1;
+                break;
+            }
+        }
+        if (status >= 0)
+            status = WIFEXITED(status)? WEXITSTATUS(status) : -1;
+    }
+
+    posix_spawnattr_destroy(&attr);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    free_args(argv);
+    if (err) errno = err;
+    return status;
+}
+
+static bool
+looks_like_text(const unsigned char *buf, size_t sz)
+{
+    for (size_t i = 0; i < sz; ++i) {
+        unsigned char c = buf[i];
+        if (c == 0) return false;
+        if (c < 0x20 && c != '\n' && c != '\r' && c != '\t'
+                && c != '\f' && c != 0x1b)
+            return false;
+    }
+    return true;
+}
+
+static const char *
+sniff(int fd)
+{
+    unsigned char buf[SNIFF_SZ];
+    ssize_t sz = pread(fd, buf, sizeof(buf), 0);
+    if (sz < 0) return NULL;
+    if (sz == 0) return "text";
+
+    for (size_t i = 0; i < sizeof(magics) / sizeof(*magics); ++i) {
+        const magic_t *m = &magics[i];
+        if (m->offset + m->size <= sz
+                && memcmp(buf + m->offset, m->bytes, m->size) == 0)
+            return m->class;
+    }
+    if (sz >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0)
+        return "audio";
+    return looks_like_text(buf, sz)? "text" : NULL;
+}
+
+const char *
+file_class(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    int64_t mtime = fs_mtime(&sb);
+    sniff_t *c = &sniff_cache[(sb.st_ino ^ sb.st_dev) % SNIFF_CACHE_SZ];
+    if (c->used && c->dev == sb.st_dev && c->ino == sb.st_ino
+            && c->mtime == mtime && c->size == sb.st_size) {
+        close(fd);
+        return c->class;
+    }
+
+    const char *class = sniff(fd);
+    close(fd);
+    *c = (sniff_t) {
+        .dev = sb.st_dev, .ino = sb.st_ino,
+        .mtime = mtime, .size = sb.st_size,
+        .class = class, .used = true,
+    };
+    return class;
+}
+
+// $MFM_OPEN_<CLASS> picks the opener for each class, text falls back to
+// $EDITOR. xdg-open is only used for things we know nothing about
+const char *
+file_opener(const char *path)
+{
+    const char *class = file_class(path);
+    char var[64];
+    const char *cmd = NULL;
+
+    if (class) {
+        size_t i = snprintf(var, sizeof(var), "MFM_OPEN_");
+        for (const char *c = class; *c && i < sizeof(var)-1; ++c)
+            var[i++] = toupper((unsigned char) *c);
+        var[i] = '\0';
+        cmd = getenv(var);
+        if (!cmd && strcmp(class, "text") == 0) {
+            cmd = getenv("EDITOR");
+            if (!cmd) cmd = "vi";
+        }
+    }
+    if (!cmd) cmd = getenv("MFM_OPEN");
+    return cmd? cmd : "xdg-open";
+}
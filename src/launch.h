@@ -0,0 +1,25 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <stdlib.h>
+
+#define SNIFF_SZ 512
+#define SNIFF_CACHE_SZ 256
+
+// split cmd into an argv on whitespace, honouring simple quotes.
+// leaves room for extra more arguments before the terminating NULL
+char **split_args(const char *cmd, size_t extra, size_t *argc);
+void free_args(char **argv);
+
+// run cmd (plus arg, if any) in cwd without going through a shell and
+// wait for it. with no cmd, arg is run on its own. returns the exit
+// status, or -1 with errno set if it couldn't be started (cwd
+// included). mfm's own cwd isn't touched
+int spawn_cmd(const char *cmd, const char *arg, const char *cwd);
+
+// "text", "image", "video", "audio", "pdf", "archive", "exec" or NULL
+const char *file_class(const char *path);
+// command line to open path with, decided from its contents
+const char *file_opener(const char *path);
+
+#endif
@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ncurses.h>
@@ -9,7 +14,29 @@
 #include "mlist.h"
 #include "mstring.h"
 #include "mfile.h"
+#include "mexec.h"
 #include "mfm.h"
+#include "session.h"
+#include "jump.h"
+#include "launch.h"
+#include "fs.h"
+#include "git.h"
+#include "dupes.h"
+#include "archive.h"
+#include "pack.h"
+#include "perms.h"
+#include "sync.h"
+#include "grep.h"
+#include "compare.h"
+#include "ops.h"
+#include "index.h"
+#include "pick.h"
+#include "tree.h"
+#include "bigdir.h"
+#include "colors.h"
+#include "columns.h"
+#include "control.h"
+#include "vfs.h"
 
 #define OFFSET 2
 #define SCROLL_OFFSET 4
@@ -26,6 +53,7 @@ enum {
     PAIR_DIR_SEL,
     PAIR_INPUT,
     PAIR_INPUT_SEL,
+    PAIR_STYLES,  // file colours, two pairs each from here on
 };
 
 enum {
@@ -35,8 +63,23 @@ enum {
     MODE_CREATE,
     MODE_DELETE,
     MODE_OPEN,
+    MODE_JUMP,
+    MODE_FILTER,
+    MODE_PACK,
+    MODE_PERMS,
+    MODE_PERMS_CONFIRM,
+    MODE_SYNC,
+    MODE_GREP,
+    MODE_COMPARE,
+    MODE_TREE,
+    MODE_LOCATE,
 };
 
+// an archive member copied out so something can open it
+typedef struct member_copy_t {
+    char *src, *dir, *file;
+} member_copy_t;
+
 typedef struct input_t {
     string_t text;
     int cursor;
@@ -48,6 +91,27 @@ static int mode = MODE_NORMAL;
 static int last_mode = MODE_NORMAL;
 static int win_w = 0, win_h = 0;
 static char status[1024];
+static session_t session;
+static jump_t jumps;
+static int jump_res[JUMP_MAX_RESULTS];
+static size_t jump_count = 0;
+static int jump_sel = 0;
+static bool indexing = false;
+static char *locate_res[INDEX_MAX_RESULTS];
+static size_t locate_count = 0;
+static int locate_sel = 0;
+static char select_name[MAX_PATH_SZ];
+static bool remote_quit = false;
+static int pick_fd = -1;  // where --pick writes the picked paths
+static tree_t tree;  // kept when leaving the tree view, for coming back
+static size_t tree_pos = 0, tree_off = 0;
+static const char grep_title[] = "[grep]";
+static grep_hits_t grep_all;  // what the grep listing is made of
+static char compare_mark[MAX_PATH_SZ];  // dir to compare with, 'm' sets it
+// marks of the compare listing, one per COMPARE_* tag
+static const char compare_marks[COMPARE_TAGS] = { ' ', '<', '>', '~', '!' };
+static member_copy_t *copies = NULL;
+static size_t ncopies = 0;
 
 #define STATUS(fmt, ...) {\
         sprintf(status, fmt, __VA_ARGS__); \
@@ -59,17 +123,27 @@ static char status[1024];
 
 static void init_curses();
 static void deinit_curses();
+static void suspend_curses();
+static void resume_curses();
+static void run(files_t *f, const char *cmd, const char *arg);
+static const char *copy_member(files_t *f, const char *name);
+static void remove_copies(void);
 static void quit(files_t *f);
 static void render_files(files_t *f);
 static void update_files(files_t *f);
 static bool update_input(files_t *f);
 static void render_status(files_t *f);
 static void render_input(files_t *f, char *prompt);
+static void render_jump(files_t *f);
+static void render_locate(files_t *f);
+static bool wait_events(files_t *f);
+static double elapsed_ms(struct timespec *start);
 
 static bool search_in_file_name(string_t file, string_t str);
 static bool search_in_range(files_t *f, string_t file, int start, int end);
 static bool search_files(files_t *f, string_t file);
 static bool search_files_back(files_t *f, string_t file);
+static bool search_window(files_t *f, string_t file, bool back);
 
 static void update_mode_normal(files_t *f);
 static void update_mode_search(files_t *f);
@@ -77,6 +151,16 @@ static void update_mode_rename(files_t *f);
 static void update_mode_create(files_t *f);
 static void update_mode_delete(files_t *f);
 static void update_mode_open(files_t *f);
+static void update_mode_jump(files_t *f);
+static void update_mode_locate(files_t *f);
+static void query_locate(void);
+static void update_mode_filter(files_t *f);
+static void update_mode_pack(files_t *f);
+static void update_mode_perms(files_t *f);
+static void update_mode_perms_confirm(files_t *f);
+static void update_mode_sync(files_t *f);
+static void update_mode_grep(files_t *f);
+static void update_mode_compare(files_t *f);
 
 static void set_pos(files_t *f, int i);
 static void move_up(files_t *f);
@@ -86,17 +170,43 @@ static void scroll_up(files_t *f);
 static void scroll_down(files_t *f);
 static void prev_dir(files_t *f);
 static void next_dir(files_t *f);
+static void restore_cursor(files_t *f);
+static void entered_dir(files_t *f);
+static void change_dir(files_t *f, char *path);
 
 static void open_file(files_t *f);
+static void pick(files_t *f);
 static void stat_file(files_t *f);
 static void edit_file(files_t *f);
 static void chmod_file(files_t *f);
 static void shell(files_t *f);
-static void bookmarks(files_t *f);
+static void bookmark_dir(files_t *f);
+static void find_dupes(files_t *f);
+static void show_dupes(files_t *f);
+static void link_dupes(files_t *f, bool reflink);
+static void start_pack(files_t *f);
+static void show_pack(files_t *f);
+static const char *pack_to(files_t *f, const char *name);
+static bool path_entry(files_t *f, const char *arg, entry_t *e);
+static void reply_path(control_reply_t *r, entry_t e);
+static void control_command(void *data, char *cmd, char *arg, control_reply_t *r);
+static void start_perms(files_t *f);
+static void show_perms(files_t *f);
+static void show_sync(files_t *f);
+static void show_grep(files_t *f);
+static bool open_hit(files_t *f);
+static void relative_path(const char *from, const char *to, char *buf, size_t sz);
+static void show_compare(files_t *f);
+static void show_ops(files_t *f);
+static void render_tree(files_t *f);
+static void tree_follow(void);
+static void enter_tree(files_t *f);
+static void update_mode_tree(files_t *f);
 
 static void select_file(files_t *f);
 static void select_all(files_t *f);
 static int file_executable(entry_t e);
+static char git_marker(entry_t e);
 static int file_selected(entry_t e);
 
 static void
@@ -117,6 +227,90 @@ init_curses()
     init_pair(PAIR_HEADER,    COLOR_RED,   COLOR_BLACK);
     init_pair(PAIR_INPUT,     COLOR_WHITE, COLOR_BLACK);
     init_pair(PAIR_INPUT_SEL, COLOR_BLACK, COLOR_WHITE);
+    colors_init_pairs(PAIR_STYLES);
+}
+
+// wait for a key or for the worker to hand over a listing. returns true
+// if there's a key to read
+static bool
+wait_events(files_t *f)
+{
+    // curses may already hold input it read ahead
+    timeout(0);
+    int ch = getch();
+    timeout(-1);
+    if (ch != ERR) {
+        ungetch(ch);
+        return true;
+    }
+
+    // the control socket and its clients come after the fixed ones
+    struct pollfd fds[12 + CONTROL_MAX_CLIENTS + 1] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = fs_fd(),      .events = POLLIN },
+        { .fd = dupes_fd(),   .events = POLLIN },
+        { .fd = pack_fd(),    .events = POLLIN },
+        { .fd = bigdir_fd(),  .events = POLLIN },
+        { .fd = perms_fd(),   .events = POLLIN },
+        { .fd = sync_fd(),    .events = POLLIN },
+        { .fd = grep_fd(),    .events = POLLIN },
+        { .fd = compare_fd(), .events = POLLIN },
+        { .fd = ops_fd(),     .events = POLLIN },
+        { .fd = tree_fd(),    .events = POLLIN },
+        { .fd = indexing? index_fd() : -1, .events = POLLIN },
+    };
+    // keep ticking while something is pending so it can time out
+    int ms = (f->state == LIST_PENDING)? 100 : -1;
+    size_t nfds = 12 + control_pollfds(fds + 12, CONTROL_MAX_CLIENTS + 1);
+    poll(fds, nfds, ms);
+
+    if (poll_entries(f) && f->entered && f->state != LIST_PENDING)
+        entered_dir(f);
+    if (fds[2].revents & POLLIN)
+        show_dupes(f);
+    if (fds[3].revents & POLLIN)
+        show_pack(f);
+    if (fds[4].revents & POLLIN) {
+        int res = poll_window(f);
+        if (res == WINDOW_JUMPED) {
+            scroll_center(f);
+        }
+        else if (res == WINDOW_MISSED) {
+            STATUS("couldn't find "STR_FMT, STR_ARG(input.text));
+        }
+    }
+    if (fds[5].revents & POLLIN)
+        show_perms(f);
+    if (fds[6].revents & POLLIN)
+        show_sync(f);
+    if (fds[7].revents & POLLIN)
+        show_grep(f);
+    if (fds[8].revents & POLLIN)
+        show_compare(f);
+    if (fds[9].revents & POLLIN)
+        show_ops(f);
+    if ((fds[10].revents & POLLIN) && tree_poll(&tree, &tree_pos))
+        tree_follow();
+    if (fds[11].revents & POLLIN) {
+        char line[256];
+        if (index_progress(line, sizeof(line)))
+            STATUS("%s", line);
+    }
+    if (control_serve(fds + 12, nfds - 12, control_command, f) && remote_quit) {
+        deinit_curses();
+        quit(f);
+        exit(0);
+    }
+    return fds[0].revents & POLLIN;
+}
+
+static double
+elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3
+        + (now.tv_nsec - start->tv_nsec) / 1e6;
 }
 
 static void
@@ -126,14 +320,138 @@ deinit_curses()
     curs_set(1);
 }
 
+// leave the terminal to a child without tearing curses down
+static void
+suspend_curses()
+{
+    def_prog_mode();
+    endwin();
+}
+
+static void
+resume_curses()
+{
+    reset_prog_mode();
+    refresh();
+}
+
+static void
+run(files_t *f, const char *cmd, const char *arg)
+{
+    // archive members are opened from a copy
+    const char *cwd = f->dir;
+    if (f->in_archive && arg && arg[0] != '/') {
+        if (!(cwd = copy_member(f, arg))) return;
+    }
+
+    suspend_curses();
+    errno = 0;
+    int res = spawn_cmd(cmd, arg, cwd);
+    int err = errno;
+    resume_curses();
+    if (res < 0 && err) {
+        STATUS("couldn't run %s: %s", cmd? cmd : arg, strerror(err));
+    }
+    else if (res < 0) {
+        STATUS("couldn't run %s", cmd? cmd : arg);
+    }
+}
+
+// copy name out of the archive being shown into a temporary dir of its
+// own, once per session. returns the dir
+static const char *
+copy_member(files_t *f, const char *name)
+{
+    char src[MAX_PATH_SZ];
+    snprintf(src, sizeof(src), "%s/%s", f->dir, name);
+    for (size_t i = 0; i < ncopies; ++i) {
+        if (strcmp(copies[i].src, src) == 0)
+            return copies[i].dir;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    char *dir = smprintf("%s/mfm-XXXXXX", tmp? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        STATUS("couldn't copy %s: %s", name, strerror(errno));
+        free(dir);
+        return NULL;
+    }
+    char *file = smprintf("%s/%s", dir, name);
+    int err = archive_extract(src, file);
+    if (err) {
+        STATUS("couldn't copy %s: %s", name, strerror(err));
+        unlink(file);
+        rmdir(dir);
+        free(file);
+        free(dir);
+        return NULL;
+    }
+
+    copies = realloc(copies, (ncopies + 1) * sizeof(member_copy_t));
+    copies[ncopies++] = (member_copy_t) { strdup(src), dir, file };
+    return dir;
+}
+
+static void
+remove_copies(void)
+{
+    for (size_t i = 0; i < ncopies; ++i) {
+        unlink(copies[i].file);
+        rmdir(copies[i].dir);
+        free(copies[i].src);
+        free(copies[i].dir);
+        free(copies[i].file);
+    }
+    free(copies);
+    copies = NULL;
+    ncopies = 0;
+}
+
 static void
 quit(files_t *f)
 {
     char file[1024] = {0};
     char path[1024] = {0};
+    control_close();
+    // a half written archive would be left behind otherwise
+    if (pack_running()) {
+        pack_cancel();
+        while (pack_running()) usleep(10000);
+    }
+    if (perms_running()) {
+        perms_cancel();
+        while (perms_running()) usleep(10000);
+    }
+    if (sync_running()) {
+        sync_cancel();
+        while (sync_running()) usleep(10000);
+    }
+    if (grep_running()) {
+        grep_cancel();
+        while (grep_running()) usleep(10000);
+    }
+    if (compare_running()) {
+        compare_cancel();
+        while (compare_running()) usleep(10000);
+    }
+    if (ops_running()) {
+        ops_cancel();
+        while (ops_running()) usleep(10000);
+    }
+
+    // archive members copied out go whether there's a HOME or not
+    remove_copies();
+    // a made up tree has no business in the session, and a pick leaves
+    // no trace
+    if (!vfs->native || pick_fd >= 0) return;
+
     char *home = getenv("HOME");
     if (!home) return;
 
+    session_store(&session, f);
+    save_session(&session);
+    save_jump(&jumps);
+
     sprintf(file, "%s/.mfmdir", home);
     sprintf(path, STR_FMT, STR_ARG(f->path));
     write_file(file, path);
@@ -222,7 +540,20 @@ render_files(files_t *f)
 {
     if (!f->size) {
         attron(COLOR_PAIR(PAIR_FILE_SEL));
-        mvprintw(OFFSET, 0, " empty ");
+        switch (f->state) {
+        case LIST_PENDING:
+            mvprintw(OFFSET, 0, " pending... ");
+            break;
+        case LIST_UNREACHABLE:
+            mvprintw(OFFSET, 0, " unreachable ");
+            break;
+        case LIST_ERROR:
+            mvprintw(OFFSET, 0, " %s ", strerror(f->err));
+            break;
+        default:
+            mvprintw(OFFSET, 0, " empty ");
+            break;
+        }
         attroff(COLOR_PAIR(PAIR_FILE_SEL));
         return;
     }
@@ -235,17 +566,28 @@ render_files(files_t *f)
         int is_sel = file_selected(f->data[i]);
         char *sel = (is_sel < 0)? " " : "+";
         char *exec = file_executable(f->data[i])? "*" : "";
-
-        int col = (f->data[i].is_dir)? PAIR_DIR : PAIR_FILE;
-        if (f->curr.pos == i) {
-            // stat_file(f);
-            col++;
+        char git[16] = "";
+        if (f->list_git) {
+            git[0] = git_marker(f->data[i]);
+            git[1] = ' ';
+        }
+        else if (f->virt && f->virt_marks) {
+            git[0] = f->virt_marks[f->data[i].group];
+            git[1] = ' ';
+        }
+        else if (f->virt && f->data[i].group) {
+            sprintf(git, "%4u ", f->data[i].group);
         }
 
-        attron(COLOR_PAIR(col));
+        // laid out once per listing, this is only a lookup
+        const char *cols = f->list_long? columns_row(f, i) : "";
+
+        int col = colors_attrs(f->data[i].style, f->curr.pos == i);
+        attron(col);
         mvprintw(i - f->curr.offset + OFFSET, 0,
-            "%s"STR_FMT"%s", sel, STR_ARG(f->data[i].name), exec);
-        attroff(COLOR_PAIR(col));
+            "%s%s%s%s"STR_FMT"%s", sel, git, cols, *cols? " " : "",
+            STR_ARG(f->data[i].name), exec);
+        attroff(col);
     }
 }
 
@@ -253,24 +595,120 @@ static void
 render_status(files_t *f)
 {
     // Draw header
+    static const char *types[] = { "", " [dirs]", " [files]", " [exec]" };
     attron(COLOR_PAIR(PAIR_HEADER));
-    mvprintw(0, 0, STR_FMT" =>", STR_ARG(f->path));
+    if (mode == MODE_TREE) {
+        mvprintw(0, 0, "%s => [tree]", tree.root);
+    }
+    else {
+        mvprintw(0, 0, STR_FMT" =>%s%s%s%s%s%s", STR_ARG(f->path),
+            f->virt? " " : "", f->virt? f->virt : "",
+            types[f->filter.type],
+            f->filter.text? " " : "", f->filter.text? f->filter.text : "",
+            (f->state == LIST_PENDING)? " ..." : "");
+    }
     attroff(COLOR_PAIR(PAIR_HEADER));
 
     int y = win_h-1;
     char pos[1024];
-    sprintf(pos, " %d:%d [%d] ", f->curr.pos+1, f->size, selected.size);
+    if (mode == MODE_TREE) {
+        sprintf(pos, " %zu:%zu [%zu] ", tree.nrows? tree_pos+1 : 0, tree.nrows, selected.size);
+    }
+    else if (f->windowed) {
+        // the count is a guess until the whole directory has been read
+        bool exact;
+        size_t count = bigdir_count(&exact);
+        size_t end = f->win_start + f->all.size;
+        sprintf(pos, " %zu:%s%zu [%zu] ", window_index(f) + 1, exact? "" : "~",
+            (count > end)? count : end, selected.size);
+    }
+    else {
+        sprintf(pos, " %d:%d [%d] ", f->curr.pos+1, f->size, selected.size);
+    }
 
     // Draw status bar
     attron(COLOR_PAIR(PAIR_HEADER));
     move(y, 0);
     clrtoeol();
-    if (mode == MODE_NORMAL)
+    if (mode == MODE_NORMAL || mode == MODE_TREE)
         mvprintw(y, 0, "%s", status);
     mvprintw(y, win_w - strlen(pos), "%s", pos);
     attroff(COLOR_PAIR(PAIR_HEADER));
 }
 
+// dirs are marked + closed, - open, ~ while they're being read and
+// ! if they couldn't be
+static void
+render_tree(files_t *f)
+{
+    if (!tree.nrows) {
+        tree_node_t *root = &tree.nodes[0];
+        attron(COLOR_PAIR(PAIR_FILE_SEL));
+        if (root->state == TREE_LISTING)
+            mvprintw(OFFSET, 0, " pending... ");
+        else if (root->state == TREE_FAILED)
+            mvprintw(OFFSET, 0, " %s ", strerror(root->err));
+        else
+            mvprintw(OFFSET, 0, " empty ");
+        attroff(COLOR_PAIR(PAIR_FILE_SEL));
+        return;
+    }
+    for (size_t i = tree_off; i < tree.nrows && i - tree_off < win_h-1 - OFFSET; ++i) {
+        tree_node_t *n = &tree.nodes[tree.rows[i]];
+        const char *mark = " ";
+        if (n->is_dir && !n->open) mark = "+";
+        else if (n->is_dir && n->state == TREE_LISTING) mark = "~";
+        else if (n->is_dir && n->state == TREE_FAILED) mark = "!";
+        else if (n->is_dir) mark = "-";
+
+        int col = n->is_dir? PAIR_DIR : PAIR_FILE;
+        if (i == tree_pos) col = n->is_dir? PAIR_DIR_SEL : PAIR_FILE_SEL;
+        attron(COLOR_PAIR(col));
+        mvprintw(i - tree_off + OFFSET, 0, "%*s%s %s%s", (n->depth - 1) * 2, "",
+            mark, n->name, n->is_dir? "/" : "");
+        attroff(COLOR_PAIR(col));
+    }
+}
+
+static void
+render_jump(files_t *f)
+{
+    if (!jump_count) {
+        attron(COLOR_PAIR(PAIR_FILE_SEL));
+        mvprintw(OFFSET, 0, " no matches ");
+        attroff(COLOR_PAIR(PAIR_FILE_SEL));
+        return;
+    }
+    for (int i = 0; i < jump_count && i < win_h-1 - OFFSET; ++i) {
+        jump_entry_t *e = &jumps.data[jump_res[i]];
+        int col = (i == jump_sel)? PAIR_DIR_SEL : PAIR_DIR;
+        attron(COLOR_PAIR(col));
+        mvprintw(i + OFFSET, 0, "%s%.*s", e->bookmark? "*" : " ",
+            (int) e->path_sz, e->path);
+        attroff(COLOR_PAIR(col));
+    }
+}
+
+static void
+render_locate(files_t *f)
+{
+    if (!locate_count) {
+        attron(COLOR_PAIR(PAIR_FILE_SEL));
+        mvprintw(OFFSET, 0, " no matches ");
+        attroff(COLOR_PAIR(PAIR_FILE_SEL));
+        return;
+    }
+    for (int i = 0; i < locate_count && i < win_h-1 - OFFSET; ++i) {
+        const char *path = locate_res[i];
+        bool is_dir = path[strlen(path)-1] == '/';
+        int col = is_dir? PAIR_DIR : PAIR_FILE;
+        if (i == locate_sel) col = is_dir? PAIR_DIR_SEL : PAIR_FILE_SEL;
+        attron(COLOR_PAIR(col));
+        mvprintw(i + OFFSET, 0, " %s", path);
+        attroff(COLOR_PAIR(col));
+    }
+}
+
 static void
 scroll_center(files_t *f)
 {
@@ -311,28 +749,50 @@ static void
 move_up(files_t *f)
 {
     if (!f->size) return;
+    if (f->windowed && f->curr.pos == 0) {
+        size_t index = window_index(f);
+        window_goto(f, index? index - 1 : BIGDIR_END);
+        return;
+    }
     if (--f->curr.pos < 0) {
         f->curr.pos = f->size-1;
         scroll_center(f);
     }
     scroll_up(f);
+    window_follow(f);
 }
 
 static void
 move_down(files_t *f)
 {
     if (!f->size) return;
+    if (f->windowed && f->curr.pos+1 >= f->size) {
+        bool exact;
+        size_t count = bigdir_count(&exact);
+        size_t index = window_index(f);
+        window_goto(f, (exact && index+1 >= count)? 0 : index+1);
+        return;
+    }
     if (++f->curr.pos >= f->size) {
         f->curr.pos = 0;
         scroll_center(f);
     }
     scroll_down(f);
+    window_follow(f);
 }
 
 static void
 prev_dir(files_t *f)
 {
+    // leaving a result listing goes back to the directory itself
+    if (f->virt) {
+        f->virt = NULL;
+        f->curr = (cursor_t) {0, 0};
+        list_entries(f);
+        return;
+    }
     if (f->path.size <= 1) return;
+    session_store(&session, f);
 
     char fname[500] = {0};
     int path_size = f->path.size;
@@ -348,23 +808,23 @@ prev_dir(files_t *f)
     fname[dir_size] = '/';
     fname[dir_size+1] = '\0';
 
+    // put the cursor on the dir we came from once the listing is in
+    strcpy(select_name, fname);
+
+    char *c = f->path.data;
     f->path = get_full_path(f->path);
+    free(c);
+    f->curr.pos = f->curr.offset = 0;
     list_entries(f);
-
-    f->curr.pos = 0;
-    f->curr.offset = 0;
-    for (int i = 0; i < f->size; ++i) {
-        if (streqp(&f->data[i].name, fname)) {
-            f->curr.pos = i;
-            scroll_center(f);
-            break;
-        }
-    }
+    jump_visit(&jumps, f->path);
+    if (f->state != LIST_PENDING)
+        entered_dir(f);
 }
 
 static void
 next_dir(files_t *f)
 {
+    session_store(&session, f);
     if (f->path.size > 1)
         LIST_ADD(f->path, f->path.size, '/');
     for (int i = 0; i < f->data[f->curr.pos].name.size; ++i) {
@@ -376,42 +836,125 @@ next_dir(files_t *f)
     char *c = f->path.data;
     f->path = get_full_path(f->path);
     list_entries(f);
+    jump_visit(&jumps, f->path);
+    if (f->state != LIST_PENDING)
+        entered_dir(f);
     free(c);
 }
 
+static void
+change_dir(files_t *f, char *path)
+{
+    session_store(&session, f);
+
+    string_t p = { .data = path, .size = strlen(path), .alloc = strlen(path) };
+    free(f->path.data);
+    f->path = get_full_path(p);
+    f->curr.pos = f->curr.offset = 0;
+    list_entries(f);
+    jump_visit(&jumps, f->path);
+    if (f->state != LIST_PENDING)
+        entered_dir(f);
+}
+
+// the first listing of a directory we moved to is in
+static void
+entered_dir(files_t *f)
+{
+    f->entered = false;
+    // the dir's filter comes back either way
+    restore_cursor(f);
+    if (!select_name[0]) return;
+
+    for (int i = 0; i < f->size; ++i) {
+        if (streqp(&f->data[i].name, select_name)) {
+            f->curr.pos = i;
+            scroll_center(f);
+            break;
+        }
+    }
+    select_name[0] = '\0';
+}
+
+static void
+restore_cursor(files_t *f)
+{
+    if (!session_restore(&session, f)) return;
+    if (f->curr.pos - f->curr.offset >= win_h - OFFSET)
+        scroll_center(f);
+}
+
 static void
 open_file(files_t *f)
 {
-    if (!f->size) return;
-    char cmd[1024] = {0};
+    if (!f->size || open_hit(f)) return;
 
     entry_t curr = f->data[f->curr.pos];
-    if (file_executable(curr)) {
-        sprintf(cmd, "cd \""STR_FMT"\" && ./"STR_FMT,
-                STR_ARG(f->path), STR_ARG(curr.name));
+    char *name = string_to_cstr(curr.name);
+    char *path = smprintf("%s/%s", curr.path, name);
+
+    if (f->in_archive) {
+        // members never run, and get sniffed from their copy
+        const char *dir = copy_member(f, name);
+        if (dir) {
+            free(path);
+            path = smprintf("%s/%s", dir, name);
+            run(f, file_opener(path), name);
+        }
+    }
+    else if (file_executable(curr)) {
+        run(f, NULL, path);
     }
     else {
-        sprintf(cmd, "cd \""STR_FMT"\" && command xdg-open \""STR_FMT"\"",
-            STR_ARG(f->path), STR_ARG(curr.name));
+        run(f, file_opener(path), name);
+    }
+
+    free(path);
+    free(name);
+}
+
+// the current entry and everything selected go out, and that's it
+static void
+pick(files_t *f)
+{
+    if (f->in_archive) {
+        STATUS("%s", "archive members can't be picked");
+        return;
+    }
+    if (!f->size && !selected.size) return;
+
+    static picker_t p;
+    p.fd = pick_fd;
+    if (f->size && file_selected(f->data[f->curr.pos]) < 0) {
+        entry_t e = f->data[f->curr.pos];
+        pick_add(&p, e.path, e.name.data, e.name.size - e.is_dir);
+    }
+    for (int i = 0; i < selected.size; ++i) {
+        entry_t e = selected.data[i];
+        pick_add(&p, e.path, e.name.data, e.name.size - e.is_dir);
     }
+    bool ok = pick_flush(&p);
 
     deinit_curses();
-    system(cmd);
-    init_curses();
+    quit(f);
+    exit(ok? 0 : 1);
 }
 
 static int
 file_executable(entry_t e)
 {
-    char name[1024] = {0};
-    sprintf(name, "%s/"STR_FMT,
-        e.path, STR_ARG(e.name));
+    // mode comes from the worker, never stat from here
+    return e.mode && !S_ISDIR(e.mode) && (e.mode & S_IXUSR);
+}
 
-    struct stat sb;
-    if (stat(name, &sb) == 0) {
-        return !(sb.st_mode & S_IFDIR) && (sb.st_mode & S_IXUSR);
-    }
-    return 0;
+static char
+git_marker(entry_t e)
+{
+    if (e.git & GIT_MODIFIED) return 'M';
+    if (e.git & GIT_STAGED) return 'S';
+    if (e.git & GIT_UNTRACKED) return '?';
+    if (e.git & GIT_IGNORED) return '!';
+    return ' ';
 }
 
 static void
@@ -424,7 +967,7 @@ stat_file(files_t *f)
 
     STATUS("file %s", name);
     struct stat sb;
-    if (stat(name, &sb) == 0) {
+    if (vfs->stat(name, &sb, true) == 0) {
         if (sb.st_mode & S_IFDIR) {
             STATUS("dir %s", name);
         }
@@ -448,105 +991,612 @@ file_selected(entry_t entry)
     return -1;
 }
 
+// duplicates among the selection, or everything below the current dir
 static void
-select_file(files_t *f)
+find_dupes(files_t *f)
 {
-    if (!f->size) return;
-    entry_t curr = f->data[f->curr.pos];
+    if (dupes_running()) {
+        dupes_cancel();
+        STATUS("%s", "dupes: cancelled");
+        return;
+    }
 
-    int sel = file_selected(curr);
-    if (sel < 0) {
-        LIST_ADD(selected, selected.size, curr);
-        if (f->curr.pos+1 < f->size)
-            move_down(f);
+    size_t n = selected.size? selected.size : 1;
+    char **roots = malloc(n * sizeof(char*));
+    char *base;
+    if (!selected.size) {
+        roots[0] = string_to_cstr(f->path);
+        base = strdup(roots[0]);
+    }
+    else {
+        // results are shown under the deepest dir holding all of them
+        base = strdup(selected.data[0].path);
+        for (size_t i = 0; i < n; ++i) {
+            entry_t e = selected.data[i];
+            roots[i] = malloc(strlen(e.path) + e.name.size + 2);
+            sprintf(roots[i], "%s/"STR_FMT, e.path, STR_ARG(e.name));
+
+            size_t k = 0;
+            while (base[k] && base[k] == e.path[k]) ++k;
+            bool at_dir = (!base[k] || base[k] == '/')
+                && (!e.path[k] || e.path[k] == '/');
+            if (!at_dir) {
+                while (k > 0 && base[k-1] != '/') --k;
+                if (k) --k;
+            }
+            if (k) base[k] = '\0';
+            else strcpy(base, "/");
+        }
+    }
+
+    if (dupes_start(roots, n, base, f->list_hidden)) {
+        STATUS("%s", "dupes: scanning");
+    }
+    else {
+        STATUS("%s", "dupes: couldn't start");
+    }
+    for (size_t i = 0; i < n; ++i)
+        free(roots[i]);
+    free(roots);
+    free(base);
+}
+
+static void
+show_dupes(files_t *f)
+{
+    char line[256];
+    dupes_progress(line, sizeof(line));
+    if (line[0]) {
+        STATUS("%s", line);
         return;
     }
 
-    LIST_POP(selected, sel);
-    if (f->curr.pos+1 < f->size)
-        move_down(f);
+    dupes_result_t *r = dupes_take();
+    if (!r) return;
+    if (!r->count) {
+        STATUS("%s", "dupes: none found");
+        dupes_free_result(r);
+        return;
+    }
+
+    // paths are relative to the dir the search was started from
+    session_store(&session, f);
+    fill_virtual(f, "[dupes]", r->buf, r->sz, r->groups);
+    STATUS("dupes: %zu files in %u groups, %.1f MiB reclaimable",
+        r->count, r->groups[r->count-1], r->wasted / 1048576.0);
+    dupes_free_result(r);
 }
 
+// within each group, the first entry that isn't selected is kept and
+// the others become links to it. with nothing selected, all but the
+// first of each group are linked
 static void
-select_all(files_t *f)
+link_dupes(files_t *f, bool reflink)
 {
-    if (!f->size) return;
+    if (!f->virt || !f->size) return;
 
-    for (size_t i = 0; i < f->size; ++i) {
-        entry_t curr = f->data[i];
+    char keep[MAX_PATH_SZ], target[MAX_PATH_SZ];
+    int linked = 0, failed = 0, err = 0;
+    for (size_t i = 0; i < f->size; ) {
+        size_t j = i + 1;
+        while (j < f->size && f->data[j].group == f->data[i].group) ++j;
 
-        if (file_selected(curr) < 0) {
-            LIST_ADD(selected, selected.size, curr);
+        int k = -1;
+        for (size_t x = i; x < j && k < 0; ++x) {
+            if (!selected.size || file_selected(f->data[x]) < 0) k = x;
+        }
+        for (size_t x = i; k >= 0 && x < j; ++x) {
+            if (x == k) continue;
+            if (selected.size && file_selected(f->data[x]) < 0) continue;
+            snprintf(keep, sizeof(keep), "%s/"STR_FMT, f->dir, STR_ARG(f->data[k].name));
+            snprintf(target, sizeof(target), "%s/"STR_FMT, f->dir, STR_ARG(f->data[x].name));
+            int res = dupes_link(keep, target, reflink);
+            if (res) {
+                failed++;
+                err = res;
+            }
+            else {
+                linked++;
+            }
         }
+        i = j;
+    }
+
+    clear_selection(&selected);
+    list_entries(f);
+    if (failed) {
+        STATUS("linked %d, %d failed: %s", linked, failed, strerror(err));
+    }
+    else {
+        STATUS("linked %d", linked);
     }
 }
 
+// asks where to pack the selection, or the current entry, to
 static void
-edit_file(files_t *f)
+start_pack(files_t *f)
 {
-    if (!f->size) return;
-    char cmd[1024] = {0};
+    if (pack_running()) {
+        pack_cancel();
+        STATUS("%s", "pack: cancelling");
+        return;
+    }
+    if (!selected.size && !f->size) return;
 
-    sprintf(cmd, "cd \""STR_FMT"\" && command $EDITOR \""STR_FMT"\"",
-        STR_ARG(f->path), STR_ARG(f->data[f->curr.pos].name));
-    deinit_curses();
-    system(cmd);
-    init_curses();
+    char name[MAX_PATH_SZ];
+    if (selected.size == 1 || !selected.size) {
+        string_t s = selected.size? selected.data[0].name : f->data[f->curr.pos].name;
+        snprintf(name, sizeof(name), STR_FMT, STR_ARG(s));
+    }
+    else {
+        snprintf(name, sizeof(name), "%s", f->dir);
+    }
+    size_t len = strlen(name);
+    while (len > 1 && name[len-1] == '/') name[--len] = '\0';
+    char *base = strrchr(name, '/');
+    base = (base && base[1])? base + 1 : (base? "archive" : name);
+    base = smprintf("%s.tar.gz", base);
+
+    last_mode = MODE_NORMAL;
+    mode = MODE_PACK;
+    input.cursor = 0;
+    input.text.size = 0;
+    for (char *p = base; *p; ++p) {
+        LIST_ADD(input.text, input.text.size, *p);
+    }
+    // leave the cursor before the extension
+    input.cursor = input.text.size - strlen(".tar.gz");
+    free(base);
 }
 
 static void
-chmod_file(files_t *f)
+show_pack(files_t *f)
 {
-    if (!f->size) return;
-    char cmd[1024] = {0};
+    char line[256];
+    if (pack_progress(line, sizeof(line)) && !f->virt)
+        list_entries(f);
+    STATUS("%s", line);
+}
 
-    entry_t curr = f->data[f->curr.pos];
-    char chmod = file_executable(curr)? '-' : '+';
+// names of the entries a perms job touches that are in the listing, so
+// they can be restated once it's applied
+static char **perms_names = NULL;
+static size_t perms_nnames = 0;
 
-    sprintf(cmd, "cd \""STR_FMT"\" && chmod %cx \""STR_FMT"\"",
-            STR_ARG(f->path), chmod, STR_ARG(curr.name));
-    deinit_curses();
-    system(cmd);
-    init_curses();
+static void
+free_perms_names(void)
+{
+    for (size_t i = 0; i < perms_nnames; ++i)
+        free(perms_names[i]);
+    free(perms_names);
+    perms_names = NULL;
+    perms_nnames = 0;
 }
 
+// asks what to change on the selection, or the current entry
 static void
-shell(files_t *f)
+start_perms(files_t *f)
 {
-    char cmd[1024] = {0};
-    sprintf(cmd, "cd \""STR_FMT"\" && command $SHELL", STR_ARG(f->path));
-    deinit_curses();
-    system(cmd);
-    init_curses();
+    if (perms_running()) {
+        perms_cancel();
+        STATUS("%s", "perms: cancelling");
+        return;
+    }
+    if (!selected.size && !f->size) return;
+
+    char text[16] = {0};
+    if (!selected.size && f->data[f->curr.pos].mode)
+        snprintf(text, sizeof(text), "%o", f->data[f->curr.pos].mode & 07777);
+
+    last_mode = MODE_NORMAL;
+    mode = MODE_PERMS;
+    input.cursor = 0;
+    input.text.size = 0;
+    for (char *p = text; *p; ++p) {
+        LIST_ADD(input.text, input.text.size, *p);
+    }
+    input.cursor = input.text.size;
 }
 
 static void
-bookmarks(files_t *f)
+show_perms(files_t *f)
 {
-    deinit_curses();
-    system("command mbm ~/.mbm");
-    init_curses();
-
-    char *home = getenv("HOME");
-    char path[1024] = {0};
-    sprintf(path, "%s/.mbmsel", home);
-    char *s = read_file(path);
-    if (strcmp(s, "NULL") == 0)
-        goto fail_bookmarks;
-
-    f->path.size = 0;
-    for (size_t i = 0; i < strlen(s); ++i) {
-        LIST_ADD(f->path, f->path.size, s[i]);
+    char line[256];
+    if (!perms_progress(line, sizeof(line))) {
+        STATUS("%s", line);
+        return;
     }
-    
-    list_entries(f);
-    f->curr.pos = f->curr.offset = 0;
 
-fail_bookmarks:
-    free(s);
+    size_t seen, changed;
+    bool counted, applied;
+    perms_result(&seen, &changed, &counted, &applied);
+    if (counted && changed) {
+        // the count is in, have it confirmed before touching anything
+        last_mode = MODE_NORMAL;
+        mode = MODE_PERMS_CONFIRM;
+        return;
+    }
+    if (applied && !f->virt)
+        restat_entries(f, perms_names, perms_nnames);
+    free_perms_names();
+    STATUS("%s", line);
 }
 
-static bool
+static void
+show_sync(files_t *f)
+{
+    char line[256];
+    if (!sync_progress(line, sizeof(line))) {
+        STATUS("%s", line);
+        return;
+    }
+
+    sync_plan_t *plan = sync_take_plan();
+    if (plan && plan->count) {
+        // paths are relative to the dir being synced into
+        session_store(&session, f);
+        fill_virtual(f, "[sync plan]", plan->buf, plan->sz, NULL);
+    }
+    else if (!plan && f->virt) {
+        // the plan, if that's what is shown, is out of date
+        f->virt = NULL;
+        f->curr = (cursor_t) {0, 0};
+        list_entries(f);
+    }
+    else if (!plan) {
+        cursor_t curr = f->curr;
+        list_entries(f);
+        f->curr = curr;
+    }
+    sync_free_plan(plan);
+    STATUS("%s", line);
+}
+
+// hits are shown as they come in, the listing is made again from all of
+// them every time and the cursor stays where it was
+static void
+show_grep(files_t *f)
+{
+    char line[256];
+    grep_progress(line, sizeof(line));
+    STATUS("%s", line);
+
+    grep_hits_t *h = grep_take();
+    if (!h) return;
+    bool first = !grep_all.count;
+    grep_merge(&grep_all, h);
+    free(h);
+    if (!first && f->virt != grep_title) return;
+
+    cursor_t curr = f->curr;
+    if (first) session_store(&session, f);
+    fill_virtual(f, grep_title, grep_all.buf, grep_all.sz, NULL);
+    f->virt_fixed = true;
+    if (!first && curr.pos < f->size) f->curr = curr;
+}
+
+// a hit is opened in the editor, on its line
+static bool
+open_hit(files_t *f)
+{
+    if (f->virt != grep_title || !f->size) return false;
+    uint32_t i = f->view[f->curr.pos];
+    if (i >= grep_all.count) return true;
+
+    char *editor = getenv("EDITOR");
+    char *cmd = smprintf("%s +%u", editor? editor : "vi", grep_all.lines[i]);
+    char *path = strndup(f->all.data[i].name.data, grep_all.path_sz[i]);
+    run(f, cmd, path);
+    free(path);
+    free(cmd);
+    return true;
+}
+
+// the way from one absolute dir to another, "../b" from /x/a to /x/b
+static void
+relative_path(const char *from, const char *to, char *buf, size_t sz)
+{
+    // how much of the two is the same dirs
+    size_t common = 0, i = 0;
+    for (; from[i] && from[i] == to[i]; ++i) {
+        if (from[i] == '/') common = i;
+    }
+    if (!from[i] && (!to[i] || to[i] == '/')) common = i;
+    else if (!to[i] && from[i] == '/') common = i;
+
+    // a ".." for each dir of from past those
+    size_t len = 0;
+    buf[0] = '\0';
+    for (const char *p = from + common; *p; ++p) {
+        if (*p == '/' && p[1] && len + 4 < sz) {
+            memcpy(buf + len, "../", 3);
+            len += 3;
+        }
+    }
+    const char *rest = to + common;
+    while (*rest == '/') ++rest;
+    if (*rest) snprintf(buf + len, sz - len, "%s", rest);
+    else if (len) buf[len-1] = '\0';
+    else snprintf(buf, sz, ".");
+}
+
+static void
+show_compare(files_t *f)
+{
+    char line[256];
+    if (!compare_progress(line, sizeof(line))) {
+        STATUS("%s", line);
+        return;
+    }
+    STATUS("%s", line);
+
+    compare_result_t *r = compare_take();
+    if (!r || !r->count) {
+        compare_free_result(r);
+        return;
+    }
+    // mismatches can be selected and copied, synced or deleted from here
+    session_store(&session, f);
+    fill_virtual(f, "[compare]", r->buf, r->sz, r->tags);
+    f->virt_marks = compare_marks;
+    compare_free_result(r);
+}
+
+static void
+show_ops(files_t *f)
+{
+    char line[256];
+    bool finished = ops_progress(line, sizeof(line));
+    STATUS("%s", line);
+    if (!finished) return;
+
+    cursor_t curr = f->curr;
+    list_entries(f);
+    f->curr = curr;
+    if (!f->size) f->curr = (cursor_t) {0, 0};
+    while (f->size && f->curr.pos >= f->size)
+        move_up(f);
+}
+
+// an entry like the ones in the listing for any path, relative paths
+// being relative to the current dir
+static bool
+path_entry(files_t *f, const char *arg, entry_t *e)
+{
+    char path[MAX_PATH_SZ];
+    errno = EINVAL;
+    if (!*arg) return false;
+    if (arg[0] == '/') snprintf(path, sizeof(path), "%s", arg);
+    else snprintf(path, sizeof(path), "%s/%s", f->dir, arg);
+    size_t len = strlen(path);
+    while (len > 1 && path[len-1] == '/') path[--len] = '\0';
+
+    struct stat st;
+    char *slash = strrchr(path, '/');
+    if (!slash[1] || fs_stat_path(path, &st, true) < 0) return false;
+    *slash = '\0';
+    e->path = strdup(slash == path? "/" : path);
+    e->name = (string_t) LIST_ALLOC(char);
+    for (char *p = slash + 1; *p; ++p) {
+        LIST_ADD(e->name, e->name.size, *p);
+    }
+    if (S_ISDIR(st.st_mode)) {
+        LIST_ADD(e->name, e->name.size, '/');
+    }
+    e->is_dir = S_ISDIR(st.st_mode);
+    e->mode = st.st_mode;
+    e->git = 0;
+    e->group = 0;
+    e->style = STYLE_FILE;
+    return true;
+}
+
+static void
+reply_path(control_reply_t *r, entry_t e)
+{
+    int sz = e.name.size - e.is_dir;
+    bool root = strcmp(e.path, "/") == 0;
+    control_printf(r, "%s/%.*s", root? "" : e.path, sz, e.name.data);
+}
+
+static void
+control_command(void *data, char *cmd, char *arg, control_reply_t *r)
+{
+    files_t *f = data;
+    if (strcmp(cmd, "pwd") == 0) {
+        control_printf(r, "%s", f->dir);
+    }
+    else if (strcmp(cmd, "cursor") == 0) {
+        if (!f->size) control_error(r, "%s", "empty");
+        else reply_path(r, f->data[f->curr.pos]);
+    }
+    else if (strcmp(cmd, "selection") == 0) {
+        for (size_t i = 0; i < selected.size; ++i)
+            reply_path(r, selected.data[i]);
+    }
+    else if (strcmp(cmd, "cd") == 0) {
+        entry_t e;
+        if (!path_entry(f, arg, &e)) {
+            control_error(r, "%s", strerror(errno));
+            return;
+        }
+        // a file is shown in its dir, with the cursor on it
+        char *dir = e.is_dir? smprintf("%s/"STR_FMT, e.path, STR_ARG(e.name)) : strdup(e.path);
+        if (!e.is_dir) snprintf(select_name, sizeof(select_name), STR_FMT, STR_ARG(e.name));
+        change_dir(f, dir);
+        free(dir);
+        free(e.path);
+        LIST_FREE(e.name);
+    }
+    else if (strcmp(cmd, "select") == 0 || strcmp(cmd, "unselect") == 0) {
+        entry_t e;
+        if (!path_entry(f, arg, &e)) {
+            control_error(r, "%s", strerror(errno));
+            return;
+        }
+        int sel = file_selected(e);
+        if (cmd[0] == 's' && sel < 0) {
+            LIST_ADD(selected, selected.size, e);
+            return;
+        }
+        if (cmd[0] == 'u' && sel >= 0) {
+            LIST_FREE(selected.data[sel].name);
+            free(selected.data[sel].path);
+            LIST_POP(selected, sel);
+        }
+        free(e.path);
+        LIST_FREE(e.name);
+    }
+    else if (strcmp(cmd, "clear") == 0) {
+        clear_selection(&selected);
+    }
+    else if (strcmp(cmd, "refresh") == 0) {
+        cursor_t curr = f->curr;
+        list_entries(f);
+        f->curr = curr;
+        if (f->curr.pos >= (int) f->size)
+            f->curr.pos = f->size? f->size-1 : 0;
+    }
+    else if (!vfs->native && (strcmp(cmd, "dupes") == 0 || strcmp(cmd, "pack") == 0)) {
+        control_error(r, "only on the real filesystem");
+    }
+    else if (strcmp(cmd, "dupes") == 0) {
+        find_dupes(f);
+    }
+    else if (strcmp(cmd, "pack") == 0) {
+        const char *err = pack_to(f, arg);
+        if (err) control_error(r, "%s", err);
+    }
+    else if (strcmp(cmd, "quit") == 0) {
+        remote_quit = true;
+    }
+    else {
+        control_error(r, "unknown command %s", cmd);
+    }
+}
+
+static void
+select_file(files_t *f)
+{
+    if (!f->size) return;
+    entry_t curr = f->data[f->curr.pos];
+
+    int sel = file_selected(curr);
+    if (sel < 0) {
+        curr = copy_entry(curr);
+        LIST_ADD(selected, selected.size, curr);
+        if (f->curr.pos+1 < f->size)
+            move_down(f);
+        return;
+    }
+
+    LIST_FREE(selected.data[sel].name);
+    free(selected.data[sel].path);
+    LIST_POP(selected, sel);
+    if (f->curr.pos+1 < f->size)
+        move_down(f);
+}
+
+static void
+select_all(files_t *f)
+{
+    if (!f->size) return;
+
+    // name -> index into selected, open addressing. looking every entry
+    // up in the selection would be quadratic
+    size_t hsz = 16;
+    while (hsz < (selected.size + f->size) * 2) hsz *= 2;
+    int *table = malloc(hsz * sizeof(int));
+    memset(table, -1, hsz * sizeof(int));
+    for (int i = 0; i < selected.size; ++i) {
+        string_t name = selected.data[i].name;
+        uint32_t h = 2166136261u;
+        for (size_t c = 0; c < name.size; ++c) h = (h ^ (unsigned char) name.data[c]) * 16777619u;
+        size_t k = h & (hsz - 1);
+        while (table[k] >= 0) k = (k + 1) & (hsz - 1);
+        table[k] = i;
+    }
+
+    for (size_t i = 0; i < f->size; ++i) {
+        entry_t curr = f->data[i];
+        uint32_t h = 2166136261u;
+        for (size_t c = 0; c < curr.name.size; ++c) h = (h ^ (unsigned char) curr.name.data[c]) * 16777619u;
+        size_t k = h & (hsz - 1);
+        bool found = false;
+        for (; table[k] >= 0; k = (k + 1) & (hsz - 1)) {
+            entry_t sel = selected.data[table[k]];
+            if (streqs(&sel.name, &curr.name) && strcmp(sel.path, curr.path) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (found) continue;
+
+        table[k] = selected.size;
+        curr = copy_entry(curr);
+        LIST_ADD(selected, selected.size, curr);
+    }
+    free(table);
+}
+
+static void
+edit_file(files_t *f)
+{
+    if (!f->size || open_hit(f)) return;
+    char *editor = getenv("EDITOR");
+    char *name = string_to_cstr(f->data[f->curr.pos].name);
+    run(f, editor? editor : "vi", name);
+    free(name);
+}
+
+static void
+chmod_file(files_t *f)
+{
+    if (!f->size || f->virt) return;
+    char name[MAX_PATH_SZ], path[MAX_PATH_SZ];
+
+    entry_t curr = f->data[f->curr.pos];
+    snprintf(name, sizeof(name), STR_FMT, STR_ARG(curr.name));
+    if (curr.is_dir) name[strlen(name)-1] = '\0';
+    snprintf(path, sizeof(path), "%s/%s", f->dir, name);
+
+    struct stat st;
+    if (fs_stat_path(path, &st, true) < 0) {
+        STATUS("chmod: %s", strerror(errno));
+        return;
+    }
+    // like chmod +x, only what the umask lets through
+    mode_t mask = umask(0);
+    umask(mask);
+    mode_t to = (st.st_mode & S_IXUSR)? st.st_mode & ~0111 : st.st_mode | (0111 & ~mask);
+    if (vfs->chmod(path, to & 07777) < 0) {
+        STATUS("chmod: %s", strerror(errno));
+    }
+    else {
+        char *names[] = { name };
+        restat_entries(f, names, 1);
+    }
+}
+
+static void
+shell(files_t *f)
+{
+    char *sh = getenv("SHELL");
+    run(f, sh? sh : "/bin/sh", NULL);
+}
+
+static void
+bookmark_dir(files_t *f)
+{
+    if (jump_toggle_bookmark(&jumps, f->path)) {
+        STATUS("bookmarked "STR_FMT, STR_ARG(f->path));
+    }
+    else {
+        STATUS("removed bookmark "STR_FMT, STR_ARG(f->path));
+    }
+}
+
+static bool
 search_in_file_name(string_t file, string_t str)
 {
     if (str.size > file.size || str.size == 0)
@@ -584,9 +1634,22 @@ search_in_range(files_t *f, string_t file, int start, int end)
     return false;
 }
 
+// the worker goes through the directory, the cursor moves once it's
+// found something
+static bool
+search_window(files_t *f, string_t file, bool back)
+{
+    if (!file.size) return false;
+    char *text = string_to_cstr(file);
+    window_search(f, text, back);
+    free(text);
+    return true;
+}
+
 static bool
 search_files_back(files_t *f, string_t file)
 {
+    if (f->windowed) return search_window(f, file, true);
     cursor_t pos = {.pos = f->curr.pos, .offset = f->curr.offset};
     bool wrap = (f->curr.pos-1 < 0);
     bool found = search_in_range(f, file, f->curr.pos-1, 0);
@@ -605,6 +1668,7 @@ search_files_back(files_t *f, string_t file)
 static bool
 search_files(files_t *f, string_t file)
 {
+    if (f->windowed) return search_window(f, file, false);
     cursor_t pos = {.pos = f->curr.pos, .offset = f->curr.offset};
     bool wrap = (f->curr.pos+1 >= f->size);
     bool found = search_in_range(f, file, f->curr.pos+1, f->size);
@@ -624,21 +1688,113 @@ static void
 update_mode_normal(files_t *f)
 {
     int ch = getch();
+    if (f->in_archive && ch > 0 && ch < 128 && strchr("rdDxXfFvpPMY*", ch)) {
+        STATUS("%s", "archives are read only");
+        return;
+    }
+    // these read and write the disk themselves
+    if (!vfs->native && ch > 0 && ch < 128 && strchr("ULCPMYcKy", ch)) {
+        STATUS("%s", "only on the real filesystem");
+        return;
+    }
     switch (ch) {
     case CTRL('q'):
     case 'q':
     case 'Q':
         deinit_curses();
         quit(f);
-        exit(0);
+        exit(pick_fd >= 0? 1 : 0);
     case '.':
         f->list_hidden = !f->list_hidden;
-        f->curr.pos = f->curr.offset = 0;
+        if (f->windowed) list_entries(f);
+        else update_view(f);
+        break;
+    case 'i':
+        if (f->windowed) {
+            STATUS("%s", "filters don't work on windowed listings");
+            break;
+        }
+        STATUS("%s", "");
+        last_mode = MODE_NORMAL;
+        mode = MODE_FILTER;
+        input.cursor = 0;
+        input.text.size = 0;
+        break;
+    case 't':
+        enter_tree(f);
+        break;
+    case 'w':
+        f->list_long = !f->list_long;
+        break;
+    case 'T':
+        if (f->windowed) {
+            STATUS("%s", "filters don't work on windowed listings");
+            break;
+        }
+        set_filter_type(f, (f->filter.type + 1) % (FILTER_EXEC + 1));
+        break;
+    case 'U':
+        find_dupes(f);
+        break;
+    case 'L':
+        link_dupes(f, false);
+        break;
+    case 'C':
+        link_dupes(f, true);
+        break;
+    case 'P':
+        start_pack(f);
+        break;
+    case 'V':
+        f->list_git = !f->list_git;
         list_entries(f);
         break;
     case '*':
         chmod_file(f);
-        list_entries(f);
+        break;
+    case 'M':
+        start_perms(f);
+        break;
+    case 'Y':
+        if (sync_running()) {
+            sync_cancel();
+            STATUS("%s", "sync: cancelling");
+        }
+        else if (selected.size) {
+            last_mode = MODE_NORMAL;
+            mode = MODE_SYNC;
+        }
+        break;
+    case 'c':
+        if (grep_running()) {
+            grep_cancel();
+            STATUS("%s", "grep: cancelling");
+        }
+        else {
+            last_mode = MODE_NORMAL;
+            mode = MODE_GREP;
+            input.cursor = 0;
+            input.text.size = 0;
+        }
+        break;
+    case 'm':
+        if (!f->virt) {
+            snprintf(compare_mark, sizeof(compare_mark), "%s", f->dir);
+            STATUS("marked %.*s to compare with", (int) sizeof(status) - 32, compare_mark);
+        }
+        break;
+    case 'K':
+        if (compare_running()) {
+            compare_cancel();
+            STATUS("%s", "compare: cancelling");
+        }
+        else if (!compare_mark[0]) {
+            STATUS("%s", "mark a dir to compare with first");
+        }
+        else if (!f->virt && strcmp(compare_mark, f->dir) != 0) {
+            last_mode = MODE_NORMAL;
+            mode = MODE_COMPARE;
+        }
         break;
     case CTRL('f'):
     case '/':
@@ -716,18 +1872,30 @@ update_mode_normal(files_t *f)
         select_all(f);
         break;
     case 'u':
-        selected.size = 0;
+        clear_selection(&selected);
         break;
     case 'v':
-        if (selected.size) {
-            move_selected_entries(f, &selected);
-            selected.size = 0;
+        if (!selected.size) break;
+        if (move_selected_entries(f, &selected)) {
+            clear_selection(&selected);
+        }
+        else {
+            STATUS("%s", "another copy, move or delete is still running");
+        }
+        break;
+    case 'y':
+        if (!ops_resume()) {
+            STATUS("%s", ops_running()? "another copy, move or delete is still running"
+                : "nothing to resume");
         }
         break;
     case 'p':
-        if (selected.size) {
-            copy_selected_entries(f, &selected);
-            selected.size = 0;
+        if (!selected.size) break;
+        if (copy_selected_entries(f, &selected)) {
+            clear_selection(&selected);
+        }
+        else {
+            STATUS("%s", "another copy, move or delete is still running");
         }
         break;
     case 's':
@@ -739,16 +1907,43 @@ update_mode_normal(files_t *f)
         edit_file(f);
         break;
     case 'b':
-        bookmarks(f);
+        last_mode = MODE_NORMAL;
+        mode = MODE_JUMP;
+        input.cursor = 0;
+        input.text.size = 0;
+        jump_sel = 0;
+        jump_count = jump_query(&jumps, input.text, jump_res, JUMP_MAX_RESULTS);
+        break;
+    case 'B':
+        bookmark_dir(f);
+        break;
+    case 'z':
+        if (!indexing) {
+            STATUS("%s", "set MFM_INDEX to the dirs to index");
+            break;
+        }
+        last_mode = MODE_NORMAL;
+        mode = MODE_LOCATE;
+        input.cursor = 0;
+        input.text.size = 0;
+        query_locate();
         break;
     case 'g':
     case KEY_HOME:
+        if (f->windowed) {
+            window_goto(f, 0);
+            break;
+        }
         if (!f->size) break;
         f->curr.pos = 0;
         scroll_center(f);
         break;
     case 'G':
     case KEY_END:
+        if (f->windowed) {
+            window_goto(f, BIGDIR_END);
+            break;
+        }
         if (!f->size) break;
         f->curr.pos = f->size-1;
         scroll_center(f);
@@ -765,11 +1960,17 @@ update_mode_normal(files_t *f)
     case KEY_LEFT:
         prev_dir(f);
         break;
+    case '\n':
+        if (pick_fd >= 0) {
+            pick(f);
+            break;
+        }
+        // fallthrough
     case 'l':
     case KEY_RIGHT:
-    case '\n':
         if (!f->size) break;
-        if (f->data[f->curr.pos].is_dir) {
+        entry_t curr = f->data[f->curr.pos];
+        if (curr.is_dir || (!f->virt && archive_name(curr.name.data, curr.name.size))) {
             next_dir(f);
         }
         else {
@@ -856,15 +2057,13 @@ update_mode_delete(files_t *f)
     case 'Y':
     case '\n': {
         cursor_t curr = f->curr;
-        if (selected.size) {
-            remove_selected_entries(f, &selected);
-            selected.size = 0;
-            list_entries(f);
-        }
-        else {
-            remove_current_entry(f);
-            list_entries(f);
+        bool started = selected.size?
+            remove_selected_entries(f, &selected) : remove_current_entry(f);
+        if (!started) {
+            STATUS("%s", "another copy, move or delete is still running");
+            break;
         }
+        clear_selection(&selected);
         f->curr = curr;
         if (f->size) {
             while (f->curr.pos >= f->size)
@@ -886,17 +2085,413 @@ update_mode_open(files_t *f)
         last_mode = MODE_OPEN;
         mode = MODE_NORMAL;
 
-        if (!input.text.size) return;
-        char cmd[1024] = {0};
-
-        entry_t curr = f->data[f->curr.pos];
-        sprintf(cmd, "cd \""STR_FMT"\" && "STR_FMT" "STR_FMT,
-                STR_ARG(f->path), STR_ARG(input.text), STR_ARG(curr.name));
+        if (!input.text.size || !f->size) return;
+        char *cmd = string_to_cstr(input.text);
+        char *name = string_to_cstr(f->data[f->curr.pos].name);
 
         input.text.size = input.cursor = 0;
-        deinit_curses();
-        system(cmd);
-        init_curses();
+        run(f, cmd, name);
+        free(name);
+        free(cmd);
+    }
+}
+
+static void
+update_mode_pack(files_t *f)
+{
+    render_input(f, "pack to: ");
+    if (!update_input(f)) return;
+    last_mode = MODE_PACK;
+    mode = MODE_NORMAL;
+    if (!input.text.size) return;
+
+    char *name = string_to_cstr(input.text);
+    input.text.size = input.cursor = 0;
+    const char *err = pack_to(f, name);
+    free(name);
+    if (err) {
+        STATUS("pack: %s", err);
+    }
+    else {
+        STATUS("%s", "pack: starting");
+    }
+}
+
+// packs the selection, or the current entry. NULL or what's wrong
+static const char *
+pack_to(files_t *f, const char *name)
+{
+    if (!pack_supported(name)) return "name it .tar, .tar.gz or .tgz";
+    if (!selected.size && !f->size) return "nothing to pack";
+    char *dest = (name[0] == '/')? strdup(name) : smprintf("%s/%s", f->dir, name);
+
+    size_t n = selected.size? selected.size : 1;
+    char **paths = malloc(n * sizeof(char*));
+    for (size_t i = 0; i < n; ++i) {
+        entry_t e = selected.size? selected.data[i] : f->data[f->curr.pos];
+        paths[i] = smprintf("%s/"STR_FMT, selected.size? e.path : f->dir, STR_ARG(e.name));
+    }
+
+    bool ok = pack_start(paths, n, dest);
+    if (ok) clear_selection(&selected);
+    for (size_t i = 0; i < n; ++i)
+        free(paths[i]);
+    free(paths);
+    free(dest);
+    return ok? NULL : "couldn't start";
+}
+
+// keep the cursor on a row, and the row on screen
+static void
+tree_follow(void)
+{
+    size_t h = (win_h-1 - OFFSET > 0)? win_h-1 - OFFSET : 1;
+    if (tree_pos >= tree.nrows) tree_pos = tree.nrows? tree.nrows-1 : 0;
+    if (tree_pos < tree_off) tree_off = tree_pos;
+    if (tree_pos >= tree_off + h) tree_off = tree_pos - h + 1;
+}
+
+// the tree is kept for as long as it's of the same dir
+static void
+enter_tree(files_t *f)
+{
+    if (f->in_archive) {
+        STATUS("%s", "archives have no tree view");
+        return;
+    }
+    if (!tree.root || strcmp(tree.root, f->dir) != 0 || tree.hidden != f->list_hidden) {
+        if (tree.root) tree_free(&tree);
+        tree_init(&tree, f->dir, f->list_hidden);
+        tree_pos = tree_off = 0;
+    }
+    mode = MODE_TREE;
+}
+
+static void
+update_mode_tree(files_t *f)
+{
+    int ch = getch();
+    tree_node_t *n = tree.nrows? &tree.nodes[tree.rows[tree_pos]] : NULL;
+    switch (ch) {
+    case 'k':
+    case KEY_UP:
+        if (tree_pos > 0) --tree_pos;
+        break;
+    case 'j':
+    case KEY_DOWN:
+        ++tree_pos;
+        break;
+    case 'g':
+    case KEY_HOME:
+        tree_pos = 0;
+        break;
+    case 'G':
+    case KEY_END:
+        tree_pos = SIZE_MAX;
+        break;
+    case 'l':
+    case KEY_RIGHT:
+        if (!n) break;
+        // into an open dir, or open it
+        if (n->open && n->state == TREE_LISTED && n->nkids) ++tree_pos;
+        else tree_open(&tree, tree_pos);
+        break;
+    case 'h':
+    case KEY_LEFT:
+        if (!n) break;
+        if (n->is_dir && n->open) tree_close(&tree, tree_pos);
+        else tree_pos = tree_parent_row(&tree, tree_pos);
+        break;
+    case '\n': {
+        // the listing takes over where the cursor is
+        if (!n) break;
+        char *path = tree_path(&tree, tree.rows[tree_pos]);
+        if (!n->is_dir) {
+            char *slash = strrchr(path, '/');
+            snprintf(select_name, sizeof(select_name), "%s", slash + 1);
+            slash[slash == path] = '\0';
+        }
+        mode = MODE_NORMAL;
+        change_dir(f, path);
+        free(path);
+    } break;
+    case 't':
+    case 'q':
+    case CTRL('q'):
+    case CTRL('c'):
+    case 27:
+        mode = MODE_NORMAL;
+        break;
+    default: break;
+    }
+    tree_follow();
+}
+
+static void
+update_mode_jump(files_t *f)
+{
+    render_input(f, "jump: ");
+    int ch = getch();
+    switch (ch) {
+    case KEY_UP:
+    case CTRL('p'):
+        if (jump_sel > 0) --jump_sel;
+        return;
+    case KEY_DOWN:
+    case CTRL('n'):
+        if (jump_sel+1 < jump_count) ++jump_sel;
+        return;
+    default:
+        ungetch(ch);
+        break;
+    }
+
+    if (update_input(f)) {
+        last_mode = MODE_JUMP;
+        mode = MODE_NORMAL;
+        if (jump_count) {
+            jump_entry_t *e = &jumps.data[jump_res[jump_sel]];
+            char *path = strndup(e->path, e->path_sz);
+            change_dir(f, path);
+            free(path);
+        }
+        return;
+    }
+    jump_sel = 0;
+    jump_count = jump_query(&jumps, input.text, jump_res, JUMP_MAX_RESULTS);
+}
+
+static void
+query_locate(void)
+{
+    for (size_t i = 0; i < locate_count; ++i)
+        free(locate_res[i]);
+    locate_sel = 0;
+    char *text = string_to_cstr(input.text);
+    locate_count = index_query(text, locate_res, INDEX_MAX_RESULTS);
+    free(text);
+}
+
+// like the jump prompt, over every name in the index. picking one goes
+// to its dir with the cursor on it
+static void
+update_mode_locate(files_t *f)
+{
+    render_input(f, "locate: ");
+    int ch = getch();
+    switch (ch) {
+    case KEY_UP:
+    case CTRL('p'):
+        if (locate_sel > 0) --locate_sel;
+        return;
+    case KEY_DOWN:
+    case CTRL('n'):
+        if (locate_sel+1 < locate_count) ++locate_sel;
+        return;
+    default:
+        ungetch(ch);
+        break;
+    }
+
+    if (update_input(f)) {
+        last_mode = MODE_LOCATE;
+        mode = MODE_NORMAL;
+        if (locate_count) {
+            char *path = locate_res[locate_sel];
+            size_t len = strlen(path);
+            size_t end = (path[len-1] == '/')? len-1 : len;
+            char *slash = path + end;
+            while (slash > path && *--slash != '/');
+            if (*slash == '/') {
+                snprintf(select_name, sizeof(select_name), "%s", slash + 1);
+                if (slash == path) slash[1] = '\0';
+                else slash[0] = '\0';
+                change_dir(f, path);
+            }
+        }
+        input.text.size = 0;
+        query_locate();
+        return;
+    }
+    query_locate();
+}
+
+// the view follows every keystroke, cancelling drops the filter
+static void
+update_mode_filter(files_t *f)
+{
+    render_input(f, "filter: ");
+    bool done = update_input(f);
+    if (mode == MODE_NORMAL) {
+        last_mode = MODE_FILTER;
+        if (!done) set_filter(f, "");
+        return;
+    }
+
+    char *text = string_to_cstr(input.text);
+    if (set_filter(f, text)) {
+        STATUS("%s", "");
+    }
+    else {
+        STATUS("bad regex: %s", text + 1);
+    }
+    free(text);
+}
+
+static void
+update_mode_perms(files_t *f)
+{
+    render_input(f, "perms: ");
+    if (!update_input(f)) return;
+    last_mode = MODE_PERMS;
+    mode = MODE_NORMAL;
+    if (!input.text.size) return;
+
+    char *text = string_to_cstr(input.text);
+    input.text.size = input.cursor = 0;
+    perms_spec_t spec;
+    const char *err = perms_parse(text, &spec);
+    free(text);
+    if (err) {
+        STATUS("perms: %s", err);
+        return;
+    }
+
+    free_perms_names();
+    size_t n = selected.size? selected.size : 1;
+    char **paths = malloc(n * sizeof(char*));
+    perms_names = malloc(n * sizeof(char*));
+    for (size_t i = 0; i < n; ++i) {
+        entry_t e = selected.size? selected.data[i] : f->data[f->curr.pos];
+        char *dir = selected.size? e.path : f->dir;
+        char *name = string_to_cstr(e.name);
+        size_t len = strlen(name);
+        while (len > 1 && name[len-1] == '/') name[--len] = '\0';
+        paths[i] = smprintf("%s/%s", dir, name);
+        if (strcmp(dir, f->dir) == 0)
+            perms_names[perms_nnames++] = name;
+        else
+            free(name);
+    }
+
+    if (perms_start(paths, n, &spec)) {
+        STATUS("%s", "perms: counting");
+        clear_selection(&selected);
+    }
+    else {
+        STATUS("%s", "perms: couldn't start");
+        free_perms_names();
+    }
+    for (size_t i = 0; i < n; ++i)
+        free(paths[i]);
+    free(paths);
+}
+
+static void
+update_mode_perms_confirm(files_t *f)
+{
+    size_t seen, changed;
+    bool counted, applied;
+    perms_result(&seen, &changed, &counted, &applied);
+
+    char prompt[128];
+    snprintf(prompt, sizeof(prompt), "perms: change %zu of %zu entries? [y/n] ", changed, seen);
+    render_input(f, prompt);
+    int ch = getch();
+    last_mode = MODE_PERMS_CONFIRM;
+    mode = MODE_NORMAL;
+    if ((ch == 'y' || ch == 'Y' || ch == '\n') && perms_commit()) {
+        STATUS("%s", "perms: applying");
+    }
+    else {
+        free_perms_names();
+        STATUS("%s", "perms: not applied");
+    }
+}
+
+// the selection stays selected after a plan, so it can be synced for
+// real straight from it
+static void
+update_mode_sync(files_t *f)
+{
+    render_input(f, "sync selection here? [y]es, by [c]ontents, [p]lan, [P]lan by contents ");
+    int ch = getch();
+    last_mode = MODE_SYNC;
+    mode = MODE_NORMAL;
+    if (ch <= 0 || ch >= 128 || !strchr("ycpP", ch)) return;
+    bool contents = (ch == 'c' || ch == 'P');
+    bool dry = (ch == 'p' || ch == 'P');
+
+    size_t n = selected.size;
+    char **paths = malloc(n * sizeof(char*));
+    for (size_t i = 0; i < n; ++i) {
+        entry_t e = selected.data[i];
+        paths[i] = smprintf("%s/"STR_FMT, e.path, STR_ARG(e.name));
+    }
+    if (sync_start(paths, n, f->dir, contents, dry)) {
+        STATUS("%s", dry? "sync: planning" : "sync: starting");
+        if (!dry) clear_selection(&selected);
+    }
+    else {
+        STATUS("%s", "sync: couldn't start");
+    }
+    for (size_t i = 0; i < n; ++i)
+        free(paths[i]);
+    free(paths);
+}
+
+// "-R text" looks in the dirs below too
+static void
+update_mode_grep(files_t *f)
+{
+    render_input(f, "grep: ");
+    if (!update_input(f)) return;
+    last_mode = MODE_GREP;
+    mode = MODE_NORMAL;
+
+    char *text = string_to_cstr(input.text);
+    char *what = text;
+    bool recursive = strncmp(what, "-R ", 3) == 0;
+    if (recursive) what += 3;
+    if (!*what) {
+        free(text);
+        return;
+    }
+
+    grep_free_hits(&grep_all);
+    if (f->virt == grep_title) {
+        f->virt = NULL;
+        f->curr = (cursor_t) {0, 0};
+        list_entries(f);
+    }
+    if (grep_start(f->dir, what, recursive, f->list_hidden)) {
+        STATUS("%s", "grep: starting");
+    }
+    else {
+        STATUS("%s", "grep: couldn't start");
+    }
+    free(text);
+}
+
+// the current dir is the left side, the marked one the right
+static void
+update_mode_compare(files_t *f)
+{
+    char prompt[MAX_PATH_SZ + 64];
+    snprintf(prompt, sizeof(prompt), "compare with %s? [y]es, by [c]ontents ", compare_mark);
+    render_input(f, prompt);
+    int ch = getch();
+    last_mode = MODE_COMPARE;
+    mode = MODE_NORMAL;
+    if (ch != 'y' && ch != 'c') return;
+
+    char rel[MAX_PATH_SZ];
+    relative_path(f->dir, compare_mark, rel, sizeof(rel));
+    if (compare_start(f->dir, compare_mark, rel, ch == 'c', f->list_hidden)) {
+        STATUS("%s", "compare: starting");
+    }
+    else {
+        STATUS("%s", "compare: couldn't start");
     }
 }
 
@@ -919,9 +2514,39 @@ update_files(files_t *f)
     case MODE_DELETE:
         update_mode_delete(f);
         break;
+    case MODE_PACK:
+        update_mode_pack(f);
+        break;
+    case MODE_PERMS:
+        update_mode_perms(f);
+        break;
+    case MODE_PERMS_CONFIRM:
+        update_mode_perms_confirm(f);
+        break;
+    case MODE_SYNC:
+        update_mode_sync(f);
+        break;
+    case MODE_GREP:
+        update_mode_grep(f);
+        break;
+    case MODE_COMPARE:
+        update_mode_compare(f);
+        break;
     case MODE_OPEN:
         update_mode_open(f);
         break;
+    case MODE_JUMP:
+        update_mode_jump(f);
+        break;
+    case MODE_LOCATE:
+        update_mode_locate(f);
+        break;
+    case MODE_TREE:
+        update_mode_tree(f);
+        break;
+    case MODE_FILTER:
+        update_mode_filter(f);
+        break;
     default: break;
     }
 }
@@ -929,11 +2554,84 @@ update_files(files_t *f)
 int
 main(int argc, const char *argv[])
 {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bool startup_bench = false;
+    int pick_to = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--startup-bench") == 0)
+            startup_bench = true;
+        else if (strcmp(argv[i], "--pick") == 0)
+            pick_to = STDOUT_FILENO;
+        else if (strncmp(argv[i], "--pick=", 7) == 0)
+            pick_to = atoi(argv[i] + 7);
+    }
+
+    // the picked paths get a copy of their fd of their own, and the
+    // terminal takes stdin and stdout for curses and whatever is run
+    if (pick_to >= 0) {
+        pick_fd = fcntl(pick_to, F_DUPFD_CLOEXEC, 3);
+        int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if (pick_fd < 0 || tty < 0) {
+            fprintf(stderr, "mfm: --pick needs a terminal and fd %d open\n", pick_to);
+            return 2;
+        }
+        dup2(tty, STDIN_FILENO);
+        dup2(tty, STDOUT_FILENO);
+        close(tty);
+        if (pick_to > STDERR_FILENO) close(pick_to);
+    }
+
+    // a picker comes and goes: files and dirs in their plain colours, no
+    // snapshot to paint and nothing to jump to
+    if (pick_fd < 0)
+        colors_load();
     string_t path = { .data = "./", .alloc = 2, .size = 2 };
     files_t files = init_files(path);
-
-    list_entries(&files);
+    char *root = string_to_cstr(files.path);
+    if (!vfs_init(getenv("MFM_VFS"), root))
+        STATUS("%s", "MFM_VFS makes no sense, using the disk");
+    free(root);
+
+    // paint the last listing of this directory right away if we have
+    // one, and only check whether it's still current once it's on screen
+    fs_init();
+    if (pick_fd < 0) {
+        session = load_session();
+        jumps = load_jump();
+    }
+    else {
+        session = (session_t) LIST_ALLOC(dirstate_t);
+        jumps = (jump_t) LIST_ALLOC(jump_entry_t);
+    }
+    files.list_hidden = session.list_hidden;
+    files.list_git = getenv("MFM_GIT") && atoi(getenv("MFM_GIT"));
+    bool warm = vfs->native && session_load_listing(&session, &files);
+    // a picker comes and goes, nothing is going to drive it
+    if (pick_fd < 0)
+        control_open();
+    if (vfs->native && pick_fd < 0)
+        indexing = index_start();
+    char interrupted[256];
+    if (vfs->native && pick_fd < 0 && ops_interrupted(interrupted, sizeof(interrupted)))
+        STATUS("%s was cut short, y resumes it", interrupted);
+
+    // otherwise the worker reads the directory while the terminal is
+    // being set up
+    if (!warm)
+        request_entries(&files);
     init_curses();
+    if (!warm)
+        await_entries(&files, fs_wait_ms(files.dir));
+
+    getmaxyx(stdscr, win_h, win_w);
+    if (warm)
+        restore_cursor(&files);
+    else if (files.state != LIST_PENDING)
+        entered_dir(&files);
+    if (pick_fd < 0)
+        jump_visit(&jumps, files.path);
 
     selected = (selection_t) LIST_ALLOC(entry_t);
 
@@ -944,15 +2642,42 @@ main(int argc, const char *argv[])
 
     for (;;) {
         getmaxyx(stdscr, win_h, win_w);
-        clear();
-        render_files(&files);
+        erase();
+        if (mode == MODE_JUMP)
+            render_jump(&files);
+        else if (mode == MODE_LOCATE)
+            render_locate(&files);
+        else if (mode == MODE_TREE)
+            render_tree(&files);
+        else
+            render_files(&files);
         render_status(&files);
+        if (startup_bench) {
+            refresh();
+            double ms = elapsed_ms(&start);
+            deinit_curses();
+            printf("first paint: %.3f ms, %zu entries%s\n", ms, files.size,
+                warm? " (snapshot)" : "");
+            return 0;
+        }
+        if (warm) {
+            // the snapshot is on screen, now check it's still current.
+            // the worker's listing only replaces it if the dir changed
+            warm = false;
+            refresh();
+            request_entries(&files);
+        }
+        // prompts draw themselves and wait in getch
+        if ((mode == MODE_NORMAL || mode == MODE_TREE) && !wait_events(&files))
+            continue;
         update_files(&files);
     }
 
     deinit_curses();
     quit(&files);
     free_files(&files);
+    free_session(&session);
+    free_jump(&jumps);
     LIST_FREE(input.text);
     LIST_FREE(selected);
     return 0;
@@ -2,13 +2,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include "mstring.h"
 #include "mlist.h"
-#include "mexec.h"
 #include "mfm.h"
+#include "fs.h"
+#include "archive.h"
+#include "bigdir.h"
+#include "colors.h"
+#include "columns.h"
+#include "vfs.h"
+#include "ops.h"
 
-static entry_t next_entry(char *entries, int *pos);
-static char *exec_ls(char *path);
+#define NAMES_CHUNK_SZ (64*1024)
+
+// entry names are carved out of big chunks instead of one malloc each
+typedef struct names_t {
+    struct names_t *next;
+    size_t used, size;
+    char data[];
+} names_t;
+
+static char *alloc_name(files_t *f, size_t sz);
+static void reset_entries(files_t *f);
+static void add_entry(files_t *f, const char *name, size_t sz, bool is_dir);
+static void set_mode(entry_t *e, mode_t mode, bool link);
+static void copy_modes(files_t *f);
+static bool apply_result(files_t *f, fs_result_t *r);
+static bool entry_visible(files_t *f, entry_t *e);
+static void build_view(files_t *f);
+static void clear_filter(filter_t *filter);
+static void prune_virtual(files_t *f);
+static void open_window(files_t *f);
+static int compare_cstr(const void *a, const void *b);
 
 char*
 string_to_cstr(string_t str)
@@ -19,14 +47,50 @@ string_to_cstr(string_t str)
     return s;
 }
 
+// absolute paths are cleaned up without touching the filesystem, so
+// walking around a dead mount can't block. only the relative start
+// path goes through realpath()
 string_t
 get_full_path(string_t path)
 {
     string_t full_path;
-    char cmd[MAX_CMD_SZ];
-    sprintf(cmd, "cd \""STR_FMT"\" && pwd", STR_ARG(path));
-    full_path.data = execscript(cmd);
-    full_path.size = full_path.alloc = strlen(full_path.data);
+    char *p = string_to_cstr(path);
+
+    if (p[0] != '/') {
+        char *res = realpath(p, NULL);
+        if (res) {
+            free(p);
+            p = res;
+        }
+    }
+    else {
+        char *out = malloc(strlen(p) + 2);
+        size_t sz = 0;
+        char *src = p;
+        while (*src) {
+            while (*src == '/') ++src;
+            char *end = strchr(src, '/');
+            if (!end) end = src + strlen(src);
+            size_t len = end - src;
+            if (len == 2 && src[0] == '.' && src[1] == '.') {
+                while (sz > 0 && out[sz-1] != '/') --sz;
+                if (sz > 0) --sz;
+            }
+            else if (len && !(len == 1 && src[0] == '.')) {
+                out[sz++] = '/';
+                memcpy(out + sz, src, len);
+                sz += len;
+            }
+            src = end;
+        }
+        if (sz == 0) out[sz++] = '/';
+        out[sz] = '\0';
+        free(p);
+        p = out;
+    }
+    full_path.data = p;
+    full_path.size = strlen(p);
+    full_path.alloc = full_path.size + 1;
     return full_path;
 }
 
@@ -34,189 +98,802 @@ files_t
 init_files(string_t path)
 {
     files_t files = (files_t) LIST_ALLOC(entry_t);
+    files.all = (entries_t) LIST_ALLOC(entry_t);
+    files.view = NULL;
+    files.filter = (filter_t) { .type = FILTER_ALL };
     files.path = get_full_path(path);
     files.curr = (cursor_t) {0, 0};
     files.list_hidden = false;
+    files.list_git = false;
+    files.mtime = 0;
+    files.snapshot = false;
+    files.dir = NULL;
+    files.names = NULL;
+    files.state = LIST_OK;
+    files.err = 0;
+    files.gen = 0;
+    files.entered = false;
+    files.in_archive = false;
+    files.virt = NULL;
+    files.windowed = false;
+    files.win_start = 0;
+    files.win_goto = SIZE_MAX;
+    files.win_pending = false;
     return files;
 }
 
 void
 free_files(files_t *f)
 {
-    for (int i = 0; i < f->size; ++i) {
-        LIST_FREE(f->data[i].name);
-    }
-
+    reset_entries(f);
+    free(f->dir);
+    f->dir = NULL;
+    clear_filter(&f->filter);
+    free(f->view);
+    f->view = NULL;
+    LIST_FREE(f->all);
     LIST_FREEP(f);
 }
 
+entry_t
+copy_entry(entry_t e)
+{
+    entry_t copy = e;
+    copy.name.alloc = e.name.size + 1;
+    copy.name.data = malloc(copy.name.alloc);
+    memcpy(copy.name.data, e.name.data, e.name.size);
+    copy.path = strdup(e.path);
+    return copy;
+}
+
+void
+clear_selection(selection_t *sel)
+{
+    for (int i = 0; i < sel->size; ++i) {
+        LIST_FREE(sel->data[i].name);
+        free(sel->data[i].path);
+    }
+    sel->size = 0;
+}
+
+// like mv, a dir that is already there gets the entry moved into it
 void
 rename_current_entry(files_t *f, string_t name)
 {
-    char cmd[MAX_CMD_SZ] = {0};
-    char *path = string_to_cstr(f->data[f->curr.pos].name);
-    char *new_name = string_to_cstr(name);
-    sprintf(cmd, "cd \""STR_FMT"\" && mv %s %s", STR_ARG(f->path), path, new_name);
-    char *res = execscript(cmd);
-    if (res) free(res);
-    free(path);
+    char from[MAX_PATH_SZ], to[MAX_PATH_SZ];
+    entry_t e = f->data[f->curr.pos];
+    snprintf(from, sizeof(from), "%s/%.*s", f->dir, (int) (e.name.size - e.is_dir), e.name.data);
+    snprintf(to, sizeof(to), "%s/"STR_FMT, f->dir, STR_ARG(name));
+
+    struct stat st;
+    if (fs_stat_path(to, &st, true) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(to, sizeof(to), "%s/"STR_FMT"/%.*s", f->dir, STR_ARG(name),
+            (int) (e.name.size - e.is_dir), e.name.data);
+    }
+    vfs->rename(from, to);
     list_entries(f);
 }
 
-void
+bool
 remove_current_entry(files_t *f)
 {
-    char cmd[MAX_CMD_SZ] = {0};
-    char *path = string_to_cstr(f->data[f->curr.pos].name);
-    sprintf(cmd, "cd \""STR_FMT"\" && rm -rf %s", STR_ARG(f->path), path);
-    char *res = execscript(cmd);
-    if (res) free(res);
-    free(path);
+    char path[MAX_PATH_SZ];
+    entry_t e = f->data[f->curr.pos];
+    snprintf(path, sizeof(path), "%s/%.*s", f->dir, (int) (e.name.size - e.is_dir), e.name.data);
+    if (vfs->native) {
+        char *paths[] = { path };
+        return ops_start(OPS_REMOVE, paths, 1, NULL);
+    }
+    vfs->remove(path);
     list_entries(f);
+    return true;
 }
 
-void
+// on disk the removal goes on in the background, list_entries is left
+// to whoever sees it finish
+bool
 remove_selected_entries(files_t *f, selection_t *sel)
 {
-    if (!sel->size) return;
-    char cmd[MAX_CMD_SZ] = {0};
-    char *res;
+    if (!sel->size) return true;
+    char **paths = malloc(sel->size * sizeof(char*));
 
     for (int i = 0; i < sel->size; ++i) {
         entry_t entry = sel->data[i];
-        sprintf(cmd, "rm -rf %s/"STR_FMT,
-            entry.path, STR_ARG(entry.name));
-        res = execscript(cmd);
-        if (res) free(res);
+        paths[i] = malloc(MAX_PATH_SZ);
+        snprintf(paths[i], MAX_PATH_SZ, "%s/%.*s", entry.path,
+            (int) (entry.name.size - entry.is_dir), entry.name.data);
+        if (!vfs->native) vfs->remove(paths[i]);
     }
 
-    list_entries(f);
+    bool res = true;
+    if (vfs->native) res = ops_start(OPS_REMOVE, paths, sel->size, NULL);
+    else list_entries(f);
+    for (int i = 0; i < sel->size; ++i)
+        free(paths[i]);
+    free(paths);
+    return res;
 }
 
-void
+// on disk a move that crosses filesystems is a copy, and goes on in the
+// background like one
+bool
 move_selected_entries(files_t *f, selection_t *sel)
 {
-    if (!sel->size) return;
-    char cmd[MAX_CMD_SZ] = {0};
-    char *res;
+    if (!sel->size) return true;
+    char from[MAX_PATH_SZ], to[MAX_PATH_SZ];
+
+    if (vfs->native) {
+        char **paths = malloc(sel->size * sizeof(char*));
+        for (int i = 0; i < sel->size; ++i) {
+            entry_t entry = sel->data[i];
+            paths[i] = malloc(MAX_PATH_SZ);
+            snprintf(paths[i], MAX_PATH_SZ, "%s/%.*s", entry.path,
+                (int) (entry.name.size - entry.is_dir), entry.name.data);
+        }
+        bool res = ops_start(OPS_MOVE, paths, sel->size, f->dir);
+        for (int i = 0; i < sel->size; ++i)
+            free(paths[i]);
+        free(paths);
+        return res;
+    }
 
     for (int i = 0; i < sel->size; ++i) {
         entry_t entry = sel->data[i];
-        sprintf(cmd, "mv \"%s/"STR_FMT"\" "STR_FMT"/",
-            entry.path, STR_ARG(entry.name), STR_ARG(f->path));
-        res = execscript(cmd);
-        if (res) free(res);
+        int name_sz = entry.name.size - entry.is_dir;
+        snprintf(from, sizeof(from), "%s/%.*s", entry.path, name_sz, entry.name.data);
+        snprintf(to, sizeof(to), "%s/%s", f->dir, strrchr(from, '/') + 1);
+        vfs->rename(from, to);
     }
     list_entries(f);
+    return true;
 }
 
-void
+bool
 copy_selected_entries(files_t *f, selection_t *sel)
 {
-    if (!sel->size) return;
-    char cmd[MAX_CMD_SZ] = {0};
-    char *res;
+    if (!sel->size) return true;
+    if (vfs->native && ops_running()) return false;
+    char src[MAX_PATH_SZ], file[MAX_PATH_SZ];
+    char **paths = malloc(sel->size * sizeof(char*));
+    size_t npaths = 0;
 
     for (int i = 0; i < sel->size; ++i) {
         entry_t entry = sel->data[i];
-        sprintf(cmd, "cp -r \"%s/"STR_FMT"\" "STR_FMT"/",
-            entry.path, STR_ARG(entry.name), STR_ARG(f->path));
-        res = execscript(cmd);
-        if (res) free(res);
+
+        // members of an archive are read out of it directly
+        const char *inner;
+        int name_sz = entry.name.size - entry.is_dir;
+        snprintf(src, sizeof(src), "%s/%.*s", entry.path, name_sz, entry.name.data);
+        if (vfs->native && archive_find(src, file, sizeof(file), &inner)) {
+            const char *base = strrchr(src, '/') + 1;
+            snprintf(file, sizeof(file), STR_FMT"/%s", STR_ARG(f->path), base);
+            archive_extract(src, file);
+            continue;
+        }
+        if (vfs->native) {
+            paths[npaths++] = strdup(src);
+            continue;
+        }
+
+        snprintf(file, sizeof(file), "%s/%s", f->dir, strrchr(src, '/') + 1);
+        vfs->copy(src, file);
     }
-    list_entries(f);
+
+    bool res = true;
+    if (npaths) res = ops_start(OPS_COPY, paths, npaths, f->dir);
+    else list_entries(f);
+    for (size_t i = 0; i < npaths; ++i)
+        free(paths[i]);
+    free(paths);
+    return res;
 }
 
 void
 create_file(files_t *f, string_t name)
 {
-    char cmd[MAX_CMD_SZ] = {0};
-    char *path = string_to_cstr(name);
-    sprintf(cmd, "cd \""STR_FMT"\" && touch %s", STR_ARG(f->path), path);
-    char *res = execscript(cmd);
-    if (res) free(res);
-    free(path);
+    char path[MAX_PATH_SZ];
+    snprintf(path, sizeof(path), "%s/"STR_FMT, f->dir, STR_ARG(name));
+    vfs->create(path);
     list_entries(f);
 }
 
 void
 create_dir(files_t *f, string_t name)
 {
-    char cmd[MAX_CMD_SZ] = {0};
-    char *path = string_to_cstr(name);
-    sprintf(cmd, "cd \""STR_FMT"\" && mkdir %s", STR_ARG(f->path), path);
-    char *res = execscript(cmd);
-    if (res) free(res);
-    free(path);
+    char path[MAX_PATH_SZ];
+    snprintf(path, sizeof(path), "%s/"STR_FMT, f->dir, STR_ARG(name));
+    vfs->mkdir(path);
     list_entries(f);
 }
 
 void
 list_entries(files_t *f)
 {
-    f->size = 0;
+    request_entries(f);
+    if (f->state == LIST_PENDING)
+        await_entries(f, fs_wait_ms(f->dir));
+}
+
+// ask the worker for f->path. a listing of the directory already shown
+// stays up until the new one is in
+void
+request_entries(files_t *f)
+{
     char *path = string_to_cstr(f->path);
-    char *entries = exec_ls(path);
-    int pos = 0;
+    f->entered = !f->dir || strcmp(path, f->dir) != 0;
+    if (f->entered) {
+        clear_filter(&f->filter);
+        reset_entries(f);
+        f->mtime = 0;
+    }
+    free(path);
+
+    if (f->virt && !f->entered) {
+        if (!f->virt_fixed) prune_virtual(f);
+        return;
+    }
+    f->virt = NULL;
+
+    // a directory that was too big still is, read it again from the window
+    if (f->windowed && !f->entered) {
+        size_t index = window_index(f);
+        bigdir_open(f->dir, f->list_hidden);
+        window_goto(f, index);
+        return;
+    }
+    if (f->windowed) {
+        bigdir_close();
+        f->windowed = false;
+    }
+
+    // hidden files are always read, whether they show is up to the view
+    int flags = FS_LIST_HIDDEN;
+    if (f->list_git) flags |= FS_LIST_GIT;
+    f->gen = fs_list(f->dir, flags);
+    f->state = LIST_PENDING;
+}
 
-    while (pos < strlen(entries)) {
-        entry_t entry = next_entry(entries, &pos);
-        // hide hidden files lul
-        if (entry.name.data[0] == '.' && !f->list_hidden) {
-            LIST_FREE(entry.name);
+// block for at most ms until the listing is in
+bool
+await_entries(files_t *f, int ms)
+{
+    fs_result_t *r = fs_wait(f->gen, ms);
+    if (!r) return false;
+    return apply_result(f, r);
+}
+
+// pick up whatever the worker has for us, returns true if f changed
+bool
+poll_entries(files_t *f)
+{
+    bool changed = false;
+    fs_result_t *r;
+    while ((r = fs_poll(f->gen)))
+        changed |= apply_result(f, r);
+
+    if (f->state == LIST_PENDING && fs_expired(f->gen)) {
+        f->state = LIST_UNREACHABLE;
+        changed = true;
+    }
+    return changed;
+}
+
+static bool
+apply_result(files_t *f, fs_result_t *r)
+{
+    if (r->kind == FS_LISTED) {
+        if (r->err == EFBIG) {
+            open_window(f);
+        }
+        else if (r->err) {
+            reset_entries(f);
+            f->mtime = 0;
+            f->err = r->err;
+            f->state = (r->err == ETIMEDOUT)? LIST_UNREACHABLE : LIST_ERROR;
+            f->in_archive = false;
         }
         else {
-            strncpy(entry.path, path, strlen(path));
-            entry.path[strlen(path)] = '\0';
-            LIST_ADDP(f, f->size, entry);
+            // a snapshot of a dir that hasn't changed since is as good.
+            // git status changes with the files, not with the dir
+            if (!f->snapshot || f->list_git || !r->mtime || r->mtime != f->mtime)
+                fill_entries(f, r->buf, r->sz);
+            f->in_archive = r->archive;
+            f->mtime = r->mtime;
+            f->state = LIST_OK;
         }
+        f->snapshot = false;
+        if (f->curr.pos >= (int) f->size)
+            f->curr.pos = f->size? f->size-1 : 0;
+        if (f->curr.offset > f->curr.pos)
+            f->curr.offset = f->curr.pos;
     }
+    else if (r->kind == FS_STATED && r->count == f->all.size) {
+        for (size_t i = 0; i < r->count; ++i)
+            set_mode(&f->all.data[i], r->modes[i], r->links && r->links[i]);
+        free(f->meta);
+        f->meta = r->meta;
+        r->meta = NULL;
+        columns_reset(f);
+        if (f->filter.type == FILTER_EXEC)
+            update_view(f);
+        copy_modes(f);
+    }
+    else if (r->kind == FS_GIT && r->count == f->all.size) {
+        for (size_t i = 0; i < r->count; ++i)
+            f->all.data[i].git = r->git[i];
+        for (size_t i = 0; i < f->size; ++i)
+            f->data[i].git = f->all.data[f->view[i]].git;
+    }
+    fs_free_result(r);
+    return true;
+}
+
+void
+fill_entries(files_t *f, const char *entries, size_t sz)
+{
+    reset_entries(f);
 
-    // free(path);
-    free(entries);
+    size_t pos = 0;
+    while (pos < sz) {
+        const char *name = entries + pos;
+        const char *end = memchr(name, '\n', sz - pos);
+        size_t len = end? end - name : sz - pos;
+        pos += len + 1;
+
+        if (!len) continue;
+        bool is_dir = (name[len-1] == '/');
+        add_entry(f, name, len - is_dir, is_dir);
+    }
+    build_view(f);
 }
 
-static entry_t
-next_entry(char *entries, int *pos)
+static bool
+entry_visible(files_t *f, entry_t *e)
 {
-    entry_t e;
-    e.name = ALLOC_STRING;
-    int i = *pos;
+    // hide hidden files lul
+    if (e->name.data[0] == '.' && !f->list_hidden && !f->virt)
+        return false;
 
-    while (i < strlen(entries) && entries[i] != '\n') {
-        LIST_ADD(e.name, e.name.size, entries[i]);
-        ++i;
+    switch (f->filter.type) {
+    case FILTER_DIRS:
+        if (!e->is_dir) return false;
+        break;
+    case FILTER_FILES:
+        if (e->is_dir) return false;
+        break;
+    case FILTER_EXEC:
+        if (e->is_dir || !(e->mode & S_IXUSR)) return false;
+        break;
     }
-    ++i;
+    if (!f->filter.text) return true;
 
-    e.is_dir = (e.name.data[e.name.size-1] == '/');
+    char name[MAX_PATH_SZ];
+    size_t sz = e->name.size - e->is_dir;
+    if (sz >= sizeof(name)) return false;
+    memcpy(name, e->name.data, sz);
+    name[sz] = '\0';
 
-    *pos = i;
-    return e;
+    if (f->filter.regex)
+        return regexec(&f->filter.re, name, 0, NULL, 0) == 0;
+    return fnmatch(f->filter.text, name, FNM_PERIOD) == 0;
 }
 
-static char*
-exec_ls(char *path)
+// the view is rebuilt from memory only, it costs a pass over the listing
+static void
+build_view(files_t *f)
 {
-    char cmd[MAX_CMD_SZ] = {0};
-    sprintf(cmd, "ls -A1p --group-directories-first --color=none \"%s\"", path);
+    if (f->alloc < f->all.size + 1) {
+        f->alloc = f->all.alloc + 1;
+        f->data = realloc(f->data, f->alloc * sizeof(entry_t));
+        f->view = realloc(f->view, f->alloc * sizeof(uint32_t));
+    }
+    else if (!f->view) {
+        f->view = malloc(f->alloc * sizeof(uint32_t));
+    }
 
-	FILE *fp;
-	char retval[CMD_RET_SZ+1];
-	size_t rv;
+    f->size = 0;
+    for (size_t i = 0; i < f->all.size; ++i) {
+        if (!entry_visible(f, &f->all.data[i])) continue;
+        f->view[f->size] = i;
+        f->data[f->size++] = f->all.data[i];
+    }
+}
 
-	memset(retval, 0, sizeof(retval));
+// like build_view, but the cursor stays on the entry it was on if that
+// is still visible, or the closest one before it
+void
+update_view(files_t *f)
+{
+    size_t keep = (f->size && f->view)? f->view[f->curr.pos] : 0;
+    build_view(f);
 
-	fp = popen(cmd, "r");
-	if (fp == NULL)
-		return smprintf("");
+    int pos = 0;
+    for (size_t i = 0; i < f->size && f->view[i] <= keep; ++i)
+        pos = i;
+    f->curr.pos = pos;
+    if (f->curr.offset > f->curr.pos)
+        f->curr.offset = f->curr.pos;
+}
 
-	rv = fread(retval, 1, sizeof(retval), fp);
+// show a result set under f->path in place of its listing. groups has
+// one entry per name, or is NULL
+void
+fill_virtual(files_t *f, const char *title, const char *entries,
+        size_t sz, const uint32_t *groups)
+{
+    // whatever the worker still sends for the directory is dropped
+    f->gen = 0;
+    f->state = LIST_OK;
+    f->entered = false;
+    clear_filter(&f->filter);
+    fill_entries(f, entries, sz);
+    if (f->windowed) {
+        bigdir_close();
+        f->windowed = false;
+    }
+    f->virt = title;
+    f->virt_fixed = false;
+    f->virt_marks = NULL;
+    f->mtime = 0;
+    for (size_t i = 0; groups && i < f->all.size; ++i)
+        f->all.data[i].group = groups[i];
+    build_view(f);
+    f->curr = (cursor_t) {0, 0};
+}
 
-	pclose(fp);
-	if (rv == 0)
-		return smprintf("");
-	retval[strlen(retval)-1] = '\0';
+// the closest a result listing gets to being re-read: drop what is gone,
+// what has become a link to another entry of its group, and groups that
+// are down to one entry. marked groups are only kinds of entries
+static void
+prune_virtual(files_t *f)
+{
+    // the stats go through the fs worker, a listing that can't be
+    // checked in time stays as it is
+    size_t count = f->all.size;
+    char **paths = malloc((count + 1) * sizeof(char*));
+    for (size_t i = 0; i < count; ++i)
+        paths[i] = smprintf("%s/"STR_FMT, f->dir, STR_ARG(f->all.data[i].name));
+    struct stat *sts = malloc((count + 1) * sizeof(struct stat));
+    int *errs = malloc((count + 1) * sizeof(int));
+    bool ok = fs_stat(paths, count, false, sts, errs, NULL);
+    for (size_t i = 0; i < count; ++i)
+        free(paths[i]);
+    free(paths);
+    if (!ok) {
+        free(sts);
+        free(errs);
+        return;
+    }
+
+    bool grouped = !f->virt_marks;
+    dev_t *devs = malloc((count + 1) * sizeof(dev_t));
+    ino_t *inos = malloc((count + 1) * sizeof(ino_t));
+    size_t n = 0, start = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        entry_t e = f->all.data[i];
+        if (errs[i]) continue;
+
+        if (!n || f->all.data[n-1].group != e.group)
+            start = n;
+        bool linked = false;
+        for (size_t j = start; grouped && e.group && j < n; ++j)
+            linked |= devs[j] == sts[i].st_dev && inos[j] == sts[i].st_ino;
+        if (linked) continue;
+
+        devs[n] = sts[i].st_dev;
+        inos[n] = sts[i].st_ino;
+        f->all.data[n++] = e;
+    }
+    free(devs);
+    free(inos);
+    free(sts);
+    free(errs);
+
+    size_t m = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && f->all.data[j].group == f->all.data[i].group) ++j;
+        if (!grouped || !f->all.data[i].group || j - i > 1) {
+            for (size_t k = i; k < j; ++k)
+                f->all.data[m++] = f->all.data[k];
+        }
+        i = j;
+    }
+    f->all.size = m;
+
+    update_view(f);
+    if (f->curr.pos >= (int) f->size)
+        f->curr.pos = f->size? f->size-1 : 0;
+    if (f->curr.offset > f->curr.pos)
+        f->curr.offset = f->curr.pos;
+}
+
+static int
+compare_cstr(const void *a, const void *b)
+{
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+// refresh the metadata of a few entries of the listing after changing
+// it ourselves, which is cheaper than reading the directory again
+void
+restat_entries(files_t *f, char **names, size_t n)
+{
+    if (!n) return;
+    qsort(names, n, sizeof(char*), compare_cstr);
+
+    // which entries they are first, then their stats in one go on the
+    // fs worker
+    char name[MAX_PATH_SZ], path[MAX_PATH_SZ];
+    size_t *at = malloc(n * sizeof(size_t));
+    char **paths = malloc(n * sizeof(char*));
+    size_t count = 0;
+    for (size_t i = 0; i < f->all.size && count < n; ++i) {
+        entry_t *e = &f->all.data[i];
+        size_t sz = e->name.size - e->is_dir;
+        if (sz >= sizeof(name)) continue;
+        memcpy(name, e->name.data, sz);
+        name[sz] = '\0';
+        char *key = name;
+        if (!bsearch(&key, names, n, sizeof(char*), compare_cstr)) continue;
+
+        int len = snprintf(path, sizeof(path), "%s/%s", f->dir, name);
+        if (len < 0 || len >= (int) sizeof(path)) continue;
+        at[count] = i;
+        paths[count++] = strdup(path);
+    }
+
+    struct stat *sts = malloc((count + 1) * sizeof(struct stat));
+    int *errs = malloc((count + 1) * sizeof(int));
+    bool *links = malloc((count + 1) * sizeof(bool));
+    if (fs_stat(paths, count, true, sts, errs, links)) {
+        for (size_t j = 0; j < count; ++j) {
+            entry_t *e = &f->all.data[at[j]];
+            struct stat *st = &sts[j];
+            bool ok = !errs[j];
+            set_mode(e, ok? st->st_mode : 0, links[j]);
+            if (f->meta && ok) {
+                f->meta[at[j]] = (fs_meta_t) {
+                    st->st_uid, st->st_gid, st->st_nlink, st->st_size, st->st_mtim.tv_sec,
+                };
+            }
+        }
+    }
+    for (size_t j = 0; j < count; ++j)
+        free(paths[j]);
+    free(paths);
+    free(at);
+    free(sts);
+    free(errs);
+    free(links);
+    columns_reset(f);
+    if (f->filter.type == FILTER_EXEC && !f->windowed)
+        update_view(f);
+    copy_modes(f);
+}
+
+// the listing gave up on the directory, from now on only a window of
+// it is kept around the cursor
+static void
+open_window(files_t *f)
+{
+    reset_entries(f);
+    clear_filter(&f->filter);
+    build_view(f);
+    f->mtime = 0;
+    f->state = LIST_OK;
+    f->in_archive = false;
+    f->windowed = true;
+    f->win_start = 0;
+    f->curr = (cursor_t) {0, 0};
+    bigdir_open(f->dir, f->list_hidden);
+    window_goto(f, 0);
+}
+
+// where the cursor is in the whole directory
+size_t
+window_index(files_t *f)
+{
+    if (f->win_pending && f->win_goto != SIZE_MAX)
+        return f->win_goto;
+    if (!f->size) return f->win_start;
+    return f->win_start + f->view[f->curr.pos];
+}
+
+// BIGDIR_END goes to the last entry
+void
+window_goto(files_t *f, size_t index)
+{
+    size_t start = index;
+    if (index != BIGDIR_END)
+        start = (index > BIGDIR_WINDOW/2)? index - BIGDIR_WINDOW/2 : 0;
+    f->win_goto = index;
+    f->win_pending = true;
+    bigdir_request(start);
+}
+
+// once the cursor gets close to an edge of the window, the next one is
+// asked for. the cursor can keep moving meanwhile
+void
+window_follow(files_t *f)
+{
+    if (!f->windowed || f->win_pending || !f->size) return;
+    bool exact;
+    size_t count = bigdir_count(&exact);
+    size_t margin = BIGDIR_WINDOW / 8;
+    size_t index = window_index(f);
+    bool near_start = f->win_start && index < f->win_start + margin;
+    bool near_end = index + margin >= f->win_start + f->all.size
+        && (!exact || f->win_start + f->all.size < count);
+    if (!near_start && !near_end) return;
+
+    size_t start = (index > BIGDIR_WINDOW/2)? index - BIGDIR_WINDOW/2 : 0;
+    if (start == f->win_start) return;
+    f->win_goto = SIZE_MAX;
+    f->win_pending = true;
+    bigdir_request(start);
+}
+
+void
+window_search(files_t *f, const char *text, bool back)
+{
+    f->win_goto = SIZE_MAX;
+    f->win_pending = true;
+    bigdir_search(window_index(f), text, back);
+}
+
+// pick up the window, if it's in. returns WINDOW_*
+int
+poll_window(files_t *f)
+{
+    bigdir_window_t *w = bigdir_take();
+    if (!f->windowed || !w) {
+        bigdir_free_window(w);
+        return f->windowed? WINDOW_FOLLOWED : WINDOW_IDLE;
+    }
+
+    size_t index = window_index(f);
+    bool jumped = f->win_goto != SIZE_MAX || w->search;
+    if (w->search && w->found == SIZE_MAX) {
+        f->win_pending = false;
+        bigdir_free_window(w);
+        return WINDOW_MISSED;
+    }
+    if (w->search) index = w->found;
+    else if (index == BIGDIR_END) index = w->start + w->count - 1;
+
+    // following the cursor, it stays on the same row of the screen
+    int row = f->curr.pos - f->curr.offset;
+    fill_entries(f, w->buf, w->sz);
+    for (size_t i = 0; i < f->all.size && i < w->count; ++i)
+        set_mode(&f->all.data[i], w->modes[i], false);
+    copy_modes(f);
+    f->win_start = w->start;
+    f->win_pending = false;
+    f->win_goto = SIZE_MAX;
+
+    int pos = (index > w->start)? (int) (index - w->start) : 0;
+    if (pos >= (int) f->size) pos = f->size? f->size-1 : 0;
+    f->curr.pos = pos;
+    f->curr.offset = (pos > row)? pos - row : 0;
+    bigdir_free_window(w);
+    return jumped? WINDOW_JUMPED : WINDOW_FOLLOWED;
+}
+
+static void
+clear_filter(filter_t *filter)
+{
+    if (filter->text && filter->regex)
+        regfree(&filter->re);
+    free(filter->text);
+    filter->text = NULL;
+    filter->regex = false;
+}
+
+// empty text clears the filter, "~re" is an extended regex, anything
+// else a glob. false if the regex doesn't compile
+bool
+set_filter(files_t *f, const char *text)
+{
+    filter_t filter = { .type = f->filter.type };
+    if (text[0] == '~') {
+        if (regcomp(&filter.re, text + 1, REG_EXTENDED | REG_NOSUB) != 0)
+            return false;
+        filter.regex = true;
+        filter.text = strdup(text);
+    }
+    else if (text[0] && !strpbrk(text, "*?[")) {
+        // plain text matches anywhere in the name
+        filter.text = malloc(strlen(text) + 3);
+        sprintf(filter.text, "*%s*", text);
+    }
+    else if (text[0]) {
+        filter.text = strdup(text);
+    }
+
+    clear_filter(&f->filter);
+    f->filter = filter;
+    update_view(f);
+    return true;
+}
+
+void
+set_filter_type(files_t *f, int type)
+{
+    f->filter.type = type;
+    update_view(f);
+}
+
+static char *
+alloc_name(files_t *f, size_t sz)
+{
+    names_t *chunk = f->names;
+    if (!chunk || chunk->used + sz > chunk->size) {
+        size_t size = (sz > NAMES_CHUNK_SZ)? sz : NAMES_CHUNK_SZ;
+        chunk = malloc(sizeof(names_t) + size);
+        chunk->next = f->names;
+        chunk->used = 0;
+        chunk->size = size;
+        f->names = chunk;
+    }
+    char *name = chunk->data + chunk->used;
+    chunk->used += sz;
+    return name;
+}
+
+static void
+reset_entries(files_t *f)
+{
+    while (f->names) {
+        names_t *next = ((names_t*) f->names)->next;
+        free(f->names);
+        f->names = next;
+    }
+    f->size = 0;
+    f->all.size = 0;
+    free(f->meta);
+    f->meta = NULL;
+    columns_reset(f);
 
-	return smprintf("%s", retval);
+    // every entry of the listing shares the same path string
+    free(f->dir);
+    f->dir = string_to_cstr(f->path);
+}
+
+static void
+add_entry(files_t *f, const char *name, size_t sz, bool is_dir)
+{
+    entry_t entry;
+    entry.name.size = sz + is_dir;
+    entry.name.alloc = entry.name.size;
+    entry.name.data = alloc_name(f, entry.name.size);
+    memcpy(entry.name.data, name, sz);
+    if (is_dir) entry.name.data[sz] = '/';
+    entry.path = f->dir;
+    entry.is_dir = is_dir;
+    entry.mode = 0;
+    entry.git = 0;
+    entry.group = 0;
+    entry.style = colors_classify(name, sz, is_dir? S_IFDIR : 0, false);
+    LIST_ADD(f->all, f->all.size, entry);
+}
+
+// the style goes with the metadata, so drawing never has to work it out
+static void
+set_mode(entry_t *e, mode_t mode, bool link)
+{
+    e->mode = mode;
+    e->style = colors_classify(e->name.data, e->name.size - e->is_dir,
+        mode? mode : (e->is_dir? S_IFDIR : 0), link);
+}
+
+// the view holds copies of the entries, they need the new metadata too
+static void
+copy_modes(files_t *f)
+{
+    for (size_t i = 0; i < f->size; ++i) {
+        f->data[i].mode = f->all.data[f->view[i]].mode;
+        f->data[i].style = f->all.data[f->view[i]].style;
+    }
 }
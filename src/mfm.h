@@ -3,6 +3,9 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <regex.h>
+#include <sys/stat.h>
 #include "mlist.h"
 #include "mstring.h"
 
@@ -13,6 +16,28 @@
 #define MAX_CMD_SZ 2048
 #define CMD_RET_SZ (2048*8)
 
+enum {
+    LIST_OK,
+    LIST_PENDING,     // waiting on the worker
+    LIST_UNREACHABLE, // the mount stopped answering
+    LIST_ERROR,
+};
+
+// what picking up a window did
+enum {
+    WINDOW_IDLE,
+    WINDOW_FOLLOWED, // the cursor stayed on its entry
+    WINDOW_JUMPED,   // the cursor went where it was asked to
+    WINDOW_MISSED,   // a search found nothing
+};
+
+enum {
+    FILTER_ALL,
+    FILTER_DIRS,
+    FILTER_FILES,
+    FILTER_EXEC,
+};
+
 typedef struct cursor_t {
     int pos, offset;
 } cursor_t;
@@ -20,31 +45,89 @@ typedef struct cursor_t {
 // all files are 'entries'
 typedef struct entry_t {
     string_t name;
-    char path[MAX_PATH_SZ];
+    char *path; // shared with the listing, owned by selected entries
     bool is_dir;
+    mode_t mode; // 0 until the metadata is in
+    uint8_t git; // GIT_* flags, 0 until the markers are in
+    uint8_t style; // colours to draw it with, see colors.h
+    uint32_t group; // result listings: entries that belong together
 } entry_t;
 
 LIST_DEFINE(entry_t, selection_t);
+LIST_DEFINE(entry_t, entries_t);
 
+// what of the listing is visible. changing it never touches the disk
+typedef struct filter_t {
+    int type;      // FILTER_*
+    char *text;    // as typed, NULL if there is none
+    bool regex;    // text is "~regex" rather than a glob
+    regex_t re;
+} filter_t;
+
+// data is the view, all is the listing it is built from
 typedef struct files_t {
     entry_t *data;
     size_t size, alloc;
+    entries_t all;   // everything in the directory, hidden files too
+    uint32_t *view;  // data[i] is a copy of all.data[view[i]]
+    filter_t filter;
     string_t path;
     cursor_t curr;
     bool list_hidden;
+    bool list_git; // ask the worker for git markers
+    bool list_long; // columns with the metadata before the names
+    int64_t mtime; // mtime of path when it was listed, 0 if unknown
+    bool snapshot; // the entries came from the session, not a listing
+    char *dir;     // path as a c string, shared by all entries
+    void *names;   // storage for the entry names
+    int state;     // LIST_*
+    int err;       // errno for LIST_ERROR
+    unsigned gen;  // listing request in flight
+    bool entered;  // the listing in flight is for a new directory
+    bool in_archive;  // path is inside an archive, read only
+    const char *virt; // shown instead of the directory: names are paths
+                      // relative to it. title for the header, or NULL
+    bool virt_fixed;  // the virtual names aren't paths, never prune them
+    const char *virt_marks; // shown for each group instead of its number
+    bool windowed;    // too big to hold, all is a window of the directory
+    size_t win_start; // index in the directory of all.data[0]
+    size_t win_goto;  // where the cursor goes once the window asked for
+                      // is in, SIZE_MAX to leave it where it is
+    bool win_pending;
+    struct fs_meta_t *meta; // one per entry of all, NULL until stated
+    char *cols;       // the long listing columns, see columns.h
+    size_t cols_w;
 } files_t;
 
 files_t init_files(string_t path);
 void free_files(files_t *f);
 string_t get_full_path(string_t path);
 void list_entries(files_t *f);
+void request_entries(files_t *f);
+bool await_entries(files_t *f, int ms);
+bool poll_entries(files_t *f);
+void fill_entries(files_t *f, const char *entries, size_t sz);
+void fill_virtual(files_t *f, const char *title, const char *entries,
+        size_t sz, const uint32_t *groups);
+void update_view(files_t *f);
+void restat_entries(files_t *f, char **names, size_t n);
+size_t window_index(files_t *f);
+void window_goto(files_t *f, size_t index);
+void window_follow(files_t *f);
+void window_search(files_t *f, const char *text, bool back);
+int poll_window(files_t *f);
+bool set_filter(files_t *f, const char *text);
+void set_filter_type(files_t *f, int type);
 void rename_current_entry(files_t *f, string_t name);
-void remove_current_entry(files_t *f);
+bool remove_current_entry(files_t *f);
 
 // TODO: rename_selected_entries (how tf am i gonna do that?)
-void remove_selected_entries(files_t *f, selection_t *sel);
-void move_selected_entries(files_t *f, selection_t *sel);
-void copy_selected_entries(files_t *f, selection_t *sel);
+bool remove_selected_entries(files_t *f, selection_t *sel);
+bool move_selected_entries(files_t *f, selection_t *sel);
+bool copy_selected_entries(files_t *f, selection_t *sel);
+
+entry_t copy_entry(entry_t e);
+void clear_selection(selection_t *sel);
 
 void create_file(files_t *f, string_t name);
 void create_dir(files_t *f, string_t name);
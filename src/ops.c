@@ -0,0 +1,936 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <zlib.h>
+#include "ops.h"
+#include "journal.h"
+#include "fs.h"
+#include "wake.h"
+
+#define OPS_SCAN 64  // how far down the queue a free worker looks
+
+enum {
+    DEV_HDD,
+    DEV_SSD,
+    DEV_NET,
+    DEV_MEM,
+    DEV_OTHER,
+};
+
+typedef struct class_t {
+    const char *name;
+    int start, max;  // depth to begin with, and never to go past
+} class_t;
+
+static const class_t classes[] = {
+    [DEV_HDD]   = { "hdd",  1, 2 },
+    [DEV_SSD]   = { "ssd",  4, OPS_MAX_THREADS },
+    [DEV_NET]   = { "net",  4, OPS_MAX_THREADS },
+    [DEV_MEM]   = { "mem",  4, 8 },
+    [DEV_OTHER] = { "disk", 2, 8 },
+};
+
+typedef struct device_t {
+    dev_t dev;
+    int cls;
+    int depth;      // tasks it may have running at once
+    int inflight;
+    // the window being measured
+    int64_t win_start;
+    uint64_t win_cost;  // bytes, plus OPS_OP_BYTES per task
+    int64_t win_us;     // time the tasks took, added up
+    bool win_full;      // depth was reached, so the numbers mean something
+    double rate;        // cost per second over the last window
+    double best_us;     // lowest time per unit of cost seen
+    bool grew;          // the last change was one more
+} device_t;
+
+typedef struct task_t {
+    char *src;
+    char *dst;   // NULL for removes
+    mode_t mode;
+    off_t size;
+    int64_t mtime;   // of src, ns
+    int sdev, ddev;  // in devices, ddev is -1 for removes
+    journal_rec_t last;  // where an earlier run got to with dst
+} task_t;
+
+typedef struct dir_t {
+    char *path;
+    mode_t mode;
+} dir_t;
+
+typedef struct job_t {
+    int kind;
+    char **paths;
+    size_t npaths;
+    char *dest;
+    mode_t umask;
+    bool resume;
+    bool *crossed;  // moves that had to be copied, their sources go last
+} job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false, reported = true;
+static volatile bool cancel = false;
+static int op_kind = OPS_COPY;
+static bool removing = false;  // the sources of a move are going
+
+// under lock
+static device_t *devices = NULL;
+static size_t ndevices = 0;
+static task_t *tasks = NULL;
+static size_t ntasks = 0, tasks_alloc = 0, head = 0, queued = 0;
+static bool walk_done = false;
+static size_t nfiles = 0, ndone = 0, nfailed = 0;
+static size_t nmoved = 0, nresumed = 0, ncopied = 0;
+static uint64_t total_bytes = 0, done_bytes = 0;
+static uint64_t resumed_bytes = 0;  // in done_bytes, but not copied now
+static int first_err = 0;
+static int64_t start_ms = 0, end_ms = 0;
+
+// only touched by the ops thread
+static dir_t *dirs = NULL;
+static size_t ndirs = 0, dirs_alloc = 0;
+
+static int64_t now_us(void);
+static void failed(int err);
+static int classify(dev_t dev, const char *path);
+static int find_device(dev_t dev, const char *path);
+static void lower_ioprio(void);
+static void adapt(device_t *d, uint64_t cost, int64_t us);
+static bool has_room(task_t *t);
+static task_t *next_task(void);
+static void queue_task(task_t t);
+static void add_dir(const char *path, mode_t mode);
+static int copy_data(int in, int out, char *buf, task_t *t, off_t pos);
+static off_t resume_at(int out, task_t *t, char *buf);
+static int run_task(task_t *t, char *buf);
+static void *worker_thread(void *arg);
+static void copy_walk(char *src, size_t slen, char *dst, size_t dlen, int ddev);
+static void remove_walk(char *path, size_t len);
+static void run_phase(job_t *job, int kind);
+static void *ops_thread(void *arg);
+static bool start(int kind, char **paths, size_t npaths, const char *dest, bool resume);
+
+static int64_t
+now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+failed(int err)
+{
+    pthread_mutex_lock(&lock);
+    nfailed++;
+    if (!first_err) first_err = err;
+    wake_notify(&wake, false);
+    pthread_mutex_unlock(&lock);
+}
+
+// what kind of thing is behind a device: the filesystem type says if
+// it's remote or in memory, sysfs if a block device spins. fuse could
+// be anything, mountinfo tells by its subtype and source
+static int
+classify(dev_t dev, const char *path)
+{
+    struct statfs sf;
+    bool net;
+    dev_t source;
+    if (statfs(path, &sf) == 0) {
+        switch ((unsigned long) sf.f_type) {
+        case 0x6969:      // nfs
+        case 0x517b:      // smb
+        case 0xfe534d42:  // smb2
+        case 0xff534d42:  // cifs
+        case 0x01021997:  // 9p
+        case 0x00c36400:  // ceph
+            return DEV_NET;
+        case 0x01021994:  // tmpfs
+        case 0x858458f6:  // ramfs
+            return DEV_MEM;
+        case 0x65735546:  // fuse
+            if (!fs_mount_info(dev, &net, &source)) return DEV_OTHER;
+            if (net) return DEV_NET;
+            if (!source) return DEV_OTHER;
+            dev = source;
+            break;
+        }
+    }
+
+    // a partition has no queue of its own, its disk does
+    char sys[128], val[8] = "";
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/queue/rotational",
+        major(dev), minor(dev));
+    FILE *fp = fopen(sys, "r");
+    if (!fp) {
+        snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/../queue/rotational",
+            major(dev), minor(dev));
+        fp = fopen(sys, "r");
+    }
+    if (!fp) return DEV_OTHER;
+    if (!fgets(val, sizeof(val), fp)) val[0] = '\0';
+    fclose(fp);
+    return (val[0] == '1')? DEV_HDD : (val[0] == '0')? DEV_SSD : DEV_OTHER;
+}
+
+static int
+find_device(dev_t dev, const char *path)
+{
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < ndevices; ++i) {
+        if (devices[i].dev == dev) {
+            pthread_mutex_unlock(&lock);
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    int cls = classify(dev, path);
+    pthread_mutex_lock(&lock);
+    devices = realloc(devices, (ndevices + 1) * sizeof(device_t));
+    devices[ndevices] = (device_t) {
+        .dev = dev,
+        .cls = cls,
+        .depth = classes[cls].start,
+        .win_start = now_ms(),
+    };
+    int res = ndevices++;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+// ioprio_set on the calling thread: best effort, lowest level
+static void
+lower_ioprio(void)
+{
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, 1, 0, (2 << 13) | 7);
+#endif
+}
+
+// called with the lock held when a task of d is over. more depth while
+// it pays, half as much once throughput drops or the time each unit of
+// work takes shows things queueing up
+static void
+adapt(device_t *d, uint64_t cost, int64_t us)
+{
+    d->win_cost += cost;
+    d->win_us += us;
+    int64_t now = now_ms();
+    if (now - d->win_start < OPS_WINDOW_MS) return;
+
+    double rate = d->win_cost * 1000.0 / (now - d->win_start);
+    double per_unit = d->win_cost? (double) d->win_us / d->win_cost : 0;
+    if (d->win_full) {
+        int max = classes[d->cls].max;
+        if (per_unit && (!d->best_us || per_unit < d->best_us))
+            d->best_us = per_unit;
+        if (d->rate && (rate < d->rate * 0.8 || per_unit > d->best_us * 4)) {
+            d->depth = (d->depth > 1)? d->depth / 2 : 1;
+            d->grew = false;
+        }
+        else if (!d->rate || rate > d->rate * 1.05) {
+            if (d->depth < max) d->depth++;
+            d->grew = true;
+        }
+        else if (d->grew && d->depth > 1) {
+            // the last one didn't buy anything
+            d->depth--;
+            d->grew = false;
+        }
+        d->rate = rate;
+    }
+    d->win_start = now;
+    d->win_cost = 0;
+    d->win_us = 0;
+    d->win_full = false;
+}
+
+// called with the lock held
+static bool
+has_room(task_t *t)
+{
+    device_t *s = &devices[t->sdev];
+    if (s->inflight >= s->depth) return false;
+    if (t->ddev < 0 || t->ddev == t->sdev) return true;
+    device_t *d = &devices[t->ddev];
+    return d->inflight < d->depth;
+}
+
+// called with the lock held. tasks that have been taken have no src
+static task_t *
+next_task(void)
+{
+    while (head < ntasks && !tasks[head].src) ++head;
+    for (size_t i = head; i < ntasks && i < head + OPS_SCAN; ++i) {
+        if (tasks[i].src && has_room(&tasks[i])) return &tasks[i];
+    }
+    return NULL;
+}
+
+static void
+queue_task(task_t t)
+{
+    pthread_mutex_lock(&lock);
+    if (ntasks == tasks_alloc) {
+        tasks_alloc = tasks_alloc? tasks_alloc*2 : 1024;
+        tasks = realloc(tasks, tasks_alloc * sizeof(task_t));
+    }
+    tasks[ntasks++] = t;
+    queued++;
+    nfiles++;
+    total_bytes += t.size;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+add_dir(const char *path, mode_t mode)
+{
+    if (ndirs == dirs_alloc) {
+        dirs_alloc = dirs_alloc? dirs_alloc*2 : 64;
+        dirs = realloc(dirs, dirs_alloc * sizeof(dir_t));
+    }
+    dirs[ndirs++] = (dir_t) { strdup(path), mode };
+}
+
+// from pos on. now and then the chunk just copied goes in the journal
+// with its checksum, read back from out when it didn't pass through buf
+static int
+copy_data(int in, int out, char *buf, task_t *t, off_t pos)
+{
+    bool fallback = false;
+    bool journaled = journal_active();
+    int64_t last = now_us();
+    for (;;) {
+        ssize_t n;
+        if (!fallback) {
+            n = copy_file_range(in, NULL, out, NULL, OPS_CHUNK_SZ, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                    || errno == EOPNOTSUPP)) {
+                fallback = true;
+                continue;
+            }
+        }
+        else {
+            n = read(in, buf, OPS_CHUNK_SZ);
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t w = write(out, buf + off, n - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) return errno;
+                off += w;
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        if (n == 0) return 0;
+
+        int64_t now = now_us();
+        if (journaled && now - last >= JOURNAL_FLUSH_MS * 1000
+                && (fallback || pread(out, buf, n, pos) == n)) {
+            journal_chunk(t->dst, pos, n, crc32(0, (Bytef*) buf, n), t->mtime);
+            last = now;
+        }
+        pos += n;
+
+        pthread_mutex_lock(&lock);
+        done_bytes += n;
+        wake_notify(&wake, false);
+        pthread_mutex_unlock(&lock);
+        if (cancel) return ECANCELED;
+    }
+}
+
+// where to go on with a file an earlier run got partway through: after
+// its last journaled chunk if the file still has that chunk as it was,
+// from the start otherwise
+static off_t
+resume_at(int out, task_t *t, char *buf)
+{
+    struct stat st;
+    journal_rec_t *j = &t->last;
+    if (j->state != JOURNAL_PARTIAL || j->len > OPS_CHUNK_SZ
+            || fstat(out, &st) < 0 || (uint64_t) st.st_size < j->off + j->len
+            || j->off + j->len > (uint64_t) t->size)
+        return 0;
+    if (pread(out, buf, j->len, j->off) != (ssize_t) j->len
+            || crc32(0, (Bytef*) buf, j->len) != j->crc)
+        return 0;
+    return j->off + j->len;
+}
+
+static int
+run_task(task_t *t, char *buf)
+{
+    if (!t->dst)
+        return (unlink(t->src) < 0)? errno : 0;
+
+    int in = open(t->src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0) return errno;
+    // read as well, for the checksums
+    int flags = (t->last.state == JOURNAL_PARTIAL)? 0 : O_TRUNC;
+    int out = open(t->dst, O_RDWR | O_CREAT | O_CLOEXEC | flags, t->mode);
+    if (out < 0) {
+        int err = errno;
+        close(in);
+        return err;
+    }
+
+    off_t from = resume_at(out, t, buf);
+    int err = 0;
+    if (ftruncate(out, from) < 0 || lseek(in, from, SEEK_SET) < 0
+            || lseek(out, from, SEEK_SET) < 0)
+        err = errno;
+    if (from && !err) {
+        pthread_mutex_lock(&lock);
+        done_bytes += from;
+        resumed_bytes += from;
+        nresumed++;
+        pthread_mutex_unlock(&lock);
+    }
+    if (!err) err = copy_data(in, out, buf, t, from);
+    close(in);
+    if (close(out) < 0 && !err) err = errno;
+    // half a file is worse than none, unless the journal says how much
+    // of it there is
+    if (err && !(err == ECANCELED && journal_active())) unlink(t->dst);
+    if (!err) journal_done(t->dst, t->size, t->mtime);
+    return err;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    (void) arg;
+    lower_ioprio();
+    char *buf = malloc(OPS_CHUNK_SZ);
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        task_t *next;
+        while (!(next = next_task()) && !cancel && !(walk_done && !queued))
+            pthread_cond_wait(&cond, &lock);
+        if (!next || cancel) break;
+
+        task_t t = *next;
+        next->src = NULL;
+        queued--;
+        device_t *s = &devices[t.sdev];
+        if (++s->inflight >= s->depth) s->win_full = true;
+        if (t.ddev >= 0 && t.ddev != t.sdev) {
+            device_t *d = &devices[t.ddev];
+            if (++d->inflight >= d->depth) d->win_full = true;
+        }
+        pthread_mutex_unlock(&lock);
+
+        int64_t start = now_us();
+        int err = run_task(&t, buf);
+        int64_t us = now_us() - start;
+
+        pthread_mutex_lock(&lock);
+        uint64_t cost = t.size + OPS_OP_BYTES;
+        devices[t.sdev].inflight--;
+        adapt(&devices[t.sdev], cost, us);
+        if (t.ddev >= 0 && t.ddev != t.sdev) {
+            devices[t.ddev].inflight--;
+            adapt(&devices[t.ddev], cost, us);
+        }
+        ndone++;
+        if (err && err != ECANCELED) {
+            nfailed++;
+            if (!first_err) first_err = err;
+        }
+        wake_notify(&wake, false);
+        pthread_cond_broadcast(&cond);
+        free(t.src);
+        free(t.dst);
+    }
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    free(buf);
+    return NULL;
+}
+
+// dirs are made right away and writable, their own modes are put back
+// once everything is in them
+static void
+copy_walk(char *src, size_t slen, char *dst, size_t dlen, int ddev)
+{
+    struct stat st, same;
+    if (lstat(src, &st) < 0) {
+        failed(errno);
+        return;
+    }
+    // a hardlink or a bind mount can make dst src under another name
+    if (lstat(dst, &same) == 0 && same.st_dev == st.st_dev && same.st_ino == st.st_ino) {
+        failed(EINVAL);
+        return;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        // an earlier run got to it before the source changed
+        journal_rec_t last = journal_lookup(dst);
+        struct stat dt;
+        if (last.mtime != fs_mtime(&st)) last.state = JOURNAL_NONE;
+        if (last.state == JOURNAL_DONE && last.size == (uint64_t) st.st_size
+                && lstat(dst, &dt) == 0 && S_ISREG(dt.st_mode) && dt.st_size == st.st_size) {
+            pthread_mutex_lock(&lock);
+            nfiles++;
+            ndone++;
+            nresumed++;
+            total_bytes += st.st_size;
+            done_bytes += st.st_size;
+            resumed_bytes += st.st_size;
+            wake_notify(&wake, false);
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        if (last.state == JOURNAL_DONE) last.state = JOURNAL_NONE;
+
+        int sdev = find_device(st.st_dev, src);
+        queue_task((task_t) {
+            strdup(src), strdup(dst), st.st_mode & 07777, st.st_size,
+            fs_mtime(&st), sdev, ddev, last,
+        });
+    }
+    else if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(src, target, sizeof(target) - 1);
+        if (n >= 0) target[n] = '\0';
+        unlink(dst);
+        if (n < 0 || symlink(target, dst) < 0) failed(errno);
+    }
+    else if (S_ISFIFO(st.st_mode)) {
+        if (mkfifo(dst, st.st_mode & 07777) < 0 && errno != EEXIST) failed(errno);
+    }
+    else if (S_ISDIR(st.st_mode)) {
+        if (mkdir(dst, 0700) < 0 && errno != EEXIST) {
+            failed(errno);
+            return;
+        }
+        add_dir(dst, st.st_mode & 07777);
+        DIR *dir = opendir(src);
+        if (!dir) {
+            failed(errno);
+            return;
+        }
+        struct dirent *de;
+        while ((de = readdir(dir)) && !cancel) {
+            char *name = de->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            int sn = snprintf(src + slen, PATH_MAX - slen, "/%s", name);
+            int dn = snprintf(dst + dlen, PATH_MAX - dlen, "/%s", name);
+            if (sn >= PATH_MAX - (int) slen || dn >= PATH_MAX - (int) dlen) {
+                failed(ENAMETOOLONG);
+            }
+            else {
+                copy_walk(src, slen + sn, dst, dlen + dn, ddev);
+            }
+            src[slen] = '\0';
+            dst[dlen] = '\0';
+        }
+        closedir(dir);
+    }
+    else {
+        failed(EOPNOTSUPP);
+    }
+}
+
+// dirs go once the files in them are gone, deepest first
+static void
+remove_walk(char *path, size_t len)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        failed(errno);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        int dev = find_device(st.st_dev, path);
+        queue_task((task_t) { strdup(path), NULL, 0, 0, 0, dev, -1 });
+        return;
+    }
+
+    add_dir(path, 0);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        failed(errno);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) && !cancel) {
+        char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        int n = snprintf(path + len, PATH_MAX - len, "/%s", name);
+        if (n >= PATH_MAX - (int) len) failed(ENAMETOOLONG);
+        else remove_walk(path, len + n);
+        path[len] = '\0';
+    }
+    closedir(dir);
+}
+
+// one pass of workers over the job's paths: the copies of a copy or a
+// move, the removes of a remove, or the sources a move had to copy
+static void
+run_phase(job_t *job, int kind)
+{
+    pthread_t threads[OPS_MAX_THREADS];
+    size_t started = 0;
+    pthread_mutex_lock(&lock);
+    walk_done = false;
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < OPS_MAX_THREADS; ++i) {
+        if (pthread_create(&threads[started], NULL, worker_thread, NULL) == 0)
+            started++;
+    }
+
+    char *src = malloc(PATH_MAX), *dst = malloc(PATH_MAX);
+    int ddev = -1;
+    char dest[PATH_MAX] = "";
+    struct stat st;
+    if (kind == OPS_COPY) {
+        if (stat(job->dest, &st) < 0 || !realpath(job->dest, dest)) failed(errno);
+        else ddev = find_device(st.st_dev, job->dest);
+    }
+
+    for (size_t i = 0; i < job->npaths && started && !cancel; ++i) {
+        size_t len = strlen(job->paths[i]);
+        while (len > 1 && job->paths[i][len-1] == '/') job->paths[i][--len] = '\0';
+        if (len >= PATH_MAX) {
+            failed(ENAMETOOLONG);
+            continue;
+        }
+        memcpy(src, job->paths[i], len + 1);
+        if (kind == OPS_REMOVE) {
+            if (job->kind == OPS_REMOVE || job->crossed[i])
+                remove_walk(src, len);
+            continue;
+        }
+        if (ddev < 0) break;
+
+        // a tree copied into itself would never run out of new entries
+        char real[PATH_MAX];
+        size_t rlen = realpath(src, real)? strlen(real) : 0;
+        const char *base = strrchr(src, '/')? strrchr(src, '/') + 1 : src;
+        int dlen = snprintf(dst, PATH_MAX, "%s/%s", dest, base);
+        bool inside = rlen && strncmp(dest, real, rlen) == 0
+            && (dest[rlen] == '/' || dest[rlen] == '\0');
+        if (job->kind == OPS_MOVE && !rlen && job->resume && errno == ENOENT)
+            continue;  // it went before things were cut short
+        if (inside || dlen >= PATH_MAX) {
+            failed(inside? EINVAL : ENAMETOOLONG);
+            continue;
+        }
+        // copied into the dir it's in, opening dst would truncate src
+        struct stat ss, ds;
+        if (lstat(src, &ss) == 0 && lstat(dst, &ds) == 0
+                && ss.st_dev == ds.st_dev && ss.st_ino == ds.st_ino) {
+            failed(EINVAL);
+            continue;
+        }
+        if (job->kind == OPS_MOVE) {
+            if (rename(src, dst) == 0) {
+                pthread_mutex_lock(&lock);
+                nmoved++;
+                wake_notify(&wake, false);
+                pthread_mutex_unlock(&lock);
+                continue;
+            }
+            if (errno != EXDEV) {
+                failed(errno);
+                continue;
+            }
+            job->crossed[i] = true;
+        }
+        copy_walk(src, len, dst, dlen, ddev);
+    }
+    free(src);
+    free(dst);
+
+    pthread_mutex_lock(&lock);
+    walk_done = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    if (!started) failed(EAGAIN);
+
+    for (size_t i = ndirs; i-- > 0; ) {
+        if (cancel) {
+            // copied dirs still get their modes, removes stop right here
+            if (kind == OPS_REMOVE) break;
+        }
+        if (kind == OPS_REMOVE && rmdir(dirs[i].path) < 0)
+            failed(errno);
+        if (kind == OPS_COPY && chmod(dirs[i].path, dirs[i].mode & ~job->umask) < 0)
+            failed(errno);
+    }
+    for (size_t i = 0; i < ndirs; ++i)
+        free(dirs[i].path);
+    free(dirs);
+    dirs = NULL;
+    ndirs = dirs_alloc = 0;
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = head; i < ntasks; ++i) {
+        free(tasks[i].src);
+        free(tasks[i].dst);
+    }
+    free(tasks);
+    tasks = NULL;
+    ntasks = tasks_alloc = head = queued = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+// moves within a filesystem are renames. the ones that aren't are
+// copied, and their sources removed once everything is across
+static void *
+ops_thread(void *arg)
+{
+    job_t *job = arg;
+    run_phase(job, (job->kind == OPS_REMOVE)? OPS_REMOVE : OPS_COPY);
+
+    bool crossed = false;
+    for (size_t i = 0; i < job->npaths; ++i)
+        crossed |= job->crossed[i];
+    if (job->kind == OPS_MOVE && crossed && !cancel && !nfailed) {
+        pthread_mutex_lock(&lock);
+        removing = true;
+        ncopied = ndone;
+        nfiles = ndone = 0;
+        pthread_mutex_unlock(&lock);
+        run_phase(job, OPS_REMOVE);
+    }
+    // cut short or with files that didn't make it, it can be picked
+    // up again later
+    if (job->kind != OPS_REMOVE) journal_end(!cancel && !nfailed);
+
+    pthread_mutex_lock(&lock);
+    running = false;
+    end_ms = now_ms();
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < job->npaths; ++i)
+        free(job->paths[i]);
+    free(job->paths);
+    free(job->crossed);
+    free(job->dest);
+    free(job);
+    return NULL;
+}
+
+static bool
+start(int kind, char **paths, size_t npaths, const char *dest, bool resume)
+{
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wake_open(&wake);
+    // devices are measured again every time, they may be busy with
+    // something else by now
+    free(devices);
+    devices = NULL;
+    ndevices = 0;
+    walk_done = false;
+    nfiles = ndone = nfailed = 0;
+    nmoved = nresumed = ncopied = 0;
+    total_bytes = done_bytes = resumed_bytes = 0;
+    first_err = 0;
+    start_ms = now_ms();
+    end_ms = 0;
+    op_kind = kind;
+    removing = false;
+    cancel = false;
+    reported = false;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->kind = kind;
+    job->paths = malloc((npaths + 1) * sizeof(char*));
+    for (size_t i = 0; i < npaths; ++i)
+        job->paths[i] = strdup(paths[i]);
+    job->npaths = npaths;
+    job->dest = dest? strdup(dest) : NULL;
+    job->umask = umask(0);
+    umask(job->umask);
+    job->resume = resume;
+    job->crossed = calloc(npaths + 1, sizeof(bool));
+    // a resumed job goes on writing where it left off. another mfm
+    // having the journal only means this one can't be resumed
+    if (kind != OPS_REMOVE)
+        journal_begin(kind, dest, paths, npaths, resume);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, ops_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) {
+        if (kind != OPS_REMOVE) journal_end(false);
+        for (size_t i = 0; i < npaths; ++i)
+            free(job->paths[i]);
+        free(job->paths);
+        free(job->crossed);
+        free(job->dest);
+        free(job);
+        reported = true;
+    }
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+bool
+ops_start(int kind, char **paths, size_t npaths, const char *dest)
+{
+    return start(kind, paths, npaths, dest, false);
+}
+
+bool
+ops_interrupted(char *buf, size_t sz)
+{
+    int kind;
+    char *dest, **paths;
+    size_t npaths;
+    if (ops_running() || !journal_load(&kind, &dest, &paths, &npaths)) return false;
+    snprintf(buf, sz, "%s of %zu %s into %s", (kind == OPS_MOVE)? "move" : "copy",
+        npaths, (npaths == 1)? "path" : "paths", dest);
+    for (size_t i = 0; i < npaths; ++i)
+        free(paths[i]);
+    free(paths);
+    free(dest);
+    return true;
+}
+
+bool
+ops_resume(void)
+{
+    int kind;
+    char *dest, **paths;
+    size_t npaths;
+    if (ops_running() || !journal_load(&kind, &dest, &paths, &npaths)) return false;
+    if (kind != OPS_COPY && kind != OPS_MOVE) kind = OPS_COPY;
+    bool res = start(kind, paths, npaths, dest, true);
+    for (size_t i = 0; i < npaths; ++i)
+        free(paths[i]);
+    free(paths);
+    free(dest);
+    return res;
+}
+
+void
+ops_cancel(void)
+{
+    pthread_mutex_lock(&lock);
+    cancel = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+bool
+ops_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+ops_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+ops_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    const char *what = (op_kind == OPS_COPY)? "copy" : (op_kind == OPS_MOVE)? "move" : "delete";
+    int64_t ms = (running? now_ms() : end_ms) - start_ms;
+    double mib = done_bytes / 1048576.0;
+    double copied_mib = (done_bytes - resumed_bytes) / 1048576.0;
+    double rate = ms? copied_mib * 1000 / ms : 0;
+    size_t copied = removing? ncopied : ndone;
+    char extra[256] = "";
+    size_t len = 0;
+    if (nmoved) {
+        len += snprintf(extra + len, sizeof(extra) - len, ", %zu renamed", nmoved);
+    }
+    if (nresumed) {
+        len += snprintf(extra + len, sizeof(extra) - len, ", %zu resumed", nresumed);
+    }
+    if (nfailed && len < sizeof(extra)) {
+        snprintf(extra + len, sizeof(extra) - len, ", %zu failed: %s",
+            nfailed, strerror(first_err));
+    }
+
+    bool finished = false;
+    if (running) {
+        // the depth each device is at right now
+        char depths[128] = "";
+        size_t len = 0;
+        for (size_t i = 0; i < ndevices && len < sizeof(depths); ++i) {
+            len += snprintf(depths + len, sizeof(depths) - len, " %s:%d",
+                classes[devices[i].cls].name, devices[i].depth);
+        }
+        if (removing) {
+            snprintf(buf, sz, "move: removing the originals, %zu/%zu%s files,%s%s",
+                ndone, nfiles, walk_done? "" : "+", depths, extra);
+        }
+        else if (op_kind != OPS_REMOVE) {
+            snprintf(buf, sz, "%s: %zu/%zu%s files, %.0f/%.0f MiB, %.0f MiB/s,%s%s",
+                what, ndone, nfiles, walk_done? "" : "+", mib, total_bytes / 1048576.0,
+                rate, depths, extra);
+        }
+        else {
+            snprintf(buf, sz, "delete: %zu/%zu%s files,%s%s",
+                ndone, nfiles, walk_done? "" : "+", depths, extra);
+        }
+    }
+    else {
+        finished = !reported;
+        reported = true;
+        if (cancel) {
+            snprintf(buf, sz, "%s: cancelled after %zu files%s", what, copied, extra);
+        }
+        else if (op_kind == OPS_MOVE && !copied && !removing) {
+            // renames all of it, extra starts with ", "
+            snprintf(buf, sz, "move: %s", *extra? extra + 2 : "nothing to move");
+        }
+        else if (op_kind != OPS_REMOVE) {
+            snprintf(buf, sz, "%s: %zu files, %.1f MiB in %.2fs, %.0f MiB/s%s",
+                what, copied, copied_mib, ms / 1000.0, rate, extra);
+        }
+        else {
+            snprintf(buf, sz, "delete: %zu files in %.2fs%s", ndone, ms / 1000.0, extra);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
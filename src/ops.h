@@ -0,0 +1,47 @@
+#ifndef OPS_H
+#define OPS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// copies, moves and deletes trees in the background. the trees are walked on
+// one thread and every file becomes a task for a pool of workers.
+//
+// how many tasks run at once is decided per device: each starts from a
+// depth that suits its class (a spinning disk, an ssd, a network mount,
+// memory) and moves from there, one more while throughput keeps going
+// up, half as many once it drops or latency piles up. a task only runs
+// when both its source and destination devices have room, so a copy
+// between two disks goes at the pace of the slower one. the workers
+// run at the lowest best effort i/o priority, listings go first.
+//
+// copies and moves are written down in the journal as they go. one cut
+// short, by mfm quitting or dying, can be resumed: files it finished are
+// left alone and the ones it was partway through go on after their last
+// chunk that checks out
+
+#define OPS_MAX_THREADS 16
+#define OPS_WINDOW_MS 250            // how often depths are reconsidered
+#define OPS_OP_BYTES (64*1024)       // what a file costs besides its data
+#define OPS_CHUNK_SZ (8*1024*1024)   // copied between checks for cancel
+
+enum {
+    OPS_COPY,    // paths go into dest/<basename>
+    OPS_REMOVE,  // paths go away, with everything below them
+    OPS_MOVE,    // renamed into dest/<basename>, or copied and removed
+};
+
+// false if an operation is already running
+bool ops_start(int kind, char **paths, size_t npaths, const char *dest);
+// a copy or move an earlier run didn't get to finish, described in buf
+bool ops_interrupted(char *buf, size_t sz);
+// go on with it. false if there's none or something is running
+bool ops_resume(void);
+void ops_cancel(void);
+bool ops_running(void);
+// fd that becomes readable on progress and when it's over
+int ops_fd(void);
+// one line describing the operation. true once, when it has just finished
+bool ops_progress(char *buf, size_t sz);
+
+#endif
@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "pack.h"
+#include "wake.h"
+
+#define TAR_BLOCK 512
+#define ROUND_UP(n) (((n) + TAR_BLOCK - 1) & ~(uint64_t) (TAR_BLOCK - 1))
+
+enum {
+    STAGE_PLAN,
+    STAGE_PACK,
+    STAGE_DONE,
+};
+
+// one file, dir or symlink, and where its record sits in the tar stream
+typedef struct member_t {
+    char *path;
+    char *name;  // in the archive, dirs end in '/'
+    char *link;  // symlink target
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    int64_t mtime;
+    uint64_t size;    // data bytes, 0 unless it's a regular file
+    uint64_t offset;  // of the first header
+    uint32_t hdr_sz;  // headers, long name records included
+    volatile bool changed; // shorter than it was or unreadable
+} member_t;
+
+// compressed block waiting for its turn to be written
+typedef struct slot_t {
+    unsigned char *out;
+    size_t out_sz;
+    size_t in_sz;
+    uint32_t crc;
+    bool ready;
+} slot_t;
+
+typedef struct worker_t {
+    pthread_t thread;
+    unsigned char *in;
+    unsigned char *hdr;
+    size_t hdr_alloc;
+    z_stream z;
+    size_t fd_member;
+    int fd;
+} worker_t;
+
+typedef struct job_t {
+    char **paths;
+    size_t npaths;
+    char *dest;
+} job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false, reported = true;
+static volatile bool cancel = false;
+
+// progress, under lock
+static int stage = STAGE_DONE;
+static size_t nplanned = 0, nskipped = 0, nchanged = 0;
+static uint64_t done_in = 0, total_in = 0, done_out = 0;
+static int64_t start_ms = 0, end_ms = 0;
+static int job_err = 0;
+static char dest_name[256];
+
+static member_t *members = NULL;
+static size_t nmembers = 0, members_alloc = 0;
+
+// the pipeline, under lock
+static slot_t *slots = NULL;
+static size_t window = 0, nblocks = 0, next_block = 0, written = 0;
+static bool gzip_out = false;
+
+static void put_number(char *p, size_t sz, uint64_t v);
+static uint32_t header_size(member_t *m);
+static void put_header(unsigned char *p, const char *name, member_t *m, char type, uint64_t size);
+static void build_headers(member_t *m, unsigned char *out);
+static int compare_names(const void *a, const void *b);
+static void add(char *path, size_t sz, size_t name_off, int depth);
+static void walk(char *path, size_t sz, size_t name_off, int depth);
+static void read_member(worker_t *w, size_t i, unsigned char *dst, uint64_t off, size_t len);
+static void fill_block(worker_t *w, size_t k, unsigned char *in, size_t n);
+static int compress_block(worker_t *w, slot_t *s, bool last);
+static void *worker_thread(void *arg);
+static int write_all(int fd, const void *buf, size_t sz);
+static void put_le32(unsigned char *p, uint32_t v);
+static int run_pipeline(int fd);
+static void *pack_thread(void *arg);
+
+bool
+pack_supported(const char *name)
+{
+    static const char *exts[] = { ".tar", ".tar.gz", ".tgz" };
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(exts) / sizeof(*exts); ++i) {
+        size_t n = strlen(exts[i]);
+        if (len > n && strcmp(name + len - n, exts[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// octal text while it fits, gnu's base-256 for anything bigger
+static void
+put_number(char *p, size_t sz, uint64_t v)
+{
+    if (v >> (3 * (sz - 1)) == 0) {
+        snprintf(p, sz, "%0*llo", (int) sz - 1, (unsigned long long) v);
+    }
+    else {
+        memset(p, 0, sz);
+        p[0] = (char) 0x80;
+        for (size_t i = sz - 1; i > 0 && v; --i, v >>= 8)
+            p[i] = v & 0xff;
+    }
+}
+
+// names and link targets over 100 bytes get a gnu long name record
+static uint32_t
+header_size(member_t *m)
+{
+    uint32_t sz = TAR_BLOCK;
+    size_t len = strlen(m->name);
+    if (len > 100) sz += TAR_BLOCK + ROUND_UP(len + 1);
+    if (m->link && (len = strlen(m->link)) > 100)
+        sz += TAR_BLOCK + ROUND_UP(len + 1);
+    return sz;
+}
+
+static void
+put_header(unsigned char *p, const char *name, member_t *m, char type, uint64_t size)
+{
+    char *h = (char*) p;
+    memset(h, 0, TAR_BLOCK);
+    strncpy(h, name, 100);
+    put_number(h + 100, 8, m->mode & 07777);
+    put_number(h + 108, 8, m->uid);
+    put_number(h + 116, 8, m->gid);
+    put_number(h + 124, 12, size);
+    put_number(h + 136, 12, m->mtime > 0? m->mtime : 0);
+    h[156] = type;
+    if (type == '2') strncpy(h + 157, m->link, 100);
+    memcpy(h + 257, "ustar  ", 8);
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; ++i)
+        sum += p[i];
+    snprintf(h + 148, 8, "%06o", sum);
+}
+
+static void
+build_headers(member_t *m, unsigned char *out)
+{
+    size_t len = strlen(m->name);
+    if (len > 100) {
+        memset(out + TAR_BLOCK, 0, ROUND_UP(len + 1));
+        put_header(out, "././@LongLink", m, 'L', len + 1);
+        memcpy(out + TAR_BLOCK, m->name, len);
+        out += TAR_BLOCK + ROUND_UP(len + 1);
+    }
+    if (m->link && (len = strlen(m->link)) > 100) {
+        memset(out + TAR_BLOCK, 0, ROUND_UP(len + 1));
+        put_header(out, "././@LongLink", m, 'K', len + 1);
+        memcpy(out + TAR_BLOCK, m->link, len);
+        out += TAR_BLOCK + ROUND_UP(len + 1);
+    }
+    char type = S_ISDIR(m->mode)? '5' : S_ISLNK(m->mode)? '2' : '0';
+    put_header(out, m->name, m, type, m->size);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+// path[name_off..] is the name in the archive
+static void
+add(char *path, size_t sz, size_t name_off, int depth)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0
+            || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode))) {
+        pthread_mutex_lock(&lock);
+        nskipped++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    char target[PATH_MAX];
+    ssize_t target_sz = 0;
+    if (S_ISLNK(st.st_mode)) {
+        target_sz = readlink(path, target, sizeof(target) - 1);
+        if (target_sz < 0) return;
+        target[target_sz] = '\0';
+    }
+
+    if (nmembers == members_alloc) {
+        members_alloc = members_alloc? members_alloc*2 : 1024;
+        members = realloc(members, members_alloc * sizeof(member_t));
+    }
+    member_t *m = &members[nmembers++];
+    memset(m, 0, sizeof(*m));
+    m->path = strdup(path);
+    m->name = malloc(sz - name_off + 2);
+    sprintf(m->name, "%s%s", path + name_off, S_ISDIR(st.st_mode)? "/" : "");
+    if (S_ISLNK(st.st_mode)) m->link = strdup(target);
+    m->mode = st.st_mode;
+    m->uid = st.st_uid;
+    m->gid = st.st_gid;
+    m->mtime = st.st_mtime;
+    m->size = S_ISREG(st.st_mode)? st.st_size : 0;
+    m->hdr_sz = header_size(m);
+
+    pthread_mutex_lock(&lock);
+    nplanned++;
+    total_in += m->hdr_sz + ROUND_UP(m->size);
+    wake_notify(&wake, false);
+    pthread_mutex_unlock(&lock);
+
+    if (S_ISDIR(st.st_mode))
+        walk(path, sz, name_off, depth + 1);
+}
+
+// sorted, so packing the same tree twice gives the same archive
+static void
+walk(char *path, size_t sz, size_t name_off, int depth)
+{
+    if (cancel || depth > 256) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    char **names = NULL;
+    size_t n = 0, alloc = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        char *name = de->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (n == alloc) {
+            alloc = alloc? alloc*2 : 64;
+            names = realloc(names, alloc * sizeof(char*));
+        }
+        names[n++] = strdup(name);
+    }
+    closedir(dir);
+    if (n) qsort(names, n, sizeof(char*), compare_names);
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = strlen(names[i]);
+        if (!cancel && sz + len + 2 < PATH_MAX) {
+            path[sz] = '/';
+            memcpy(path + sz + 1, names[i], len + 1);
+            add(path, sz + 1 + len, name_off, depth);
+            path[sz] = '\0';
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+// data of member i from off. what can't be read stays zeroes, the
+// header already promised that many bytes
+static void
+read_member(worker_t *w, size_t i, unsigned char *dst, uint64_t off, size_t len)
+{
+    member_t *m = &members[i];
+    if (w->fd_member != i) {
+        if (w->fd >= 0) close(w->fd);
+        w->fd = open(m->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        w->fd_member = i;
+    }
+    if (w->fd < 0) {
+        m->changed = true;
+        return;
+    }
+    while (len) {
+        ssize_t n = pread(w->fd, dst, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            m->changed = true;
+            return;
+        }
+        dst += n;
+        off += n;
+        len -= n;
+    }
+}
+
+// tar stream bytes [k*PACK_BLOCK_SZ, +n), headers built on the spot
+static void
+fill_block(worker_t *w, size_t k, unsigned char *in, size_t n)
+{
+    uint64_t a = (uint64_t) k * PACK_BLOCK_SZ, b = a + n;
+    memset(in, 0, n);
+
+    size_t lo = 0, hi = nmembers;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        member_t *m = &members[mid];
+        if (m->offset + m->hdr_sz + ROUND_UP(m->size) <= a) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (size_t i = lo; i < nmembers && members[i].offset < b; ++i) {
+        member_t *m = &members[i];
+        uint64_t h = m->offset, d = h + m->hdr_sz;
+        if (d > a) {
+            if (w->hdr_alloc < m->hdr_sz) {
+                w->hdr_alloc = m->hdr_sz;
+                w->hdr = realloc(w->hdr, w->hdr_alloc);
+            }
+            build_headers(m, w->hdr);
+            uint64_t from = (h > a)? h : a, to = (d < b)? d : b;
+            memcpy(in + (from - a), w->hdr + (from - h), to - from);
+        }
+        uint64_t from = (d > a)? d : a, to = (d + m->size < b)? d + m->size : b;
+        if (from < to)
+            read_member(w, i, in + (from - a), from - d, to - from);
+    }
+}
+
+// each block is a raw deflate stream of its own, ended by a sync flush
+// so they can be concatenated. only the last one is final
+static int
+compress_block(worker_t *w, slot_t *s, bool last)
+{
+    s->crc = crc32(0, w->in, s->in_sz);
+    deflateReset(&w->z);
+    w->z.next_in = w->in;
+    w->z.avail_in = s->in_sz;
+    w->z.next_out = s->out;
+    w->z.avail_out = compressBound(PACK_BLOCK_SZ) + 64;
+    int res = deflate(&w->z, last? Z_FINISH : Z_SYNC_FLUSH);
+    if (last? res != Z_STREAM_END : (res != Z_OK || w->z.avail_in))
+        return EIO;
+    s->out_sz = w->z.next_out - s->out;
+    return 0;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    worker_t *w = arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!cancel && next_block < nblocks && next_block >= written + window)
+            pthread_cond_wait(&space_cond, &lock);
+        if (cancel || next_block >= nblocks) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        size_t k = next_block++;
+        slot_t *s = &slots[k % window];
+        pthread_mutex_unlock(&lock);
+
+        s->in_sz = (k + 1 < nblocks)? PACK_BLOCK_SZ
+            : total_in - (uint64_t) k * PACK_BLOCK_SZ;
+        int err = 0;
+        if (gzip_out) {
+            fill_block(w, k, w->in, s->in_sz);
+            err = compress_block(w, s, k + 1 == nblocks);
+        }
+        else {
+            fill_block(w, k, s->out, s->in_sz);
+            s->out_sz = s->in_sz;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (err) {
+            job_err = err;
+            cancel = true;
+            pthread_cond_broadcast(&space_cond);
+        }
+        s->ready = true;
+        pthread_cond_broadcast(&ready_cond);
+        pthread_mutex_unlock(&lock);
+    }
+    if (w->fd >= 0) close(w->fd);
+    return NULL;
+}
+
+static int
+write_all(int fd, const void *buf, size_t sz)
+{
+    const char *p = buf;
+    while (sz) {
+        ssize_t n = write(fd, p, sz);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        p += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+static void
+put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = v >> (8 * i);
+}
+
+// workers fill and compress blocks, this thread writes them in order
+static int
+run_pipeline(int fd)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = (cpus < 1)? 1 : (cpus > PACK_MAX_THREADS)? PACK_MAX_THREADS : cpus;
+    size_t cap = gzip_out? compressBound(PACK_BLOCK_SZ) + 64 : PACK_BLOCK_SZ;
+
+    pthread_mutex_lock(&lock);
+    nblocks = (total_in + PACK_BLOCK_SZ - 1) / PACK_BLOCK_SZ;
+    next_block = written = 0;
+    window = nthreads * 2;
+    slots = calloc(window, sizeof(slot_t));
+    for (size_t i = 0; i < window; ++i)
+        slots[i].out = malloc(cap);
+    pthread_mutex_unlock(&lock);
+
+    int err = 0;
+    if (gzip_out) {
+        unsigned char head[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        put_le32(head + 4, time(NULL));
+        err = write_all(fd, head, sizeof(head));
+    }
+
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    size_t started = 0;
+    for (size_t i = 0; !err && i < nthreads; ++i) {
+        worker_t *w = &workers[i];
+        w->fd = -1;
+        w->fd_member = (size_t) -1;
+        if (gzip_out) {
+            w->in = malloc(PACK_BLOCK_SZ);
+            if (deflateInit2(&w->z, PACK_LEVEL, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+                err = ENOMEM;
+                break;
+            }
+        }
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            if (gzip_out) deflateEnd(&w->z);
+            err = EAGAIN;
+            break;
+        }
+        started++;
+    }
+    if (!started && !err) err = EAGAIN;
+
+    uint32_t crc = crc32(0, NULL, 0);
+    for (size_t k = 0; !err && k < nblocks; ++k) {
+        slot_t *s = &slots[k % window];
+        pthread_mutex_lock(&lock);
+        while (!s->ready && !cancel)
+            pthread_cond_wait(&ready_cond, &lock);
+        bool ok = s->ready && !cancel;
+        pthread_mutex_unlock(&lock);
+        if (!ok) break;
+
+        err = write_all(fd, s->out, s->out_sz);
+        if (gzip_out) crc = crc32_combine(crc, s->crc, s->in_sz);
+
+        pthread_mutex_lock(&lock);
+        s->ready = false;
+        written++;
+        done_in += s->in_sz;
+        done_out += s->out_sz;
+        pthread_cond_broadcast(&space_cond);
+        wake_notify(&wake, false);
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (err) cancel = true;
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+    for (size_t i = 0; i < nthreads; ++i) {
+        if (i < started && gzip_out) deflateEnd(&workers[i].z);
+        free(workers[i].in);
+        free(workers[i].hdr);
+    }
+    free(workers);
+
+    if (!err && !cancel && gzip_out) {
+        unsigned char tail[8];
+        put_le32(tail, crc);
+        put_le32(tail + 4, (uint32_t) total_in);
+        err = write_all(fd, tail, sizeof(tail));
+    }
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < window; ++i)
+        free(slots[i].out);
+    free(slots);
+    slots = NULL;
+    window = 0;
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+static void *
+pack_thread(void *arg)
+{
+    job_t *job = arg;
+    char path[PATH_MAX];
+    for (size_t i = 0; i < job->npaths && !cancel; ++i) {
+        size_t sz = strlen(job->paths[i]);
+        if (sz >= sizeof(path)) continue;
+        memcpy(path, job->paths[i], sz + 1);
+        while (sz > 1 && path[sz-1] == '/') path[--sz] = '\0';
+        char *slash = strrchr(path, '/');
+        size_t name_off = slash? slash - path + 1 : 0;
+        if (path[name_off]) add(path, sz, name_off, 0);
+    }
+
+    uint64_t off = 0;
+    for (size_t i = 0; i < nmembers; ++i) {
+        members[i].offset = off;
+        off += members[i].hdr_sz + ROUND_UP(members[i].size);
+    }
+
+    pthread_mutex_lock(&lock);
+    // the end of the archive is two zero blocks
+    total_in = off + 2 * TAR_BLOCK;
+    stage = STAGE_PACK;
+    start_ms = now_ms();
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+
+    // made only now so it can't end up packed into itself
+    int err = 0;
+    int fd = -1;
+    if (!nmembers) {
+        err = ENOENT;
+    }
+    else if (!cancel) {
+        fd = open(job->dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) err = errno;
+    }
+    if (fd >= 0) {
+        err = run_pipeline(fd);
+        if (close(fd) < 0 && !err) err = errno;
+        pthread_mutex_lock(&lock);
+        if (!err) err = job_err;
+        bool failed = err || cancel;
+        pthread_mutex_unlock(&lock);
+        if (failed) unlink(job->dest);
+    }
+
+    size_t changed = 0;
+    for (size_t i = 0; i < nmembers; ++i) {
+        if (members[i].changed) changed++;
+        free(members[i].path);
+        free(members[i].name);
+        free(members[i].link);
+    }
+    free(members);
+    members = NULL;
+    nmembers = members_alloc = 0;
+    for (size_t i = 0; i < job->npaths; ++i)
+        free(job->paths[i]);
+    free(job->paths);
+    free(job->dest);
+    free(job);
+
+    pthread_mutex_lock(&lock);
+    job_err = err;
+    nchanged = changed;
+    end_ms = now_ms();
+    stage = STAGE_DONE;
+    running = false;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+bool
+pack_start(char **paths, size_t npaths, const char *dest)
+{
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wake_open(&wake);
+    stage = STAGE_PLAN;
+    nplanned = nskipped = nchanged = 0;
+    done_in = total_in = done_out = 0;
+    start_ms = end_ms = 0;
+    job_err = 0;
+    cancel = false;
+    reported = false;
+    const char *slash = strrchr(dest, '/');
+    snprintf(dest_name, sizeof(dest_name), "%s", slash? slash + 1 : dest);
+    size_t len = strlen(dest);
+    gzip_out = !(len > 4 && strcmp(dest + len - 4, ".tar") == 0);
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->paths = malloc((npaths + 1) * sizeof(char*));
+    for (size_t i = 0; i < npaths; ++i)
+        job->paths[i] = strdup(paths[i]);
+    job->npaths = npaths;
+    job->dest = strdup(dest);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, pack_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) {
+        for (size_t i = 0; i < npaths; ++i)
+            free(job->paths[i]);
+        free(job->paths);
+        free(job->dest);
+        free(job);
+        stage = STAGE_DONE;
+        reported = true;
+    }
+    pthread_mutex_unlock(&lock);
+    return running;
+}
+
+void
+pack_cancel(void)
+{
+    pthread_mutex_lock(&lock);
+    cancel = true;
+    pthread_cond_broadcast(&space_cond);
+    pthread_cond_broadcast(&ready_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+bool
+pack_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+pack_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+pack_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    int64_t ms = ((stage == STAGE_DONE)? end_ms : now_ms()) - start_ms;
+    double rate = (ms > 0)? done_in / 1048576.0 / (ms / 1000.0) : 0;
+    bool finished = false;
+    switch (stage) {
+    case STAGE_PLAN:
+        snprintf(buf, sz, "pack: reading tree, %zu files", nplanned);
+        break;
+    case STAGE_PACK:
+        snprintf(buf, sz, "pack: %d%% of %.1f MiB, %.1f MiB/s",
+            total_in? (int) (done_in * 100 / total_in) : 0,
+            total_in / 1048576.0, rate);
+        break;
+    default:
+        finished = !reported;
+        reported = true;
+        if (job_err) {
+            snprintf(buf, sz, "pack: %s", strerror(job_err));
+        }
+        else if (cancel) {
+            snprintf(buf, sz, "%s", "pack: cancelled");
+        }
+        else {
+            char extra[64] = "";
+            if (nchanged || nskipped) {
+                snprintf(extra, sizeof(extra), ", %zu changed or unreadable",
+                    nchanged + nskipped);
+            }
+            snprintf(buf, sz, "packed %s: %zu files, %.1f -> %.1f MiB, %.1f MiB/s%s",
+                dest_name, nplanned, done_in / 1048576.0,
+                done_out / 1048576.0, rate, extra);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
@@ -0,0 +1,28 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// packs files into a .tar or .tar.gz in the background. the tar stream
+// is laid out before anything is read, so every block of it can be
+// read and compressed on its own thread and written out in order
+
+#define PACK_BLOCK_SZ (256*1024)  // tar bytes per compressed block
+#define PACK_MAX_THREADS 8
+#define PACK_LEVEL 6
+
+// whether name ends in something pack knows how to write
+bool pack_supported(const char *name);
+
+// pack paths (and everything below them) into dest. members are named
+// relative to the dir each path is in. false if a job is running
+bool pack_start(char **paths, size_t npaths, const char *dest);
+void pack_cancel(void);
+bool pack_running(void);
+// fd that becomes readable on progress and when the job is over
+int pack_fd(void);
+// one line describing the job. true once, when it has just finished
+bool pack_progress(char *buf, size_t sz);
+
+#endif
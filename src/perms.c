@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include "perms.h"
+#include "wake.h"
+
+#define ALL_BITS (S_ISUID | S_ISGID | S_ISVTX | 0777)
+
+typedef struct job_t {
+    char **paths;
+    size_t npaths;
+    perms_spec_t spec;
+    bool dry;
+} job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false, reported = true;
+static volatile bool cancel = false;
+static job_t *last_job = NULL;  // kept to be applied after counting
+
+// progress, under lock
+static size_t seen = 0, changed = 0, failed = 0, expected = 0;
+static bool dry_run = true;
+static bool cancelled = false;  // cancel, as the finished job saw it
+static int first_err = 0;
+
+// directories waiting to be walked, under lock
+static char **queue = NULL;
+static size_t queued = 0, queue_alloc = 0, busy = 0;
+
+static mode_t who_bits(char c);
+static const char *parse_symbolic(const char *s, perms_spec_t *spec);
+static const char *parse_owner(const char *s, perms_spec_t *spec);
+static void push_dir(const char *path);
+static void visit(int dirfd, const char *name, const char *path, const perms_spec_t *spec, bool dry);
+static void walk_dir(const char *path, const perms_spec_t *spec, bool dry);
+static void *walk_thread(void *arg);
+static void *perms_thread(void *arg);
+static bool start_job(job_t *job);
+static void free_job(job_t *job);
+
+static mode_t
+who_bits(char c)
+{
+    switch (c) {
+    case 'u': return S_ISUID | S_IRWXU;
+    case 'g': return S_ISGID | S_IRWXG;
+    case 'o': return S_IRWXO;
+    case 'a': return ALL_BITS;
+    }
+    return 0;
+}
+
+// chmod's grammar: [ugoa]*([-+=]([rwxXst]*|[ugo]))+, comma separated
+static const char *
+parse_symbolic(const char *s, perms_spec_t *spec)
+{
+    while (*s) {
+        mode_t who = 0;
+        while (*s && strchr("ugoa", *s))
+            who |= who_bits(*s++);
+        if (!*s || !strchr("+-=", *s))
+            return "expected + - or =";
+
+        while (*s && strchr("+-=", *s)) {
+            if (spec->nclauses == PERMS_MAX_CLAUSES)
+                return "too many clauses";
+            perms_clause_t *c = &spec->clauses[spec->nclauses++];
+            memset(c, 0, sizeof(*c));
+            c->op = *s++;
+            c->who = who? who : ALL_BITS;
+            c->masked = !who;
+            if (*s && strchr("ugo", *s)) {
+                c->copy = *s++;
+                continue;
+            }
+            for (; *s && strchr("rwxXst", *s); ++s) {
+                switch (*s) {
+                case 'r': c->perm |= 0444; break;
+                case 'w': c->perm |= 0222; break;
+                case 'x': c->perm |= 0111; break;
+                case 'X': c->exec_if = true; break;
+                case 's': c->perm |= S_ISUID | S_ISGID; break;
+                case 't': c->perm |= S_ISVTX; break;
+                }
+            }
+        }
+        if (*s == ',') ++s;
+        else if (*s) return "bad mode";
+    }
+    return NULL;
+}
+
+// user, user:group or :group. names or numbers
+static const char *
+parse_owner(const char *s, perms_spec_t *spec)
+{
+    char user[256];
+    const char *colon = strchr(s, ':');
+    size_t len = colon? (size_t) (colon - s) : strlen(s);
+    if (len >= sizeof(user)) return "user name too long";
+    memcpy(user, s, len);
+    user[len] = '\0';
+
+    char *end;
+    if (len) {
+        struct passwd *pw = getpwnam(user);
+        unsigned long id = strtoul(user, &end, 10);
+        if (pw) spec->uid = pw->pw_uid;
+        else if (!*end) spec->uid = id;
+        else return "no such user";
+    }
+    if (colon && colon[1]) {
+        struct group *gr = getgrnam(colon + 1);
+        unsigned long id = strtoul(colon + 1, &end, 10);
+        if (gr) spec->gid = gr->gr_gid;
+        else if (!*end) spec->gid = id;
+        else return "no such group";
+    }
+    return NULL;
+}
+
+const char *
+perms_parse(const char *text, perms_spec_t *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->uid = (uid_t) -1;
+    spec->gid = (gid_t) -1;
+    spec->umask = umask(0);
+    umask(spec->umask);
+
+    char *copy = strdup(text);
+    const char *err = NULL;
+    bool owner = false;
+    for (char *tok = strtok(copy, " \t"); tok && !err; tok = strtok(NULL, " \t")) {
+        if (strcmp(tok, "-R") == 0) {
+            spec->recursive = true;
+        }
+        else if (strspn(tok, "01234567") == strlen(tok)) {
+            if (spec->set_mode) err = "more than one mode";
+            spec->mode = strtoul(tok, NULL, 8);
+            if (spec->mode & ~ALL_BITS) err = "bad octal mode";
+            spec->set_mode = spec->octal = true;
+        }
+        else if (strpbrk(tok, "+-=") && strspn(tok, "ugoa+-=rwxXst,") == strlen(tok)) {
+            if (spec->set_mode) err = "more than one mode";
+            else err = parse_symbolic(tok, spec);
+            spec->set_mode = true;
+        }
+        else {
+            if (owner) err = "more than one owner";
+            else err = parse_owner(tok, spec);
+            owner = true;
+        }
+    }
+    free(copy);
+    if (!err && !spec->set_mode && !owner)
+        err = "nothing to change";
+    return err;
+}
+
+mode_t
+perms_apply_mode(const perms_spec_t *spec, mode_t mode)
+{
+    if (!spec->set_mode) return mode;
+    if (spec->octal) return (mode & ~ALL_BITS) | spec->mode;
+
+    for (int i = 0; i < spec->nclauses; ++i) {
+        const perms_clause_t *c = &spec->clauses[i];
+        mode_t bits = c->perm;
+        if (c->copy) {
+            int shift = (c->copy == 'u')? 6 : (c->copy == 'g')? 3 : 0;
+            bits = ((mode >> shift) & 7) * 0111;
+        }
+        if (c->exec_if && (S_ISDIR(mode) || (mode & 0111)))
+            bits |= 0111;
+        bits &= c->who;
+        if (c->masked) bits &= ~spec->umask;
+
+        switch (c->op) {
+        case '+': mode |= bits; break;
+        case '-': mode &= ~bits; break;
+        case '=': {
+            mode_t clear = c->who;
+            // like chmod, dirs keep set-id bits unless they're named
+            if (S_ISDIR(mode)) clear &= ~((S_ISUID | S_ISGID) & ~bits);
+            mode = (mode & ~clear) | bits;
+            break;
+        }
+        }
+    }
+    return mode;
+}
+
+static void
+push_dir(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    if (queued == queue_alloc) {
+        queue_alloc = queue_alloc? queue_alloc*2 : 256;
+        queue = realloc(queue, queue_alloc * sizeof(char*));
+    }
+    queue[queued++] = strdup(path);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// name in dirfd, which is path. symlinks get their owner changed but
+// have no mode of their own
+static void
+visit(int dirfd, const char *name, const char *path, const perms_spec_t *spec, bool dry)
+{
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        pthread_mutex_lock(&lock);
+        seen++;
+        failed++;
+        if (!first_err) first_err = errno;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    mode_t mode = S_ISLNK(st.st_mode)? st.st_mode : perms_apply_mode(spec, st.st_mode);
+    bool new_mode = (mode & ALL_BITS) != (st.st_mode & ALL_BITS);
+    bool new_owner = (spec->uid != (uid_t) -1 && spec->uid != st.st_uid)
+        || (spec->gid != (gid_t) -1 && spec->gid != st.st_gid);
+
+    int err = 0;
+    if (!dry && new_owner
+            && fchownat(dirfd, name, spec->uid, spec->gid, AT_SYMLINK_NOFOLLOW) < 0)
+        err = errno;
+    // after chown, which may have dropped set-id bits
+    if (!dry && !err && new_mode && fchmodat(dirfd, name, mode & ALL_BITS, 0) < 0)
+        err = errno;
+
+    pthread_mutex_lock(&lock);
+    seen++;
+    if (new_mode || new_owner) changed++;
+    if (err) {
+        failed++;
+        if (!first_err) first_err = err;
+    }
+    wake_notify(&wake, false);
+    pthread_mutex_unlock(&lock);
+
+    // the dir itself was done first, so a mode that locks us out shows
+    // up as failures below it, like chmod -R
+    if (spec->recursive && S_ISDIR(st.st_mode))
+        push_dir(path);
+}
+
+static void
+walk_dir(const char *path, const perms_spec_t *spec, bool dry)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        pthread_mutex_lock(&lock);
+        failed++;
+        if (!first_err) first_err = errno;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    char child[PATH_MAX];
+    size_t sz = strlen(path);
+    struct dirent *de;
+    while ((de = readdir(dir)) && !cancel) {
+        char *name = de->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        size_t len = strlen(name);
+        if (sz + len + 2 >= sizeof(child)) continue;
+        memcpy(child, path, sz);
+        child[sz] = '/';
+        memcpy(child + sz + 1, name, len + 1);
+        visit(dirfd(dir), name, child, spec, dry);
+    }
+    closedir(dir);
+}
+
+// takes dirs off the queue until it's empty and nobody can add more
+static void *
+walk_thread(void *arg)
+{
+    job_t *job = arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!queued && busy && !cancel)
+            pthread_cond_wait(&cond, &lock);
+        if (!queued || cancel) {
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        char *path = queue[--queued];
+        busy++;
+        pthread_mutex_unlock(&lock);
+
+        walk_dir(path, &job->spec, job->dry);
+        free(path);
+
+        pthread_mutex_lock(&lock);
+        busy--;
+        if (!busy) pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void *
+perms_thread(void *arg)
+{
+    job_t *job = arg;
+
+    // roots are done from their parent, like any other entry
+    for (size_t i = 0; i < job->npaths && !cancel; ++i) {
+        char *path = job->paths[i];
+        char *slash = strrchr(path, '/');
+        char parent[PATH_MAX];
+        const char *name = path;
+        if (slash) {
+            size_t len = (slash == path)? 1 : (size_t) (slash - path);
+            if (len >= sizeof(parent)) continue;
+            memcpy(parent, path, len);
+            parent[len] = '\0';
+            name = slash + 1;
+        }
+        int dirfd = open(slash? parent : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0) {
+            pthread_mutex_lock(&lock);
+            failed++;
+            if (!first_err) first_err = errno;
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        visit(dirfd, name, path, &job->spec, job->dry);
+        close(dirfd);
+    }
+
+    pthread_t threads[PERMS_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < PERMS_THREADS; ++i) {
+        if (pthread_create(&threads[started], NULL, walk_thread, job) == 0)
+            started++;
+    }
+    walk_thread(job);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_lock(&lock);
+    cancelled = cancel;
+    while (queued)
+        free(queue[--queued]);
+    free(queue);
+    queue = NULL;
+    queue_alloc = 0;
+    running = false;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static bool
+start_job(job_t *job)
+{
+    wake_open(&wake);
+    if (!job->dry) expected = changed;
+    seen = changed = failed = 0;
+    busy = 0;
+    first_err = 0;
+    dry_run = job->dry;
+    cancel = false;
+    reported = false;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, perms_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) reported = true;
+    return running;
+}
+
+static void
+free_job(job_t *job)
+{
+    if (!job) return;
+    for (size_t i = 0; i < job->npaths; ++i)
+        free(job->paths[i]);
+    free(job->paths);
+    free(job);
+}
+
+bool
+perms_start(char **paths, size_t npaths, const perms_spec_t *spec)
+{
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    free_job(last_job);
+    job_t *job = calloc(1, sizeof(job_t));
+    job->paths = malloc((npaths + 1) * sizeof(char*));
+    for (size_t i = 0; i < npaths; ++i)
+        job->paths[i] = strdup(paths[i]);
+    job->npaths = npaths;
+    job->spec = *spec;
+    job->dry = true;
+    last_job = job;
+
+    bool ok = start_job(job);
+    if (!ok) {
+        free_job(job);
+        last_job = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+bool
+perms_commit(void)
+{
+    pthread_mutex_lock(&lock);
+    bool ok = !running && last_job && last_job->dry;
+    if (ok) {
+        last_job->dry = false;
+        ok = start_job(last_job);
+    }
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void
+perms_cancel(void)
+{
+    pthread_mutex_lock(&lock);
+    cancel = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+bool
+perms_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+perms_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+perms_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    bool finished = false;
+    if (running && dry_run) {
+        snprintf(buf, sz, "perms: counting, %zu to change of %zu", changed, seen);
+    }
+    else if (running) {
+        snprintf(buf, sz, "perms: %zu/%zu changed", changed, expected);
+    }
+    else {
+        finished = !reported;
+        reported = true;
+        if (cancelled) {
+            snprintf(buf, sz, "%s", "perms: cancelled");
+        }
+        else if (failed) {
+            snprintf(buf, sz, "perms: %s %zu of %zu, %zu failed: %s",
+                dry_run? "would change" : "changed", changed - (dry_run? 0 : failed),
+                seen, failed, strerror(first_err));
+        }
+        else {
+            snprintf(buf, sz, "perms: %s %zu of %zu",
+                dry_run? "would change" : "changed", changed, seen);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
+
+void
+perms_result(size_t *n_seen, size_t *n_changed, bool *counted, bool *applied)
+{
+    pthread_mutex_lock(&lock);
+    *n_seen = seen;
+    *n_changed = changed;
+    *counted = dry_run && !cancelled;
+    *applied = !dry_run;
+    pthread_mutex_unlock(&lock);
+}
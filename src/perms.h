@@ -0,0 +1,56 @@
+#ifndef PERMS_H
+#define PERMS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// chmod and chown over a set of paths, and optionally everything below
+// them, on a pool of threads. a job is counted first and only applied
+// once that count has been confirmed
+
+#define PERMS_THREADS 8      // the work waits on the disk, not the cpu
+#define PERMS_MAX_CLAUSES 16
+
+typedef struct perms_clause_t {
+    mode_t who;    // bits the clause may touch
+    char op;       // '+', '-' or '='
+    mode_t perm;   // bits named, X and u/g/o copies are resolved later
+    bool exec_if;  // X: exec only for dirs and files executable already
+    char copy;     // 'u', 'g' or 'o' to copy from, 0 if none
+    bool masked;   // no who was given, the umask applies
+} perms_clause_t;
+
+typedef struct perms_spec_t {
+    bool recursive;
+    bool set_mode;
+    bool octal;
+    mode_t mode;   // octal modes
+    perms_clause_t clauses[PERMS_MAX_CLAUSES];
+    int nclauses;
+    mode_t umask;
+    uid_t uid;     // (uid_t) -1 to leave it
+    gid_t gid;
+} perms_spec_t;
+
+// "[-R] [mode] [owner][:group]". mode is octal or symbolic like chmod's,
+// owner and group are names or ids. returns NULL or what's wrong
+const char *perms_parse(const char *text, perms_spec_t *spec);
+// mode after applying spec to an entry that has mode now
+mode_t perms_apply_mode(const perms_spec_t *spec, mode_t mode);
+
+// count what spec would change under paths. false if a job is running
+bool perms_start(char **paths, size_t npaths, const perms_spec_t *spec);
+// apply the job that was just counted
+bool perms_commit(void);
+void perms_cancel(void);
+bool perms_running(void);
+// fd that becomes readable on progress and when the job is over
+int perms_fd(void);
+// one line describing the job. true once, when it has just finished
+bool perms_progress(char *buf, size_t sz);
+// how the last job went: entries looked at and needing a change.
+// counted if a count ran to the end, applied if changes were made
+void perms_result(size_t *seen, size_t *changed, bool *counted, bool *applied);
+
+#endif
@@ -0,0 +1,44 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pick.h"
+
+static void put(picker_t *p, const char *s, size_t sz);
+
+static void
+put(picker_t *p, const char *s, size_t sz)
+{
+    while (sz && !p->failed) {
+        if (p->len == PICK_BUF_SZ) pick_flush(p);
+        size_t n = PICK_BUF_SZ - p->len;
+        if (n > sz) n = sz;
+        memcpy(p->buf + p->len, s, n);
+        p->len += n;
+        s += n;
+        sz -= n;
+    }
+}
+
+void
+pick_add(picker_t *p, const char *dir, const char *name, size_t name_sz)
+{
+    size_t len = strlen(dir);
+    put(p, dir, len);
+    if (!len || dir[len-1] != '/') put(p, "/", 1);
+    put(p, name, name_sz);
+    put(p, "", 1);
+}
+
+bool
+pick_flush(picker_t *p)
+{
+    size_t off = 0;
+    while (off < p->len && !p->failed) {
+        ssize_t n = write(p->fd, p->buf + off, p->len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) p->failed = true;
+        else off += n;
+    }
+    p->len = 0;
+    return !p->failed;
+}
@@ -0,0 +1,25 @@
+#ifndef PICK_H
+#define PICK_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// what --pick hands back: absolute paths, each NUL terminated, written
+// out a buffer at a time as they are added, so any number of them can go
+// straight into xargs -0
+
+#define PICK_BUF_SZ (64*1024)
+
+typedef struct picker_t {
+    int fd;
+    size_t len;
+    bool failed;  // a write went wrong, the rest is dropped
+    char buf[PICK_BUF_SZ];
+} picker_t;
+
+// dir/name, name being name_sz bytes long
+void pick_add(picker_t *p, const char *dir, const char *name, size_t name_sz);
+// write out what is left. false if anything couldn't be written
+bool pick_flush(picker_t *p);
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mstring.h"
+#include "mlist.h"
+#include "mfm.h"
+#include "session.h"
+
+// on-disk layout, native endianness:
+//   header | record* where record = record_t | path | filter | listing
+typedef struct header_t {
+    uint32_t magic, version;
+    uint32_t count;
+    uint8_t list_hidden;
+    uint8_t pad[3];
+} header_t;
+
+typedef struct record_t {
+    int64_t mtime;
+    int32_t pos, offset;
+    uint32_t path_sz, filter_sz, listing_sz;
+    uint8_t hidden, filter_type;
+    uint8_t pad[2];
+} record_t;
+
+static bool session_file(char *file, size_t sz);
+static int find_dir(session_t *s, string_t path);
+static void drop_listing(dirstate_t *d);
+
+static bool
+session_file(char *file, size_t sz)
+{
+    char *home = getenv("HOME");
+    if (!home) return false;
+    snprintf(file, sz, "%s/.mfmsession", home);
+    return true;
+}
+
+static int
+find_dir(session_t *s, string_t path)
+{
+    for (int i = 0; i < s->size; ++i) {
+        if (streqs(&s->data[i].path, &path))
+            return i;
+    }
+    return -1;
+}
+
+static void
+drop_listing(dirstate_t *d)
+{
+    if (d->owned) free(d->listing);
+    d->listing = NULL;
+    d->listing_sz = 0;
+    d->owned = false;
+}
+
+session_t
+load_session(void)
+{
+    session_t s = (session_t) LIST_ALLOC(dirstate_t);
+    s.list_hidden = false;
+    s.map = NULL;
+    s.map_sz = 0;
+
+    char file[MAX_PATH_SZ];
+    if (!session_file(file, sizeof(file))) return s;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return s;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(header_t)) {
+        close(fd);
+        return s;
+    }
+
+    // listings point straight into the map, nothing is copied until
+    // a directory is actually visited again
+    char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return s;
+
+    header_t *hdr = (header_t*) map;
+    if (hdr->magic != SESSION_MAGIC || hdr->version != SESSION_VERSION) {
+        munmap(map, sb.st_size);
+        return s;
+    }
+
+    s.map = map;
+    s.map_sz = sb.st_size;
+    s.list_hidden = hdr->list_hidden;
+
+    size_t pos = sizeof(header_t);
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        if (pos + sizeof(record_t) > s.map_sz) break;
+        record_t rec;
+        memcpy(&rec, map + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (pos + rec.path_sz + rec.filter_sz + rec.listing_sz > s.map_sz) break;
+
+        dirstate_t d = {0};
+        d.path.size = rec.path_sz;
+        d.path.alloc = rec.path_sz + 1;
+        d.path.data = malloc(d.path.alloc);
+        memcpy(d.path.data, map + pos, rec.path_sz);
+        pos += rec.path_sz;
+        if (rec.filter_sz)
+            d.filter = strndup(map + pos, rec.filter_sz);
+        d.filter_type = (rec.filter_type <= FILTER_EXEC)? rec.filter_type : FILTER_ALL;
+        pos += rec.filter_sz;
+
+        d.curr = (cursor_t) {rec.pos, rec.offset};
+        d.mtime = rec.mtime;
+        d.hidden = rec.hidden;
+        if (rec.listing_sz) {
+            d.listing = map + pos;
+            d.listing_sz = rec.listing_sz;
+        }
+        pos += rec.listing_sz;
+        LIST_ADD(s, s.size, d);
+    }
+    return s;
+}
+
+void
+save_session(session_t *s)
+{
+    char file[MAX_PATH_SZ], tmp[MAX_PATH_SZ+8];
+    if (!session_file(file, sizeof(file))) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+
+    header_t hdr = {
+        .magic = SESSION_MAGIC,
+        .version = SESSION_VERSION,
+        .count = s->size,
+        .list_hidden = s->list_hidden,
+    };
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    for (int i = 0; i < s->size; ++i) {
+        dirstate_t *d = &s->data[i];
+        size_t filter_sz = d->filter? strlen(d->filter) : 0;
+        record_t rec = {
+            .mtime = d->mtime,
+            .pos = d->curr.pos,
+            .offset = d->curr.offset,
+            .path_sz = d->path.size,
+            .filter_sz = filter_sz,
+            .filter_type = d->filter_type,
+            .listing_sz = d->listing_sz,
+            .hidden = d->hidden,
+        };
+        fwrite(&rec, sizeof(rec), 1, fp);
+        fwrite(d->path.data, 1, d->path.size, fp);
+        if (filter_sz)
+            fwrite(d->filter, 1, filter_sz, fp);
+        if (d->listing_sz)
+            fwrite(d->listing, 1, d->listing_sz, fp);
+    }
+
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (ok) rename(tmp, file);
+    else unlink(tmp);
+}
+
+void
+free_session(session_t *s)
+{
+    for (int i = 0; i < s->size; ++i) {
+        drop_listing(&s->data[i]);
+        free(s->data[i].filter);
+        LIST_FREE(s->data[i].path);
+    }
+    LIST_FREEP(s);
+    if (s->map) munmap(s->map, s->map_sz);
+    s->map = NULL;
+}
+
+void
+session_store(session_t *s, files_t *f)
+{
+    dirstate_t d = {0};
+    int i = find_dir(s, f->path);
+    if (i >= 0) {
+        d = s->data[i];
+        LIST_POP((*s), i);
+    }
+    else {
+        d.path.size = f->path.size;
+        d.path.alloc = f->path.size + 1;
+        d.path.data = malloc(d.path.alloc);
+        memcpy(d.path.data, f->path.data, f->path.size);
+    }
+
+    d.curr = f->curr;
+    // a result listing's filter isn't the directory's
+    if (!f->virt) {
+        free(d.filter);
+        d.filter = f->filter.text? strdup(f->filter.text) : NULL;
+        d.filter_type = f->filter.type;
+    }
+    drop_listing(&d);
+
+    // only keep snapshots of listings that are known to be complete
+    if (f->mtime) {
+        size_t sz = 0;
+        for (int j = 0; j < f->all.size; ++j)
+            sz += f->all.data[j].name.size + 1;
+
+        d.listing = malloc(sz + 1);
+        d.listing_sz = sz;
+        d.owned = true;
+        char *p = d.listing;
+        for (int j = 0; j < f->all.size; ++j) {
+            memcpy(p, f->all.data[j].name.data, f->all.data[j].name.size);
+            p += f->all.data[j].name.size;
+            *p++ = '\n';
+        }
+        d.mtime = f->mtime;
+        d.hidden = true; // the listing has hidden files either way
+    }
+
+    LIST_ADDP(s, 0, d);
+    s->list_hidden = f->list_hidden;
+
+    for (int j = SESSION_MAX_SNAPSHOTS; j < s->size; ++j)
+        drop_listing(&s->data[j]);
+    while (s->size > SESSION_MAX_DIRS) {
+        free(s->data[s->size-1].filter);
+        LIST_FREE(s->data[s->size-1].path);
+        s->size--;
+    }
+}
+
+bool
+session_restore(session_t *s, files_t *f)
+{
+    int i = find_dir(s, f->path);
+    if (i < 0) return false;
+
+    // the filter goes first, the cursor is a position in what it lets through
+    dirstate_t *d = &s->data[i];
+    if (!f->windowed) {
+        f->filter.type = d->filter_type;
+        if (!set_filter(f, d->filter? d->filter : ""))
+            update_view(f);
+    }
+
+    cursor_t curr = d->curr;
+    if (curr.pos >= (int) f->size)
+        curr.pos = f->size ? f->size-1 : 0;
+    if (curr.offset > curr.pos)
+        curr.offset = curr.pos;
+    if (curr.pos < 0 || curr.offset < 0)
+        curr = (cursor_t) {0, 0};
+    f->curr = curr;
+    return true;
+}
+
+bool
+session_load_listing(session_t *s, files_t *f)
+{
+    int i = find_dir(s, f->path);
+    if (i < 0) return false;
+
+    dirstate_t *d = &s->data[i];
+    if (!d->listing || !d->hidden)
+        return false;
+
+    fill_entries(f, d->listing, d->listing_sz);
+    f->mtime = d->mtime;
+    f->snapshot = true;
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "mstring.h"
+#include "mfm.h"
+
+#define SESSION_MAGIC 0x534d464d /* "MFMS" */
+#define SESSION_VERSION 2
+#define SESSION_MAX_DIRS 512
+#define SESSION_MAX_SNAPSHOTS 8
+
+// per-directory state, most recently visited first
+typedef struct dirstate_t {
+    string_t path;
+    cursor_t curr;
+    char *filter;    // filter text as set_filter takes it, NULL if none
+    int filter_type; // FILTER_*
+    int64_t mtime;   // dir mtime (ns) when the listing was taken
+    bool hidden;     // listing was taken with hidden files shown
+    char *listing;   // '\n' separated names, NULL if there's no snapshot
+    size_t listing_sz;
+    bool owned;      // listing was malloc'd (otherwise it points into the map)
+} dirstate_t;
+
+typedef struct session_t {
+    dirstate_t *data;
+    size_t size, alloc;
+    bool list_hidden;
+    void *map;
+    size_t map_sz;
+} session_t;
+
+session_t load_session(void);
+void save_session(session_t *s);
+void free_session(session_t *s);
+
+// remember filter, cursor (and a snapshot of the listing) for f->path
+void session_store(session_t *s, files_t *f);
+// restore filter and cursor for f->path, returns false if there's
+// nothing stored
+bool session_restore(session_t *s, files_t *f);
+// fill f from a snapshot if the directory didn't change since it was taken
+bool session_load_listing(session_t *s, files_t *f);
+
+#endif
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sync.h"
+#include "wake.h"
+
+typedef struct name_t {
+    char *name;
+} name_t;
+
+typedef struct job_t {
+    char **paths;
+    size_t npaths;
+    char *dest;
+    bool contents;
+    bool dry;
+} job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static bool running = false, reported = true, dry_run = false;
+static volatile bool cancel = false;
+static sync_plan_t *result = NULL;
+
+// progress, under lock
+static size_t nseen = 0, ncopied = 0, nfresh = 0, nfailed = 0;
+static uint64_t done_bytes = 0;
+static int first_err = 0;
+static int64_t start_ms = 0, end_ms = 0;
+
+// only touched by the sync thread
+static sync_plan_t *plan = NULL;
+static size_t plan_alloc = 0;
+static char *buf_a = NULL, *buf_b = NULL;
+
+static void count(size_t *what, int err);
+static void plan_add(const char *rel, size_t len, bool created, uint64_t bytes);
+static int compare_names(const void *a, const void *b);
+static name_t *read_names(int fd, size_t *n);
+static void free_names(name_t *names, size_t n);
+static bool same_contents(int sfd, int dfd, const char *name);
+static int copy_data(int in, int out);
+static int copy_file(int sfd, int dfd, const char *name, struct stat *st);
+static int copy_link(int dfd, const char *name, const char *target);
+static void sync_entry(int sfd, int dfd, const char *name, bool exists, char *rel, size_t len, job_t *job);
+static void sync_dir(int sfd, int dfd, char *rel, size_t len, job_t *job);
+static void *sync_thread(void *arg);
+
+static void
+count(size_t *what, int err)
+{
+    pthread_mutex_lock(&lock);
+    (*what)++;
+    if (err && !first_err) first_err = err;
+    wake_notify(&wake, false);
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+plan_add(const char *rel, size_t len, bool created, uint64_t bytes)
+{
+    if (plan->sz + len + 1 > plan_alloc) {
+        plan_alloc = (plan->sz + len + 1) * 2;
+        plan->buf = realloc(plan->buf, plan_alloc);
+    }
+    memcpy(plan->buf + plan->sz, rel, len);
+    plan->sz += len;
+    plan->buf[plan->sz++] = '\n';
+    plan->count++;
+    plan->created += created;
+    plan->bytes += bytes;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    return strcmp(((name_t*) a)->name, ((name_t*) b)->name);
+}
+
+// names in the directory, sorted so source and destination can be
+// walked side by side
+static name_t *
+read_names(int fd, size_t *n)
+{
+    *n = 0;
+    int dup_fd = dup(fd);
+    DIR *dir = (dup_fd >= 0)? fdopendir(dup_fd) : NULL;
+    if (!dir) {
+        if (dup_fd >= 0) close(dup_fd);
+        return NULL;
+    }
+    size_t alloc = 64;
+    name_t *names = malloc(alloc * sizeof(name_t));
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (*n == alloc) {
+            alloc *= 2;
+            names = realloc(names, alloc * sizeof(name_t));
+        }
+        names[*n].name = strdup(ent->d_name);
+        (*n)++;
+    }
+    closedir(dir);
+    qsort(names, *n, sizeof(name_t), compare_names);
+    return names;
+}
+
+static void
+free_names(name_t *names, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        free(names[i].name);
+    free(names);
+}
+
+static bool
+same_contents(int sfd, int dfd, const char *name)
+{
+    int a = openat(sfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    int b = openat(dfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    bool same = a >= 0 && b >= 0;
+    while (same && !cancel) {
+        ssize_t na = read(a, buf_a, SYNC_READ_SZ);
+        ssize_t nb = (na > 0)? read(b, buf_b, na) : 0;
+        // a short read on one side isn't a difference, catch it up
+        while (nb > 0 && nb < na) {
+            ssize_t more = read(b, buf_b + nb, na - nb);
+            if (more <= 0) break;
+            nb += more;
+        }
+        if (na < 0 || na != nb || memcmp(buf_a, buf_b, na) != 0)
+            same = false;
+        if (na <= 0) break;
+    }
+    if (a >= 0) close(a);
+    if (b >= 0) close(b);
+    return same && !cancel;
+}
+
+// the kernel moves the bytes when it can, without them passing through
+// here, and a plain read and write loop is left for when it can't
+static int
+copy_data(int in, int out)
+{
+    bool in_kernel = true;
+    while (!cancel) {
+        ssize_t n;
+        if (in_kernel) {
+            n = copy_file_range(in, NULL, out, NULL, SYNC_CHUNK_SZ, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                    || errno == EOPNOTSUPP)) {
+                in_kernel = false;
+                continue;
+            }
+        }
+        else {
+            n = read(in, buf_a, SYNC_READ_SZ);
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t w = write(out, buf_a + off, n - off);
+                if (w < 0) {
+                    n = -1;
+                    break;
+                }
+                off += w;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (n == 0) return 0;
+        pthread_mutex_lock(&lock);
+        done_bytes += n;
+        wake_notify(&wake, false);
+        pthread_mutex_unlock(&lock);
+    }
+    return ECANCELED;
+}
+
+// written next to the old file and renamed over it, so the old one
+// stays whole until the new one is
+static int
+copy_file(int sfd, int dfd, const char *name, struct stat *st)
+{
+    char tmp[NAME_MAX + 1];
+    bool direct = snprintf(tmp, sizeof(tmp), ".%s.sync", name) >= (int) sizeof(tmp);
+    if (direct) snprintf(tmp, sizeof(tmp), "%s", name);
+
+    int in = openat(sfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in < 0) return errno;
+    int out = openat(dfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (out < 0) {
+        int err = errno;
+        close(in);
+        return err;
+    }
+
+    int err = copy_data(in, out);
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if (!err && fchmod(out, st->st_mode & 07777) < 0) err = errno;
+    // the mtime is what tells the next sync the file is up to date
+    if (!err && futimens(out, times) < 0) err = errno;
+    if (close(out) < 0 && !err) err = errno;
+    close(in);
+    if (!err && !direct && renameat(dfd, tmp, dfd, name) < 0) err = errno;
+    if (err && !direct) unlinkat(dfd, tmp, 0);
+    return err;
+}
+
+static int
+copy_link(int dfd, const char *name, const char *target)
+{
+    char tmp[NAME_MAX + 1];
+    if (snprintf(tmp, sizeof(tmp), ".%s.sync", name) >= (int) sizeof(tmp))
+        return ENAMETOOLONG;
+    unlinkat(dfd, tmp, 0);
+    if (symlinkat(target, dfd, tmp) < 0) return errno;
+    if (renameat(dfd, tmp, dfd, name) < 0) {
+        int err = errno;
+        unlinkat(dfd, tmp, 0);
+        return err;
+    }
+    return 0;
+}
+
+// rel holds the path of the parent relative to the destination, len
+// bytes of it. dfd is -1 when a dry run gets below a directory that
+// doesn't exist yet
+static void
+sync_entry(int sfd, int dfd, const char *name, bool exists, char *rel, size_t len, job_t *job)
+{
+    struct stat ss, ds;
+    if (fstatat(sfd, name, &ss, AT_SYMLINK_NOFOLLOW) < 0) {
+        count(&nfailed, errno);
+        return;
+    }
+    bool have = exists && dfd >= 0 && fstatat(dfd, name, &ds, AT_SYMLINK_NOFOLLOW) == 0;
+    size_t name_sz = strlen(name);
+    if (len + name_sz + 2 >= PATH_MAX) {
+        count(&nfailed, ENAMETOOLONG);
+        return;
+    }
+    memcpy(rel + len, name, name_sz);
+    size_t sub = len + name_sz;
+    rel[sub] = '\0';
+
+    pthread_mutex_lock(&lock);
+    nseen++;
+    pthread_mutex_unlock(&lock);
+
+    // the same file on both sides, there's nothing to bring over
+    if (have && ss.st_dev == ds.st_dev && ss.st_ino == ds.st_ino) {
+        count(&nfresh, 0);
+        return;
+    }
+    if (have && S_ISDIR(ss.st_mode) != S_ISDIR(ds.st_mode)) {
+        count(&nfailed, S_ISDIR(ds.st_mode)? EISDIR : ENOTDIR);
+        return;
+    }
+
+    if (S_ISDIR(ss.st_mode)) {
+        rel[sub] = '/';
+        if (!have) plan_add(rel, sub + 1, true, 0);
+        if (!have && !job->dry && mkdirat(dfd, name, (ss.st_mode & 07777) | S_IRWXU) < 0) {
+            count(&nfailed, errno);
+            return;
+        }
+        int sub_sfd = openat(sfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        int sub_dfd = (dfd >= 0 && (have || !job->dry))?
+            openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW) : -1;
+        if (sub_sfd < 0 || (sub_dfd < 0 && (have || !job->dry))) {
+            count(&nfailed, errno);
+        }
+        else {
+            if (have) count(&nfresh, 0);
+            else if (!job->dry) count(&ncopied, 0);
+            sync_dir(sub_sfd, sub_dfd, rel, sub + 1, job);
+            // made writable for the copy, now it gets its own mode
+            if (!have && !job->dry) fchmod(sub_dfd, ss.st_mode & 07777);
+        }
+        if (sub_sfd >= 0) close(sub_sfd);
+        if (sub_dfd >= 0) close(sub_dfd);
+    }
+    else if (S_ISREG(ss.st_mode)) {
+        bool same = have && S_ISREG(ds.st_mode) && ss.st_size == ds.st_size;
+        if (same && job->contents) {
+            same = same_contents(sfd, dfd, name);
+        }
+        else if (same) {
+            same = ss.st_mtim.tv_sec == ds.st_mtim.tv_sec
+                && ss.st_mtim.tv_nsec == ds.st_mtim.tv_nsec;
+        }
+        if (same) {
+            count(&nfresh, 0);
+            return;
+        }
+        plan_add(rel, sub, !have, ss.st_size);
+        if (job->dry) return;
+        int err = copy_file(sfd, dfd, name, &ss);
+        if (err != ECANCELED) count(err? &nfailed : &ncopied, err);
+    }
+    else if (S_ISLNK(ss.st_mode)) {
+        char target[PATH_MAX], old[PATH_MAX];
+        ssize_t n = readlinkat(sfd, name, target, sizeof(target) - 1);
+        if (n < 0) {
+            count(&nfailed, errno);
+            return;
+        }
+        target[n] = '\0';
+        ssize_t m = (have && S_ISLNK(ds.st_mode))?
+            readlinkat(dfd, name, old, sizeof(old) - 1) : -1;
+        if (m == n && memcmp(old, target, n) == 0) {
+            count(&nfresh, 0);
+            return;
+        }
+        plan_add(rel, sub, !have, 0);
+        if (job->dry) return;
+        int err = copy_link(dfd, name, target);
+        count(err? &nfailed : &ncopied, err);
+    }
+    // sockets, fifos and devices aren't copied
+}
+
+static void
+sync_dir(int sfd, int dfd, char *rel, size_t len, job_t *job)
+{
+    size_t ns = 0, nd = 0;
+    name_t *src = read_names(sfd, &ns);
+    name_t *dst = (dfd >= 0)? read_names(dfd, &nd) : NULL;
+    if (!src) {
+        count(&nfailed, errno);
+        free_names(dst, nd);
+        return;
+    }
+
+    // both sides are sorted, so a name is on the destination side only
+    // if it turns up before the source side passes it
+    size_t j = 0;
+    for (size_t i = 0; i < ns && !cancel; ++i) {
+        int cmp = 1;
+        while (j < nd && (cmp = strcmp(dst[j].name, src[i].name)) < 0) ++j;
+        sync_entry(sfd, dfd, src[i].name, j < nd && cmp == 0, rel, len, job);
+    }
+    free_names(src, ns);
+    free_names(dst, nd);
+}
+
+static void *
+sync_thread(void *arg)
+{
+    job_t *job = arg;
+    char *rel = malloc(PATH_MAX);
+    plan = calloc(1, sizeof(sync_plan_t));
+    plan_alloc = 0;
+    buf_a = malloc(SYNC_READ_SZ);
+    buf_b = malloc(SYNC_READ_SZ);
+
+    char dest[PATH_MAX];
+    int dfd = open(job->dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0 || !realpath(job->dest, dest)) {
+        count(&nfailed, errno);
+    }
+    for (size_t i = 0; dfd >= 0 && i < job->npaths && !cancel; ++i) {
+        char *path = job->paths[i];
+        size_t len = strlen(path);
+        while (len > 1 && path[len-1] == '/') path[--len] = '\0';
+
+        // a tree synced into itself would never run out of new entries
+        char real[PATH_MAX];
+        size_t rlen = realpath(path, real)? strlen(real) : 0;
+        if (rlen && strncmp(dest, real, rlen) == 0 && dest[rlen] == '/') {
+            count(&nfailed, EINVAL);
+            continue;
+        }
+
+        char *slash = strrchr(path, '/');
+        char parent[PATH_MAX];
+        const char *name = path;
+        if (slash) {
+            size_t plen = (slash == path)? 1 : (size_t) (slash - path);
+            memcpy(parent, path, plen);
+            parent[plen] = '\0';
+            name = slash + 1;
+        }
+        int sfd = open(slash? parent : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sfd < 0) {
+            count(&nfailed, errno);
+            continue;
+        }
+        sync_entry(sfd, dfd, name, true, rel, 0, job);
+        close(sfd);
+    }
+    if (dfd >= 0) close(dfd);
+
+    for (size_t i = 0; i < job->npaths; ++i)
+        free(job->paths[i]);
+    free(job->paths);
+    free(job->dest);
+    free(job);
+    free(rel);
+    free(buf_a);
+    free(buf_b);
+    buf_a = buf_b = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (dry_run && !cancel) {
+        result = plan;
+    }
+    else {
+        sync_free_plan(plan);
+    }
+    plan = NULL;
+    end_ms = now_ms();
+    running = false;
+    wake_notify(&wake, true);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+bool
+sync_start(char **paths, size_t npaths, const char *dest, bool contents, bool dry)
+{
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wake_open(&wake);
+    sync_free_plan(result);
+    result = NULL;
+    nseen = ncopied = nfresh = nfailed = 0;
+    done_bytes = 0;
+    first_err = 0;
+    start_ms = now_ms();
+    end_ms = 0;
+    dry_run = dry;
+    cancel = false;
+    reported = false;
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->paths = malloc((npaths + 1) * sizeof(char*));
+    for (size_t i = 0; i < npaths; ++i)
+        job->paths[i] = strdup(paths[i]);
+    job->npaths = npaths;
+    job->dest = strdup(dest);
+    job->contents = contents;
+    job->dry = dry;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    running = pthread_create(&thread, &attr, sync_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!running) {
+        for (size_t i = 0; i < npaths; ++i)
+            free(job->paths[i]);
+        free(job->paths);
+        free(job->dest);
+        free(job);
+        reported = true;
+    }
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void
+sync_cancel(void)
+{
+    pthread_mutex_lock(&lock);
+    cancel = true;
+    pthread_mutex_unlock(&lock);
+}
+
+bool
+sync_running(void)
+{
+    pthread_mutex_lock(&lock);
+    bool res = running;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+int
+sync_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+sync_progress(char *buf, size_t sz)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+
+    int64_t ms = (running? now_ms() : end_ms) - start_ms;
+    char failed[128] = "";
+    if (nfailed) {
+        snprintf(failed, sizeof(failed), ", %zu failed: %s", nfailed, strerror(first_err));
+    }
+
+    bool finished = false;
+    if (running && dry_run) {
+        snprintf(buf, sz, "sync: planning, %zu checked", nseen);
+    }
+    else if (running) {
+        snprintf(buf, sz, "sync: %zu checked, %zu copied, %.1f MiB",
+            nseen, ncopied, done_bytes / 1048576.0);
+    }
+    else {
+        finished = !reported;
+        reported = true;
+        if (cancel) {
+            snprintf(buf, sz, "%s", "sync: cancelled");
+        }
+        else if (dry_run) {
+            snprintf(buf, sz, "sync: %zu to copy (%zu new), %.1f MiB, %zu up to date%s",
+                result? result->count : 0, result? result->created : 0,
+                result? result->bytes / 1048576.0 : 0, nfresh, failed);
+        }
+        else {
+            snprintf(buf, sz, "synced: %zu copied, %zu up to date, %.1f MiB in %.1fs%s",
+                ncopied, nfresh, done_bytes / 1048576.0, ms / 1000.0, failed);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return finished;
+}
+
+sync_plan_t *
+sync_take_plan(void)
+{
+    pthread_mutex_lock(&lock);
+    sync_plan_t *res = running? NULL : result;
+    if (res) result = NULL;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void
+sync_free_plan(sync_plan_t *p)
+{
+    if (!p) return;
+    free(p->buf);
+    free(p);
+}
@@ -0,0 +1,38 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// brings a copy of a few trees up to date. source and destination are
+// read side by side, sorted, and only what is new or changed gets
+// copied. nothing is ever removed from the destination
+
+#define SYNC_CHUNK_SZ (8*1024*1024)  // copied between checks for cancel
+#define SYNC_READ_SZ (1024*1024)     // buffers when comparing contents
+
+typedef struct sync_plan_t {
+    char *buf;       // paths relative to the destination, '\n' terminated
+    size_t sz;
+    size_t count;
+    size_t created;  // of those, how many don't exist yet
+    uint64_t bytes;  // to be copied
+} sync_plan_t;
+
+// sync each of paths into dest/<basename>. files are skipped when size
+// and mtime match, or with contents set, when their contents do. with
+// dry set nothing is touched and a plan is made instead. false if a
+// sync is already running
+bool sync_start(char **paths, size_t npaths, const char *dest, bool contents, bool dry);
+void sync_cancel(void);
+bool sync_running(void);
+// fd that becomes readable on progress and when the sync is over
+int sync_fd(void);
+// one line describing the sync. true once, when it has just finished
+bool sync_progress(char *buf, size_t sz);
+// the plan of a finished dry run, NULL otherwise
+sync_plan_t *sync_take_plan(void);
+void sync_free_plan(sync_plan_t *p);
+
+#endif
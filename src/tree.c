@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "tree.h"
+#include "vfs.h"
+#include "wake.h"
+
+enum {
+    NAME_DIR = 1,
+    NAME_LINK = 2,
+};
+
+typedef struct request_t {
+    struct request_t *next;
+    uint64_t gen;
+    uint32_t node, id;
+    bool hidden;
+    char *path;
+} request_t;
+
+typedef struct result_t {
+    struct result_t *next;
+    uint64_t gen;
+    uint32_t node, id;
+    int err;
+    char *names;     // '\0' terminated, one after the other
+    uint8_t *flags;  // NAME_* for each
+    uint32_t count;
+} result_t;
+
+typedef struct name_t {
+    char *name;
+    size_t sz;
+    uint8_t flags;
+} name_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static wake_t wake = WAKE_INIT;
+static request_t *requests = NULL, *requests_last = NULL;
+static result_t *results = NULL;
+static size_t nthreads = 0;
+static uint64_t live_gen = 0;  // requests of any other tree are skipped
+
+static int compare_names(const void *a, const void *b);
+static result_t *list_dir(request_t *req);
+static void *list_thread(void *arg);
+static void request(tree_t *t, uint32_t node);
+static uint32_t alloc_node(tree_t *t);
+static bool shown(tree_t *t, uint32_t node);
+static size_t find_row(tree_t *t, uint32_t node);
+static void collect(tree_t *t, uint32_t node, uint32_t **buf, size_t *n, size_t *alloc);
+static size_t insert_rows(tree_t *t, size_t at, uint32_t node);
+static bool apply(tree_t *t, result_t *r, size_t *keep);
+static void drop_kids(tree_t *t, uint32_t node);
+static int compare_used(const void *a, const void *b);
+static void evict(tree_t *t);
+
+// dirs first, then by name, like the listing
+static int
+compare_names(const void *a, const void *b)
+{
+    const name_t *x = a, *y = b;
+    bool xd = x->flags & NAME_DIR, yd = y->flags & NAME_DIR;
+    if (xd != yd)
+        return yd - xd;
+
+    int res = memcmp(x->name, y->name, (x->sz < y->sz)? x->sz : y->sz);
+    if (res) return res;
+    return (x->sz > y->sz) - (x->sz < y->sz);
+}
+
+static result_t *
+list_dir(request_t *req)
+{
+    result_t *r = calloc(1, sizeof(result_t));
+    r->gen = req->gen;
+    r->node = req->node;
+    r->id = req->id;
+
+    void *dir = vfs->opendir(req->path);
+    if (!dir) {
+        r->err = errno;
+        return r;
+    }
+
+    name_t *names = NULL;
+    size_t count = 0, alloc = 0, total = 0;
+    const char *name;
+    int type;
+    while ((name = vfs->readdir(dir, &type))) {
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if (name[0] == '.' && !req->hidden)
+            continue;
+        if ((count & 1023) == 0 && req->gen != live_gen)
+            break;
+
+        // links are never opened, a loop would go on forever
+        if (type == VFS_UNKNOWN) {
+            struct stat st;
+            bool ok = vfs->statat(dir, name, &st, false) == 0;
+            type = !ok? VFS_FILE : S_ISDIR(st.st_mode)? VFS_DIR
+                : S_ISLNK(st.st_mode)? VFS_LINK : VFS_FILE;
+        }
+
+        if (count == alloc) {
+            alloc = alloc? alloc*2 : 256;
+            names = realloc(names, alloc * sizeof(name_t));
+        }
+        size_t sz = strlen(name);
+        uint8_t flags = (type == VFS_DIR)? NAME_DIR : (type == VFS_LINK)? NAME_LINK : 0;
+        names[count++] = (name_t) { strdup(name), sz, flags };
+        total += sz + 1;
+    }
+    vfs->closedir(dir);
+
+    qsort(names, count, sizeof(name_t), compare_names);
+    r->names = malloc(total + 1);
+    r->flags = malloc(count + 1);
+    char *p = r->names;
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(p, names[i].name, names[i].sz + 1);
+        p += names[i].sz + 1;
+        r->flags[i] = names[i].flags;
+        free(names[i].name);
+    }
+    r->count = count;
+    free(names);
+    return r;
+}
+
+static void *
+list_thread(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!requests)
+            pthread_cond_wait(&cond, &lock);
+        request_t *req = requests;
+        requests = req->next;
+        if (!requests) requests_last = NULL;
+        if (req->gen != live_gen) {
+            free(req->path);
+            free(req);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+
+        result_t *r = list_dir(req);
+        free(req->path);
+        free(req);
+
+        pthread_mutex_lock(&lock);
+        r->next = results;
+        results = r;
+        wake_notify(&wake, true);
+    }
+    return NULL;
+}
+
+static void
+request(tree_t *t, uint32_t node)
+{
+    tree_node_t *n = &t->nodes[node];
+    n->state = TREE_LISTING;
+    request_t *req = calloc(1, sizeof(request_t));
+    req->gen = t->gen;
+    req->node = node;
+    req->id = n->id;
+    req->hidden = t->hidden;
+    req->path = tree_path(t, node);
+
+    pthread_mutex_lock(&lock);
+    if (requests_last) requests_last->next = req;
+    else requests = req;
+    requests_last = req;
+
+    // the readers stay around, waiting for the next tree
+    while (nthreads < TREE_THREADS) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, list_thread, NULL) != 0) break;
+        pthread_detach(thread);
+        nthreads++;
+    }
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static uint32_t
+alloc_node(tree_t *t)
+{
+    t->held++;
+    if (t->nfree) return t->free[--t->nfree];
+    if (t->nnodes == t->alloc) {
+        t->alloc = t->alloc? t->alloc*2 : 1024;
+        t->nodes = realloc(t->nodes, t->alloc * sizeof(tree_node_t));
+    }
+    return t->nnodes++;
+}
+
+// every dir above it is open
+static bool
+shown(tree_t *t, uint32_t node)
+{
+    if (!node) return true;
+    for (uint32_t x = t->nodes[node].parent; x; x = t->nodes[x].parent) {
+        if (!t->nodes[x].open) return false;
+    }
+    return true;
+}
+
+static size_t
+find_row(tree_t *t, uint32_t node)
+{
+    for (size_t i = 0; i < t->nrows; ++i) {
+        if (t->rows[i] == node) return i;
+    }
+    return SIZE_MAX;
+}
+
+// the rows below an open node, in order
+static void
+collect(tree_t *t, uint32_t node, uint32_t **buf, size_t *n, size_t *alloc)
+{
+    tree_node_t *p = &t->nodes[node];
+    for (uint32_t i = 0; i < p->nkids; ++i) {
+        uint32_t kid = p->kids[i];
+        if (*n == *alloc) {
+            *alloc = *alloc? *alloc*2 : 256;
+            *buf = realloc(*buf, *alloc * sizeof(uint32_t));
+        }
+        (*buf)[(*n)++] = kid;
+        tree_node_t *k = &t->nodes[kid];
+        if (k->open && k->state == TREE_LISTED)
+            collect(t, kid, buf, n, alloc);
+    }
+}
+
+static size_t
+insert_rows(tree_t *t, size_t at, uint32_t node)
+{
+    uint32_t *buf = NULL;
+    size_t n = 0, alloc = 0;
+    collect(t, node, &buf, &n, &alloc);
+    if (!n) return 0;
+
+    if (t->nrows + n > t->rows_alloc) {
+        while (t->nrows + n > t->rows_alloc)
+            t->rows_alloc = t->rows_alloc? t->rows_alloc*2 : 1024;
+        t->rows = realloc(t->rows, t->rows_alloc * sizeof(uint32_t));
+    }
+    memmove(t->rows + at + n, t->rows + at, (t->nrows - at) * sizeof(uint32_t));
+    memcpy(t->rows + at, buf, n * sizeof(uint32_t));
+    t->nrows += n;
+    free(buf);
+    return n;
+}
+
+static bool
+apply(tree_t *t, result_t *r, size_t *keep)
+{
+    if (r->gen != t->gen || r->node >= t->nnodes) return false;
+    if (t->nodes[r->node].id != r->id || t->nodes[r->node].state != TREE_LISTING)
+        return false;
+    if (r->err) {
+        t->nodes[r->node].state = TREE_FAILED;
+        t->nodes[r->node].err = r->err;
+        return false;
+    }
+
+    uint32_t *kids = malloc((r->count + 1) * sizeof(uint32_t));
+    uint16_t depth = t->nodes[r->node].depth + 1;
+    char *name = r->names;
+    for (uint32_t i = 0; i < r->count; ++i) {
+        uint32_t k = alloc_node(t);
+        t->nodes[k] = (tree_node_t) {
+            .name = name,
+            .parent = r->node,
+            .id = ++t->next_id,
+            .depth = depth,
+            .is_dir = r->flags[i] & NAME_DIR,
+            .is_link = r->flags[i] & NAME_LINK,
+        };
+        name += strlen(name) + 1;
+        kids[i] = k;
+    }
+    tree_node_t *n = &t->nodes[r->node];
+    n->kids = kids;
+    n->nkids = r->count;
+    n->names = r->names;
+    n->state = TREE_LISTED;
+    r->names = NULL;
+
+    if (!n->open || !shown(t, r->node)) return false;
+    size_t at = 0;
+    if (r->node) {
+        at = find_row(t, r->node);
+        if (at == SIZE_MAX) return false;
+        at++;
+    }
+    size_t added = insert_rows(t, at, r->node);
+    if (keep && *keep >= at && t->nrows > added) *keep += added;
+    return added > 0;
+}
+
+static void
+drop_kids(tree_t *t, uint32_t node)
+{
+    for (uint32_t i = 0; i < t->nodes[node].nkids; ++i) {
+        uint32_t k = t->nodes[node].kids[i];
+        drop_kids(t, k);
+        t->nodes[k].id = 0;
+        if (t->nfree == t->free_alloc) {
+            t->free_alloc = t->free_alloc? t->free_alloc*2 : 1024;
+            t->free = realloc(t->free, t->free_alloc * sizeof(uint32_t));
+        }
+        t->free[t->nfree++] = k;
+        t->held--;
+    }
+    tree_node_t *n = &t->nodes[node];
+    free(n->kids);
+    free(n->names);
+    n->kids = NULL;
+    n->names = NULL;
+    n->nkids = 0;
+    if (n->state == TREE_LISTED) n->state = TREE_UNLISTED;
+}
+
+static tree_t *sorting;
+
+static int
+compare_used(const void *a, const void *b)
+{
+    uint32_t x = sorting->nodes[*(uint32_t*) a].used;
+    uint32_t y = sorting->nodes[*(uint32_t*) b].used;
+    return (x > y) - (x < y);
+}
+
+// closed dirs let go of what they hold, the ones closed longest ago
+// first. nothing below a closed dir is on screen
+static void
+evict(tree_t *t)
+{
+    uint32_t *closed = malloc(t->nnodes * sizeof(uint32_t));
+    size_t n = 0;
+    for (size_t i = 1; i < t->nnodes; ++i) {
+        tree_node_t *node = &t->nodes[i];
+        if (node->id && !node->open && node->nkids) closed[n++] = i;
+    }
+    sorting = t;
+    qsort(closed, n, sizeof(uint32_t), compare_used);
+    for (size_t i = 0; i < n && t->held > TREE_MAX_NODES / 4 * 3; ++i) {
+        // it may have gone with a dir above it already
+        if (t->nodes[closed[i]].id) drop_kids(t, closed[i]);
+    }
+    free(closed);
+}
+
+void
+tree_init(tree_t *t, const char *root, bool hidden)
+{
+    *t = (tree_t) { .root = strdup(root), .hidden = hidden };
+    pthread_mutex_lock(&lock);
+    wake_open(&wake);
+    t->gen = ++live_gen;
+    pthread_mutex_unlock(&lock);
+
+    uint32_t r = alloc_node(t);
+    t->nodes[r] = (tree_node_t) {
+        .name = "",
+        .id = ++t->next_id,
+        .is_dir = true,
+        .open = true,
+    };
+    request(t, r);
+}
+
+void
+tree_free(tree_t *t)
+{
+    pthread_mutex_lock(&lock);
+    if (live_gen == t->gen) ++live_gen;
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < t->nnodes; ++i) {
+        if (!t->nodes[i].id) continue;
+        free(t->nodes[i].kids);
+        free(t->nodes[i].names);
+    }
+    free(t->nodes);
+    free(t->free);
+    free(t->rows);
+    free(t->root);
+    *t = (tree_t) {0};
+}
+
+void
+tree_open(tree_t *t, size_t row)
+{
+    if (row >= t->nrows) return;
+    uint32_t node = t->rows[row];
+    tree_node_t *n = &t->nodes[node];
+    if (!n->is_dir || n->open) return;
+    n->open = true;
+    if (n->state == TREE_UNLISTED || n->state == TREE_FAILED)
+        request(t, node);
+    else if (n->state == TREE_LISTED)
+        insert_rows(t, row + 1, node);
+}
+
+void
+tree_close(tree_t *t, size_t row)
+{
+    if (row >= t->nrows) return;
+    tree_node_t *n = &t->nodes[t->rows[row]];
+    if (!n->open) return;
+    n->open = false;
+    n->used = ++t->tick;
+
+    size_t end = row + 1;
+    while (end < t->nrows && t->nodes[t->rows[end]].depth > n->depth)
+        ++end;
+    memmove(t->rows + row + 1, t->rows + end, (t->nrows - end) * sizeof(uint32_t));
+    t->nrows -= end - row - 1;
+}
+
+size_t
+tree_parent_row(tree_t *t, size_t row)
+{
+    if (row >= t->nrows) return row;
+    uint16_t depth = t->nodes[t->rows[row]].depth;
+    for (size_t i = row; i-- > 0; ) {
+        if (t->nodes[t->rows[i]].depth < depth) return i;
+    }
+    return row;
+}
+
+char *
+tree_path(tree_t *t, uint32_t node)
+{
+    // a root of "/" already ends in one
+    size_t root_sz = strlen(t->root);
+    if (root_sz && t->root[root_sz-1] == '/') --root_sz;
+    size_t len = root_sz;
+    for (uint32_t x = node; x; x = t->nodes[x].parent)
+        len += strlen(t->nodes[x].name) + 1;
+
+    char *path = malloc(len + 2);
+    memcpy(path, t->root, root_sz);
+    size_t end = len;
+    path[end] = '\0';
+    for (uint32_t x = node; x; x = t->nodes[x].parent) {
+        size_t sz = strlen(t->nodes[x].name);
+        end -= sz;
+        memcpy(path + end, t->nodes[x].name, sz);
+        path[--end] = '/';
+    }
+    if (!len) strcpy(path, "/");
+    return path;
+}
+
+int
+tree_fd(void)
+{
+    return wake.fd[0];
+}
+
+bool
+tree_poll(tree_t *t, size_t *keep)
+{
+    pthread_mutex_lock(&lock);
+    wake_drain(&wake);
+    result_t *r = results;
+    results = NULL;
+    pthread_mutex_unlock(&lock);
+
+    bool changed = false;
+    while (r) {
+        result_t *next = r->next;
+        if (t->root && apply(t, r, keep)) changed = true;
+        free(r->names);
+        free(r->flags);
+        free(r);
+        r = next;
+    }
+    if (t->held > TREE_MAX_NODES) evict(t);
+    return changed;
+}
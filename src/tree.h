@@ -0,0 +1,69 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// the tree view. dirs open in place, and their children are read in the
+// background the first time they're opened. what is shown is a flat
+// array of node indices, one per row, so drawing and moving around cost
+// the rows on screen however much of the tree is open. closed dirs keep
+// their children until more than TREE_MAX_NODES are held, then the ones
+// closed the longest ago let go of theirs
+
+#define TREE_MAX_NODES (1 << 20)
+#define TREE_THREADS 4  // dirs read at once, it's mostly waiting on slow mounts
+
+enum {
+    TREE_UNLISTED,
+    TREE_LISTING,
+    TREE_LISTED,
+    TREE_FAILED,
+};
+
+typedef struct tree_node_t {
+    const char *name;  // in the parent's names
+    char *names;       // the children's names, one block
+    uint32_t *kids;    // node indices, sorted like a listing
+    uint32_t nkids;
+    uint32_t parent;
+    uint32_t id;       // 0 once the slot is free
+    uint32_t used;     // when it was last closed
+    int err;           // TREE_FAILED
+    uint16_t depth;    // the root's children are 1
+    uint8_t state;
+    bool is_dir, is_link, open;
+} tree_node_t;
+
+typedef struct tree_t {
+    char *root;
+    bool hidden;
+    tree_node_t *nodes;  // the root is 0
+    size_t nnodes, alloc;
+    uint32_t *free;      // slots let go of, used before nodes grows
+    size_t nfree, free_alloc;
+    uint32_t *rows;      // node shown on each row
+    size_t nrows, rows_alloc;
+    size_t held;         // nodes in use
+    uint32_t next_id, tick;
+    uint64_t gen;
+} tree_t;
+
+// a tree of root with the root open. children are read as they're needed
+void tree_init(tree_t *t, const char *root, bool hidden);
+void tree_free(tree_t *t);
+// open or close the dir on row
+void tree_open(tree_t *t, size_t row);
+void tree_close(tree_t *t, size_t row);
+// row of the dir holding the node on row, row itself at the top level
+size_t tree_parent_row(tree_t *t, size_t row);
+// full path of a node, malloc'd
+char *tree_path(tree_t *t, uint32_t node);
+// fd that becomes readable when a listing is in
+int tree_fd(void);
+// hand the listings read so far to their nodes. rows after *keep move
+// with what is put in before them. true if the rows changed
+bool tree_poll(tree_t *t, size_t *keep);
+
+#endif
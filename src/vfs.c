@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "vfs.h"
+
+extern char **environ;
+
+typedef struct node_t {
+    struct node_t *parent;
+    struct node_t **kids;  // sorted by name
+    size_t nkids, kids_alloc;
+    char *name;
+    mode_t mode;
+    off_t size;
+    int64_t mtime;  // ns
+} node_t;
+
+// a listing is a copy of the names taken when the dir was opened, what
+// happens to the dir after that doesn't show
+typedef struct mem_dir_t {
+    char *path;
+    char *names;
+    size_t *offs;
+    unsigned char *types;
+    size_t count, next;
+} mem_dir_t;
+
+static pthread_rwlock_t mem_lock = PTHREAD_RWLOCK_INITIALIZER;
+static node_t *mem_root = NULL;
+static double mem_latency = 0, mem_jitter = 0;  // ms
+
+static int run_tool(char *const argv[]);
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+static void *posix_opendir(const char *path);
+static const char *posix_readdir(void *dir, int *type);
+static int posix_statat(void *dir, const char *name, struct stat *st, bool follow);
+static void posix_closedir(void *dir);
+static int posix_stat(const char *path, struct stat *st, bool follow);
+static int posix_rename(const char *from, const char *to);
+static int posix_remove(const char *path);
+static int posix_copy(const char *from, const char *to);
+static int posix_create(const char *path);
+static int posix_mkdir(const char *path);
+static int posix_chmod(const char *path, mode_t mode);
+
+static int64_t now_ns(void);
+static void delay(void);
+static int fail(int err);
+static node_t *new_node(const char *name, mode_t mode, off_t size);
+static void free_node(node_t *n);
+static int compare_kids(const void *a, const void *b);
+static node_t *find_kid(node_t *dir, const char *name, size_t *pos);
+static void add_kid(node_t *dir, node_t *kid);
+static void drop_kid(node_t *kid);
+static node_t *lookup(const char *path);
+static node_t *lookup_parent(const char *path, char *name);
+static node_t *copy_node(node_t *n, const char *name);
+static void fill_stat(node_t *n, struct stat *st);
+static void make_tree(node_t *dir, size_t files, size_t dirs, int depth);
+static bool mem_init(const char *opts, const char *root);
+static void *mem_opendir(const char *path);
+static const char *mem_readdir(void *dir, int *type);
+static int mem_statat(void *dir, const char *name, struct stat *st, bool follow);
+static void mem_closedir(void *dir);
+static int mem_stat(const char *path, struct stat *st, bool follow);
+static int mem_rename(const char *from, const char *to);
+static int mem_remove(const char *path);
+static int mem_copy(const char *from, const char *to);
+static int mem_create(const char *path);
+static int mem_mkdir(const char *path);
+static int mem_chmod(const char *path, mode_t mode);
+
+static const vfs_t posix_vfs = {
+    .name = "posix",
+    .native = true,
+    .opendir = posix_opendir,
+    .readdir = posix_readdir,
+    .statat = posix_statat,
+    .closedir = posix_closedir,
+    .stat = posix_stat,
+    .rename = posix_rename,
+    .remove = posix_remove,
+    .copy = posix_copy,
+    .create = posix_create,
+    .mkdir = posix_mkdir,
+    .chmod = posix_chmod,
+};
+
+static vfs_t mem_vfs = {
+    .name = "mem",
+    .opendir = mem_opendir,
+    .readdir = mem_readdir,
+    .statat = mem_statat,
+    .closedir = mem_closedir,
+    .stat = mem_stat,
+    .rename = mem_rename,
+    .remove = mem_remove,
+    .copy = mem_copy,
+    .create = mem_create,
+    .mkdir = mem_mkdir,
+    .chmod = mem_chmod,
+};
+
+const vfs_t *vfs = &posix_vfs;
+
+// cp and mv know about every corner of copying across filesystems,
+// there's no point doing that again
+static int
+run_tool(char *const argv[])
+{
+    pid_t pid;
+    int status;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+        return fail(EIO);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return fail(EIO);
+    return 0;
+}
+
+static int
+remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st; (void) flag; (void) ftw;
+    return remove(path);
+}
+
+static void *
+posix_opendir(const char *path)
+{
+    return opendir(path);
+}
+
+static const char *
+posix_readdir(void *dir, int *type)
+{
+    struct dirent *de = readdir(dir);
+    if (!de) return NULL;
+    switch (de->d_type) {
+    case DT_UNKNOWN: *type = VFS_UNKNOWN; break;
+    case DT_DIR:     *type = VFS_DIR; break;
+    case DT_LNK:     *type = VFS_LINK; break;
+    default:         *type = VFS_FILE; break;
+    }
+    return de->d_name;
+}
+
+static int
+posix_statat(void *dir, const char *name, struct stat *st, bool follow)
+{
+    return fstatat(dirfd((DIR*) dir), name, st, follow? 0 : AT_SYMLINK_NOFOLLOW);
+}
+
+static void
+posix_closedir(void *dir)
+{
+    closedir(dir);
+}
+
+static int
+posix_stat(const char *path, struct stat *st, bool follow)
+{
+    return follow? stat(path, st) : lstat(path, st);
+}
+
+static int
+posix_rename(const char *from, const char *to)
+{
+    if (rename(from, to) == 0) return 0;
+    if (errno != EXDEV) return -1;
+    char *argv[] = { "mv", "--", (char*) from, (char*) to, NULL };
+    return run_tool(argv);
+}
+
+static int
+posix_remove(const char *path)
+{
+    return nftw(path, remove_one, 32, FTW_DEPTH | FTW_PHYS);
+}
+
+static int
+posix_copy(const char *from, const char *to)
+{
+    char *argv[] = { "cp", "-R", "--", (char*) from, (char*) to, NULL };
+    return run_tool(argv);
+}
+
+static int
+posix_create(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    futimens(fd, NULL);
+    close(fd);
+    return 0;
+}
+
+static int
+posix_mkdir(const char *path)
+{
+    return mkdir(path, 0777);
+}
+
+static int
+posix_chmod(const char *path, mode_t mode)
+{
+    return chmod(path, mode);
+}
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the lock is never held while waiting, like a slow mount other calls
+// go on meanwhile
+static void
+delay(void)
+{
+    if (mem_latency <= 0 && mem_jitter <= 0) return;
+    double ms = mem_latency + mem_jitter * (rand() / (double) RAND_MAX);
+    struct timespec ts = {
+        .tv_sec = (time_t) (ms / 1000),
+        .tv_nsec = (long) ((ms - (time_t) (ms / 1000) * 1000) * 1e6),
+    };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static int
+fail(int err)
+{
+    errno = err;
+    return -1;
+}
+
+static node_t *
+new_node(const char *name, mode_t mode, off_t size)
+{
+    node_t *n = calloc(1, sizeof(node_t));
+    n->name = strdup(name);
+    n->mode = mode;
+    n->size = size;
+    n->mtime = now_ns();
+    return n;
+}
+
+static void
+free_node(node_t *n)
+{
+    for (size_t i = 0; i < n->nkids; ++i)
+        free_node(n->kids[i]);
+    free(n->kids);
+    free(n->name);
+    free(n);
+}
+
+static int
+compare_kids(const void *a, const void *b)
+{
+    return strcmp((*(node_t**) a)->name, (*(node_t**) b)->name);
+}
+
+// pos is where name is or would go
+static node_t *
+find_kid(node_t *dir, const char *name, size_t *pos)
+{
+    size_t lo = 0, hi = dir->nkids;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int res = strcmp(dir->kids[mid]->name, name);
+        if (res == 0) {
+            if (pos) *pos = mid;
+            return dir->kids[mid];
+        }
+        if (res < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return NULL;
+}
+
+static void
+add_kid(node_t *dir, node_t *kid)
+{
+    size_t pos;
+    find_kid(dir, kid->name, &pos);
+    if (dir->nkids == dir->kids_alloc) {
+        dir->kids_alloc = dir->kids_alloc? dir->kids_alloc*2 : 16;
+        dir->kids = realloc(dir->kids, dir->kids_alloc * sizeof(node_t*));
+    }
+    memmove(dir->kids + pos + 1, dir->kids + pos, (dir->nkids - pos) * sizeof(node_t*));
+    dir->kids[pos] = kid;
+    dir->nkids++;
+    dir->mtime = now_ns();
+    kid->parent = dir;
+}
+
+static void
+drop_kid(node_t *kid)
+{
+    node_t *dir = kid->parent;
+    size_t pos;
+    if (!find_kid(dir, kid->name, &pos)) return;
+    memmove(dir->kids + pos, dir->kids + pos + 1, (dir->nkids - pos - 1) * sizeof(node_t*));
+    dir->nkids--;
+    dir->mtime = now_ns();
+    kid->parent = NULL;
+}
+
+// called with the lock held
+static node_t *
+lookup(const char *path)
+{
+    if (path[0] != '/') return NULL;
+    node_t *n = mem_root;
+    char name[NAME_MAX + 1];
+    for (const char *p = path; *p; ) {
+        while (*p == '/') ++p;
+        size_t len = strcspn(p, "/");
+        if (!len) break;
+        if (len > NAME_MAX) return NULL;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+
+        if (!S_ISDIR(n->mode)) return NULL;
+        if (strcmp(name, ".") == 0) continue;
+        if (strcmp(name, "..") == 0) {
+            if (n->parent) n = n->parent;
+            continue;
+        }
+        if (!(n = find_kid(n, name, NULL))) return NULL;
+    }
+    return n;
+}
+
+// the dir path would be in, with its last part copied to name
+static node_t *
+lookup_parent(const char *path, char *name)
+{
+    char dir[PATH_MAX];
+    size_t len = strlen(path);
+    while (len > 1 && path[len-1] == '/') --len;
+    if (len >= sizeof(dir)) return NULL;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    char *slash = strrchr(dir, '/');
+    if (!slash || !slash[1] || strlen(slash + 1) > NAME_MAX) return NULL;
+    strcpy(name, slash + 1);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return NULL;
+    if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+
+    node_t *n = lookup(dir);
+    return (n && S_ISDIR(n->mode))? n : NULL;
+}
+
+static node_t *
+copy_node(node_t *n, const char *name)
+{
+    node_t *c = new_node(name, n->mode, n->size);
+    c->kids_alloc = n->nkids;
+    c->kids = malloc((c->kids_alloc + 1) * sizeof(node_t*));
+    for (size_t i = 0; i < n->nkids; ++i) {
+        c->kids[i] = copy_node(n->kids[i], n->kids[i]->name);
+        c->kids[i]->parent = c;
+    }
+    c->nkids = n->nkids;
+    return c;
+}
+
+static void
+fill_stat(node_t *n, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = 1;
+    st->st_ino = (ino_t) (uintptr_t) n;
+    st->st_mode = n->mode;
+    st->st_nlink = S_ISDIR(n->mode)? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = n->size;
+    st->st_mtim.tv_sec = n->mtime / 1000000000;
+    st->st_mtim.tv_nsec = n->mtime % 1000000000;
+    st->st_ctim = st->st_atim = st->st_mtim;
+}
+
+// names are padded so they sort the way they were made
+static void
+make_tree(node_t *dir, size_t files, size_t dirs, int depth)
+{
+    static const char *exts[] = {
+        ".c", ".h", ".txt", ".md", ".png", ".tar.gz", ".sh", "",
+    };
+    int fw = snprintf(NULL, 0, "%zu", files), dw = snprintf(NULL, 0, "%zu", dirs);
+    size_t count = files + (depth > 0? dirs : 0);
+    dir->kids = malloc((count + 1) * sizeof(node_t*));
+    dir->kids_alloc = count;
+
+    char name[64];
+    for (size_t i = 0; i < files; ++i) {
+        const char *ext = exts[i % (sizeof(exts) / sizeof(*exts))];
+        snprintf(name, sizeof(name), "file%0*zu%s", fw, i, ext);
+        mode_t mode = S_IFREG | (strcmp(ext, ".sh") == 0? 0755 : 0644);
+        node_t *n = new_node(name, mode, (i * 2654435761u) % (1 << 20));
+        n->parent = dir;
+        dir->kids[dir->nkids++] = n;
+    }
+    for (size_t i = 0; depth > 0 && i < dirs; ++i) {
+        snprintf(name, sizeof(name), "dir%0*zu", dw, i);
+        node_t *n = new_node(name, S_IFDIR | 0755, 4096);
+        n->parent = dir;
+        dir->kids[dir->nkids++] = n;
+        make_tree(n, files, dirs, depth - 1);
+    }
+    qsort(dir->kids, dir->nkids, sizeof(node_t*), compare_kids);
+}
+
+static bool
+mem_init(const char *opts, const char *root)
+{
+    size_t files = 100, dirs = 4;
+    int depth = 2;
+    double latency = 0, jitter = 0;
+
+    char *copy = strdup(opts), *save = NULL;
+    bool ok = true;
+    for (char *opt = strtok_r(copy, ",", &save); opt && ok; opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, '=');
+        if (!val) {
+            ok = false;
+            break;
+        }
+        *val++ = '\0';
+        char *end;
+        double num = strtod(val, &end);
+        if (end == val || *end || num < 0) ok = false;
+        else if (strcmp(opt, "files") == 0) files = num;
+        else if (strcmp(opt, "dirs") == 0) dirs = num;
+        else if (strcmp(opt, "depth") == 0) depth = num;
+        else if (strcmp(opt, "latency") == 0) latency = num;
+        else if (strcmp(opt, "jitter") == 0) jitter = num;
+        else ok = false;
+    }
+    free(copy);
+    if (!ok || root[0] != '/') return false;
+
+    // the dirs leading to root only hold the next one
+    mem_root = new_node("", S_IFDIR | 0755, 4096);
+    node_t *n = mem_root;
+    char name[NAME_MAX + 1];
+    for (const char *p = root; *p; ) {
+        while (*p == '/') ++p;
+        size_t len = strcspn(p, "/");
+        if (!len || len > NAME_MAX) break;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+        node_t *kid = new_node(name, S_IFDIR | 0755, 4096);
+        add_kid(n, kid);
+        n = kid;
+    }
+    make_tree(n, files, dirs, depth);
+
+    mem_latency = latency;
+    mem_jitter = jitter;
+    mem_vfs.remote = latency > 0 || jitter > 0;
+    vfs = &mem_vfs;
+    return true;
+}
+
+static void *
+mem_opendir(const char *path)
+{
+    delay();
+    pthread_rwlock_rdlock(&mem_lock);
+    node_t *n = lookup(path);
+    if (!n || !S_ISDIR(n->mode)) {
+        pthread_rwlock_unlock(&mem_lock);
+        errno = n? ENOTDIR : ENOENT;
+        return NULL;
+    }
+
+    mem_dir_t *d = calloc(1, sizeof(mem_dir_t));
+    d->path = strdup(path);
+    d->count = n->nkids;
+    d->offs = malloc((d->count + 1) * sizeof(size_t));
+    d->types = malloc(d->count + 1);
+    size_t total = 0;
+    for (size_t i = 0; i < n->nkids; ++i)
+        total += strlen(n->kids[i]->name) + 1;
+    d->names = malloc(total + 1);
+    char *p = d->names;
+    for (size_t i = 0; i < n->nkids; ++i) {
+        node_t *kid = n->kids[i];
+        size_t len = strlen(kid->name) + 1;
+        memcpy(p, kid->name, len);
+        d->offs[i] = p - d->names;
+        d->types[i] = S_ISDIR(kid->mode)? VFS_DIR : S_ISLNK(kid->mode)? VFS_LINK : VFS_FILE;
+        p += len;
+    }
+    pthread_rwlock_unlock(&mem_lock);
+    return d;
+}
+
+static const char *
+mem_readdir(void *dir, int *type)
+{
+    mem_dir_t *d = dir;
+    if (d->next == d->count) return NULL;
+    if (d->next && d->next % VFS_BATCH == 0) delay();
+    *type = d->types[d->next];
+    return d->names + d->offs[d->next++];
+}
+
+static int
+mem_statat(void *dir, const char *name, struct stat *st, bool follow)
+{
+    mem_dir_t *d = dir;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", d->path, name) >= (int) sizeof(path))
+        return fail(ENAMETOOLONG);
+    return mem_stat(path, st, follow);
+}
+
+static void
+mem_closedir(void *dir)
+{
+    mem_dir_t *d = dir;
+    free(d->path);
+    free(d->names);
+    free(d->offs);
+    free(d->types);
+    free(d);
+}
+
+// there are no links in here, follow makes no difference
+static int
+mem_stat(const char *path, struct stat *st, bool follow)
+{
+    (void) follow;
+    delay();
+    pthread_rwlock_rdlock(&mem_lock);
+    node_t *n = lookup(path);
+    if (n) fill_stat(n, st);
+    pthread_rwlock_unlock(&mem_lock);
+    return n? 0 : fail(ENOENT);
+}
+
+// same rules as rename(2): a dir only replaces an empty dir, and never
+// goes below itself
+static int
+mem_rename(const char *from, const char *to)
+{
+    char name[NAME_MAX + 1];
+    delay();
+    pthread_rwlock_wrlock(&mem_lock);
+    node_t *src = lookup(from), *dir = lookup_parent(to, name), *old = NULL;
+    int err = 0;
+    if (!src || !dir) err = ENOENT;
+    else if (src == mem_root) err = EBUSY;
+    for (node_t *p = dir; !err && p; p = p->parent) {
+        if (p == src) err = EINVAL;
+    }
+    if (!err && (old = find_kid(dir, name, NULL)) == src) {
+        pthread_rwlock_unlock(&mem_lock);
+        return 0;
+    }
+    if (!err && old) {
+        if (S_ISDIR(old->mode) && !S_ISDIR(src->mode)) err = EISDIR;
+        else if (!S_ISDIR(old->mode) && S_ISDIR(src->mode)) err = ENOTDIR;
+        else if (old->nkids) err = ENOTEMPTY;
+    }
+    if (!err) {
+        if (old) {
+            drop_kid(old);
+            free_node(old);
+        }
+        drop_kid(src);
+        free(src->name);
+        src->name = strdup(name);
+        add_kid(dir, src);
+    }
+    pthread_rwlock_unlock(&mem_lock);
+    return err? fail(err) : 0;
+}
+
+static int
+mem_remove(const char *path)
+{
+    delay();
+    pthread_rwlock_wrlock(&mem_lock);
+    node_t *n = lookup(path);
+    int err = !n? ENOENT : (n == mem_root)? EBUSY : 0;
+    if (!err) {
+        drop_kid(n);
+        free_node(n);
+    }
+    pthread_rwlock_unlock(&mem_lock);
+    return err? fail(err) : 0;
+}
+
+static int
+mem_copy(const char *from, const char *to)
+{
+    char name[NAME_MAX + 1];
+    delay();
+    pthread_rwlock_wrlock(&mem_lock);
+    node_t *src = lookup(from), *dir = lookup_parent(to, name);
+    int err = (!src || !dir)? ENOENT : find_kid(dir, name, NULL)? EEXIST : 0;
+    for (node_t *p = dir; !err && p; p = p->parent) {
+        if (p == src) err = EINVAL;
+    }
+    if (!err) add_kid(dir, copy_node(src, name));
+    pthread_rwlock_unlock(&mem_lock);
+    return err? fail(err) : 0;
+}
+
+static int
+mem_create(const char *path)
+{
+    char name[NAME_MAX + 1];
+    delay();
+    pthread_rwlock_wrlock(&mem_lock);
+    node_t *dir = lookup_parent(path, name), *n = NULL;
+    if (dir && (n = find_kid(dir, name, NULL)))
+        n->mtime = now_ns();
+    else if (dir)
+        add_kid(dir, new_node(name, S_IFREG | 0644, 0));
+    pthread_rwlock_unlock(&mem_lock);
+    return dir? 0 : fail(ENOENT);
+}
+
+static int
+mem_mkdir(const char *path)
+{
+    char name[NAME_MAX + 1];
+    delay();
+    pthread_rwlock_wrlock(&mem_lock);
+    node_t *dir = lookup_parent(path, name);
+    int err = !dir? ENOENT : find_kid(dir, name, NULL)? EEXIST : 0;
+    if (!err) add_kid(dir, new_node(name, S_IFDIR | 0755, 4096));
+    pthread_rwlock_unlock(&mem_lock);
+    return err? fail(err) : 0;
+}
+
+static int
+mem_chmod(const char *path, mode_t mode)
+{
+    delay();
+    pthread_rwlock_wrlock(&mem_lock);
+    node_t *n = lookup(path);
+    if (n) n->mode = (n->mode & S_IFMT) | (mode & 07777);
+    pthread_rwlock_unlock(&mem_lock);
+    return n? 0 : fail(ENOENT);
+}
+
+bool
+vfs_init(const char *spec, const char *root)
+{
+    if (!spec || !*spec || strcmp(spec, "posix") == 0)
+        return true;
+    if (strcmp(spec, "mem") == 0)
+        return mem_init("", root);
+    if (strncmp(spec, "mem:", 4) == 0)
+        return mem_init(spec + 4, root);
+    return false;
+}
@@ -0,0 +1,62 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// what the listing, the entry operations and the metadata lookups go
+// through, so mfm can run against something other than the disk.
+// MFM_VFS picks the backend:
+//   posix          the real filesystem, the default
+//   mem[:opts]     a made up tree held in memory, rooted at the dir mfm
+//                  starts in. opts are comma separated key=value pairs:
+//     files=N      files in each dir (100)
+//     dirs=N       subdirs in each dir (4)
+//     depth=N      levels of subdirs below the root (2)
+//     latency=MS   every call waits this long first, fractions work (0)
+//     jitter=MS    and up to this much more, at random (0)
+// with a latency the tree counts as a network mount, so it gets the
+// shorter waits and timeouts those get. listings pay it once per dir
+// and once per VFS_BATCH names, like a getdents per buffer would.
+//
+// every call returns -1 (or NULL) and sets errno when it fails
+
+#define VFS_BATCH 128
+
+enum {
+    VFS_UNKNOWN,  // readdir couldn't tell, statat will
+    VFS_FILE,
+    VFS_DIR,
+    VFS_LINK,
+};
+
+typedef struct vfs_t {
+    const char *name;
+    bool native;  // the real filesystem. archives, git markers and
+                  // windowed listings only work on that one
+    bool remote;  // acts like a network mount
+    void *(*opendir)(const char *path);
+    // next name in dir and its VFS_* type, NULL at the end. "." and ".."
+    // may come too
+    const char *(*readdir)(void *dir, int *type);
+    // name in dir, "." for the dir itself
+    int (*statat)(void *dir, const char *name, struct stat *st, bool follow);
+    void (*closedir)(void *dir);
+    int (*stat)(const char *path, struct stat *st, bool follow);
+    int (*rename)(const char *from, const char *to);
+    int (*remove)(const char *path);            // dirs with all they hold
+    int (*copy)(const char *from, const char *to);  // same
+    int (*create)(const char *path);            // or touch it if it's there
+    int (*mkdir)(const char *path);
+    int (*chmod)(const char *path, mode_t mode);
+} vfs_t;
+
+extern const vfs_t *vfs;
+
+// pick the backend from spec (NULL is posix). root is where a made up
+// tree goes. false if spec makes no sense, posix is used then
+bool vfs_init(const char *spec, const char *root);
+
+#endif
@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "wake.h"
+
+void
+wake_open(wake_t *w)
+{
+    if (w->fd[0] >= 0 || pipe(w->fd) < 0) return;
+    fcntl(w->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(w->fd[1], F_SETFL, O_NONBLOCK);
+    fcntl(w->fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(w->fd[1], F_SETFD, FD_CLOEXEC);
+}
+
+void
+wake_notify(wake_t *w, bool force)
+{
+    int64_t now = now_ms();
+    if (!force && now - w->last < WAKE_MS) return;
+    w->last = now;
+    char c = 0;
+    if (w->fd[1] < 0) return;
+    if (write(w->fd[1], &c, 1) < 0) {
+        // pipe full, the ui is awake anyway
+    }
+}
+
+void
+wake_drain(wake_t *w)
+{
+    char buf[64];
+    while (w->fd[0] >= 0 && read(w->fd[0], buf, sizeof(buf)) > 0);
+}
+
+int64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,30 @@
+#ifndef WAKE_H
+#define WAKE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// how a background job gets the ui out of poll: a nonblocking pipe it
+// writes a byte to and whose read end the ui waits on along with the
+// terminal. the ui drains it before looking at what the job did
+
+#define WAKE_MS 100  // least time between two wakeups for progress
+
+typedef struct wake_t {
+    int fd[2];      // -1 until wake_open
+    int64_t last;   // ms of the last wakeup
+} wake_t;
+
+#define WAKE_INIT { .fd = {-1, -1}, .last = 0 }
+
+// make the pipe if there isn't one yet, it's never closed
+void wake_open(wake_t *w);
+// wake the ui, unless it was woken less than WAKE_MS ago and it isn't
+// forced. progress goes unforced, a job that ended or a result forced
+void wake_notify(wake_t *w, bool force);
+// empty the pipe so poll waits again
+void wake_drain(wake_t *w);
+// CLOCK_MONOTONIC in ms
+int64_t now_ms(void);
+
+#endif